@@ -117,6 +117,9 @@ void Py2CConverter::initialize_parameters()
   // CitcomS.solver.vsolver
   parameters["Solver"] = Parameter("cgrad","CitcomS.solver.vsolver");
   parameters["node_assemble"] = Parameter("1","CitcomS.solver.vsolver");
+  parameters["block_csr"] = Parameter("0","CitcomS.solver.vsolver");
+  parameters["overlap_exchange"] = Parameter("0","CitcomS.solver.vsolver");
+  parameters["omp_threads"] = Parameter("0","CitcomS.solver.vsolver");
   parameters["precond"] = Parameter("1","CitcomS.solver.vsolver");
   parameters["accuracy"] = Parameter("1.0e-4","CitcomS.solver.vsolver");
   parameters["uzawa"] = Parameter("cg","CitcomS.solver.vsolver");
@@ -124,6 +127,16 @@ void Py2CConverter::initialize_parameters()
   parameters["mg_cycle"] = Parameter("1","CitcomS.solver.vsolver");
   parameters["down_heavy"] = Parameter("3","CitcomS.solver.vsolver");
   parameters["up_heavy"] = Parameter("3","CitcomS.solver.vsolver");
+  parameters["mg_smoother"] = Parameter("0","CitcomS.solver.vsolver");
+  parameters["mg_sor"] = Parameter("1.0","CitcomS.solver.vsolver");
+  parameters["mg_krylov"] = Parameter("0","CitcomS.solver.vsolver");
+  parameters["mg_coarse_direct"] = Parameter("0","CitcomS.solver.vsolver");
+  parameters["pipelined_cg"] = Parameter("0","CitcomS.solver.vsolver");
+  parameters["mg_single_precision"] = Parameter("0","CitcomS.solver.vsolver");
+  parameters["matrix_free"] = Parameter("0","CitcomS.solver.vsolver");
+  parameters["stiffness_cache"] = Parameter("0","CitcomS.solver.vsolver");
+  parameters["stiffness_update_tol"] = Parameter("0","CitcomS.solver.vsolver");
+  parameters["mg_jacobi_omega"] = Parameter("0.5","CitcomS.solver.vsolver");
   parameters["vlowstep"] = Parameter("1000","CitcomS.solver.vsolver");
   parameters["vhighstep"] = Parameter("3","CitcomS.solver.vsolver");
   parameters["max_mg_cycles"] = Parameter("50","CitcomS.solver.vsolver");
@@ -190,7 +203,10 @@ void Py2CConverter::initialize_parameters()
   // CitcomS.solver.output
   parameters["output_format"] = Parameter("\"ascii\"", "CitcomS.solver.output");
   parameters["output_optional"] = Parameter("\"surf,botm,tracer\"", "CitcomS.solver.output");
+  parameters["output_async"] = Parameter("0", "CitcomS.solver.output");
   parameters["output_ll_max"] = Parameter("20", "CitcomS.solver.output");
+  parameters["compact_sph_tables"] = Parameter("0", "CitcomS.solver.output");
+  parameters["float_sph_tables"] = Parameter("0", "CitcomS.solver.output");
   parameters["self_gravitation"] = Parameter("0", "CitcomS.solver.output");
   parameters["use_cbf_topo"] = Parameter("0", "CitcomS.solver.output");
   parameters["cb_block_size"] = Parameter("1048576", "CitcomS.solver.output");
@@ -201,6 +217,7 @@ void Py2CConverter::initialize_parameters()
   parameters["cache_mdc_nelmts"] = Parameter("10330", "CitcomS.solver.output");
   parameters["cache_rdcc_nelmts"] = Parameter("521", "CitcomS.solver.output");
   parameters["cache_rdcc_nbytes"] = Parameter("1048576", "CitcomS.solver.output");
+  parameters["output_tracer_stride"] = Parameter("1", "CitcomS.solver.output");
   parameters["write_q_files"] = Parameter("0", "CitcomS.solver.output");
   parameters["vtk_format"] = Parameter("binary", "CitcomS.solver.output");
   parameters["gzdir_vtkio"] = Parameter("1", "CitcomS.solver.output");
@@ -246,6 +263,11 @@ void Py2CConverter::initialize_parameters()
   parameters["ic_method_for_flavors"] = Parameter("0", "Citcoms.Solver.tracer");
   parameters["z_interface"] = Parameter("0.7", "Citcoms.Solver.tracer");
   parameters["itracer_warnings"] = Parameter("1", "Citcoms.Solver.tracer");
+  parameters["tracer_sort_every"] = Parameter("0", "Citcoms.Solver.tracer");
+  parameters["tracer_balance"] = Parameter("0", "Citcoms.Solver.tracer");
+  parameters["tracer_integrator"] = Parameter("0", "Citcoms.Solver.tracer");
+  parameters["tracer_substeps"] = Parameter("1", "Citcoms.Solver.tracer");
+  parameters["tracer_courant"] = Parameter("0", "Citcoms.Solver.tracer");
   parameters["regular_grid_deltheta"] = Parameter("1.0", "Citcoms.Solver.tracer");
   parameters["regular_grid_delphi"] = Parameter("1.0", "Citcoms.Solver.tracer");
   parameters["chemical_buoyancy"] = Parameter("1", "Citcoms.Solver.tracer");
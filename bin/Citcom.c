@@ -36,6 +36,7 @@
 #include "interuption.h"
 #include "output.h"
 #include "parallel_related.h"
+#include "drive_solvers.h"
 #include "checkpoints.h"
 
 extern int Emergency_stop;
@@ -293,6 +294,9 @@ int main(argc,argv)
     fprintf(E->fp,"Average cpu time taken for velocity step = %f\n",
 	    cpu_time_on_vp_it/((float)(E->monitor.solution_cycles-E->control.restart)));
   }
+  parallel_exchange_time_report(E);
+  solver_workspace_report(E);
+  stiffness_operator_report(E);
   citcom_finalize(E, 0);
   return(0);
 
@@ -103,6 +103,23 @@ void strip_bcs_from_residual(E,Res,level)
 }
 
 
+/* float version, for the levels below levmax with mg_single_precision */
+void strip_bcs_from_residual_float(E,Res,level)
+    struct All_variables *E;
+    float **Res;
+    int level;
+{
+    int m,i;
+
+    for (m=1;m<=E->sphere.caps_per_proc;m++)
+        if (E->num_zero_resid[level][m])
+            for(i=1;i<=E->num_zero_resid[level][m];i++)
+                Res[m][E->zero_resid[level][m][i]] = 0.0;
+
+    return;
+}
+
+
 void temperatures_conform_bcs(E)
      struct All_variables *E;
 {
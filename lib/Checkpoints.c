@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include "global_defs.h"
 #include "composition_related.h"
+#include "output.h"
 
 /* Private function prototypes */
 static void backup_file(const char *output_file);
@@ -55,6 +56,9 @@ void output_checkpoint(struct All_variables *E)
     char output_file[255];
     FILE *fp1;
 
+    /* finish the pending output first */
+    output_flush(E);
+
     sprintf(output_file, "%s.chkpt.%d.%d", E->control.data_file,
             E->parallel.me, E->monitor.solution_cycles);
 
@@ -245,9 +249,44 @@ static void read_general_checkpoint(struct All_variables *E, FILE *fp)
 }
 
 
+/* Tracer quantities are written and read one at a time, as columns of
+ * ntracers+1 values, the format of the old column-wise tracer arrays.
+ * Each block of the tracer store goes through a small buffer. */
+static void write_tracer_column(struct All_variables *E, int m, int q,
+                                FILE *fp)
+{
+    double buffer[TRACER_BLOCK];
+    int kk, k0, n;
+
+    for(k0=0; k0<=E->trace.ntracers[m]; k0+=TRACER_BLOCK) {
+        n = min(TRACER_BLOCK, E->trace.ntracers[m]+1-k0);
+        for(kk=0; kk<n; kk++)
+            buffer[kk] = tracer_basicq(E, m, k0+kk)[q];
+        fwrite(buffer, sizeof(double), n, fp);
+    }
+    return;
+}
+
+
+static void read_tracer_column(struct All_variables *E, int m, int q,
+                               FILE *fp)
+{
+    double buffer[TRACER_BLOCK];
+    int kk, k0, n;
+
+    for(k0=0; k0<=E->trace.ntracers[m]; k0+=TRACER_BLOCK) {
+        n = min(TRACER_BLOCK, E->trace.ntracers[m]+1-k0);
+        fread(buffer, sizeof(double), n, fp);
+        for(kk=0; kk<n; kk++)
+            tracer_basicq(E, m, k0+kk)[q] = buffer[kk];
+    }
+    return;
+}
+
+
 static void tracer_checkpoint(struct All_variables *E, FILE *fp)
 {
-    int m, i;
+    int m, i, b, n;
 
     write_sentinel(fp);
 
@@ -259,19 +298,17 @@ static void tracer_checkpoint(struct All_variables *E, FILE *fp)
     for(m=1; m<=E->sphere.caps_per_proc; m++)
         fwrite(&(E->trace.ntracers[m]), sizeof(int), 1, fp);
 
-    /* the 0-th element of basicq/extraq/ielement is not init'd
+    /* the 0-th tracer of the store is not init'd
      * and won't be used when read it. */
     for(m=1; m<=E->sphere.caps_per_proc; m++) {
-        for(i=0; i<6; i++) {
-            fwrite(E->trace.basicq[m][i], sizeof(double),
-                   E->trace.ntracers[m]+1, fp);
-        }
-        for(i=0; i<E->trace.number_of_extra_quantities; i++) {
-            fwrite(E->trace.extraq[m][i], sizeof(double),
-                   E->trace.ntracers[m]+1, fp);
+        for(i=0; i<6; i++)
+            write_tracer_column(E, m, i, fp);
+        for(i=0; i<E->trace.number_of_extra_quantities; i++)
+            write_tracer_column(E, m, E->trace.number_of_basic_quantities+i, fp);
+        for(b=0; b*TRACER_BLOCK<=E->trace.ntracers[m]; b++) {
+            n = min(TRACER_BLOCK, E->trace.ntracers[m]+1-b*TRACER_BLOCK);
+            fwrite(E->trace.store[m].elem[b], sizeof(int), n, fp);
         }
-        fwrite(E->trace.ielement[m], sizeof(int),
-               E->trace.ntracers[m]+1, fp);
     }
 
     return;
@@ -283,7 +320,7 @@ static void read_tracer_checkpoint(struct All_variables *E, FILE *fp)
     void count_tracers_of_flavors(struct All_variables *E);
     void allocate_tracer_arrays();
 
-    int m, i, itmp;
+    int m, i, b, n, itmp;
 
     read_sentinel(fp, E->parallel.me);
 
@@ -326,16 +363,14 @@ static void read_tracer_checkpoint(struct All_variables *E, FILE *fp)
 
     /* read tracer data */
     for(m=1; m<=E->sphere.caps_per_proc; m++) {
-        for(i=0; i<6; i++) {
-            fread(E->trace.basicq[m][i], sizeof(double),
-                  E->trace.ntracers[m]+1, fp);
-        }
-        for(i=0; i<E->trace.number_of_extra_quantities; i++) {
-            fread(E->trace.extraq[m][i], sizeof(double),
-                  E->trace.ntracers[m]+1, fp);
+        for(i=0; i<6; i++)
+            read_tracer_column(E, m, i, fp);
+        for(i=0; i<E->trace.number_of_extra_quantities; i++)
+            read_tracer_column(E, m, E->trace.number_of_basic_quantities+i, fp);
+        for(b=0; b*TRACER_BLOCK<=E->trace.ntracers[m]; b++) {
+            n = min(TRACER_BLOCK, E->trace.ntracers[m]+1-b*TRACER_BLOCK);
+            fread(E->trace.store[m].elem[b], sizeof(int), n, fp);
         }
-        fread(E->trace.ielement[m], sizeof(int),
-              E->trace.ntracers[m]+1, fp);
     }
 
     /* init E->trace.ntracer_flavor */
@@ -56,6 +56,9 @@ struct All_variables* citcom_init(MPI_Comm *world)
   E->control.total_iteration_cycles=0;
   E->control.total_v_solver_calls=0;
 
+  E->parallel.allreduce_calls=0;
+  E->parallel.allreduce_time=0.0;
+
 
 
   return(E);
@@ -66,8 +69,10 @@ void citcom_finalize(struct All_variables *E, int status)
 {
     void output_finalize(struct All_variables*);
     void parallel_process_finalize();
+    void exchange_plans_free(struct All_variables*);
 
     output_finalize(E);
+    exchange_plans_free(E);
     parallel_process_finalize();
     exit(status);
 }
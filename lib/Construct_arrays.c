@@ -29,6 +29,7 @@
 #include <sys/types.h>
 #include "element_definitions.h"
 #include "global_defs.h"
+#include "drive_solvers.h"
 
 int layers_r(struct All_variables *,float );
 int layers(struct All_variables *,int ,int );
@@ -251,6 +252,100 @@ void construct_lm(E)
    Function to build the local node matrix indexing maps
    ===================================================== */
 
+/* block-CSR layout of the nodal stiffness matrix: one row of 3x3 blocks
+   per node, with a block for itself and each of its (up to 26)
+   neighbours, in increasing node order. Bsr_col holds the first
+   equation of the neighbour, and Bsr_pos the block of each of the 27
+   neighbour offsets of the node, or -1 at the mesh boundary. The values
+   are added by add_elt_k_to_node_bsr(). */
+static void construct_node_bsr_map(struct All_variables *E, int lev, int m)
+{
+    int ii,jj,kk,i,j,k,is,ie,js,je,ks,ke,nn,ja,nblk;
+
+    const int dims=E->mesh.nsd;
+    const int nno=E->lmesh.NNO[lev];
+    const int nox=E->lmesh.NOX[lev];
+    const int noy=E->lmesh.NOY[lev];
+    const int noz=E->lmesh.NOZ[lev];
+    const int noxz=nox*noz;
+
+    E->Bsr_ptr[lev][m] = (int *) malloc((nno+1)*sizeof(int));
+    E->Bsr_col[lev][m] = (int *) malloc(27*nno*sizeof(int));
+    E->Bsr_pos[lev][m] = (int *) malloc(27*nno*sizeof(int));
+
+    for (i=0;i<27*nno;i++)
+        E->Bsr_pos[lev][m][i] = -1;
+
+    nblk = 0;
+    for (ii=1;ii<=noy;ii++)
+    for (jj=1;jj<=nox;jj++)
+    for (kk=1;kk<=noz;kk++)  {
+        nn = kk + (jj-1)*noz + (ii-1)*noxz;
+        E->Bsr_ptr[lev][m][nn-1] = nblk;
+
+        is=1; ie=dims;
+        js=1; je=dims;
+        ks=1; ke=dims;
+        if (kk==1  ) ks=2;
+        if (kk==noz) ke=2;
+        if (jj==1  ) js=2;
+        if (jj==nox) je=2;
+        if (ii==1  ) is=2;
+        if (ii==noy) ie=2;
+        for (i=is;i<=ie;i++)
+            for (j=js;j<=je;j++)
+                for (k=ks;k<=ke;k++)  {
+                    ja = nn-((2-i)*noxz + (2-j)*noz + 2-k);
+                    E->Bsr_pos[lev][m][27*(nn-1) + 9*(i-1) + 3*(j-1) + k-1] = nblk;
+                    E->Bsr_col[lev][m][nblk++] = E->ID[lev][m][ja].doff[1];
+                }
+    }
+    E->Bsr_ptr[lev][m][nno] = nblk;
+
+    E->Bsr_k[lev][m] = (higher_precision *) malloc(9*nblk*sizeof(higher_precision));
+
+    return;
+}
+
+
+/* Node_halo marks the nodes whose contributions to Au must be complete
+   before the halo exchange: the exchanged nodes and their neighbours,
+   which scatter into them in n_assemble_del2_u(). */
+static void construct_node_halo(struct All_variables *E, int lev, int m)
+{
+    int i,j,n,node,ii,jj,kk,di,dj,dk;
+    struct EXCHANGE_MSG *msg;
+
+    const int nno=E->lmesh.NNO[lev];
+    const int nox=E->lmesh.NOX[lev];
+    const int noy=E->lmesh.NOY[lev];
+    const int noz=E->lmesh.NOZ[lev];
+    const int noxz=nox*noz;
+
+    E->Node_halo[lev][m] = (unsigned char *) malloc((nno+1)*sizeof(unsigned char));
+    for(n=0;n<=nno;n++)
+        E->Node_halo[lev][m][n] = 0;
+
+    for(i=0;i<E->parallel.plan_node_d[lev]->nmsg;i++) {
+        msg = &E->parallel.plan_node_d[lev]->msg[i];
+        for(j=0;j<msg->n;j++) {
+            if(msg->cap[j] != m)
+                continue;
+            node = msg->id[j];
+            kk = (node-1)%noz + 1;
+            jj = ((node-1)/noz)%nox + 1;
+            ii = (node-1)/noxz + 1;
+            for(di=max(ii-1,1);di<=min(ii+1,noy);di++)
+                for(dj=max(jj-1,1);dj<=min(jj+1,nox);dj++)
+                    for(dk=max(kk-1,1);dk<=min(kk+1,noz);dk++)
+                        E->Node_halo[lev][m][dk + (dj-1)*noz + (di-1)*noxz] = 1;
+        }
+    }
+
+    return;
+}
+
+
 void construct_node_maps(E)
     struct All_variables *E;
 {
@@ -266,6 +361,20 @@ void construct_node_maps(E)
   dims2 = dims-1;
   for(lev=E->mesh.gridmax;lev>=E->mesh.gridmin;lev--)
     for (m=1;m<=E->sphere.caps_per_proc;m++)             {
+       if(MATRIX_FREE_LEVEL(E,lev)) {
+           E->mesh.matrix_size[lev] = 0;
+           continue;
+       }
+
+       if(E->control.block_csr) {
+           /* the block-CSR rows take the place of Node_map and Eqn_k */
+           E->mesh.matrix_size[lev] = 0;
+           construct_node_bsr_map(E,lev,m);
+           if(E->control.overlap_exchange)
+               construct_node_halo(E,lev,m);
+           continue;
+       }
+
        neq=E->lmesh.NEQ[lev];
        nno=E->lmesh.NNO[lev];
        noxz = E->lmesh.NOX[lev]*E->lmesh.NOZ[lev];
@@ -315,6 +424,9 @@ void construct_node_maps(E)
 
        E->mesh.matrix_size[lev] = matrix;
 
+       if(E->control.overlap_exchange)
+           construct_node_halo(E,lev,m);
+
        if(E->control.verbose) {
            fprintf(E->fp_out, "output Node_map lev=%d m=%d\n", lev, m);
            fprintf(E->fp_out, "neq=%d nno=%d max_eqn=%d matrix=%d\n", neq, nno, max_eqn, matrix);
@@ -328,53 +440,105 @@ void construct_node_maps(E)
 }
 
 
-void construct_node_ks(E)
-     struct All_variables *E;
+/* block of the block-CSR row of node that couples it to node1 */
+static int node_bsr_block(struct All_variables *E, int level, int m,
+                          int node, int node1)
 {
-    int m,level,i,j,k,e;
-    int node,node1,eqn1,eqn2,eqn3,loc0,loc1,loc2,loc3,found,element,index,pp,qq;
-    int neq,nno,nel,max_eqn;
+    int di,dj,dk,b;
+    void myerror();
 
-    double elt_K[24*24];
-    double w1,w2,w3,ww1,ww2,ww3,zero;
+    const int nox=E->lmesh.NOX[level];
+    const int noz=E->lmesh.NOZ[level];
+    const int noxz=nox*noz;
 
-    higher_precision *B1,*B2,*B3;
+    di = (node1-1)/noxz - (node-1)/noxz;
+    dj = ((node1-1)/noz)%nox - ((node-1)/noz)%nox;
+    dk = (node1-1)%noz - (node-1)%noz;
 
-    void get_elt_k();
-    void get_aug_k();
-    void build_diagonal_of_K();
-    void parallel_process_termination();
+    b = -1;
+    if(abs(di)<=1 && abs(dj)<=1 && abs(dk)<=1)
+        b = E->Bsr_pos[level][m][27*(node-1) + 9*(di+1) + 3*(dj+1) + dk+1];
 
-    const int dims=E->mesh.nsd,dofs=E->mesh.dof;
+    if(b < 0)
+        myerror(E,"Error: element coupling outside the block-CSR pattern");
+
+    return b;
+}
+
+
+/* add the element matrix elt_K into the block-CSR rows of its nodes.
+   Row r of a 3x3 block couples equation r of the row node to the three
+   equations of the column node. The lower half is taken from elt_K as
+   in add_elt_k_to_node_ks(), and the upper half is its transpose, so
+   that the stored matrix is exactly symmetric. */
+static void add_elt_k_to_node_bsr(struct All_variables *E, int element,
+                                  double elt_K[24*24], int level, int m)
+{
+    int i,j,r,c;
+    int node,node1,pp,qq;
+    double w[3],ww[3],v;
+    higher_precision *K,*Kt;
+
+    const int dims=E->mesh.nsd;
     const int ends=enodes[dims];
     const int lms=loc_mat_size[E->mesh.nsd];
 
-    zero = 0.0;
-    max_eqn = 14*dims;
-
-   for(level=E->mesh.gridmax;level>=E->mesh.gridmin;level--)   {
+    for(i=1;i<=ends;i++) {
+        node=E->IEN[level][m][element].node[i];
+        pp=(i-1)*dims;
+
+        w[0] = (E->NODE[level][m][node] & VBX) ? 0.0 : 1.0;
+        w[1] = (E->NODE[level][m][node] & VBY) ? 0.0 : 1.0;
+        w[2] = (E->NODE[level][m][node] & VBZ) ? 0.0 : 1.0;
+
+        for(j=1;j<=ends;j++) {
+            node1=E->IEN[level][m][element].node[j];
+            if(node1 > node)
+                continue;
+            qq=(j-1)*dims;
+
+            ww[0] = (E->NODE[level][m][node1] & VBX) ? 0.0 : 1.0;
+            ww[1] = (E->NODE[level][m][node1] & VBY) ? 0.0 : 1.0;
+            ww[2] = (E->NODE[level][m][node1] & VBZ) ? 0.0 : 1.0;
+
+            K = E->Bsr_k[level][m] + 9*node_bsr_block(E,level,m,node,node1);
+            Kt = NULL;
+            if(node1 < node)
+                Kt = E->Bsr_k[level][m] + 9*node_bsr_block(E,level,m,node1,node);
+
+            for(r=0;r<dims;r++)
+                for(c=0;c<dims;c++) {
+                    v = w[r]*ww[c]*elt_K[(pp+r)*lms+qq+c];
+                    K[3*r+c] += v;
+                    if(Kt != NULL)
+                        Kt[3*c+r] += v;
+                }
+        }
+    }
 
-      for(m=1;m<=E->sphere.caps_per_proc;m++)     {
+    return;
+}
 
-        neq=E->lmesh.NEQ[level];
-        nel=E->lmesh.NEL[level];
-        nno=E->lmesh.NNO[level];
-	for(i=0;i<neq;i++)
-	    E->BI[level][m][i] = zero;
-        for(i=0;i<E->mesh.matrix_size[level];i++) {
-            E->Eqn_k1[level][m][i] = zero;
-            E->Eqn_k2[level][m][i] = zero;
-            E->Eqn_k3[level][m][i] = zero;
-            }
 
-        for(element=1;element<=nel;element++) {
+/* add the element matrix elt_K into the rows of Eqn_k1/2/3 of its nodes */
+static void add_elt_k_to_node_ks(struct All_variables *E, int element,
+                                 double elt_K[24*24], int level, int m)
+{
+    int i,j,k;
+    int node,node1,eqn1,eqn2,eqn3,loc0,found,index,pp,qq;
+    int max_eqn;
+    double w1,w2,w3,ww1,ww2,ww3;
 
-	    get_elt_k(E,element,elt_K,level,m,0);
+    const int dims=E->mesh.nsd;
+    const int ends=enodes[dims];
+    const int lms=loc_mat_size[E->mesh.nsd];
 
-	    if (E->control.augmented_Lagr)
-	         get_aug_k(E,element,elt_K,level,m);
+    if(E->control.block_csr) {
+        add_elt_k_to_node_bsr(E,element,elt_K,level,m);
+        return;
+    }
 
-            build_diagonal_of_K(E,element,elt_K,level,m);
+    max_eqn = 14*dims;
 
 	    for(i=1;i<=ends;i++) {  /* i, is the node we are storing to */
 	       node=E->IEN[level][m][element].node[i];
@@ -455,11 +619,175 @@ void construct_node_ks(E)
 		    }   /* end for j */
 		  }   /* end for node1<= node */
 		}      /* end for i */
+
+    return;
+}
+
+
+/* has the viscosity of element el moved, at any integration point, by
+   more than stiffness_update_tol (relative) since Eqn_k was assembled? */
+static int elt_k_outdated(struct All_variables *E, int el, int level, int m)
+{
+    int k;
+    const int vpts=vpoints[E->mesh.nsd];
+    const float *evi=E->EVI[level][m]+(el-1)*vpts;
+    const float *evik=E->EVI_K[level][m]+(el-1)*vpts;
+    const double tol=E->control.stiffness_update_tol;
+
+    for(k=1;k<=vpts;k++)
+        if(fabs(evi[k]-evik[k]) > tol*evik[k])
+            return 1;
+
+    return 0;
+}
+
+
+/* With stiffness_update_tol, a level is updated in place when at most
+   half of its elements are outdated: the element matrix is linear in
+   EVI, so the outdated elements add the matrix of their viscosity
+   change to Eqn_k and to the diagonal. Otherwise the level is assembled
+   again, and so are all levels at the first call of each time step, so
+   that the round-off of the updates to the float Eqn_k does not build
+   up over the run. */
+
+void construct_node_ks(E)
+     struct All_variables *E;
+{
+    int m,level,i,j,el,element;
+    int neq,nel;
+    int full,update[MAX_LEVELS],count[2*MAX_LEVELS];
+
+    double elt_K[24*24];
+    double zero;
+    float *evi,*delta;
+
+    void get_elt_k();
+    void get_aug_k();
+    void build_diagonal_of_K();
+    void parallel_process_termination();
+
+    const int vpts=vpoints[E->mesh.nsd];
+
+    zero = 0.0;
+    delta = NULL;
+
+    for(level=E->mesh.gridmin;level<=E->mesh.gridmax;level++)
+        update[level] = 0;
+
+    if (E->control.stiffness_update_tol > 0.0) {
+        for(i=0;i<2*MAX_LEVELS;i++)
+            count[i] = 0;
+        for(level=E->mesh.gridmin;level<=E->mesh.gridmax;level++)
+            for(m=1;m<=E->sphere.caps_per_proc;m++)  {
+                for(el=1;el<=E->lmesh.NEL[level];el++)
+                    count[level] += elt_k_outdated(E,el,level,m);
+                count[MAX_LEVELS+level] += E->lmesh.NEL[level];
+            }
+
+        /* the same choice on all processors, for exchange_id_d */
+        MPI_Allreduce(count,E->monitor.elt_k_updated,MAX_LEVELS,MPI_INT,MPI_SUM,E->parallel.world);
+        MPI_Allreduce(count+MAX_LEVELS,E->monitor.elt_k_total,MAX_LEVELS,MPI_INT,MPI_SUM,E->parallel.world);
+
+        full = (E->monitor.solution_cycles != E->monitor.elt_k_cycle);
+        E->monitor.elt_k_cycle = E->monitor.solution_cycles;
+
+        for(level=E->mesh.gridmin;level<=E->mesh.gridmax;level++) {
+            update[level] = !full &&
+                (2*E->monitor.elt_k_updated[level] <= E->monitor.elt_k_total[level]);
+            if(!update[level])
+                E->monitor.elt_k_updated[level] = E->monitor.elt_k_total[level];
+            E->monitor.elt_k_updated_sum += E->monitor.elt_k_updated[level];
+            E->monitor.elt_k_total_sum += E->monitor.elt_k_total[level];
+        }
+
+        delta = (float *)malloc((E->lmesh.NEL[E->mesh.gridmax]+1)*vpts*sizeof(float));
+    }
+
+   for(level=E->mesh.gridmax;level>=E->mesh.gridmin;level--)   {
+
+      for(m=1;m<=E->sphere.caps_per_proc;m++)     {
+
+        neq=E->lmesh.NEQ[level];
+        nel=E->lmesh.NEL[level];
+	for(i=0;i<neq;i++)
+	    E->BI[level][m][i] = zero;
+
+        if(update[level]) {
+            /* BI takes the change of the diagonal */
+            evi = E->EVI[level][m];
+            for(element=1;element<=nel;element++) {
+                if(!elt_k_outdated(E,element,level,m))
+                    continue;
+
+                for(i=(element-1)*vpts+1;i<=element*vpts;i++) {
+                    delta[i] = evi[i] - E->EVI_K[level][m][i];
+                    E->EVI_K[level][m][i] = evi[i];
+                }
+
+                /* not in column order: iconv, for the rotation terms */
+                E->EVI[level][m] = delta;
+                get_elt_k(E,element,elt_K,level,m,1);
+                if (E->control.augmented_Lagr)
+                    get_aug_k(E,element,elt_K,level,m);
+                E->EVI[level][m] = evi;
+
+                build_diagonal_of_K(E,element,elt_K,level,m);
+                if(!MATRIX_FREE_LEVEL(E,level))
+                    add_elt_k_to_node_ks(E,element,elt_K,level,m);
+            }
+            continue;
+        }
+
+        if(E->control.stiffness_update_tol > 0.0)
+            for(i=1;i<=nel*vpts;i++)
+                E->EVI_K[level][m][i] = E->EVI[level][m][i];
+
+        if(MATRIX_FREE_LEVEL(E,level)) {
+            /* only the diagonal, for the smoother */
+            for(element=1;element<=nel;element++) {
+                get_elt_k(E,element,elt_K,level,m,0);
+                if (E->control.augmented_Lagr)
+                    get_aug_k(E,element,elt_K,level,m);
+                build_diagonal_of_K(E,element,elt_K,level,m);
+            }
+            continue;
+        }
+
+        if(E->control.block_csr)
+            for(i=0;i<9*E->Bsr_ptr[level][m][E->lmesh.NNO[level]];i++)
+                E->Bsr_k[level][m][i] = zero;
+
+        for(i=0;i<E->mesh.matrix_size[level];i++) {
+            E->Eqn_k1[level][m][i] = zero;
+            E->Eqn_k2[level][m][i] = zero;
+            E->Eqn_k3[level][m][i] = zero;
+            }
+
+        for(element=1;element<=nel;element++) {
+
+	    get_elt_k(E,element,elt_K,level,m,0);
+
+	    if (E->control.augmented_Lagr)
+	         get_aug_k(E,element,elt_K,level,m);
+
+            build_diagonal_of_K(E,element,elt_K,level,m);
+            add_elt_k_to_node_ks(E,element,elt_K,level,m);
 	    }            /* end for element */
 	}           /* end for m */
 
      (E->solver.exchange_id_d)(E, E->BI[level], level);
 
+     if(E->control.stiffness_update_tol > 0.0)
+       for(m=1;m<=E->sphere.caps_per_proc;m++)     {
+         neq=E->lmesh.NEQ[level];
+         if(update[level])
+           for(j=0;j<neq;j++)
+             E->BI[level][m][j] = E->K_diag[level][m][j] += E->BI[level][m][j];
+         else
+           for(j=0;j<neq;j++)
+             E->K_diag[level][m][j] = E->BI[level][m][j];
+       }
+
      for(m=1;m<=E->sphere.caps_per_proc;m++)     {
         neq=E->lmesh.NEQ[level];
 
@@ -473,16 +801,19 @@ void construct_node_ks(E)
 
     }     /* end for level */
 
+    if(delta != NULL)
+        free((void *)delta);
+
     return;
 }
 
 void rebuild_BI_on_boundary(E)
      struct All_variables *E;
 {
-    int m,level,i,j;
+    int m,level,i,j,r;
     int eqn1,eqn2,eqn3;
 
-    higher_precision *B1,*B2,*B3;
+    higher_precision *B1,*B2,*B3,*K;
     int *C;
 
     const int dims=E->mesh.nsd,dofs=E->mesh.dof;
@@ -490,10 +821,25 @@ void rebuild_BI_on_boundary(E)
     const int max_eqn = dims*14;
 
    for(level=E->mesh.gridmax;level>=E->mesh.gridmin;level--)   {
+     /* no row sums without the nodal matrix; the Jacobi smoother
+        of the matrix-free level uses the plain diagonal */
+     if(MATRIX_FREE_LEVEL(E,level))
+        continue;
+
      for (m=1;m<=E->sphere.caps_per_proc;m++)  {
         for(j=0;j<=E->lmesh.NEQ[level];j++)
             E->temp[m][j]=0.0;
 
+        if(E->control.block_csr)
+          /* the block-CSR rows hold the full matrix */
+          for(i=1;i<=E->lmesh.NNO[level];i++)  {
+            K=E->Bsr_k[level][m];
+            for(j=9*E->Bsr_ptr[level][m][i-1];j<9*E->Bsr_ptr[level][m][i];j+=9)
+              for(r=0;r<dims;r++)
+                E->temp[m][E->ID[level][m][i].doff[r+1]] +=
+                  fabs(K[j+3*r]) + fabs(K[j+3*r+1]) + fabs(K[j+3*r+2]);
+            }
+        else
         for(i=1;i<=E->lmesh.NNO[level];i++)  {
             eqn1=E->ID[level][m][i].doff[1];
             eqn2=E->ID[level][m][i].doff[2];
@@ -688,6 +1034,73 @@ void construct_elt_ks(E)
 
 
 
+/* ==============================================================
+   With stiffness_cache, keep the element stiffness of each
+   integration point at unit viscosity, see get_elt_k_cache().
+   Not on the matrix-free level.
+   ============================================================== */
+
+void construct_elt_k_cache(E)
+     struct All_variables *E;
+{
+    int el,lev,m;
+    size_t len;
+    void get_elt_k_cache();
+    void myerror();
+
+    const int n=loc_mat_size[E->mesh.nsd];
+    const size_t per_el=(size_t)VPOINTS3D*n*(n+1)/2;
+
+    for(lev=E->mesh.gridmin;lev<=E->mesh.gridmax;lev++)
+      for(m=1;m<=E->sphere.caps_per_proc;m++)     {
+        E->elt_k_cache[lev][m] = NULL;
+        if(MATRIX_FREE_LEVEL(E,lev))
+          continue;
+
+        len = per_el*E->lmesh.NEL[lev];
+        E->elt_k_cache[lev][m] = (double *) malloc(len*sizeof(double));
+        if(E->elt_k_cache[lev][m] == NULL)
+          myerror(E,"Error: cannot allocate the stiffness cache");
+
+        for(el=1;el<=E->lmesh.NEL[lev];el++)
+          get_elt_k_cache(E,el,E->elt_k_cache[lev][m]+(el-1)*per_el,lev,m);
+      }
+
+  return;
+}
+
+
+/* ==============================================================
+   With stiffness_update_tol, keep the viscosity each level was
+   assembled with and the diagonal of its stiffness, so that
+   construct_node_ks() can update both in place.
+   ============================================================== */
+
+void construct_stiffness_update(E)
+     struct All_variables *E;
+{
+    int i,lev,m,len;
+    void myerror();
+
+    const int vpts=vpoints[E->mesh.nsd];
+
+    for(lev=E->mesh.gridmin;lev<=E->mesh.gridmax;lev++)
+      for(m=1;m<=E->sphere.caps_per_proc;m++)     {
+        len = (E->lmesh.NEL[lev]+1)*vpts;
+        E->EVI_K[lev][m] = (float *) malloc(len*sizeof(float));
+        E->K_diag[lev][m] = (double *) malloc(E->lmesh.NEQ[lev]*sizeof(double));
+        if(E->EVI_K[lev][m] == NULL || E->K_diag[lev][m] == NULL)
+          myerror(E,"Error: cannot allocate the stiffness update arrays");
+
+        /* nothing assembled yet */
+        for(i=0;i<len;i++)
+          E->EVI_K[lev][m][i] = 0.0;
+      }
+
+  return;
+}
+
+
 void construct_elt_gs(E)
      struct All_variables *E;
 { int m,el,lev,a;
@@ -733,6 +1146,39 @@ void construct_elt_cs(struct All_variables *E)
 }
 
 
+/* With mg_single_precision the lower multigrid levels are smoothed in
+   float and only keep BIf. Their BI is assembled in the solver
+   workspace, which is free between the solves, and converted to BIf
+   at the end of construct_stiffness_B_matrix(). */
+static size_t BI_lower_levels_alloc(struct All_variables *E)
+{
+    int m,level;
+    size_t mark;
+
+    mark = solver_workspace_mark(E);
+    for(level=E->mesh.gridmin;level<E->mesh.gridmax;level++)
+      for (m=1;m<=E->sphere.caps_per_proc;m++)
+        E->BI[level][m] = solver_workspace_alloc(E,E->lmesh.NEQ[level]);
+
+    return mark;
+}
+
+
+void construct_BI_float(E)
+     struct All_variables *E;
+{
+    int m,level,i;
+
+    for(level=E->mesh.gridmin;level<E->mesh.gridmax;level++)
+      for (m=1;m<=E->sphere.caps_per_proc;m++) {
+        for(i=0;i<E->lmesh.NEQ[level];i++)
+          E->BIf[level][m][i] = (float) E->BI[level][m][i];
+        E->BI[level][m] = NULL;
+      }
+
+    return;
+}
+
 /* ==============================================================
  routine for constructing stiffness and node_maps
  ============================================================== */
@@ -745,14 +1191,26 @@ void construct_stiffness_B_matrix(E)
   void project_viscosity();
   void construct_node_maps();
   void construct_node_ks();
+  void coarse_solver_factor();
   void construct_elt_ks();
   void rebuild_BI_on_boundary();
+  void construct_BI_float();
+
+  double time0, CPU_time0();
+  size_t mark = 0;
+
+  time0 = CPU_time0();
+
+  if (E->control.mg_single_precision)
+    mark = BI_lower_levels_alloc(E);
 
   if (E->control.NMULTIGRID)
     project_viscosity(E);
 
   if (E->control.NMULTIGRID || E->control.NASSEMBLE) {
     construct_node_ks(E);
+    if (E->control.NMULTIGRID && E->control.mg_coarse_direct)
+      coarse_solver_factor(E);
   }
   else {
     construct_elt_ks(E);
@@ -763,6 +1221,13 @@ void construct_stiffness_B_matrix(E)
   if (E->control.NMULTIGRID || (E->control.NASSEMBLE && !E->control.CONJ_GRAD))
     rebuild_BI_on_boundary(E);
 
+  if (E->control.mg_single_precision) {
+    construct_BI_float(E);
+    solver_workspace_release(E, mark);
+  }
+
+  E->monitor.assembly_time += CPU_time0() - time0;
+  E->monitor.assembly_calls++;
 
   return;
 }
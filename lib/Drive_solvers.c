@@ -30,11 +30,20 @@
 #include "element_definitions.h"
 #include "global_defs.h"
 #include "drive_solvers.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 double global_vdot();
 double vnorm_nonnewt();
 int need_visc_update(struct All_variables *);
 int need_to_iterate(struct All_variables *);
+void myerror(struct All_variables *, char *);
+double stiffness_product_flops(struct All_variables *, int, int);
+
+static size_t workspace_chunk(int n);
+static void workspace_setup(struct All_variables *E);
+static void stiffness_update_report(struct All_variables *E);
 
 
 /************************************************************/
@@ -43,19 +52,323 @@ void general_stokes_solver_setup(struct All_variables *E)
 {
   int i, m;
   void construct_node_maps();
+  void construct_elt_k_cache();
+  void construct_stiffness_update();
+  void coarse_solver_setup();
+
+#ifdef _OPENMP
+  if (E->control.omp_threads)
+    omp_set_num_threads(E->control.omp_threads);
+#endif
+
+  if (E->control.matrix_free) {
+    /* the matrix-free product replaces the nodal matrix of levmax in
+       the multigrid solver, for the isotropic stiffness only */
+    if (!E->control.NMULTIGRID)
+      myerror(E, "Error: matrix_free requires the multigrid solver");
+#ifdef CITCOM_ALLOW_ANISOTROPIC_VISC
+    if (E->viscosity.allow_anisotropic_viscosity)
+      myerror(E, "Error: matrix_free cannot be used with anisotropic viscosity");
+#endif
+#ifdef USE_CUDA
+    myerror(E, "Error: matrix_free is not available in the CUDA build");
+#endif
+  }
+
+#ifdef USE_CUDA
+  /* the CUDA kernels read Node_map and Eqn_k */
+  if (E->control.block_csr)
+    myerror(E, "Error: block_csr is not available in the CUDA build");
+#endif
+
+  if (E->control.mg_single_precision) {
+    /* only the natural order sweep of the nodal matrix has a float
+       version, see multi_grid_float() */
+    if (!E->control.NMULTIGRID)
+      myerror(E, "Error: mg_single_precision requires the multigrid solver");
+    if (E->control.mg_smoother)
+      myerror(E, "Error: mg_single_precision cannot be used with mg_smoother=1");
+    if (E->control.block_csr)
+      myerror(E, "Error: mg_single_precision cannot be used with block_csr");
+#ifdef USE_CUDA
+    myerror(E, "Error: mg_single_precision is not available in the CUDA build");
+#endif
+  }
+
+  for (i=0;i<MAX_LEVELS;i++) {
+    E->monitor.matvec_time[i] = 0.0;
+    E->monitor.matvec_calls[i] = 0;
+    E->monitor.elt_k_updated[i] = 0;
+    E->monitor.elt_k_total[i] = 0;
+  }
+  E->monitor.assembly_time = 0.0;
+  E->monitor.assembly_calls = 0;
+  E->monitor.elt_k_updated_sum = 0.0;
+  E->monitor.elt_k_total_sum = 0.0;
+  E->monitor.elt_k_cycle = -1;
+
+  if (E->control.stiffness_cache) {
+#ifdef CITCOM_ALLOW_ANISOTROPIC_VISC
+    if (E->viscosity.allow_anisotropic_viscosity)
+      myerror(E, "Error: stiffness_cache cannot be used with anisotropic viscosity");
+#endif
+    construct_elt_k_cache(E);
+  }
+
+  if (E->control.stiffness_update_tol > 0.0) {
+    /* in place updates of the nodal matrix, for the isotropic
+       stiffness only, whose element matrix is linear in EVI */
+    if (!(E->control.NMULTIGRID || E->control.NASSEMBLE))
+      myerror(E, "Error: stiffness_update_tol requires the multigrid solver or node_assemble");
+#ifdef CITCOM_ALLOW_ANISOTROPIC_VISC
+    if (E->viscosity.allow_anisotropic_viscosity)
+      myerror(E, "Error: stiffness_update_tol cannot be used with anisotropic viscosity");
+#endif
+    construct_stiffness_update(E);
+  }
 
-  if (E->control.NMULTIGRID || E->control.NASSEMBLE)
+  if (E->control.NMULTIGRID || E->control.NASSEMBLE) {
     construct_node_maps(E);
+    if (E->control.NMULTIGRID && E->control.mg_coarse_direct)
+      coarse_solver_setup(E);
+  }
   else
     for (i=E->mesh.gridmin;i<=E->mesh.gridmax;i++)
       for (m=1;m<=E->sphere.caps_per_proc;m++)
 	E->elt_k[i][m]=(struct EK *)malloc((E->lmesh.NEL[i]+1)*sizeof(struct EK));
 
+  workspace_setup(E);
+
+  return;
+}
+
+
+/* ==========================================================
+   Solver workspace. The work vectors of the iterative solvers are
+   carved out of one block allocated here, instead of being malloc'ed
+   and freed on every call. Vectors are handed out in stack order: a
+   solver takes a mark on entry and releases it on exit, so the nested
+   solvers (Uzawa -> multigrid/CG) reuse the same memory every time.
+   ========================================================== */
+
+/* each vector starts on a 64-byte boundary */
+static size_t workspace_chunk(int n)
+{
+  return ((size_t)n + 7) & ~(size_t)7;
+}
+
+
+static void workspace_setup(struct All_variables *E)
+{
+  int lev;
+  size_t mg, cg, uzawa, bicg, outer, bi;
+  const int levmax = E->mesh.levmax;
+  const int neq = E->lmesh.neq;
+  const int npno = E->lmesh.npno;
+
+  /* multi_grid(), inside mg_conj_grad() if mg_krylov, or conj_grad() */
+  mg = 0;
+  bi = 0;
+  for(lev=E->mesh.levmin;lev<=levmax;lev++) {
+    if (E->control.mg_single_precision && lev < levmax) {
+      /* float vectors of multi_grid_float(), and the BI assembled
+         in construct_stiffness_B_matrix() */
+      mg += 3*workspace_chunk((E->lmesh.NEQ[lev]+2)/2)
+        + 2*workspace_chunk((E->lmesh.NEQ[lev]+1)/2);
+      bi += workspace_chunk(E->lmesh.NEQ[lev]);
+      continue;
+    }
+    mg += 3*workspace_chunk(E->lmesh.NEQ[lev]+1) + workspace_chunk(E->lmesh.NEQ[lev]);
+    if (lev < levmax)
+      mg += workspace_chunk(E->lmesh.NEQ[lev]);
+  }
+  if (E->control.mg_krylov)
+    mg += 2*workspace_chunk(E->lmesh.NEQ[levmax]) + 4*workspace_chunk(E->lmesh.NEQ[levmax]+1);
+  /* the transfer vectors of multi_grid_float() and the sweep vector
+     of gauss_seidel_float() */
+  if (E->control.mg_single_precision && levmax > E->mesh.levmin)
+    mg += 2*workspace_chunk(E->lmesh.NEQ[levmax-1]+1)
+      + workspace_chunk((E->lmesh.NEQ[levmax-1]+2)/2);
+  if (bi > mg) mg = bi;
+  if (E->control.pipelined_cg)
+    cg = 9*workspace_chunk(E->lmesh.NEQ[levmax]+1);
+  else
+    cg = 5*workspace_chunk(E->lmesh.NEQ[levmax]) + 3*workspace_chunk(E->lmesh.NEQ[levmax]+1);
+  if (cg > mg) mg = cg;
+
+  /* Uzawa iterations, with the CG variant also nested in iterCG */
+  uzawa = workspace_chunk(neq) + 7*workspace_chunk(npno+1);
+  bicg = 2*workspace_chunk(neq) + 10*workspace_chunk(npno+1);
+  if (bicg > uzawa) uzawa = bicg;
+  uzawa += 2*workspace_chunk(neq) + 2*workspace_chunk(npno+1);
+
+  /* general_stokes_solver() and momentum_eqn_residual() */
+  outer = 2*workspace_chunk(neq) + 2*workspace_chunk(neq+1);
+
+  E->workspace.size = E->sphere.caps_per_proc * (outer + uzawa + mg);
+  E->workspace.used = 0;
+  E->workspace.peak = 0;
+  if (posix_memalign((void **)&E->workspace.base, 64,
+                     E->workspace.size*sizeof(double)))
+    myerror(E, "Error: cannot allocate the solver workspace");
+
+  return;
+}
+
+
+size_t solver_workspace_mark(struct All_variables *E)
+{
+  return E->workspace.used;
+}
+
+
+double *solver_workspace_alloc(struct All_variables *E, int n)
+{
+  double *v;
+  const size_t len = workspace_chunk(n);
+
+  if (E->workspace.used + len > E->workspace.size)
+    myerror(E, "Error: solver workspace exhausted");
+
+  v = E->workspace.base + E->workspace.used;
+  E->workspace.used += len;
+  if (E->workspace.used > E->workspace.peak)
+    E->workspace.peak = E->workspace.used;
+
+  return v;
+}
+
+
+/* a vector of n floats, taken from the same stack */
+float *solver_workspace_alloc_float(struct All_variables *E, int n)
+{
+  return (float *)solver_workspace_alloc(E, (n+1)/2);
+}
+
+
+void solver_workspace_release(struct All_variables *E, size_t mark)
+{
+  E->workspace.used = mark;
+  return;
+}
+
+
+/* peak workspace in use, maximum over processors */
+void solver_workspace_report(struct All_variables *E)
+{
+  double bytes[2], maxbytes[2];
+
+  bytes[0] = (double)E->workspace.peak * sizeof(double);
+  bytes[1] = (double)E->workspace.size * sizeof(double);
+  MPI_Reduce(bytes, maxbytes, 2, MPI_DOUBLE, MPI_MAX, 0, E->parallel.world);
+
+  if (E->parallel.me == 0)
+    fprintf(E->fp,"Peak solver workspace = %.0f bytes (of %.0f allocated)\n",
+            maxbytes[0], maxbytes[1]);
+
   return;
 }
 
 
 
+/* time spent assembling the stiffness; storage of the stiffness
+   operator and of the stiffness_cache, summed over the levels, per node
+   of levmax; and the time of the products of each level (maximum over
+   processors) and their rate per processor (average) */
+void stiffness_operator_report(struct All_variables *E)
+{
+  int lev, m, nno;
+  double local[MAX_LEVELS+2], global[MAX_LEVELS+2];
+  double time[MAX_LEVELS], sumtime[MAX_LEVELS];
+
+  const int max_eqn = 14*E->mesh.nsd;
+  const int lms = loc_mat_size[E->mesh.nsd];
+
+  MPI_Reduce(&E->monitor.assembly_time, time, 1, MPI_DOUBLE, MPI_MAX, 0, E->parallel.world);
+  if (E->parallel.me == 0)
+    fprintf(E->fp,"Stiffness assembly = %f (%d calls)\n",
+            time[0], E->monitor.assembly_calls);
+
+  if (E->control.stiffness_update_tol > 0.0 && E->parallel.me == 0)
+    fprintf(E->fp,"Stiffness elements reassembled = %.0f of %.0f\n",
+            E->monitor.elt_k_updated_sum, E->monitor.elt_k_total_sum);
+
+  if (E->control.stiffness_cache) {
+    local[0] = local[1] = 0.0;
+    for(lev=E->mesh.gridmin;lev<=E->mesh.gridmax;lev++)
+      for (m=1;m<=E->sphere.caps_per_proc;m++) {
+        if (!MATRIX_FREE_LEVEL(E,lev))
+          local[0] += (double)E->lmesh.NEL[lev] * VPOINTS3D * lms*(lms+1)/2 * sizeof(double);
+        if (lev == E->mesh.levmax)
+          local[1] += E->lmesh.NNO[lev];
+      }
+    MPI_Reduce(local, global, 2, MPI_DOUBLE, MPI_SUM, 0, E->parallel.world);
+    if (E->parallel.me == 0)
+      fprintf(E->fp,"Stiffness cache = %.0f bytes per node\n", global[0]/global[1]);
+  }
+
+  if (!(E->control.NMULTIGRID || E->control.NASSEMBLE))
+    return;
+
+  local[MAX_LEVELS] = local[MAX_LEVELS+1] = 0.0;
+  for(lev=0;lev<MAX_LEVELS;lev++)
+    local[lev] = 0.0;
+
+  for(lev=E->mesh.gridmin;lev<=E->mesh.gridmax;lev++)
+    for (m=1;m<=E->sphere.caps_per_proc;m++) {
+      nno = E->lmesh.NNO[lev];
+      local[lev] += stiffness_product_flops(E,lev,m) * E->monitor.matvec_calls[lev];
+      if (lev == E->mesh.levmax)
+        local[MAX_LEVELS+1] += nno;
+      if (MATRIX_FREE_LEVEL(E,lev))
+        continue;
+      if (E->control.block_csr)
+        local[MAX_LEVELS] += (double)(nno + 1 + 27*nno + E->Bsr_ptr[lev][m][nno]) * sizeof(int)
+          + 9.0 * E->Bsr_ptr[lev][m][nno] * sizeof(higher_precision);
+      else
+        local[MAX_LEVELS] += (double)nno * max_eqn * (sizeof(int) + 3*sizeof(higher_precision));
+      if (E->control.overlap_exchange)
+        local[MAX_LEVELS] += nno;
+    }
+
+  MPI_Reduce(local, global, MAX_LEVELS+2, MPI_DOUBLE, MPI_SUM, 0, E->parallel.world);
+  MPI_Reduce(E->monitor.matvec_time, time, MAX_LEVELS, MPI_DOUBLE, MPI_MAX, 0, E->parallel.world);
+  MPI_Reduce(E->monitor.matvec_time, sumtime, MAX_LEVELS, MPI_DOUBLE, MPI_SUM, 0, E->parallel.world);
+
+  if (E->parallel.me == 0) {
+    fprintf(E->fp,"Stiffness storage = %.0f bytes per node%s\n",
+            global[MAX_LEVELS]/global[MAX_LEVELS+1],
+            E->control.matrix_free ? " (matrix-free on levmax)" : "");
+    for(lev=E->mesh.gridmax;lev>=E->mesh.gridmin;lev--)
+      fprintf(E->fp,"Stiffness products at level %d = %f (%d calls), %.3f GFLOP/s per processor\n",
+              lev, time[lev], E->monitor.matvec_calls[lev],
+              (sumtime[lev] > 0) ? 1e-9*global[lev]/sumtime[lev] : 0.0);
+  }
+
+  return;
+}
+
+
+/* elements of each level reassembled by the last
+   construct_stiffness_B_matrix(), with stiffness_update_tol */
+static void stiffness_update_report(struct All_variables *E)
+{
+  int lev;
+
+  if (E->control.stiffness_update_tol <= 0.0 || E->parallel.me != 0)
+    return;
+
+  fprintf(E->fp,"Stiffness reassembled for iteration %d:",
+          E->monitor.visc_iter_count);
+  for(lev=E->mesh.gridmax;lev>=E->mesh.gridmin;lev--)
+    fprintf(E->fp," level %d %d/%d", lev,
+            E->monitor.elt_k_updated[lev], E->monitor.elt_k_total[lev]);
+  fprintf(E->fp,"\n");
+  fflush(E->fp);
+
+  return;
+}
+
 
 void general_stokes_solver(struct All_variables *E)
 {
@@ -69,6 +382,7 @@ void general_stokes_solver(struct All_variables *E)
 
   double Udot_mag, dUdot_mag;
   int m,i;
+  size_t mark;
 
   double *oldU[NCS], *delta_U[NCS];
 
@@ -82,6 +396,7 @@ void general_stokes_solver(struct All_variables *E)
   if(need_visc_update(E)){
     get_system_viscosity(E,1,E->EVI[E->mesh.levmax],E->VI[E->mesh.levmax]);
     construct_stiffness_B_matrix(E);
+    stiffness_update_report(E);
   } 
   
   solve_constrained_flow_iterative(E);
@@ -90,9 +405,10 @@ void general_stokes_solver(struct All_variables *E)
   if (need_to_iterate(E)) {
     /* outer iterations for velocity dependent viscosity */
 
+    mark = solver_workspace_mark(E);
     for (m=1;m<=E->sphere.caps_per_proc;m++)  {
-      delta_U[m] = (double *)malloc(neq*sizeof(double));
-      oldU[m] = (double *)malloc(neq*sizeof(double));
+      delta_U[m] = solver_workspace_alloc(E, neq);
+      oldU[m] = solver_workspace_alloc(E, neq);
       for(i=0;i<neq;i++)
 	oldU[m][i]=0.0;
     }
@@ -126,16 +442,14 @@ void general_stokes_solver(struct All_variables *E)
       
       get_system_viscosity(E,1,E->EVI[E->mesh.levmax],E->VI[E->mesh.levmax]);
       construct_stiffness_B_matrix(E);
+      stiffness_update_report(E);
       solve_constrained_flow_iterative(E);
       
       E->monitor.visc_iter_count++;
 
     } /*end while*/
 
-    for (m=1;m<=E->sphere.caps_per_proc;m++)  {
-      free((void *) oldU[m]);
-      free((void *) delta_U[m]);
-    }
+    solver_workspace_release(E, mark);
 
   } /*end if we need iterations */
 
@@ -206,6 +520,7 @@ void general_stokes_solver_pseudo_surf(struct All_variables *E)
 
   double Udot_mag, dUdot_mag;
   int m,count,i;
+  size_t mark;
 
   double *oldU[NCS], *delta_U[NCS];
 
@@ -226,9 +541,10 @@ void general_stokes_solver_pseudo_surf(struct All_variables *E)
 
 	  if (E->viscosity.SDEPV || E->viscosity.PDEPV) {
 
+		  mark = solver_workspace_mark(E);
 		  for (m=1;m<=E->sphere.caps_per_proc;m++)  {
-			  delta_U[m] = (double *)malloc(neq*sizeof(double));
-			  oldU[m] = (double *)malloc(neq*sizeof(double));
+			  delta_U[m] = solver_workspace_alloc(E, neq);
+			  oldU[m] = solver_workspace_alloc(E, neq);
 			  for(i=0;i<neq;i++)
 				  oldU[m][i]=0.0;
 		  }
@@ -265,10 +581,7 @@ void general_stokes_solver_pseudo_surf(struct All_variables *E)
 			  count++;
 
 		  } /*end while */
-		  for (m=1;m<=E->sphere.caps_per_proc;m++)  {
-			  free((void *) oldU[m]);
-			  free((void *) delta_U[m]);
-		  }
+		  solver_workspace_release(E, mark);
 
 	  } /*end if SDEPV or PDEPV */
 	  E->monitor.topo_loop++;
@@ -274,6 +274,97 @@ void get_ba_p(struct Shape_function *N, struct Shape_function_dx *GNx,
 
 
 
+/*==============================================================
+  With stiffness_cache, the element k matrix of each integration
+  point at unit viscosity is computed once, by get_elt_k_cache(),
+  and get_elt_k() only sums them weighted by EVI. The upper
+  triangle is stored in row order, with the integration points
+  of one entry next to each other.
+  ==============================================================  */
+
+void get_elt_k_cache(E,el,C,lev,m)
+     struct All_variables *E;
+     int el,lev,m;
+     double *C;
+{
+    int a,b,i,j,k,p,q;
+    double rtf[4][9],wk[9],v;
+
+    const double two = 2.0;
+    const double two_thirds = 2.0/3.0;
+
+    void get_rtf_at_vpts();
+
+    double ba[9][9][4][7];
+
+    const int nn=loc_mat_size[E->mesh.nsd];
+    const int vpts = VPOINTS3D;
+    const int dims=E->mesh.nsd;
+
+    get_rtf_at_vpts(E, m, lev, el, rtf);
+
+    if ((el-1)%E->lmesh.ELZ[lev]==0)
+      construct_c3x3matrix_el(E,el,&E->element_Cc,&E->element_Ccx,lev,m,0);
+
+    for(k=1;k<=vpts;k++)
+      wk[k]=g_point[k].weight[dims-1]*E->GDA[lev][m][el].vpt[k];
+
+    get_ba(&(E->N), &(E->GNX[lev][m][el]), &E->element_Cc, &E->element_Ccx,
+           rtf, E->mesh.nsd, ba);
+
+    for(p=0;p<nn;p++) {
+      a = p/dims+1;
+      i = p%dims+1;
+      for(q=p;q<nn;q++) {
+        b = q/dims+1;
+        j = q%dims+1;
+        for(k=1;k<=vpts;k++) {
+          v = two * ( ba[a][k][i][1]*ba[b][k][j][1] +
+                      ba[a][k][i][2]*ba[b][k][j][2] +
+                      ba[a][k][i][3]*ba[b][k][j][3] ) +
+              ba[a][k][i][4]*ba[b][k][j][4] +
+              ba[a][k][i][5]*ba[b][k][j][5] +
+              ba[a][k][i][6]*ba[b][k][j][6];
+          if(E->control.inv_gruneisen != 0)
+            v -= two_thirds *
+              ( ba[a][k][i][1] + ba[a][k][i][2] + ba[a][k][i][3] ) *
+              ( ba[b][k][j][1] + ba[b][k][j][2] + ba[b][k][j][3] );
+          *C++ = wk[k]*v;
+        }
+      }
+    }
+
+    return;
+}
+
+
+static void get_elt_k_cached(struct All_variables *E, int el,
+                             double elt_k[24*24], int lev, int m)
+{
+    int p,q,k;
+    double sum;
+    const double *C;
+    const float *evi;
+
+    const int nn=loc_mat_size[E->mesh.nsd];
+    const int vpts = VPOINTS3D;
+
+    C = E->elt_k_cache[lev][m] + (size_t)(el-1)*vpts*nn*(nn+1)/2;
+    evi = E->EVI[lev][m] + (el-1)*vpts + 1;
+
+    for(p=0;p<nn;p++)
+      for(q=p;q<nn;q++) {
+        sum = 0.0;
+        for(k=0;k<vpts;k++)
+          sum += evi[k]*C[k];
+        C += vpts;
+        elt_k[p*nn+q] = elt_k[q*nn+p] = sum;
+      }
+
+    return;
+}
+
+
 /*==============================================================
   Function to supply the element k matrix for a given element e.
   ==============================================================  */
@@ -307,6 +398,11 @@ void get_elt_k(E,el,elt_k,lev,m,iconv)
     int l1,l2;
 #endif
 
+    if (E->control.stiffness_cache && !MATRIX_FREE_LEVEL(E,lev)) {
+      get_elt_k_cached(E,el,elt_k,lev,m);
+      return;
+    }
+
     get_rtf_at_vpts(E, m, lev, el, rtf);
 
     if (iconv || (el-1)%E->lmesh.ELZ[lev]==0)
@@ -518,26 +614,322 @@ void e_assemble_del2_u(E,u,Au,level,strip_bcs)
    Assemble Au using stored, nodal coefficients.
    ====================================================== */
 
-void n_assemble_del2_u(E,u,Au,level,strip_bcs)
-     struct All_variables *E;
-     double **u,**Au;
-     int level;
-     int strip_bcs;
+/* halo<0: all nodes; otherwise only the nodes with Node_halo == halo */
+#define N_ASSEMBLE_ROW(E,level,m,e,halo) \
+    ((halo) < 0 || (E)->Node_halo[level][m][e] == (halo))
+
+/* contribution of node e: its own rows gather from the lower
+   neighbours, and the symmetric half is scattered back to them */
+static void n_assemble_del2_u_node(struct All_variables *E,
+                                   double *u, double *Au,
+                                   int level, int m, int e)
 {
-    int m, e,i;
+    int i;
     int eqn1,eqn2,eqn3;
 
     double UU,U1,U2,U3;
-    void strip_bcs_from_residual();
 
     int *C;
     higher_precision *B1,*B2,*B3;
 
-    const int neq=E->lmesh.NEQ[level];
-    const int nno=E->lmesh.NNO[level];
     const int dims=E->mesh.nsd;
     const int max_eqn = dims*14;
 
+    eqn1=E->ID[level][m][e].doff[1];
+    eqn2=E->ID[level][m][e].doff[2];
+    eqn3=E->ID[level][m][e].doff[3];
+
+    U1 = u[eqn1];
+    U2 = u[eqn2];
+    U3 = u[eqn3];
+
+    C=E->Node_map[level][m] + (e-1)*max_eqn;
+    B1=E->Eqn_k1[level][m]+(e-1)*max_eqn;
+    B2=E->Eqn_k2[level][m]+(e-1)*max_eqn;
+    B3=E->Eqn_k3[level][m]+(e-1)*max_eqn;
+
+    for(i=3;i<max_eqn;i++)  {
+        UU = u[C[i]];
+        Au[eqn1] += B1[i]*UU;
+        Au[eqn2] += B2[i]*UU;
+        Au[eqn3] += B3[i]*UU;
+    }
+    for(i=0;i<max_eqn;i++)
+        Au[C[i]] += B1[i]*U1+B2[i]*U2+B3[i]*U3;
+
+    return;
+}
+
+
+/* Threaded version of the nodal loop. The nodes are grouped into
+   vertical lines (fixed x and y). A node only writes to its own line
+   and to the lines at y-1 and x-1..x+1, so two lines that agree in
+   (y mod 2, x mod 3) never touch the same entry of Au. The six colors
+   are swept one after the other in a fixed order, which makes Au
+   independent of the number of threads. Compared with the serial
+   sweep only the order of the floating point additions differs, so
+   both agree to round-off (~1e-15 relative). */
+static void n_assemble_del2_u_colored(struct All_variables *E,
+                                      double *u, double *Au,
+                                      int level, int m, int halo)
+{
+    int color,line,nlines,nx,ii,jj,kk,e0;
+
+    const int nox=E->lmesh.NOX[level];
+    const int noy=E->lmesh.NOY[level];
+    const int noz=E->lmesh.NOZ[level];
+
+    for(color=0;color<6;color++) {
+        nx = (nox - color%3 + 2)/3;
+        nlines = nx * ((noy - color/3 + 1)/2);
+
+#ifdef _OPENMP
+#pragma omp parallel for private(ii,jj,kk,e0) schedule(static)
+#endif
+        for(line=0;line<nlines;line++) {
+            ii = 1 + color/3 + 2*(line/nx);
+            jj = 1 + color%3 + 3*(line%nx);
+            e0 = (ii-1)*nox*noz + (jj-1)*noz;
+            for(kk=1;kk<=noz;kk++)
+                if(N_ASSEMBLE_ROW(E,level,m,e0+kk,halo))
+                    n_assemble_del2_u_node(E,u,Au,level,m,e0+kk);
+        }
+    }
+
+    return;
+}
+
+
+/* Block-CSR version. Each node gathers its full row of 3x3 blocks,
+   so the rows are independent and the loop needs no coloring. */
+static void n_assemble_del2_u_bsr(struct All_variables *E,
+                                  double *u, double *Au,
+                                  int level, int m, int halo)
+{
+    int e,b,eqn,col;
+    double s1,s2,s3,U1,U2,U3;
+    higher_precision *K;
+
+    const int nno=E->lmesh.NNO[level];
+    const int *ptr=E->Bsr_ptr[level][m];
+    const int *cols=E->Bsr_col[level][m];
+
+#ifdef _OPENMP
+#pragma omp parallel for private(b,eqn,col,s1,s2,s3,U1,U2,U3,K) schedule(static) if(E->control.omp_threads)
+#endif
+    for(e=1;e<=nno;e++) {
+        if(!N_ASSEMBLE_ROW(E,level,m,e,halo))
+            continue;
+        s1 = s2 = s3 = 0.0;
+        for(b=ptr[e-1];b<ptr[e];b++) {
+            col = cols[b];
+            K = E->Bsr_k[level][m] + 9*b;
+            U1 = u[col];
+            U2 = u[col+1];
+            U3 = u[col+2];
+            s1 += K[0]*U1 + K[1]*U2 + K[2]*U3;
+            s2 += K[3]*U1 + K[4]*U2 + K[5]*U3;
+            s3 += K[6]*U1 + K[7]*U2 + K[8]*U3;
+        }
+        eqn = E->ID[level][m][e].doff[1];
+        Au[eqn] = s1;
+        Au[eqn+1] = s2;
+        Au[eqn+2] = s3;
+    }
+
+    return;
+}
+
+
+static void n_assemble_del2_u_rows(struct All_variables *E,
+                                   double *u, double *Au,
+                                   int level, int m, int halo)
+{
+    int e;
+    const int nno=E->lmesh.NNO[level];
+
+    if(E->control.block_csr)
+        n_assemble_del2_u_bsr(E,u,Au,level,m,halo);
+    else if(E->control.omp_threads)
+        n_assemble_del2_u_colored(E,u,Au,level,m,halo);
+    else
+        for(e=1;e<=nno;e++)
+            if(N_ASSEMBLE_ROW(E,level,m,e,halo))
+                n_assemble_del2_u_node(E,u,Au,level,m,e);
+
+    return;
+}
+
+
+/* ======================================================
+   Matrix-free Au on levmax (matrix_free=on). The element
+   products are recomputed on every call from the viscosity
+   at the integration points, the stored shape function
+   derivatives (GNX) and Jacobians (GDA), and the nodal
+   coordinates, so no stiffness matrix is kept on this level.
+   ====================================================== */
+
+static const unsigned int mf_vbc[4] = {0, VBX, VBY, VBZ};
+
+/* flops of one element: get_ba() takes 46 per node, integration point
+   and direction, the strain and the scatter 2*6*24 each per point, the
+   stress 12 per point. The trigonometry of get_rtf_at_vpts() and the
+   rotation matrices (once per element column) are not counted.
+   aug_lagr adds MF_AUG_FLOPS. */
+#define MF_ELEMENT_FLOPS (46*8*8*3 + 2*2*6*24*8 + 12*8)
+#define MF_AUG_FLOPS (8 + 2*24 + 3*24)
+
+/* Au of element el, B^T D B u summed over the integration points,
+   plus the rank one term of get_aug_k() with aug_lagr. The constrained
+   equations are masked on input and output, as the w/ww weights do in
+   construct_node_ks(). Only the isotropic viscosity of get_elt_k() is
+   supported. */
+static void mf_assemble_del2_u_el(struct All_variables *E,
+                                  double *u, double *Au,
+                                  int level, int m, int el,
+                                  struct CC *cc, struct CCX *ccx)
+{
+    int a,k,n,i,node;
+    double rtf[4][9],W,trace,visc,div;
+    double eps[7],sig[7];
+    double ue[9][4],ae[9][4];
+    double ba[9][9][4][7];
+
+    void get_rtf_at_vpts();
+
+    const int vpts = VPOINTS3D;
+    const int ends = ENODES3D;
+    const int dims = E->mesh.nsd;
+    const double two = 2.0;
+    const double two_thirds = 2.0/3.0;
+
+    for(a=1;a<=ends;a++) {
+        node = E->IEN[level][m][el].node[a];
+        for(n=1;n<=dims;n++) {
+            ue[a][n] = (E->NODE[level][m][node] & mf_vbc[n]) ? 0.0 :
+                u[E->ID[level][m][node].doff[n]];
+            ae[a][n] = 0.0;
+        }
+    }
+
+    get_rtf_at_vpts(E, m, level, el, rtf);
+    get_ba(&(E->N), &(E->GNX[level][m][el]), cc, ccx, rtf, dims, ba);
+
+    for(k=1;k<=vpts;k++) {
+        W = g_point[k].weight[dims-1] * E->GDA[level][m][el].vpt[k]
+            * E->EVI[level][m][(el-1)*vpts+k];
+
+        /* strain */
+        for(i=1;i<=6;i++)
+            eps[i] = 0.0;
+        for(a=1;a<=ends;a++)
+            for(n=1;n<=dims;n++)
+                for(i=1;i<=6;i++)
+                    eps[i] += ba[a][k][n][i] * ue[a][n];
+
+        /* stress, times the quadrature weight */
+        sig[1] = W * two * eps[1];
+        sig[2] = W * two * eps[2];
+        sig[3] = W * two * eps[3];
+        sig[4] = W * eps[4];
+        sig[5] = W * eps[5];
+        sig[6] = W * eps[6];
+        if(E->control.inv_gruneisen != 0) {
+            trace = W * two_thirds * (eps[1] + eps[2] + eps[3]);
+            sig[1] -= trace;
+            sig[2] -= trace;
+            sig[3] -= trace;
+        }
+
+        for(a=1;a<=ends;a++)
+            for(n=1;n<=dims;n++)
+                for(i=1;i<=6;i++)
+                    ae[a][n] += ba[a][k][n][i] * sig[i];
+    }
+
+    if(E->control.augmented_Lagr) {
+        visc = div = 0.0;
+        for(k=1;k<=vpts;k++)
+            visc += E->EVI[level][m][(el-1)*vpts+k];
+        visc = visc/vpts * E->control.augmented;
+        for(a=1;a<=ends;a++)
+            for(n=1;n<=dims;n++)
+                div += E->elt_del[level][m][el].g[(a-1)*dims+n-1][0] * ue[a][n];
+        for(a=1;a<=ends;a++)
+            for(n=1;n<=dims;n++)
+                ae[a][n] += visc * div * E->elt_del[level][m][el].g[(a-1)*dims+n-1][0];
+    }
+
+    for(a=1;a<=ends;a++) {
+        node = E->IEN[level][m][el].node[a];
+        for(n=1;n<=dims;n++)
+            if(!(E->NODE[level][m][node] & mf_vbc[n]))
+                Au[E->ID[level][m][node].doff[n]] += ae[a][n];
+    }
+
+    return;
+}
+
+
+/* The elements are taken by vertical columns, which share the
+   rotation matrices of construct_c3x3matrix_el(). A column writes to
+   the nodes of its own (x,y) and of (x+1,y+1), so the columns of one
+   (x mod 2, y mod 2) color are independent and can run in threads.
+   The colors are done in a fixed order, so Au does not depend on the
+   number of threads. */
+static void mf_assemble_del2_u(struct All_variables *E,
+                               double *u, double *Au,
+                               int level, int m)
+{
+    int color,col,ncols,nx,ii,jj,kk,el;
+    struct CC cc;
+    struct CCX ccx;
+
+    const int elx=E->lmesh.ELX[level];
+    const int ely=E->lmesh.ELY[level];
+    const int elz=E->lmesh.ELZ[level];
+
+    for(color=0;color<4;color++) {
+        nx = (elx - color%2 + 1)/2;
+        ncols = nx * ((ely - color/2 + 1)/2);
+
+#ifdef _OPENMP
+#pragma omp parallel for private(ii,jj,kk,el,cc,ccx) schedule(static) if(E->control.omp_threads)
+#endif
+        for(col=0;col<ncols;col++) {
+            ii = 1 + color/2 + 2*(col/nx);
+            jj = 1 + color%2 + 2*(col%nx);
+            el = (ii-1)*elx*elz + (jj-1)*elz;
+            construct_c3x3matrix_el(E,el+1,&cc,&ccx,level,m,0);
+            for(kk=1;kk<=elz;kk++)
+                mf_assemble_del2_u_el(E,u,Au,level,m,el+kk,&cc,&ccx);
+        }
+    }
+
+    return;
+}
+
+
+/* With overlap_exchange, the nodes that contribute to exchanged
+   entries of Au (Node_halo == 1) are done first, the exchange is
+   posted, and the remaining nodes are computed while the messages
+   are in flight. The matrix-free product of levmax does all the
+   elements before a plain exchange. */
+void n_assemble_del2_u(E,u,Au,level,strip_bcs)
+     struct All_variables *E;
+     double **u,**Au;
+     int level;
+     int strip_bcs;
+{
+    int m, e;
+    double time0, CPU_time0();
+
+    void strip_bcs_from_residual();
+
+    const int neq=E->lmesh.NEQ[level];
+    const int mf=MATRIX_FREE_LEVEL(E,level);
+
+  time0 = CPU_time0();
 
   for (m=1;m<=E->sphere.caps_per_proc;m++)  {
 
@@ -546,42 +938,121 @@ void n_assemble_del2_u(E,u,Au,level,strip_bcs)
 
      u[m][neq] = 0.0;
 
-     for(e=1;e<=nno;e++)     {
+     if(mf)
+        mf_assemble_del2_u(E,u[m],Au[m],level,m);
+     else
+        n_assemble_del2_u_rows(E,u[m],Au[m],level,m,
+                               E->control.overlap_exchange ? 1 : -1);
 
-       eqn1=E->ID[level][m][e].doff[1];
-       eqn2=E->ID[level][m][e].doff[2];
-       eqn3=E->ID[level][m][e].doff[3];
+     }     /* end for m */
 
-       U1 = u[m][eqn1];
-       U2 = u[m][eqn2];
-       U3 = u[m][eqn3];
+  E->monitor.matvec_time[level] += CPU_time0() - time0;
+  E->monitor.matvec_calls[level]++;
 
-       C=E->Node_map[level][m] + (e-1)*max_eqn;
-       B1=E->Eqn_k1[level][m]+(e-1)*max_eqn;
-       B2=E->Eqn_k2[level][m]+(e-1)*max_eqn;
-       B3=E->Eqn_k3[level][m]+(e-1)*max_eqn;
+  if(E->control.overlap_exchange && !mf) {
+     (E->solver.exchange_id_d_start)(E, Au, level);
+     time0 = CPU_time0();
+     for (m=1;m<=E->sphere.caps_per_proc;m++)
+        n_assemble_del2_u_rows(E,u[m],Au[m],level,m,0);
+     E->monitor.matvec_time[level] += CPU_time0() - time0;
+     (E->solver.exchange_id_d_finish)(E, Au, level);
+  }
+  else
+     (E->solver.exchange_id_d)(E, Au, level);
 
-       for(i=3;i<max_eqn;i++)  {
-	  UU = u[m][C[i]];
-  	  Au[m][eqn1] += B1[i]*UU;
-  	  Au[m][eqn2] += B2[i]*UU;
-  	  Au[m][eqn3] += B3[i]*UU;
-       }
-       for(i=0;i<max_eqn;i++)
-          Au[m][C[i]] += B1[i]*U1+B2[i]*U2+B3[i]*U3;
+    if (strip_bcs)
+	strip_bcs_from_residual(E,Au,level);
+
+    return;
+}
+
+
+/* Au in float, for the levels below levmax with mg_single_precision.
+   Same node loop as n_assemble_del2_u_node(), without the threaded
+   and block-CSR variants, which are not used on these levels. */
+void n_assemble_del2_u_float(E,u,Au,level,strip_bcs)
+     struct All_variables *E;
+     float **u,**Au;
+     int level;
+     int strip_bcs;
+{
+    int m,e,i;
+    int eqn1,eqn2,eqn3;
+    int *C;
+    higher_precision *B1,*B2,*B3;
+    float UU,U1,U2,U3;
+    double time0, CPU_time0();
+
+    void strip_bcs_from_residual_float();
+
+    const int neq=E->lmesh.NEQ[level];
+    const int nno=E->lmesh.NNO[level];
+    const int max_eqn=14*E->mesh.nsd;
+
+  time0 = CPU_time0();
+
+  for (m=1;m<=E->sphere.caps_per_proc;m++)  {
+
+     for(e=0;e<=neq;e++)
+	Au[m][e]=0.0;
+
+     u[m][neq] = 0.0;
 
-       }     /* end for e */
+     for(e=1;e<=nno;e++)  {
+        eqn1=E->ID[level][m][e].doff[1];
+        eqn2=E->ID[level][m][e].doff[2];
+        eqn3=E->ID[level][m][e].doff[3];
+
+        U1 = u[m][eqn1];
+        U2 = u[m][eqn2];
+        U3 = u[m][eqn3];
+
+        C=E->Node_map[level][m] + (e-1)*max_eqn;
+        B1=E->Eqn_k1[level][m]+(e-1)*max_eqn;
+        B2=E->Eqn_k2[level][m]+(e-1)*max_eqn;
+        B3=E->Eqn_k3[level][m]+(e-1)*max_eqn;
+
+        for(i=3;i<max_eqn;i++)  {
+            UU = u[m][C[i]];
+            Au[m][eqn1] += B1[i]*UU;
+            Au[m][eqn2] += B2[i]*UU;
+            Au[m][eqn3] += B3[i]*UU;
+        }
+        for(i=0;i<max_eqn;i++)
+            Au[m][C[i]] += B1[i]*U1+B2[i]*U2+B3[i]*U3;
+        }
      }     /* end for m */
 
-     (E->solver.exchange_id_d)(E, Au, level);
+  E->monitor.matvec_time[level] += CPU_time0() - time0;
+  E->monitor.matvec_calls[level]++;
+
+  (E->solver.exchange_id_f)(E, Au, level);
 
     if (strip_bcs)
-	strip_bcs_from_residual(E,Au,level);
+	strip_bcs_from_residual_float(E,Au,level);
 
     return;
 }
 
 
+/* floating point operations of one n_assemble_del2_u() product on
+   cap m of level, not counting the exchange */
+double stiffness_product_flops(struct All_variables *E, int level, int m)
+{
+    const int max_eqn=14*E->mesh.nsd;
+    const int nno=E->lmesh.NNO[level];
+
+    if(MATRIX_FREE_LEVEL(E,level))
+        return (double)(MF_ELEMENT_FLOPS +
+                        (E->control.augmented_Lagr ? MF_AUG_FLOPS : 0))
+            * E->lmesh.NEL[level];
+    else if(E->control.block_csr)
+        return 18.0 * E->Bsr_ptr[level][m][nno];
+    else
+        return 6.0 * (2*max_eqn-3) * nno;
+}
+
+
 void build_diagonal_of_K(E,el,elt_k,level,m)
      struct All_variables *E;
      int level,el,m;
@@ -500,6 +500,7 @@ if (E->control.verbose) {
  ============================================ */
 
 static void face_eqn_node_to_pass(struct All_variables *, int, int, int, int);
+static void full_exchange_plans(struct All_variables *);
 static void line_eqn_node_to_pass(struct All_variables *, int, int, int, int, int, int);
 
 void full_parallel_communication_routs_v(E)
@@ -714,6 +715,7 @@ void full_parallel_communication_routs_v(E)
     E->parallel.TNUM_PASSz[lev] = kkk;
   }        /* end for level */
 
+  full_exchange_plans(E);
 
 
   if(E->control.verbose) {
@@ -882,137 +884,116 @@ static void line_eqn_node_to_pass(E,lev,m,npass,num_node,offset,stride)
 }
 
 /* ================================================
-WARNING: BUGS AHEAD
+ build the persistent exchange plans of level lev.
 
-   for (m=1;m<=E->sphere.caps_per_proc;m++)    {
-     for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-
-       sizeofk = (1+E->parallel.NUM_NEQ[lev][m].pass[k])*sizeof(double);
-       S[k]=(double *)malloc( sizeofk );
-       R[k]=(double *)malloc( sizeofk );
-       }
-      }
-
-This piece of code contain a bug. Arrays S and R are allocated for each m.
-But most of the memory is leaked.
-
-In this version of CitcomS, sphere.caps_per_proc is always equal to one.
-So, this bug won't manifest itself. But in other version of CitcomS, it will.
-
-by Tan2 7/21, 2003
-================================================ */
-
-void full_exchange_id_d(E, U, lev)
- struct All_variables *E;
- double **U;
- int lev;
- {
+ The horizontal passes (faces and lines of the cap) are
+ posted together in the first phase. The vertical passes,
+ which include the edges already summed horizontally, form
+ the second phase; for each of them the data of all caps on
+ this processor travel in one message.
+ ================================================ */
 
- int ii,j,jj,m,k,kk,t_cap,idb,msginfo[8];
- double *S[73],*R[73], *RV, *SV;
- int mid_recv, sizeofk;
-
- MPI_Status status[100];
- MPI_Status status1;
- MPI_Request request[100];
-
- for (m=1;m<=E->sphere.caps_per_proc;m++)    {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-     sizeofk = (1+E->parallel.NUM_NEQ[lev][m].pass[k])*sizeof(double);
-     S[k]=(double *)malloc( sizeofk );
-     R[k]=(double *)malloc( sizeofk );
-   }
- }
+static void full_exchange_plan(E, plan, lev, list, num)
+  struct All_variables *E;
+  struct EXCHANGE_PLAN *plan;
+  int lev;
+  struct PASS **list, *num;
+{
+  int m,k,kk;
 
- sizeofk = 0;
- for (k=1;k<=E->parallel.TNUM_PASSz[lev];k++)  {
-   kk = (1+E->parallel.NUM_NEQz[lev].pass[k])*sizeof(double);
-   sizeofk = max(sizeofk, kk);
- }
- RV=(double *)malloc( sizeofk );
- SV=(double *)malloc( sizeofk );
+  for (m=1;m<=E->sphere.caps_per_proc;m++)
+    for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++) {
+      exchange_plan_message(plan, 0, E->parallel.PROCESSOR[lev][m].pass[k]);
+      exchange_plan_append(plan, m, list[m], k, num[m].pass[k]);
+    }
 
-  idb=0;
-  for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-    for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)     {
+  for (k=1;k<=E->parallel.TNUM_PASSz[lev];k++) {
+    kk = k + E->sphere.max_connections;
+    exchange_plan_message(plan, 1, E->parallel.PROCESSORz[lev].pass[k]);
+    for (m=1;m<=E->sphere.caps_per_proc;m++)
+      exchange_plan_append(plan, m, list[m], kk, num[m].pass[kk]);
+  }
 
-      for (j=1;j<=E->parallel.NUM_NEQ[lev][m].pass[k];j++) {
-        S[k][j-1] = U[m][ E->parallel.EXCHANGE_ID[lev][m][j].pass[k] ];
-	}
+  exchange_plan_commit(E, plan);
 
-      if (E->parallel.PROCESSOR[lev][m].pass[k] != E->parallel.me &&
-	  E->parallel.PROCESSOR[lev][m].pass[k] != -1) {
-	  idb ++;
-          MPI_Isend(S[k], E->parallel.NUM_NEQ[lev][m].pass[k], MPI_DOUBLE,
-		    E->parallel.PROCESSOR[lev][m].pass[k], 1,
-		    E->parallel.world, &request[idb-1]);
-      }
-    }           /* for k */
-  }     /* for m */         /* finish sending */
+  return;
+}
 
-  for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-    for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)   {
 
-      if (E->parallel.PROCESSOR[lev][m].pass[k] != E->parallel.me &&
-	  E->parallel.PROCESSOR[lev][m].pass[k] != -1) {
-         idb++;
-	 MPI_Irecv(R[k],E->parallel.NUM_NEQ[lev][m].pass[k], MPI_DOUBLE,
-		   E->parallel.PROCESSOR[lev][m].pass[k], 1,
-		   E->parallel.world, &request[idb-1]);
-      }
-      else {
-	for (j=1;j<=E->parallel.NUM_NEQ[lev][m].pass[k];j++)
-           U[m][ E->parallel.EXCHANGE_ID[lev][m][j].pass[k] ] += S[k][j-1];
-      }
-    }      /* for k */
-  }     /* for m */         /* finish receiving */
+static void full_exchange_plans(E)
+  struct All_variables *E;
+{
+  int lev;
+
+  for(lev=E->mesh.gridmax;lev>=E->mesh.gridmin;lev--) {
+    E->parallel.plan_id_d[lev] = exchange_plan_create(MPI_DOUBLE);
+    full_exchange_plan(E, E->parallel.plan_id_d[lev], lev,
+                       E->parallel.EXCHANGE_ID[lev], E->parallel.NUM_NEQ[lev]);
+
+    E->parallel.plan_id_f[lev] = NULL;
+    if (E->control.mg_single_precision && lev < E->mesh.gridmax) {
+      E->parallel.plan_id_f[lev] = exchange_plan_create(MPI_FLOAT);
+      full_exchange_plan(E, E->parallel.plan_id_f[lev], lev,
+                         E->parallel.EXCHANGE_ID[lev], E->parallel.NUM_NEQ[lev]);
+    }
 
-  MPI_Waitall(idb,request,status);
+    E->parallel.plan_node_d[lev] = exchange_plan_create(MPI_DOUBLE);
+    full_exchange_plan(E, E->parallel.plan_node_d[lev], lev,
+                       E->parallel.EXCHANGE_NODE[lev], E->parallel.NUM_NODE[lev]);
 
-  for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-    for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)   {
+    E->parallel.plan_node_f[lev] = exchange_plan_create(MPI_FLOAT);
+    full_exchange_plan(E, E->parallel.plan_node_f[lev], lev,
+                       E->parallel.EXCHANGE_NODE[lev], E->parallel.NUM_NODE[lev]);
 
-      if (E->parallel.PROCESSOR[lev][m].pass[k] != E->parallel.me &&
-	  E->parallel.PROCESSOR[lev][m].pass[k] != -1) {
-	for (j=1;j<=E->parallel.NUM_NEQ[lev][m].pass[k];j++)
-	  U[m][ E->parallel.EXCHANGE_ID[lev][m][j].pass[k] ] += R[k][j-1];
-      }
-    }
+    E->parallel.exchange_calls[lev] = 0;
+    E->parallel.exchange_time[lev] = 0.0;
   }
 
-  /* for vertical direction  */
+  return;
+}
 
-  for (k=1;k<=E->parallel.TNUM_PASSz[lev];k++)  {
-    jj = 0;
-    kk = k + E->sphere.max_connections;
 
-    for(m=1;m<=E->sphere.caps_per_proc;m++)
-      for (j=1;j<=E->parallel.NUM_NEQ[lev][m].pass[kk];j++)
-        SV[jj++] = U[m][ E->parallel.EXCHANGE_ID[lev][m][j].pass[kk] ];
+void full_exchange_id_d(E, U, lev)
+ struct All_variables *E;
+ double **U;
+ int lev;
+ {
+   exchange_plan_execute(E, E->parallel.plan_id_d[lev], (void **) U, lev);
+   return;
+ }
 
-    MPI_Sendrecv(SV, E->parallel.NUM_NEQz[lev].pass[k], MPI_DOUBLE,
-		 E->parallel.PROCESSORz[lev].pass[k], 1,
-                 RV, E->parallel.NUM_NEQz[lev].pass[k], MPI_DOUBLE,
-		 E->parallel.PROCESSORz[lev].pass[k], 1,
-		 E->parallel.world, &status1);
 
-    jj = 0;
-    for(m=1;m<=E->sphere.caps_per_proc;m++)
-      for (j=1;j<=E->parallel.NUM_NEQ[lev][m].pass[kk];j++)
-        U[m][ E->parallel.EXCHANGE_ID[lev][m][j].pass[kk] ] += RV[jj++];
-  }
+/* split-phase version of full_exchange_id_d, for overlapping the
+   exchange with computation on the entries that are not exchanged */
+void full_exchange_id_d_start(E, U, lev)
+ struct All_variables *E;
+ double **U;
+ int lev;
+ {
+   exchange_plan_start(E, E->parallel.plan_id_d[lev], (void **) U, lev);
+   return;
+ }
+
 
- for (m=1;m<=E->sphere.caps_per_proc;m++)    {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-     free((void*) S[k]);
-     free((void*) R[k]);
-   }
+void full_exchange_id_d_finish(E, U, lev)
+ struct All_variables *E;
+ double **U;
+ int lev;
+ {
+   exchange_plan_finish(E, E->parallel.plan_id_d[lev], (void **) U, lev);
+   return;
  }
 
- free((void*) SV);
- free((void*) RV);
 
- return;
+/* float version of full_exchange_id_d, for the levels below levmax
+   with mg_single_precision */
+void full_exchange_id_f(E, U, lev)
+ struct All_variables *E;
+ float **U;
+ int lev;
+ {
+   exchange_plan_execute(E, E->parallel.plan_id_f[lev], (void **) U, lev);
+   return;
  }
 
 
@@ -1023,122 +1004,10 @@ static void exchange_node_d(E, U, lev)
  double **U;
  int lev;
  {
-
- int ii,j,jj,m,k,kk,t_cap,idb,msginfo[8];
- double *S[73],*R[73], *RV, *SV;
- int mid_recv, sizeofk;
-
- MPI_Status status[100];
- MPI_Status status1;
- MPI_Request request[100];
-
- kk=0;
- for (m=1;m<=E->sphere.caps_per_proc;m++)    {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-     ++kk;
-     sizeofk = (1+E->parallel.NUM_NODE[lev][m].pass[k])*sizeof(double);
-     S[kk]=(double *)malloc( sizeofk );
-     R[kk]=(double *)malloc( sizeofk );
-   }
- }
-
- idb= 0;
- for (k=1;k<=E->parallel.TNUM_PASSz[lev];k++)  {
-   sizeofk = (1+E->parallel.NUM_NODEz[lev].pass[k])*sizeof(double);
-   idb = max(idb,sizeofk);
+   exchange_plan_execute(E, E->parallel.plan_node_d[lev], (void **) U, lev);
+   return;
  }
 
- RV=(double *)malloc( idb );
- SV=(double *)malloc( idb );
-
-  idb=0;
-  for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-    for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)     {
-      kk=k;
-
-      for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[k];j++)
-        S[kk][j-1] = U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[k] ];
-
-      if (E->parallel.PROCESSOR[lev][m].pass[k]!=E->parallel.me) {
-	if (E->parallel.PROCESSOR[lev][m].pass[k]!=-1) {
-         idb ++;
-        MPI_Isend(S[kk],E->parallel.NUM_NODE[lev][m].pass[k],MPI_DOUBLE,
-             E->parallel.PROCESSOR[lev][m].pass[k],1,E->parallel.world,&request[idb-1]);
-	}
-         }
-      }           /* for k */
-    }     /* for m */         /* finish sending */
-
-  for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-    for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)   {
-      kk=k;
-
-      if (E->parallel.PROCESSOR[lev][m].pass[k]!=E->parallel.me)  {
-	if (E->parallel.PROCESSOR[lev][m].pass[k]!=-1) {
-         idb++;
-         MPI_Irecv(R[kk],E->parallel.NUM_NODE[lev][m].pass[k],MPI_DOUBLE,
-         E->parallel.PROCESSOR[lev][m].pass[k],1,E->parallel.world,&request[idb-1]);
-         }
-      }
-
-      else   {
-	kk=k;
-         for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[k];j++)
-           U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[k] ] += S[kk][j-1];
-         }
-      }      /* for k */
-    }     /* for m */         /* finish receiving */
-
-  MPI_Waitall(idb,request,status);
-
-  for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-    for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)   {
-      kk=k;
-
-      if (E->parallel.PROCESSOR[lev][m].pass[k]!=E->parallel.me)
-	if (E->parallel.PROCESSOR[lev][m].pass[k]!=-1) {
-        for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[k];j++)
-           U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[k] ] += R[kk][j-1];
-      }
-    }
-    }
-
-                /* for vertical direction  */
-
-  for (k=1;k<=E->parallel.TNUM_PASSz[lev];k++)  {
-    jj = 0;
-    kk = k + E->sphere.max_connections;
-
-    for(m=1;m<=E->sphere.caps_per_proc;m++)
-      for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[kk];j++)
-        SV[jj++] = U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[kk] ];
-
-    MPI_Sendrecv(SV,E->parallel.NUM_NODEz[lev].pass[k],MPI_DOUBLE,
-             E->parallel.PROCESSORz[lev].pass[k],1,
-                 RV,E->parallel.NUM_NODEz[lev].pass[k],MPI_DOUBLE,
-             E->parallel.PROCESSORz[lev].pass[k],1,E->parallel.world,&status1);
-
-    jj = 0;
-    for(m=1;m<=E->sphere.caps_per_proc;m++)
-      for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[kk];j++)
-        U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[kk] ] += RV[jj++];
-    }
-
-  kk = 0;
- for (m=1;m<=E->sphere.caps_per_proc;m++)    {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-     kk++;
-     free((void*) S[kk]);
-     free((void*) R[kk]);
-   }
- }
-
- free((void*) SV);
- free((void*) RV);
-
- return;
-}
-
 /* ================================================ */
 /* ================================================ */
 
@@ -1147,121 +1016,8 @@ static void exchange_node_f(E, U, lev)
  float **U;
  int lev;
  {
-
- int ii,j,jj,m,k,kk,t_cap,idb,msginfo[8];
-
- float *S[73],*R[73], *RV, *SV;
- int mid_recv, sizeofk;
-
- MPI_Status status[100];
- MPI_Status status1;
- MPI_Request request[100];
-
- kk=0;
- for (m=1;m<=E->sphere.caps_per_proc;m++)    {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-     ++kk;
-     sizeofk = (1+E->parallel.NUM_NODE[lev][m].pass[k])*sizeof(float);
-     S[kk]=(float *)malloc( sizeofk );
-     R[kk]=(float *)malloc( sizeofk );
-   }
- }
-
- idb= 0;
- for (k=1;k<=E->parallel.TNUM_PASSz[lev];k++)  {
-   sizeofk = (1+E->parallel.NUM_NODEz[lev].pass[k])*sizeof(float);
-   idb = max(idb,sizeofk);
- }
-
- RV=(float *)malloc( idb );
- SV=(float *)malloc( idb );
-
-  idb=0;
-  for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-    for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)     {
-      kk=k;
-
-      for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[k];j++)
-        S[kk][j-1] = U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[k] ];
-
-      if (E->parallel.PROCESSOR[lev][m].pass[k]!=E->parallel.me) {
-	if (E->parallel.PROCESSOR[lev][m].pass[k]!=-1) {
-         idb ++;
-        MPI_Isend(S[kk],E->parallel.NUM_NODE[lev][m].pass[k],MPI_FLOAT,
-             E->parallel.PROCESSOR[lev][m].pass[k],1,E->parallel.world,&request[idb-1]);
-	}
-         }
-      }           /* for k */
-    }     /* for m */         /* finish sending */
-
-  for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-    for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)   {
-      kk=k;
-
-      if (E->parallel.PROCESSOR[lev][m].pass[k]!=E->parallel.me)  {
-	if (E->parallel.PROCESSOR[lev][m].pass[k]!=-1) {
-         idb++;
-         MPI_Irecv(R[kk],E->parallel.NUM_NODE[lev][m].pass[k],MPI_FLOAT,
-         E->parallel.PROCESSOR[lev][m].pass[k],1,E->parallel.world,&request[idb-1]);
-         }
-      }
-
-      else   {
-	kk=k;
-         for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[k];j++)
-           U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[k] ] += S[kk][j-1];
-         }
-      }      /* for k */
-    }     /* for m */         /* finish receiving */
-
-  MPI_Waitall(idb,request,status);
-
-  for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-    for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)   {
-      kk=k;
-
-      if (E->parallel.PROCESSOR[lev][m].pass[k]!=E->parallel.me)
-	if (E->parallel.PROCESSOR[lev][m].pass[k]!=-1) {
-        for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[k];j++)
-           U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[k] ] += R[kk][j-1];
-      }
-    }
-    }
-
-                /* for vertical direction  */
-
-  for (k=1;k<=E->parallel.TNUM_PASSz[lev];k++)  {
-    jj = 0;
-    kk = k + E->sphere.max_connections;
-
-    for(m=1;m<=E->sphere.caps_per_proc;m++)
-      for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[kk];j++)
-        SV[jj++] = U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[kk] ];
-
-    MPI_Sendrecv(SV,E->parallel.NUM_NODEz[lev].pass[k],MPI_FLOAT,
-             E->parallel.PROCESSORz[lev].pass[k],1,
-                 RV,E->parallel.NUM_NODEz[lev].pass[k],MPI_FLOAT,
-             E->parallel.PROCESSORz[lev].pass[k],1,E->parallel.world,&status1);
-
-    jj = 0;
-    for(m=1;m<=E->sphere.caps_per_proc;m++)
-      for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[kk];j++)
-        U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[kk] ] += RV[jj++];
-    }
-
-  kk = 0;
- for (m=1;m<=E->sphere.caps_per_proc;m++)    {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-     kk++;
-     free((void*) S[kk]);
-     free((void*) R[kk]);
-   }
- }
-
- free((void*) SV);
- free((void*) RV);
-
- return;
+   exchange_plan_execute(E, E->parallel.plan_node_f[lev], (void **) U, lev);
+   return;
  }
 /* ================================================ */
 /* ================================================ */
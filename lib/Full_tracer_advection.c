@@ -27,19 +27,27 @@
  */
 
 #include <math.h>
+#include <string.h>
 #include "element_definitions.h"
 #include "global_defs.h"
 #include "parsing.h"
 #include "parallel_related.h"
 #include "composition_related.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 static void get_2dshape(struct All_variables *E,
                         int j, int nelem,
                         double u, double v,
                         int iwedge, double * shape2d);
 static void get_radial_shape(struct All_variables *E,
-                             int j, int nelem,
-                             double rad, double *shaperad);
+                             double rad, const double *radbounds,
+                             double *shaperad);
+static void get_wedge_shape_functions(struct All_variables *E,
+                                      double shp[9], int nelem,
+                                      double theta, double phi, double rad,
+                                      const double *radbounds);
 static void spherical_to_uv(struct All_variables *E, int j,
                             double theta, double phi,
                             double *u, double *v);
@@ -86,8 +94,9 @@ static int iget_regel(struct All_variables *E, int j,
                       int *ntheta, int *nphi);
 static void define_uv_space(struct All_variables *E);
 static void determine_shape_coefficients(struct All_variables *E);
-static void full_put_lost_tracers(struct All_variables *E,
-                                  int isend[13][13], double *send[13][13]);
+static int full_lost_tracer_destination(struct All_variables *E,
+                                        int j, int kk);
+static void full_migration_setup(struct All_variables *E);
 void pdebug(struct All_variables *E, int i);
 int full_icheck_cap(struct All_variables *E, int icap,
                     double x, double y, double z, double rad);
@@ -210,6 +219,7 @@ void full_tracer_setup(struct All_variables *E)
 
     /* The bounding box of neiboring processors */
     get_neighboring_caps(E);
+    full_migration_setup(E);
 
 
     /* Fine-grained regular grid to search tracers */
@@ -237,503 +247,153 @@ void full_tracer_setup(struct All_variables *E)
 /* This function is used to transport tracers to proper processor domains.   */
 /* (MPI parallel)                                                            */
 /* All of the tracers that were sent to rlater arrays are destined to another*/
-/* cap and sent there. Then they are raised up or down for multiple z procs. */
-/* isend[j][n]=number of tracers this processor cap is sending to cap n      */
-/* ireceive[j][n]=number of tracers this processor cap receiving from cap n  */
+/* processor. The destination of each tracer, a neighboring cap and the      */
+/* shell below, at or above this one, is found before any communication, so */
+/* a tracer crossing both a cap edge and a shell boundary goes straight to   */
+/* its new processor. All partners are then served in a single exchange.     */
+/* The receiver probes each message for its size, so no tracer counts are   */
+/* exchanged beforehand and no buffer has a fixed size.                      */
+/* isend[n]=number of tracers this processor is sending to partner n         */
 
 
 void full_lost_souls(struct All_variables *E)
 {
     /* This code works only if E->sphere.caps_per_proc==1 */
     const int j = 1;
+    const int itag = 11;
+    const int nq = E->trace.number_of_tracer_quantities;
+    const int nmig = E->trace.nmig;
 
-    int ithiscap;
-    int ithatcap=1;
-    int isend[13][13];
-    int ireceive[13][13];
-    int isize[13];
-    int kk,pp;
-    int mm;
+    int kk,pp,mm;
     int numtracers;
-    int icheck=0;
-    int isend_position;
-    int ipos,ipos2,ipos3;
-    int idb;
-    int idestination_proc=0;
-    int isource_proc;
-    int isend_z[13][3];
-    int ireceive_z[13][3];
-    int isum[13];
-    int irad;
-    int ival;
-    int ithat_processor;
-    int ireceive_position;
-    int ivertical_neighbor;
-    int ilast_receiver_position;
-    int it;
-    int irec[13];
-    int irec_position;
+    int isend[39];
+    int ioffset[40];
+    int *dest;
+    int nrec,maxrec;
+    int count;
     int iel;
-    int num_tracers;
-    int isize_send;
-    int isize_receive;
-    int itemp_size;
-    int itracers_subject_to_vertical_transport[13];
 
     double x,y,z;
     double theta,phi,rad;
-    double *send[13][13];
-    double *receive[13][13];
-    double *send_z[13][3];
-    double *receive_z[13][3];
-    double *REC[13];
+    double *send;
+    double *REC;
+    double *q;
+
+    MPI_Request request[39];
+    MPI_Status status;
 
     void expand_tracer_arrays();
-    int icheck_that_processor_shell();
 
     double CPU_time0();
     double begin_time = CPU_time0();
 
-    int number_of_caps=12;
-    int lev=E->mesh.levmax;
-    int num_ngb = E->parallel.TNUM_PASS[lev][j];
-
-    /* Note, if for some reason, the number of neighbors exceeds */
-    /* 50, which is unlikely, the MPI arrays must be increased.  */
-    MPI_Status status[200];
-    MPI_Request request[200];
-    MPI_Status status1;
-    MPI_Status status2;
-    int itag=1;
-
 
     parallel_process_sync(E);
     if(E->control.verbose)
       fprintf(E->trace.fpt, "Entering lost_souls()\n");
 
 
-    E->trace.istat_isend=E->trace.ilater[j];
-    /* * debug **
-    for (kk=1; kk<=E->trace.istat_isend; kk++) {
-        fprintf(E->trace.fpt, "tracer#=%d xx=(%g,%g,%g)\n", kk,
-                E->trace.rlater[j][0][kk],
-                E->trace.rlater[j][1][kk],
-                E->trace.rlater[j][2][kk]);
-    }
-    fflush(E->trace.fpt);
-    */
-
-
-
-    /* initialize isend and ireceive */
-    /* # of neighbors in the horizontal plane */
-    isize[j]=E->trace.ilater[j]*E->trace.number_of_tracer_quantities;
-    for (kk=0;kk<=num_ngb;kk++) isend[j][kk]=0;
-    for (kk=0;kk<=num_ngb;kk++) ireceive[j][kk]=0;
-
-    /* Allocate Maximum Memory to Send Arrays */
+    numtracers=E->trace.ilater[j];
+    E->trace.istat_isend=numtracers;
 
-    itemp_size=max(isize[j],1);
+    /* find the partner of each tracer (-1 if it stays here) */
 
-    for (kk=0;kk<=num_ngb;kk++) {
-        if ((send[j][kk]=(double *)malloc(itemp_size*sizeof(double)))==NULL) {
-            fprintf(E->trace.fpt,"Error(lost souls)-no memory (u389)\n");
-            fflush(E->trace.fpt);
-            exit(10);
-        }
+    if ((dest=(int *)malloc((numtracers+1)*sizeof(int)))==NULL) {
+        fprintf(E->trace.fpt,"Error(lost souls)-no memory (u389)\n");
+        fflush(E->trace.fpt);
+        exit(10);
     }
 
+    for (pp=0;pp<nmig;pp++) isend[pp]=0;
+    nrec=0;
 
-    /* * debug **
-    ithiscap=E->sphere.capid[j];
-    for (kk=1;kk<=num_ngb;kk++) {
-        ithatcap=E->parallel.PROCESSOR[lev][j].pass[kk];
-        fprintf(E->trace.fpt,"cap: %d me %d TNUM: %d rank: %d\n",
-                ithiscap,E->parallel.me,kk,ithatcap);
-
+    for (kk=1;kk<=numtracers;kk++) {
+        dest[kk]=full_lost_tracer_destination(E,j,kk);
+        if (dest[kk]<0) nrec++;
+        else isend[dest[kk]]++;
     }
-    fflush(E->trace.fpt);
-    */
-
 
-    /* Pre communication */
-    full_put_lost_tracers(E, isend, send);
+    ioffset[0]=0;
+    for (pp=0;pp<nmig;pp++) ioffset[pp+1]=ioffset[pp]+isend[pp];
 
 
-    /* Send info to other processors regarding number of send tracers */
+    /* Pack the tracers by partner. Those staying here go to REC, */
+    /* which is grown as the messages arrive.                     */
 
-    /* idb is the request array index variable */
-    /* Each send and receive has a request variable */
-
-    idb=0;
-    ithiscap=0;
-
-    /* if tracer is in same cap (nprocz>1) */
-
-    if (E->parallel.nprocz>1) {
-        ireceive[j][ithiscap]=isend[j][ithiscap];
+    maxrec=max(nrec,1);
+    send=(double *)malloc(max(ioffset[nmig]*nq,1)*sizeof(double));
+    REC=(double *)malloc(maxrec*nq*sizeof(double));
+    if (send==NULL || REC==NULL) {
+        fprintf(E->trace.fpt,"Error(lost souls)-no memory (c721)\n");
+        fflush(E->trace.fpt);
+        exit(10);
     }
 
-    for (kk=1;kk<=num_ngb;kk++) {
-        idestination_proc=E->parallel.PROCESSOR[lev][j].pass[kk];
-
-        MPI_Isend(&isend[j][kk],1,MPI_INT,idestination_proc,
-                  11,E->parallel.world,&request[idb++]);
-
-        MPI_Irecv(&ireceive[j][kk],1,MPI_INT,idestination_proc,
-                  11,E->parallel.world,&request[idb++]);
-
-    } /* end kk, number of neighbors */
-
-    /* Wait for non-blocking calls to complete */
-
-    MPI_Waitall(idb,request,status);
-
-
-    /* * debug **
-    for (kk=0;kk<=num_ngb;kk++) {
-        if(kk==0)
-	  isource_proc=E->parallel.me;
+    nrec=0;
+    for (kk=1;kk<=numtracers;kk++) {
+        if (dest[kk]<0)
+            q=&REC[(nrec++)*nq];
         else
-	  isource_proc=E->parallel.PROCESSOR[lev][j].pass[kk];
+            q=&send[(ioffset[dest[kk]]++)*nq];
 
-	fprintf(E->trace.fpt,"%d send %d to proc %d\n",
-		E->parallel.me,isend[j][kk],isource_proc);
-	fprintf(E->trace.fpt,"%d recv %d from proc %d\n",
-		E->parallel.me,ireceive[j][kk],isource_proc);
+        for (mm=0;mm<nq;mm++)
+            q[mm]=E->trace.rlater[j][mm][kk];
     }
-    */
-
-    /* Allocate memory in receive arrays */
-
-    for (ithatcap=0;ithatcap<=num_ngb;ithatcap++) {
-        isize[j]=ireceive[j][ithatcap]*E->trace.number_of_tracer_quantities;
-
-        itemp_size=max(1,isize[j]);
-
-        if ((receive[j][ithatcap]=(double *)malloc(itemp_size*sizeof(double)))==NULL) {
-            fprintf(E->trace.fpt,"Error(lost souls)-no memory (c721)\n");
-            fflush(E->trace.fpt);
-            exit(10);
-        }
-    }
-
-    /* Now, send the tracers to proper caps */
-
-    idb=0;
-    ithiscap=0;
-
-    /* same cap */
-
-    if (E->parallel.nprocz>1) {
-
-        ithatcap=ithiscap;
-        isize[j]=isend[j][ithatcap]*E->trace.number_of_tracer_quantities;
-        for (mm=0;mm<isize[j];mm++) {
-            receive[j][ithatcap][mm]=send[j][ithatcap][mm];
-        }
-
-    }
-
-    /* neighbor caps */
-
-    for (kk=1;kk<=num_ngb;kk++) {
-        idestination_proc=E->parallel.PROCESSOR[lev][j].pass[kk];
-
-        isize[j]=isend[j][kk]*E->trace.number_of_tracer_quantities;
-
-        MPI_Isend(send[j][kk],isize[j],MPI_DOUBLE,idestination_proc,
-                  11,E->parallel.world,&request[idb++]);
 
-        isize[j]=ireceive[j][kk]*E->trace.number_of_tracer_quantities;
+    for (pp=0;pp<nmig;pp++) ioffset[pp]-=isend[pp];
 
-        MPI_Irecv(receive[j][kk],isize[j],MPI_DOUBLE,idestination_proc,
-                  11,E->parallel.world,&request[idb++]);
+    free(dest);
 
-    } /* end kk, number of neighbors */
 
-    /* Wait for non-blocking calls to complete */
+    /* Send all messages, then receive them in partner order */
 
-    MPI_Waitall(idb,request,status);
-
-
-    /* Put all received tracers in array REC[j] */
-    /* This makes things more convenient.       */
-
-    /* Sum up size of receive arrays (all tracers sent to this processor) */
-
-    isum[j]=0;
-
-    ithiscap=0;
-
-    for (kk=0;kk<=num_ngb;kk++) {
-        isum[j]=isum[j]+ireceive[j][kk];
-    }
-
-    itracers_subject_to_vertical_transport[j]=isum[j];
-
-
-    /* Allocate Memory for REC array */
-
-    isize[j]=isum[j]*E->trace.number_of_tracer_quantities;
-    isize[j]=max(isize[j],1);
-    if ((REC[j]=(double *)malloc(isize[j]*sizeof(double)))==NULL) {
-        fprintf(E->trace.fpt,"Error(lost souls)-no memory (g323)\n");
-        fflush(E->trace.fpt);
-        exit(10);
+    for (pp=0;pp<nmig;pp++) {
+        MPI_Isend(&send[ioffset[pp]*nq],isend[pp]*nq,MPI_DOUBLE,
+                  E->trace.mig_proc[pp],itag,E->parallel.world,&request[pp]);
     }
 
+    for (pp=0;pp<nmig;pp++) {
+        MPI_Probe(E->trace.mig_proc[pp],itag,E->parallel.world,&status);
+        MPI_Get_count(&status,MPI_DOUBLE,&count);
 
-    /* Put Received tracers in REC */
-    irec[j]=0;
-
-    irec_position=0;
-
-    for (kk=0;kk<=num_ngb;kk++) {
-
-        ithatcap=kk;
-
-        for (pp=0;pp<ireceive[j][ithatcap];pp++) {
-            irec[j]++;
-            ipos=pp*E->trace.number_of_tracer_quantities;
-
-            for (mm=0;mm<E->trace.number_of_tracer_quantities;mm++) {
-                ipos2=ipos+mm;
-                REC[j][irec_position]=receive[j][ithatcap][ipos2];
-
-                irec_position++;
-
-            } /* end mm (cycling tracer quantities) */
-        } /* end pp (cycling tracers) */
-    } /* end kk (cycling neighbors) */
-
-
-    /* Done filling REC */
-
-
-    /* VERTICAL COMMUNICATION */
-
-    if (E->parallel.nprocz>1) {
-
-        /* Allocate memory for send_z */
-        /* Make send_z the size of receive array (max size) */
-        /* (No dynamic reallocation of send_z necessary)    */
-
-        for (kk=1;kk<=E->parallel.TNUM_PASSz[lev];kk++) {
-            isize[j]=itracers_subject_to_vertical_transport[j]*E->trace.number_of_tracer_quantities;
-            isize[j]=max(isize[j],1);
-
-            if ((send_z[j][kk]=(double *)malloc(isize[j]*sizeof(double)))==NULL) {
-                fprintf(E->trace.fpt,"Error(lost souls)-no memory (c721)\n");
-                fflush(E->trace.fpt);
-                exit(10);
-            }
-        }
-
-
-        for (ivertical_neighbor=1;ivertical_neighbor<=E->parallel.TNUM_PASSz[lev];ivertical_neighbor++) {
-
-            ithat_processor=E->parallel.PROCESSORz[lev].pass[ivertical_neighbor];
-
-            /* initialize isend_z and ireceive_z array */
-
-            isend_z[j][ivertical_neighbor]=0;
-            ireceive_z[j][ivertical_neighbor]=0;
-
-            /* sort through receive array and check radius */
-
-            it=0;
-            num_tracers=irec[j];
-            for (kk=1;kk<=num_tracers;kk++) {
-
-                ireceive_position=it*E->trace.number_of_tracer_quantities;
-                it++;
-
-                irad=ireceive_position+2;
-
-                rad=REC[j][irad];
-
-                ival=icheck_that_processor_shell(E,j,ithat_processor,rad);
-
-
-                /* if tracer is in other shell, take out of receive array and give to send_z*/
-
-                if (ival==1) {
-
-
-                    isend_position=isend_z[j][ivertical_neighbor]*E->trace.number_of_tracer_quantities;
-                    isend_z[j][ivertical_neighbor]++;
-
-                    ilast_receiver_position=(irec[j]-1)*E->trace.number_of_tracer_quantities;
-
-                    for (mm=0;mm<=(E->trace.number_of_tracer_quantities-1);mm++) {
-                        ipos=ireceive_position+mm;
-                        ipos2=isend_position+mm;
-
-                        send_z[j][ivertical_neighbor][ipos2]=REC[j][ipos];
-
-
-                        /* eject tracer info from REC array, and replace with last tracer in array */
-
-                        ipos3=ilast_receiver_position+mm;
-                        REC[j][ipos]=REC[j][ipos3];
-
-                    }
-
-                    it--;
-                    irec[j]--;
-
-                } /* end if ival===1 */
-
-                /* Otherwise, leave tracer */
-
-            } /* end kk (cycling through tracers) */
-
-        } /* end ivertical_neighbor */
-
-
-        /* Send arrays are now filled.                         */
-        /* Now send send information to vertical processor neighbor */
-        idb=0;
-        for (kk=1;kk<=E->parallel.TNUM_PASSz[lev];kk++) {
-
-            idestination_proc = E->parallel.PROCESSORz[lev].pass[kk];
-            MPI_Isend(&isend_z[j][kk],1,MPI_INT,idestination_proc,
-                      14,E->parallel.world,&request[idb++]);
-
-            MPI_Irecv(&ireceive_z[j][kk],1,MPI_INT,idestination_proc,
-                      14,E->parallel.world,&request[idb++]);
-
-        } /* end ivertical_neighbor */
-
-        /* Wait for non-blocking calls to complete */
-
-        MPI_Waitall(idb,request,status);
-
-
-        /* * debug **
-        for (kk=1;kk<=E->parallel.TNUM_PASSz[lev];kk++) {
-            fprintf(E->trace.fpt, "PROC: %d IVN: %d (P: %d) "
-                    "SEND: %d REC: %d\n",
-                    E->parallel.me,kk,E->parallel.PROCESSORz[lev].pass[kk],
-                    isend_z[j][kk],ireceive_z[j][kk]);
-        }
-        fflush(E->trace.fpt);
-        */
-
-
-        /* Allocate memory to receive_z arrays */
-
-
-        for (kk=1;kk<=E->parallel.TNUM_PASSz[lev];kk++) {
-            isize[j]=ireceive_z[j][kk]*E->trace.number_of_tracer_quantities;
-            isize[j]=max(isize[j],1);
-
-            if ((receive_z[j][kk]=(double *)malloc(isize[j]*sizeof(double)))==NULL) {
-                fprintf(E->trace.fpt,"Error(lost souls)-no memory (t590)\n");
-                fflush(E->trace.fpt);
-                exit(10);
-            }
-        }
-
-        /* Send Tracers */
-
-        idb=0;
-        for (kk=1;kk<=E->parallel.TNUM_PASSz[lev];kk++) {
-
-            idestination_proc = E->parallel.PROCESSORz[lev].pass[kk];
-
-            isize_send=isend_z[j][kk]*E->trace.number_of_tracer_quantities;
-
-            MPI_Isend(send_z[j][kk],isize_send,MPI_DOUBLE,idestination_proc,
-                      15,E->parallel.world,&request[idb++]);
-
-            isize_receive=ireceive_z[j][kk]*E->trace.number_of_tracer_quantities;
-
-            MPI_Irecv(receive_z[j][kk],isize_receive,MPI_DOUBLE,idestination_proc,
-                      15,E->parallel.world,&request[idb++]);
-        }
-
-        /* Wait for non-blocking calls to complete */
-
-        MPI_Waitall(idb,request,status);
-
-
-        /* Put tracers into REC array */
-
-        /* First, reallocate memory to REC */
-
-        isum[j]=0;
-        for (ivertical_neighbor=1;ivertical_neighbor<=E->parallel.TNUM_PASSz[lev];ivertical_neighbor++) {
-            isum[j]=isum[j]+ireceive_z[j][ivertical_neighbor];
-        }
-
-        isum[j]=isum[j]+irec[j];
-
-        isize[j]=isum[j]*E->trace.number_of_tracer_quantities;
-
-        if (isize[j]>0) {
-            if ((REC[j]=(double *)realloc(REC[j],isize[j]*sizeof(double)))==NULL) {
+        if ((nrec*nq+count)>maxrec*nq) {
+            maxrec=nrec+count/nq+maxrec/2;
+            if ((REC=(double *)realloc(REC,maxrec*nq*sizeof(double)))==NULL) {
                 fprintf(E->trace.fpt,"Error(lost souls)-no memory (i981)\n");
-                fprintf(E->trace.fpt,"isize: %d\n",isize[j]);
+                fprintf(E->trace.fpt,"isize: %d\n",maxrec*nq);
                 fflush(E->trace.fpt);
                 exit(10);
             }
         }
 
+        MPI_Recv(&REC[nrec*nq],count,MPI_DOUBLE,E->trace.mig_proc[pp],
+                 itag,E->parallel.world,&status);
+        nrec+=count/nq;
+    }
 
-        for (ivertical_neighbor=1;ivertical_neighbor<=E->parallel.TNUM_PASSz[lev];ivertical_neighbor++) {
-
-            for (kk=0;kk<ireceive_z[j][ivertical_neighbor];kk++) {
-
-                irec_position=irec[j]*E->trace.number_of_tracer_quantities;
-                irec[j]++;
-                ireceive_position=kk*E->trace.number_of_tracer_quantities;
-
-                for (mm=0;mm<E->trace.number_of_tracer_quantities;mm++) {
-                    REC[j][irec_position+mm]=receive_z[j][ivertical_neighbor][ireceive_position+mm];
-                }
-            }
-
-        }
-
-        /* Free Vertical Arrays */
-        for (ivertical_neighbor=1;ivertical_neighbor<=E->parallel.TNUM_PASSz[lev];ivertical_neighbor++) {
-            free(send_z[j][ivertical_neighbor]);
-            free(receive_z[j][ivertical_neighbor]);
-        }
+    MPI_Waitall(nmig,request,MPI_STATUSES_IGNORE);
 
-    } /* endif nprocz>1 */
+    free(send);
 
-    /* END OF VERTICAL TRANSPORT */
 
     /* Put away tracers */
 
 
-    for (kk=0;kk<irec[j];kk++) {
+    for (kk=0;kk<nrec;kk++) {
         E->trace.ntracers[j]++;
 
         if (E->trace.ntracers[j]>(E->trace.max_ntracers[j]-5)) expand_tracer_arrays(E,j);
 
-        ireceive_position=kk*E->trace.number_of_tracer_quantities;
+        /* received tracers have the layout of a record */
+        q=tracer_basicq(E,j,E->trace.ntracers[j]);
+        memcpy(q,&REC[kk*nq],nq*sizeof(double));
 
-        for (mm=0;mm<E->trace.number_of_basic_quantities;mm++) {
-            ipos=ireceive_position+mm;
-
-            E->trace.basicq[j][mm][E->trace.ntracers[j]]=REC[j][ipos];
-        }
-        for (mm=0;mm<E->trace.number_of_extra_quantities;mm++) {
-            ipos=ireceive_position+E->trace.number_of_basic_quantities+mm;
-
-            E->trace.extraq[j][mm][E->trace.ntracers[j]]=REC[j][ipos];
-        }
-
-        theta=E->trace.basicq[j][0][E->trace.ntracers[j]];
-        phi=E->trace.basicq[j][1][E->trace.ntracers[j]];
-        rad=E->trace.basicq[j][2][E->trace.ntracers[j]];
-        x=E->trace.basicq[j][3][E->trace.ntracers[j]];
-        y=E->trace.basicq[j][4][E->trace.ntracers[j]];
-        z=E->trace.basicq[j][5][E->trace.ntracers[j]];
+        theta=q[0];
+        phi=q[1];
+        rad=q[2];
+        x=q[3];
+        y=q[4];
+        z=q[5];
 
 
         iel=(E->trace.iget_element)(E,j,-99,x,y,z,theta,phi,rad);
@@ -745,7 +405,7 @@ void full_lost_souls(struct All_variables *E)
             exit(10);
         }
 
-        E->trace.ielement[j][E->trace.ntracers[j]]=iel;
+        tracer_element(E,j,E->trace.ntracers[j])=iel;
 
     }
     if(E->control.verbose){
@@ -754,15 +414,8 @@ void full_lost_souls(struct All_variables *E)
     }
     parallel_process_sync(E);
 
-    /* Free Arrays */
-
-    free(REC[j]);
+    free(REC);
 
-    for (kk=0;kk<=num_ngb;kk++) {
-        free(send[j][kk]);
-        free(receive[j][kk]);
-
-    }
     if(E->control.verbose){
       fprintf(E->trace.fpt,"Leaving lost_souls()\n");
       fflush(E->trace.fpt);
@@ -773,70 +426,110 @@ void full_lost_souls(struct All_variables *E)
 }
 
 
-static void full_put_lost_tracers(struct All_variables *E,
-                                  int isend[13][13], double *send[13][13])
+/************** LOST TRACER DESTINATION **************************************/
+/*                                                                           */
+/* Returns the migration partner (see full_migration_setup) of tracer kk in  */
+/* the rlater array, or -1 if the tracer is in this processor's domain.      */
+
+static int full_lost_tracer_destination(struct All_variables *E,
+                                        int j, int kk)
 {
-    const int j = 1;
-    int kk, pp;
-    int numtracers, ithatcap, icheck;
-    int isend_position, ipos;
+    int icap, ishell, icheck;
     int lev = E->mesh.levmax;
-    double theta, phi, rad;
-    double x, y, z;
+    int num_ngb = E->parallel.TNUM_PASS[lev][j];
+    double x, y, z, rad;
 
-    /* transfer tracers from rlater to send */
+    int icheck_processor_shell();
 
-    numtracers=E->trace.ilater[j];
+    rad=E->trace.rlater[j][2][kk];
+    x=E->trace.rlater[j][3][kk];
+    y=E->trace.rlater[j][4][kk];
+    z=E->trace.rlater[j][5][kk];
 
-    for (kk=1;kk<=numtracers;kk++) {
-        rad=E->trace.rlater[j][2][kk];
-        x=E->trace.rlater[j][3][kk];
-        y=E->trace.rlater[j][4][kk];
-        z=E->trace.rlater[j][5][kk];
+    /* the radial bounds of my shell are shared by all caps */
 
-        /* first check same cap if nprocz>1 */
+    icheck=icheck_processor_shell(E,j,rad);
+    if (icheck==-99) ishell=0;
+    else if (icheck==0) ishell=2;
+    else ishell=1;
 
-        if (E->parallel.nprocz>1) {
-            ithatcap=0;
-            icheck=full_icheck_cap(E,ithatcap,x,y,z,rad);
-            if (icheck==1) goto foundit;
+    /* first check same cap if nprocz>1, then neighboring caps */
 
-        }
+    for (icap=(E->parallel.nprocz>1)?0:1;icap<=num_ngb;icap++) {
+        if (full_icheck_cap(E,icap,x,y,z,rad)==1) break;
+    }
 
-        /* check neighboring caps */
+    /* should not be here */
+    if (icap>num_ngb) {
+        fprintf(E->trace.fpt,"Error(lost souls)-should not be here\n");
+        fprintf(E->trace.fpt,"x: %f y: %f z: %f rad: %f\n",x,y,z,rad);
+        icheck=full_icheck_cap(E,0,x,y,z,rad);
+        if (icheck==1) fprintf(E->trace.fpt," icheck here!\n");
+        else fprintf(E->trace.fpt,"icheck not here!\n");
+        fflush(E->trace.fpt);
+        exit(10);
+    }
 
-        for (pp=1;pp<=E->parallel.TNUM_PASS[lev][j];pp++) {
-            ithatcap=pp;
-            icheck=full_icheck_cap(E,ithatcap,x,y,z,rad);
-            if (icheck==1) goto foundit;
-        }
+    if (icap==0 && ishell==1) return -1;
 
+    if (E->trace.mig_index[icap][ishell]<0) {
+        fprintf(E->trace.fpt,"Error(lost souls)-no processor for tracer\n");
+        fprintf(E->trace.fpt,"cap: %d shell: %d x: %f y: %f z: %f rad: %f\n",
+                icap,ishell-1,x,y,z,rad);
+        fflush(E->trace.fpt);
+        exit(10);
+    }
 
-        /* should not be here */
-        if (icheck!=1) {
-            fprintf(E->trace.fpt,"Error(lost souls)-should not be here\n");
-            fprintf(E->trace.fpt,"x: %f y: %f z: %f rad: %f\n",x,y,z,rad);
-            icheck=full_icheck_cap(E,0,x,y,z,rad);
-            if (icheck==1) fprintf(E->trace.fpt," icheck here!\n");
-            else fprintf(E->trace.fpt,"icheck not here!\n");
-            fflush(E->trace.fpt);
-            exit(10);
-        }
+    return E->trace.mig_index[icap][ishell];
+}
 
-    foundit:
 
-        isend[j][ithatcap]++;
+/************** MIGRATION SETUP **********************************************/
+/*                                                                           */
+/* A tracer moves less than an element per step, so it can only leave for   */
+/* a neighboring cap (or my own cap, if nprocz>1) in the shell below, at or */
+/* above mine. This function lists the processors holding these domains.    */
+/* Processors are numbered z first within a cap, and the neighboring caps   */
+/* in PROCESSOR[lev][j] are in my shell, so the processor of cap kk and     */
+/* shell offset dz is PROCESSOR[lev][j].pass[kk]+dz. The list is symmetric, */
+/* so each pair of partners exchanges exactly one message in lost_souls().  */
+
+static void full_migration_setup(struct All_variables *E)
+{
+    /* This code works only if E->sphere.caps_per_proc==1 */
+    const int j = 1;
+    int kk, dz, pp;
+    int proc;
+    int lev = E->mesh.levmax;
+    int lz = E->parallel.me_loc[3];
+
+    E->trace.nmig=0;
 
-        /* assign tracer to send */
+    for (kk=0;kk<=E->parallel.TNUM_PASS[lev][j];kk++) {
+        for (dz=-1;dz<=1;dz++) {
+            E->trace.mig_index[kk][dz+1]=-1;
 
-        isend_position=(isend[j][ithatcap]-1)*E->trace.number_of_tracer_quantities;
+            if (lz+dz<0 || lz+dz>=E->parallel.nprocz) continue;
+            if (kk==0 && dz==0) continue;
 
-        for (pp=0;pp<=(E->trace.number_of_tracer_quantities-1);pp++) {
-            ipos=isend_position+pp;
-            send[j][ithatcap][ipos]=E->trace.rlater[j][pp][kk];
+            if (kk==0) proc=E->parallel.me+dz;
+            else proc=E->parallel.PROCESSOR[lev][j].pass[kk]+dz;
+
+            for (pp=0;pp<E->trace.nmig;pp++)
+                if (E->trace.mig_proc[pp]==proc) break;
+            if (pp==E->trace.nmig) E->trace.mig_proc[E->trace.nmig++]=proc;
+
+            E->trace.mig_index[kk][dz+1]=pp;
         }
+    }
 
-    } /* end kk, assigning tracers */
+    if(E->control.verbose) {
+        fprintf(E->trace.fpt,"lost_souls() partners:");
+        for (pp=0;pp<E->trace.nmig;pp++)
+            fprintf(E->trace.fpt," %d",E->trace.mig_proc[pp]);
+        fprintf(E->trace.fpt,"\n");
+        fflush(E->trace.fpt);
+    }
 
     return;
 }
@@ -873,6 +566,21 @@ static void full_put_lost_tracers(struct All_variables *E,
 void full_get_shape_functions(struct All_variables *E,
                               double shp[9], int nelem,
                               double theta, double phi, double rad)
+{
+    get_wedge_shape_functions(E, shp, nelem, theta, phi, rad, NULL);
+    return;
+}
+
+
+/* Same as full_get_shape_functions(). If radbounds is not NULL, it gives */
+/* the radii of the bottom and top nodes of the element, which may belong */
+/* to another processor of the same cap column; nelem is then only used   */
+/* for the lateral (gnomonic) shape functions.                            */
+
+static void get_wedge_shape_functions(struct All_variables *E,
+                                      double shp[9], int nelem,
+                                      double theta, double phi, double rad,
+                                      const double *radbounds)
 {
     const int j = 1;
 
@@ -886,6 +594,7 @@ void full_get_shape_functions(struct All_variables *E,
     double shaperad[3];
     double shape[7];
     double x,y,z;
+    double rb[2];
 
     int maxlevel=E->mesh.levmax;
 
@@ -964,7 +673,12 @@ void full_get_shape_functions(struct All_variables *E,
     /* Determine radial shape functions */
     /* There are 2 shape functions radially */
 
-    get_radial_shape(E,j,nelem,rad,shaperad);
+    if (radbounds==NULL) {
+        tracer_element_radii(E,j,nelem,rb);
+        radbounds=rb;
+    }
+
+    get_radial_shape(E,rad,radbounds,shaperad);
 
     /* There are 6 nodes to the solid wedge.             */
     /* The 6 shape functions assocated with the 6 nodes  */
@@ -1033,74 +747,77 @@ void full_get_velocity(struct All_variables *E,
                        double theta, double phi, double rad,
                        double *velocity_vector)
 {
-    int iwedge;
-    const int sphere_key = 0;
+    update_tracer_velocity_cache(E);
+    full_get_velocities(E, j, nelem, 1, &theta, &phi, &rad,
+                        &velocity_vector[1], &velocity_vector[2],
+                        &velocity_vector[3]);
+    return;
+}
 
-    double shape[9];
-    double VV[4][9];
-    double vx[7],vy[7],vz[7];
 
-    void velo_from_element_d();
+/************************ GET VELOCITIES *************************************/
+/*                                                                           */
+/* Same as full_get_velocity(), for n tracers that all lie in element nelem. */
+/* The nodal velocities of the element are loaded once for all of them.      */
 
-    full_get_shape_functions(E, shape, nelem, theta, phi, rad);
-    iwedge=shape[0];
+void full_get_velocities(struct All_variables *E,
+                         int j, int nelem, int n,
+                         double *theta, double *phi, double *rad,
+                         double *vx, double *vy, double *vz)
+{
+    double radbounds[2];
+    double VV[4][9];
 
     /* get cartesian velocity */
-    velo_from_element_d(E, VV, j, nelem, sphere_key);
+    tracer_velo_from_element(E, VV, j, nelem);
+    tracer_element_radii(E, j, nelem, radbounds);
 
-    /* depending on wedge, set up velocity points */
+    full_get_element_velocities(E, j, nelem, radbounds, VV, n,
+                                theta, phi, rad, vx, vy, vz);
+    return;
+}
 
-    if (iwedge==1)
-        {
-            vx[1]=VV[1][1];
-            vx[2]=VV[1][2];
-            vx[3]=VV[1][3];
-            vx[4]=VV[1][5];
-            vx[5]=VV[1][6];
-            vx[6]=VV[1][7];
-            vy[1]=VV[2][1];
-            vy[2]=VV[2][2];
-            vy[3]=VV[2][3];
-            vy[4]=VV[2][5];
-            vy[5]=VV[2][6];
-            vy[6]=VV[2][7];
-            vz[1]=VV[3][1];
-            vz[2]=VV[3][2];
-            vz[3]=VV[3][3];
-            vz[4]=VV[3][5];
-            vz[5]=VV[3][6];
-            vz[6]=VV[3][7];
-        }
-    if (iwedge==2)
-        {
-            vx[1]=VV[1][1];
-            vx[2]=VV[1][3];
-            vx[3]=VV[1][4];
-            vx[4]=VV[1][5];
-            vx[5]=VV[1][7];
-            vx[6]=VV[1][8];
-            vy[1]=VV[2][1];
-            vy[2]=VV[2][3];
-            vy[3]=VV[2][4];
-            vy[4]=VV[2][5];
-            vy[5]=VV[2][7];
-            vy[6]=VV[2][8];
-            vz[1]=VV[3][1];
-            vz[2]=VV[3][3];
-            vz[3]=VV[3][4];
-            vz[4]=VV[3][5];
-            vz[5]=VV[3][7];
-            vz[6]=VV[3][8];
-        }
 
-    velocity_vector[1]=vx[1]*shape[1]+vx[2]*shape[2]+shape[3]*vx[3]+
-        vx[4]*shape[4]+vx[5]*shape[5]+shape[6]*vx[6];
-    velocity_vector[2]=vy[1]*shape[1]+vy[2]*shape[2]+shape[3]*vy[3]+
-        vy[4]*shape[4]+vy[5]*shape[5]+shape[6]*vy[6];
-    velocity_vector[3]=vz[1]*shape[1]+vz[2]*shape[2]+shape[3]*vz[3]+
-        vz[4]*shape[4]+vz[5]*shape[5]+shape[6]*vz[6];
+/************************ GET ELEMENT VELOCITIES *****************************/
+/*                                                                           */
+/* Same as full_get_velocities(), with the radii of the bottom and top nodes */
+/* and the Cartesian nodal velocities of the element given. The element may  */
+/* belong to another processor of the same cap column (tracer_balance); the  */
+/* local element nelem of the same column gives the lateral shape functions. */
+
+void full_get_element_velocities(struct All_variables *E,
+                                 int j, int nelem, double radbounds[2],
+                                 double VV[4][9], int n,
+                                 double *theta, double *phi, double *rad,
+                                 double *vx, double *vy, double *vz)
+{
+    /* real nodes of the wedges, see table above */
+    static const int wedge_node[3][7] = {{0, 0, 0, 0, 0, 0, 0},
+                                         {0, 1, 2, 3, 5, 6, 7},
+                                         {0, 1, 3, 4, 5, 7, 8}};
+    int iwedge;
+    int t;
+    const int *w;
+
+    double shape[9];
+
+    for (t=0;t<n;t++) {
 
+        get_wedge_shape_functions(E, shape, nelem, theta[t], phi[t], rad[t],
+                                  radbounds);
+        iwedge=shape[0];
 
+        /* depending on wedge, set up velocity points */
+
+        w=wedge_node[iwedge];
+
+        vx[t]=VV[1][w[1]]*shape[1]+VV[1][w[2]]*shape[2]+shape[3]*VV[1][w[3]]+
+            VV[1][w[4]]*shape[4]+VV[1][w[5]]*shape[5]+shape[6]*VV[1][w[6]];
+        vy[t]=VV[2][w[1]]*shape[1]+VV[2][w[2]]*shape[2]+shape[3]*VV[2][w[3]]+
+            VV[2][w[4]]*shape[4]+VV[2][w[5]]*shape[5]+shape[6]*VV[2][w[6]];
+        vz[t]=VV[3][w[1]]*shape[1]+VV[3][w[2]]*shape[2]+shape[3]*VV[3][w[3]]+
+            VV[3][w[4]]*shape[4]+VV[3][w[5]]*shape[5]+shape[6]*VV[3][w[6]];
+    }
 
     return;
 }
@@ -1159,24 +876,22 @@ static void get_2dshape(struct All_variables *E,
 /* GET RADIAL SHAPE                                            */
 /*                                                             */
 /* This function determines radial shape functions at rad      */
+/* between the radii radbounds[0] and radbounds[1] of the      */
+/* bottom and top nodes of the element                         */
 
 static void get_radial_shape(struct All_variables *E,
-                             int j, int nelem,
-                             double rad, double *shaperad)
+                             double rad, const double *radbounds,
+                             double *shaperad)
 {
 
-    int node1,node5;
     double rad1,rad5,f1,f2,delrad;
 
     const double eps=1e-6;
     double top_bound=1.0+eps;
     double bottom_bound=0.0-eps;
 
-    node1=E->ien[j][nelem].node[1];
-    node5=E->ien[j][nelem].node[5];
-
-    rad1=E->sx[j][3][node1];
-    rad5=E->sx[j][3][node5];
+    rad1=radbounds[0];
+    rad5=radbounds[1];
 
     delrad=rad5-rad1;
 
@@ -2191,7 +1906,7 @@ static int icheck_element_column(struct All_variables *E,
     int node;
 
 
-    E->trace.istat_elements_checked++;
+    tracer_thread_stat(E)->istat_elements_checked++;
 
     /* surface coords of element nodes */
 
@@ -2710,7 +2425,7 @@ int full_iget_element(struct All_variables *E,
 
     /* As a last resort, check all element columns */
 
-    E->trace.istat1++;
+    tracer_thread_stat(E)->istat1++;
 
     iel=icheck_all_columns(E,j,x,y,z,rad);
 
@@ -2725,11 +2440,6 @@ int full_iget_element(struct All_variables *E,
       if (E->trace.itracer_warnings) exit(10);
     */
 
-    if (E->trace.istat1%100==0)
-        {
-            fprintf(E->trace.fpt,"Checked all elements %d times already this turn\n",E->trace.istat1);
-            fflush(E->trace.fpt);
-        }
     if (iel>0)
         {
             goto foundit;
@@ -3140,6 +2850,7 @@ void analytical_test(E)
                     E->sphere.cap[j].V[3][kk]=vel_s[3];
                 }
         }
+    E->sphere.V_stamp++;
 
     time=0.0;
 
@@ -3167,9 +2878,9 @@ void analytical_test(E)
         {
             for (pp=1;pp<=E->trace.ntracers[j];pp++)
                 {
-                    theta=E->trace.basicq[j][0][pp];
-                    phi=E->trace.basicq[j][1][pp];
-                    rad=E->trace.basicq[j][2][pp];
+                    theta=tracer_basicq(E,j,pp)[0];
+                    phi=tracer_basicq(E,j,pp)[1];
+                    rad=tracer_basicq(E,j,pp)[2];
 
                     fprintf(E->trace.fpt,"(%d) time: %f theta: %f phi: %f rad: %f\n",E->monitor.solution_cycles,time,theta,phi,rad);
 
@@ -3199,9 +2910,9 @@ void analytical_test(E)
                 {
                     for (pp=1;pp<=E->trace.ntracers[j];pp++)
                         {
-                            theta=E->trace.basicq[j][0][pp];
-                            phi=E->trace.basicq[j][1][pp];
-                            rad=E->trace.basicq[j][2][pp];
+                            theta=tracer_basicq(E,j,pp)[0];
+                            phi=tracer_basicq(E,j,pp)[1];
+                            rad=tracer_basicq(E,j,pp)[2];
 
                             fprintf(E->trace.fpt,"(%d) time: %f theta: %f phi: %f rad: %f\n",E->monitor.solution_cycles,time,theta,phi,rad);
 
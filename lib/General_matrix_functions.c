@@ -29,6 +29,7 @@
 #include <sys/types.h>
 #include "element_definitions.h"
 #include "global_defs.h"
+#include "drive_solvers.h"
 
 #ifdef _UNICOS
 #include <fortran.h>
@@ -59,6 +60,8 @@ int solve_del2_u(E,d0,F,acc,high_lev)
   void gauss_seidel();
 
   double conj_grad();
+  double conj_grad_pipelined();
+  double mg_conj_grad();
   double multi_grid();
   double global_vdot();
   void record();
@@ -90,7 +93,16 @@ int solve_del2_u(E,d0,F,acc,high_lev)
     /* conjugate gradient solution */
 
     cycles = E->control.v_steps_low;
-    residual = conj_grad(E,d0,F,acc,&cycles,high_lev);
+    if (E->control.pipelined_cg)
+      residual = conj_grad_pipelined(E,d0,F,acc,&cycles,high_lev);
+    else
+      residual = conj_grad(E,d0,F,acc,&cycles,high_lev);
+    valid = (residual < acc)? 1:0;
+  } else if (E->control.mg_krylov) {
+    /* flexible CG with a multigrid preconditioner */
+
+    cycles = E->control.max_mg_cycles;
+    residual = mg_conj_grad(E,d0,F,acc,&cycles,high_lev);
     valid = (residual < acc)? 1:0;
   } else  {
     
@@ -149,6 +161,11 @@ int solve_del2_u(E,d0,F,acc,high_lev)
    recursive multigrid function ....
    ================================= */
 
+#ifndef USE_CUDA
+static double multi_grid_float(struct All_variables *, double **,
+                               double **, double, int);
+#endif
+
 double multi_grid(E,d1,F,acc,hl)
      struct All_variables *E;
      double **d1;
@@ -166,12 +183,14 @@ double multi_grid(E,d1,F,acc,hl)
     void e_assemble_del2_u();
     void strip_bcs_from_residual();
     void n_assemble_del2_u();
+    void coarse_solve();
 
     double conj_grad(),global_vdot();
 
     FILE *fp;
     char filename[1000];
     int lev,ic,ulev,dlev;
+    size_t mark;
 
     const int levmin = E->mesh.levmin;
     const int levmax = E->mesh.levmax;
@@ -183,14 +202,20 @@ double multi_grid(E,d1,F,acc,hl)
 				/* because it's recursive, need a copy at
 				    each level */
 
+#ifndef USE_CUDA
+    if (E->control.mg_single_precision && levmax > levmin)
+      return multi_grid_float(E,d1,F,acc,hl);
+#endif
+
+    mark = solver_workspace_mark(E);
     for(i=E->mesh.levmin;i<=E->mesh.levmax;i++)
       for(m=1;m<=E->sphere.caps_per_proc;m++)    {
-	del_vel[i][m]=(double *)malloc((E->lmesh.NEQ[i]+1)*sizeof(double));
-	AU[i][m] = (double *)malloc((E->lmesh.NEQ[i]+1)*sizeof(double));
-	vel[i][m]=(double *)malloc((E->lmesh.NEQ[i]+1)*sizeof(double));
-	res[i][m]=(double *)malloc((E->lmesh.NEQ[i])*sizeof(double));
+	del_vel[i][m]=solver_workspace_alloc(E,E->lmesh.NEQ[i]+1);
+	AU[i][m] = solver_workspace_alloc(E,E->lmesh.NEQ[i]+1);
+	vel[i][m]=solver_workspace_alloc(E,E->lmesh.NEQ[i]+1);
+	res[i][m]=solver_workspace_alloc(E,E->lmesh.NEQ[i]);
 	if (i<E->mesh.levmax)
-	  fl[i][m]=(double *)malloc((E->lmesh.NEQ[i])*sizeof(double));
+	  fl[i][m]=solver_workspace_alloc(E,E->lmesh.NEQ[i]);
       }
 
     Vnmax = E->control.mg_cycle;
@@ -209,7 +234,11 @@ double multi_grid(E,d1,F,acc,hl)
 /*    time=CPU_time0(); */
     cycles = E->control.v_steps_low;
 
-    gauss_seidel(E,vel[levmin],fl[levmin],AU[levmin],acc*0.01,&cycles,levmin,0);
+    /* AU is not needed on the lowest level */
+    if (E->control.mg_coarse_direct)
+      coarse_solve(E,vel[levmin],fl[levmin]);
+    else
+      gauss_seidel(E,vel[levmin],fl[levmin],AU[levmin],acc*0.01,&cycles,levmin,0);
 
     for(lev=levmin+1;lev<=levmax;lev++) {
       time=CPU_time0();
@@ -247,7 +276,10 @@ double multi_grid(E,d1,F,acc,hl)
 
                                         /*    Bottom of the V    */
        cycles = E->control.v_steps_low;
-       gauss_seidel(E,vel[levmin],res[levmin],AU[levmin],acc*0.01,&cycles,levmin,0);
+       if (E->control.mg_coarse_direct)
+         coarse_solve(E,vel[levmin],res[levmin]);
+       else
+         gauss_seidel(E,vel[levmin],res[levmin],AU[levmin],acc*0.01,&cycles,levmin,0);
                                         /*    Upward stoke of the V    */
         for (ulev=levmin+1;ulev<=lev;ulev++)   {
             cycles=((ulev==levmax)?E->control.v_steps_high:E->control.up_heavy);
@@ -282,15 +314,7 @@ double multi_grid(E,d1,F,acc,hl)
 
      residual = sqrt(global_vdot(E,F,F,hl));
 
-      for(i=E->mesh.levmin;i<=E->mesh.levmax;i++)
-        for(m=1;m<=E->sphere.caps_per_proc;m++) {
-	  free((double*) del_vel[i][m]);
-	  free((double*) AU[i][m]);
-	  free((double*) vel[i][m]);
-	  free((double*) res[i][m]);
-	  if (i<E->mesh.levmax)
-	    free((double*) fl[i][m]);
-	  }
+    solver_workspace_release(E, mark);
 
 
     return(residual);
@@ -319,6 +343,7 @@ double conj_grad(E,d0,F,acc,cycles,level)
     double *shuffle[NCS];
 
     int m,count,i,steps;
+    size_t mark;
     double residual;
     double alpha,beta,dotprod,dotr1z1,dotr0z0;
 
@@ -334,15 +359,16 @@ double conj_grad(E,d0,F,acc,cycles,level)
 
     steps = *cycles;
 
+    mark = solver_workspace_mark(E);
     for(m=1;m<=E->sphere.caps_per_proc;m++)    {
-      r0[m] = (double *)malloc(E->lmesh.NEQ[mem_lev]*sizeof(double));
-      r1[m] = (double *)malloc(E->lmesh.NEQ[mem_lev]*sizeof(double));
-      r2[m] = (double *)malloc(E->lmesh.NEQ[mem_lev]*sizeof(double));
-      z0[m] = (double *)malloc(E->lmesh.NEQ[mem_lev]*sizeof(double));
-      z1[m] = (double *)malloc(E->lmesh.NEQ[mem_lev]*sizeof(double));
-      p1[m] = (double *)malloc((1+E->lmesh.NEQ[mem_lev])*sizeof(double));
-      p2[m] = (double *)malloc((1+E->lmesh.NEQ[mem_lev])*sizeof(double));
-      Ap[m] = (double *)malloc((1+E->lmesh.NEQ[mem_lev])*sizeof(double));
+      r0[m] = solver_workspace_alloc(E,E->lmesh.NEQ[mem_lev]);
+      r1[m] = solver_workspace_alloc(E,E->lmesh.NEQ[mem_lev]);
+      r2[m] = solver_workspace_alloc(E,E->lmesh.NEQ[mem_lev]);
+      z0[m] = solver_workspace_alloc(E,E->lmesh.NEQ[mem_lev]);
+      z1[m] = solver_workspace_alloc(E,E->lmesh.NEQ[mem_lev]);
+      p1[m] = solver_workspace_alloc(E,1+E->lmesh.NEQ[mem_lev]);
+      p2[m] = solver_workspace_alloc(E,1+E->lmesh.NEQ[mem_lev]);
+      Ap[m] = solver_workspace_alloc(E,1+E->lmesh.NEQ[mem_lev]);
     }
 
     for(m=1;m<=E->sphere.caps_per_proc;m++)
@@ -410,21 +436,279 @@ double conj_grad(E,d0,F,acc,cycles,level)
 
     strip_bcs_from_residual(E,d0,level);
 
-    for(m=1;m<=E->sphere.caps_per_proc;m++)    {
-      free((double*) r0[m]);
-      free((double*) r1[m]);
-      free((double*) r2[m]);
-      free((double*) z0[m]);
-      free((double*) z1[m]);
-      free((double*) p1[m]);
-      free((double*) p2[m]);
-      free((double*) Ap[m]);
-    }
+    solver_workspace_release(E, mark);
 
     return(residual);   }
 #endif /* !USE_CUDA */
 
 
+/*  ===========================================================
+    Flexible conjugate gradient for Kd = f, preconditioned with one
+    call of multi_grid() per iteration. The multigrid cycle is not a
+    fixed linear operator (its corrections are scaled by a line search),
+    so beta takes the Polak-Ribiere form z.(r1-r0)/z0.r0, which keeps
+    the iteration converging when the preconditioner varies.
+    Returns the residual after *cycles iterations ...
+    ===========================================================  */
+
+double mg_conj_grad(E,d0,F,acc,cycles,level)
+     struct All_variables *E;
+     double **d0;
+     double **F;
+     double acc;
+     int *cycles;
+     int level;
+{
+    double *r[NCS],*dr[NCS],*z[NCS],*w[NCS];
+    double *p[NCS],*Ap[NCS];
+
+    int m,count,i,steps;
+    size_t mark;
+    double residual;
+    double alpha,beta,dotprod,dotrz,dotrz0;
+    char message[200];
+
+    void assemble_del2_u();
+    void record();
+    void report();
+    double multi_grid();
+    double global_vdot();
+
+    const int neq = E->lmesh.NEQ[level];
+
+    steps = *cycles;
+
+    mark = solver_workspace_mark(E);
+    for(m=1;m<=E->sphere.caps_per_proc;m++)    {
+      r[m] = solver_workspace_alloc(E,neq);
+      dr[m] = solver_workspace_alloc(E,neq);
+      z[m] = solver_workspace_alloc(E,neq+1);
+      w[m] = solver_workspace_alloc(E,neq+1);
+      p[m] = solver_workspace_alloc(E,neq+1);
+      Ap[m] = solver_workspace_alloc(E,neq+1);
+    }
+
+    for(m=1;m<=E->sphere.caps_per_proc;m++)
+      for(i=0;i<neq;i++) {
+        r[m][i] = F[m][i];
+        d0[m][i] = 0.0;
+      }
+
+    residual = sqrt(global_vdot(E,r,r,level));
+    dotrz0 = 1.0;
+    count = 0;
+
+    while (((residual > acc) && (count < steps)) || count == 0)  {
+
+      /* z = M r, multi_grid() overwrites its right hand side */
+      for(m=1;m<=E->sphere.caps_per_proc;m++)
+        for(i=0;i<neq;i++) {
+          z[m][i] = 0.0;
+          w[m][i] = r[m][i];
+        }
+      multi_grid(E,z,w,acc,level);
+
+      dotrz = global_vdot(E,r,z,level);
+
+      if (count == 0)
+        for(m=1;m<=E->sphere.caps_per_proc;m++)
+          for(i=0;i<neq;i++)
+            p[m][i] = z[m][i];
+      else {
+        beta = global_vdot(E,dr,z,level)/dotrz0;
+        for(m=1;m<=E->sphere.caps_per_proc;m++)
+          for(i=0;i<neq;i++)
+            p[m][i] = z[m][i] + beta * p[m][i];
+      }
+
+      dotrz0 = dotrz;
+
+      assemble_del2_u(E,p,Ap,level,1);
+
+      dotprod = global_vdot(E,p,Ap,level);
+
+      if(0.0==dotprod)
+        alpha = 1.0e-3;
+      else
+        alpha = dotrz/dotprod;
+
+      for(m=1;m<=E->sphere.caps_per_proc;m++)
+        for(i=0;i<neq;i++) {
+          d0[m][i] += alpha * p[m][i];
+          dr[m][i] = - alpha * Ap[m][i];
+          r[m][i] += dr[m][i];
+        }
+
+      residual = sqrt(global_vdot(E,r,r,level));
+
+      count++;
+
+      if(E->parallel.me==0){	/* output  */
+        snprintf(message,200,"resi = %.6e for iter %d acc %.6e",residual,count,acc);
+        record(E,message);
+        report(E,message);
+      }
+    }
+
+    *cycles=count;
+
+    solver_workspace_release(E, mark);
+
+    return(residual);
+}
+
+
+/*  ===========================================================
+    Pipelined (Ghysels-Vanroose) variant of conj_grad(). The three
+    inner products of an iteration are reduced together with one
+    non-blocking MPI_Iallreduce, which is overlapped with the Jacobi
+    preconditioner and the matrix-vector product of the next search
+    direction. The recurrences carry s=Ap, q=Ms, z=Aq and w=Au along,
+    so it performs one matvec and one reduction per iteration, like
+    conj_grad(), but the reduction no longer stalls the solver.
+    ===========================================================  */
+
+double conj_grad_pipelined(E,d0,F,acc,cycles,level)
+     struct All_variables *E;
+     double **d0;
+     double **F;
+     double acc;
+     int *cycles;
+     int level;
+{
+    double *r[NCS],*u[NCS],*w[NCS],*mw[NCS],*nw[NCS];
+    double *z[NCS],*q[NCS],*s[NCS],*p[NCS];
+
+    int m,count,i,steps;
+    size_t mark;
+    double residual,time0;
+    double alpha,beta,gamma,gamma0,delta;
+    double local[3],sum[3];
+    MPI_Request request;
+
+    void assemble_del2_u();
+    void strip_bcs_from_residual();
+
+    const int neq = E->lmesh.NEQ[level];
+
+    steps = *cycles;
+
+    mark = solver_workspace_mark(E);
+    for(m=1;m<=E->sphere.caps_per_proc;m++)    {
+      r[m] = solver_workspace_alloc(E,neq+1);
+      u[m] = solver_workspace_alloc(E,neq+1);
+      w[m] = solver_workspace_alloc(E,neq+1);
+      mw[m] = solver_workspace_alloc(E,neq+1);
+      nw[m] = solver_workspace_alloc(E,neq+1);
+      z[m] = solver_workspace_alloc(E,neq+1);
+      q[m] = solver_workspace_alloc(E,neq+1);
+      s[m] = solver_workspace_alloc(E,neq+1);
+      p[m] = solver_workspace_alloc(E,neq+1);
+    }
+
+    /* r = F, u = M r, w = A u */
+    for(m=1;m<=E->sphere.caps_per_proc;m++) {
+      for(i=0;i<neq;i++) {
+        r[m][i] = F[m][i];
+        u[m][i] = E->BI[level][m][i] * r[m][i];
+        d0[m][i] = 0.0;
+      }
+      u[m][neq] = 0.0;
+      mw[m][neq] = 0.0;
+    }
+    assemble_del2_u(E,u,w,level,1);
+
+    alpha = gamma0 = 1.0;
+    residual = 0.0;
+    count = 0;
+
+    while (1)  {
+
+      local[0] = local_vdot(E,r,u,level);
+      local[1] = local_vdot(E,w,u,level);
+      local[2] = local_vdot(E,r,r,level);
+
+      time0 = MPI_Wtime();
+      MPI_Iallreduce(local,sum,3,MPI_DOUBLE,MPI_SUM,E->parallel.world,&request);
+      E->parallel.allreduce_time += MPI_Wtime() - time0;
+      E->parallel.allreduce_calls++;
+
+      /* m = M w, n = A m, while the reduction is in flight */
+      if (count < steps) {
+        for(m=1;m<=E->sphere.caps_per_proc;m++)
+          for(i=0;i<neq;i++)
+            mw[m][i] = E->BI[level][m][i] * w[m][i];
+        assemble_del2_u(E,mw,nw,level,1);
+      }
+
+      time0 = MPI_Wtime();
+      MPI_Wait(&request,MPI_STATUS_IGNORE);
+      E->parallel.allreduce_time += MPI_Wtime() - time0;
+
+      gamma = sum[0];
+      delta = sum[1];
+      residual = sqrt(sum[2]);
+
+      if (count == 0)
+        assert(residual != 0.0  /* initial residual for CG = 0.0 */);
+
+      /* same stopping rule as conj_grad(), at least one iteration */
+      if (!(((residual > acc) && (count < steps)) || count == 0))
+        break;
+
+      if (count == 0)
+        beta = 0.0;
+      else {
+        beta = gamma/gamma0;
+        delta -= beta*gamma/alpha;
+      }
+
+      if(0.0==delta)
+        alpha = 1.0e-3;
+      else
+        alpha = gamma/delta;
+      gamma0 = gamma;
+
+      /* z, q, s and p are not set before the first iteration */
+      if (count == 0)
+        for(m=1;m<=E->sphere.caps_per_proc;m++)
+          for(i=0;i<neq;i++) {
+            z[m][i] = nw[m][i];
+            q[m][i] = mw[m][i];
+            s[m][i] = w[m][i];
+            p[m][i] = u[m][i];
+          }
+      else
+        for(m=1;m<=E->sphere.caps_per_proc;m++)
+          for(i=0;i<neq;i++) {
+            z[m][i] = nw[m][i] + beta * z[m][i];
+            q[m][i] = mw[m][i] + beta * q[m][i];
+            s[m][i] = w[m][i] + beta * s[m][i];
+            p[m][i] = u[m][i] + beta * p[m][i];
+          }
+
+      for(m=1;m<=E->sphere.caps_per_proc;m++)
+        for(i=0;i<neq;i++) {
+
+          d0[m][i] += alpha * p[m][i];
+          r[m][i] -= alpha * s[m][i];
+          u[m][i] -= alpha * q[m][i];
+          w[m][i] -= alpha * z[m][i];
+        }
+
+      count++;
+    }
+
+    *cycles=count;
+
+    strip_bcs_from_residual(E,d0,level);
+
+    solver_workspace_release(E, mark);
+
+    return(residual);
+}
+
+
 /* ========================================================================================
    An element by element version of the gauss-seidel routine. Initially this is a test
    platform, we want to know if it handles discontinuities any better than the node/equation
@@ -596,11 +880,641 @@ void element_gauss_seidel(E,d0,F,Ad,acc,cycles,level,guess)
 
 #ifndef USE_CUDA
 
+/* relax node i: gather the corrections of the lower neighbours already
+   relaxed in this sweep, update the node and scatter its correction
+   back to the lower neighbours (the matrix is stored symmetric) */
+static void gauss_seidel_node(struct All_variables *E,
+                              double *d0, double *F, double *Ad,
+                              int level, int m, int i, double sor)
+{
+    int j;
+    int eqn1,eqn2,eqn3;
+    int *C;
+    higher_precision *B1,*B2,*B3;
+    double UU;
+    double *temp=E->temp[m];
+
+    const int max_eqn=14*E->mesh.nsd;
+
+    eqn1=E->ID[level][m][i].doff[1];
+    eqn2=E->ID[level][m][i].doff[2];
+    eqn3=E->ID[level][m][i].doff[3];
+    C=E->Node_map[level][m]+(i-1)*max_eqn;
+    B1=E->Eqn_k1[level][m]+(i-1)*max_eqn;
+    B2=E->Eqn_k2[level][m]+(i-1)*max_eqn;
+    B3=E->Eqn_k3[level][m]+(i-1)*max_eqn;
+
+    /* Ad on boundaries differs after the following operation, but
+       no communications are needed yet, because boundary Ad will
+       not be used for the G-S iterations for interior nodes */
+
+    for(j=3;j<max_eqn;j++)  {
+        UU = temp[C[j]];
+        Ad[eqn1] += B1[j]*UU;
+        Ad[eqn2] += B2[j]*UU;
+        Ad[eqn3] += B3[j]*UU;
+    }
+
+    if (!(E->NODE[level][m][i]&OFFSIDE))   {
+        temp[eqn1] = sor*(F[eqn1] - Ad[eqn1])*E->BI[level][m][eqn1];
+        temp[eqn2] = sor*(F[eqn2] - Ad[eqn2])*E->BI[level][m][eqn2];
+        temp[eqn3] = sor*(F[eqn3] - Ad[eqn3])*E->BI[level][m][eqn3];
+    }
+
+    /* Ad on boundaries differs after the following operation */
+    for(j=0;j<max_eqn;j++)
+        Ad[C[j]]  += B1[j]*temp[eqn1]
+                  +  B2[j]*temp[eqn2]
+                  +  B3[j]*temp[eqn3];
+
+    d0[eqn1] += temp[eqn1];
+    d0[eqn2] += temp[eqn2];
+    d0[eqn3] += temp[eqn3];
+
+    return;
+}
+
+
+/* block-CSR version of gauss_seidel_node(). The node gathers the
+   corrections of all its neighbours from its full row; Ad itself is
+   brought up to date by gauss_seidel_bsr_update() after the sweep */
+static void gauss_seidel_bsr_node(struct All_variables *E,
+                                  double *d0, double *F, double *Ad,
+                                  int level, int m, int i, double sor)
+{
+    int b,eqn,col;
+    double s1,s2,s3;
+    double *temp=E->temp[m];
+    higher_precision *K;
+
+    eqn=E->ID[level][m][i].doff[1];
+
+    if (!(E->NODE[level][m][i]&OFFSIDE))   {
+        s1 = Ad[eqn];
+        s2 = Ad[eqn+1];
+        s3 = Ad[eqn+2];
+        for(b=E->Bsr_ptr[level][m][i-1];b<E->Bsr_ptr[level][m][i];b++) {
+            col = E->Bsr_col[level][m][b];
+            K = E->Bsr_k[level][m] + 9*b;
+            s1 += K[0]*temp[col] + K[1]*temp[col+1] + K[2]*temp[col+2];
+            s2 += K[3]*temp[col] + K[4]*temp[col+1] + K[5]*temp[col+2];
+            s3 += K[6]*temp[col] + K[7]*temp[col+1] + K[8]*temp[col+2];
+        }
+        temp[eqn]   = sor*(F[eqn]   - s1)*E->BI[level][m][eqn];
+        temp[eqn+1] = sor*(F[eqn+1] - s2)*E->BI[level][m][eqn+1];
+        temp[eqn+2] = sor*(F[eqn+2] - s3)*E->BI[level][m][eqn+2];
+    }
+
+    d0[eqn]   += temp[eqn];
+    d0[eqn+1] += temp[eqn+1];
+    d0[eqn+2] += temp[eqn+2];
+
+    return;
+}
+
+
+/* Ad += A*temp after a block-CSR sweep; the rows are independent */
+static void gauss_seidel_bsr_update(struct All_variables *E, double *Ad,
+                                    int level, int m)
+{
+    int i,b,eqn,col;
+    double *temp=E->temp[m];
+    higher_precision *K;
+
+    const int nno=E->lmesh.NNO[level];
+
+#ifdef _OPENMP
+#pragma omp parallel for private(b,eqn,col,K) schedule(static) if(E->control.omp_threads)
+#endif
+    for(i=1;i<=nno;i++) {
+        eqn=E->ID[level][m][i].doff[1];
+        for(b=E->Bsr_ptr[level][m][i-1];b<E->Bsr_ptr[level][m][i];b++) {
+            col = E->Bsr_col[level][m][b];
+            K = E->Bsr_k[level][m] + 9*b;
+            Ad[eqn]   += K[0]*temp[col] + K[1]*temp[col+1] + K[2]*temp[col+2];
+            Ad[eqn+1] += K[3]*temp[col] + K[4]*temp[col+1] + K[5]*temp[col+2];
+            Ad[eqn+2] += K[6]*temp[col] + K[7]*temp[col+1] + K[8]*temp[col+2];
+        }
+    }
+
+    return;
+}
+
+
+/* color of a node for the multicolor sweep, see gauss_seidel_colored() */
+static int gauss_seidel_node_color(int node, int nox, int noz)
+{
+    const int jj = ((node-1)/noz)%nox;
+    const int ii = (node-1)/(nox*noz);
+
+    return 3*(ii%2) + jj%3;
+}
+
+
+/* Multicolor version of the nodal sweep. Vertical lines of nodes are
+   colored by (y mod 2, x mod 3); lines of the same color are not
+   coupled and do not scatter into the same entries of Ad (see
+   n_assemble_del2_u), so all lines of one color are relaxed
+   concurrently, each from bottom to top. Within a color this is
+   plain Gauss-Seidel, across colors the order is fixed, so the
+   result does not depend on the number of threads.
+
+   A node only gathers the corrections of its lower neighbours. Those
+   relaxed after it, in a later color, are added at the end of the
+   sweep to keep Ad = A*d0. OFFSIDE nodes already hold their
+   correction before the sweep and were gathered in the first place. */
+static void gauss_seidel_colored(struct All_variables *E,
+                                 double *d0, double *F, double *Ad,
+                                 int level, int m, double sor)
+{
+    int color,line,nlines,nx,ii,jj,kk,e0;
+    int i,j,k,c,nb;
+    int eqn1,eqn2,eqn3;
+    int *C;
+    higher_precision *B1,*B2,*B3;
+    double *temp=E->temp[m];
+
+    const int dims=E->mesh.nsd;
+    const int max_eqn=14*dims;
+    const int neq=E->lmesh.NEQ[level];
+    const int nno=E->lmesh.NNO[level];
+    const int nox=E->lmesh.NOX[level];
+    const int noy=E->lmesh.NOY[level];
+    const int noz=E->lmesh.NOZ[level];
+
+    for(color=0;color<6;color++) {
+        nx = (nox - color%3 + 2)/3;
+        nlines = nx * ((noy - color/3 + 1)/2);
+
+#ifdef _OPENMP
+#pragma omp parallel for private(ii,jj,kk,e0) schedule(static)
+#endif
+        for(line=0;line<nlines;line++) {
+            ii = 1 + color/3 + 2*(line/nx);
+            jj = 1 + color%3 + 3*(line%nx);
+            e0 = (ii-1)*nox*noz + (jj-1)*noz;
+            for(kk=1;kk<=noz;kk++)
+                if(E->control.block_csr)
+                    gauss_seidel_bsr_node(E,d0,F,Ad,level,m,e0+kk,sor);
+                else
+                    gauss_seidel_node(E,d0,F,Ad,level,m,e0+kk,sor);
+        }
+    }
+
+    if(E->control.block_csr)
+        return;
+
+#ifdef _OPENMP
+#pragma omp parallel for private(j,k,c,nb,eqn1,eqn2,eqn3,C,B1,B2,B3) schedule(static)
+#endif
+    for(i=1;i<=nno;i++) {
+        c = gauss_seidel_node_color(i,nox,noz);
+        eqn1=E->ID[level][m][i].doff[1];
+        eqn2=E->ID[level][m][i].doff[2];
+        eqn3=E->ID[level][m][i].doff[3];
+        C=E->Node_map[level][m]+(i-1)*max_eqn;
+        B1=E->Eqn_k1[level][m]+(i-1)*max_eqn;
+        B2=E->Eqn_k2[level][m]+(i-1)*max_eqn;
+        B3=E->Eqn_k3[level][m]+(i-1)*max_eqn;
+        for(j=3;j<max_eqn;j+=dims) {
+            if(C[j]==neq)
+                continue;
+            nb = C[j]/dims + 1;
+            if((E->NODE[level][m][nb] & OFFSIDE) ||
+               gauss_seidel_node_color(nb,nox,noz) <= c)
+                continue;
+            for(k=j;k<j+dims;k++) {
+                Ad[eqn1] += B1[k]*temp[C[k]];
+                Ad[eqn2] += B2[k]*temp[C[k]];
+                Ad[eqn3] += B3[k]*temp[C[k]];
+            }
+        }
+    }
+
+    return;
+}
+
+
+/* single precision version of gauss_seidel_node() */
+static void gauss_seidel_node_float(struct All_variables *E,
+                                    float *d0, float *F, float *Ad, float *temp,
+                                    int level, int m, int i, float sor)
+{
+    int j;
+    int eqn1,eqn2,eqn3;
+    int *C;
+    higher_precision *B1,*B2,*B3;
+    float UU;
+    float *BI=E->BIf[level][m];
+
+    const int max_eqn=14*E->mesh.nsd;
+
+    eqn1=E->ID[level][m][i].doff[1];
+    eqn2=E->ID[level][m][i].doff[2];
+    eqn3=E->ID[level][m][i].doff[3];
+    C=E->Node_map[level][m]+(i-1)*max_eqn;
+    B1=E->Eqn_k1[level][m]+(i-1)*max_eqn;
+    B2=E->Eqn_k2[level][m]+(i-1)*max_eqn;
+    B3=E->Eqn_k3[level][m]+(i-1)*max_eqn;
+
+    for(j=3;j<max_eqn;j++)  {
+        UU = temp[C[j]];
+        Ad[eqn1] += B1[j]*UU;
+        Ad[eqn2] += B2[j]*UU;
+        Ad[eqn3] += B3[j]*UU;
+    }
+
+    if (!(E->NODE[level][m][i]&OFFSIDE))   {
+        temp[eqn1] = sor*(F[eqn1] - Ad[eqn1])*BI[eqn1];
+        temp[eqn2] = sor*(F[eqn2] - Ad[eqn2])*BI[eqn2];
+        temp[eqn3] = sor*(F[eqn3] - Ad[eqn3])*BI[eqn3];
+    }
+
+    for(j=0;j<max_eqn;j++)
+        Ad[C[j]]  += B1[j]*temp[eqn1]
+                  +  B2[j]*temp[eqn2]
+                  +  B3[j]*temp[eqn3];
+
+    d0[eqn1] += temp[eqn1];
+    d0[eqn2] += temp[eqn2];
+    d0[eqn3] += temp[eqn3];
+
+    return;
+}
+
+
+/* Gauss-Seidel sweeps of a level below levmax in single precision
+   (mg_single_precision), on the float vectors of multi_grid_float().
+   The same natural order sweep as gauss_seidel(), with BIf and the
+   float halo exchange of Ad. */
+static void gauss_seidel_float(struct All_variables *E,
+                               float **d0, float **F, float **Ad,
+                               int steps, int level, int guess)
+{
+    int count,i,m;
+    int eqn1,eqn2,eqn3;
+    size_t mark;
+    float *temp[NCS];
+
+    void n_assemble_del2_u_float();
+
+    const int neq=E->lmesh.NEQ[level];
+    const int nno=E->lmesh.NNO[level];
+    const float sor=E->control.mg_sor;
+
+    if(guess)
+      n_assemble_del2_u_float(E,d0,Ad,level,1);
+    else
+      for (m=1;m<=E->sphere.caps_per_proc;m++)
+        for(i=0;i<neq;i++)
+          d0[m][i] = Ad[m][i] = 0.0;
+
+    mark = solver_workspace_mark(E);
+    for (m=1;m<=E->sphere.caps_per_proc;m++)
+      temp[m] = solver_workspace_alloc_float(E,neq+1);
+
+    for(count=0;count<steps;count++) {
+      for (m=1;m<=E->sphere.caps_per_proc;m++) {
+        for(i=0;i<=neq;i++)
+          temp[m][i] = 0.0;
+        Ad[m][neq] = 0.0;
+      }
+
+      for (m=1;m<=E->sphere.caps_per_proc;m++)
+        for(i=1;i<=nno;i++)
+          if(E->NODE[level][m][i] & OFFSIDE)   {
+            eqn1=E->ID[level][m][i].doff[1];
+            eqn2=E->ID[level][m][i].doff[2];
+            eqn3=E->ID[level][m][i].doff[3];
+            temp[m][eqn1] = sor*(F[m][eqn1] - Ad[m][eqn1])*E->BIf[level][m][eqn1];
+            temp[m][eqn2] = sor*(F[m][eqn2] - Ad[m][eqn2])*E->BIf[level][m][eqn2];
+            temp[m][eqn3] = sor*(F[m][eqn3] - Ad[m][eqn3])*E->BIf[level][m][eqn3];
+            E->temp1[m][eqn1] = Ad[m][eqn1];
+            E->temp1[m][eqn2] = Ad[m][eqn2];
+            E->temp1[m][eqn3] = Ad[m][eqn3];
+          }
+
+      for (m=1;m<=E->sphere.caps_per_proc;m++)
+        for(i=1;i<=nno;i++)
+          gauss_seidel_node_float(E,d0[m],F[m],Ad[m],temp[m],level,m,i,sor);
+
+      for (m=1;m<=E->sphere.caps_per_proc;m++)
+        for(i=1;i<=nno;i++)
+          if(E->NODE[level][m][i] & OFFSIDE)   {
+            eqn1=E->ID[level][m][i].doff[1];
+            eqn2=E->ID[level][m][i].doff[2];
+            eqn3=E->ID[level][m][i].doff[3];
+            Ad[m][eqn1] -= E->temp1[m][eqn1];
+            Ad[m][eqn2] -= E->temp1[m][eqn2];
+            Ad[m][eqn3] -= E->temp1[m][eqn3];
+          }
+
+      (E->solver.exchange_id_f)(E, Ad, level);
+
+      for (m=1;m<=E->sphere.caps_per_proc;m++)
+        for(i=1;i<=nno;i++)
+          if(E->NODE[level][m][i] & OFFSIDE)   {
+            eqn1=E->ID[level][m][i].doff[1];
+            eqn2=E->ID[level][m][i].doff[2];
+            eqn3=E->ID[level][m][i].doff[3];
+            Ad[m][eqn1] += E->temp1[m][eqn1];
+            Ad[m][eqn2] += E->temp1[m][eqn2];
+            Ad[m][eqn3] += E->temp1[m][eqn3];
+          }
+    }
+
+    solver_workspace_release(E, mark);
+
+    return;
+}
+
+
+static void vector_to_float(struct All_variables *E, int level,
+                            double **x, float **xf)
+{
+    int m,i;
+
+    for (m=1;m<=E->sphere.caps_per_proc;m++)
+      for(i=0;i<E->lmesh.NEQ[level];i++)
+        xf[m][i] = x[m][i];
+
+    return;
+}
+
+
+static void vector_to_double(struct All_variables *E, int level,
+                             float **xf, double **x)
+{
+    int m,i;
+
+    for (m=1;m<=E->sphere.caps_per_proc;m++)
+      for(i=0;i<E->lmesh.NEQ[level];i++)
+        x[m][i] = xf[m][i];
+
+    return;
+}
+
+
+/* project_vector() and interp_vector() between two float levels,
+   through the double vectors x and y, with the bcs stripped */
+static void project_vector_float(struct All_variables *E, int start_lev,
+                                 float **AU, float **AD,
+                                 double **x, double **y)
+{
+    void project_vector();
+    void strip_bcs_from_residual();
+
+    vector_to_double(E,start_lev,AU,x);
+    project_vector(E,start_lev,x,y,1);
+    strip_bcs_from_residual(E,y,start_lev-1);
+    vector_to_float(E,start_lev-1,y,AD);
+
+    return;
+}
+
+
+static void interp_vector_float(struct All_variables *E, int start_lev,
+                                float **AD, float **AU,
+                                double **x, double **y)
+{
+    void interp_vector();
+    void strip_bcs_from_residual();
+
+    vector_to_double(E,start_lev,AD,x);
+    interp_vector(E,start_lev,x,y);
+    strip_bcs_from_residual(E,y,start_lev+1);
+    vector_to_float(E,start_lev+1,y,AU);
+
+    return;
+}
+
+
+/* solve for the lowest level, as in multi_grid() */
+static void coarse_solve_float(struct All_variables *E,
+                               float **vel, float **res, float **AU,
+                               double **x, double **y)
+{
+    void coarse_solve();
+
+    const int levmin=E->mesh.levmin;
+
+    if (E->control.mg_coarse_direct) {
+      vector_to_double(E,levmin,res,x);
+      coarse_solve(E,y,x);
+      vector_to_float(E,levmin,y,vel);
+    }
+    else
+      gauss_seidel_float(E,vel,res,AU,E->control.v_steps_low,levmin,0);
+
+    return;
+}
+
+
+/* multi_grid() with the levels below levmax in single precision
+   (mg_single_precision). Only levmax keeps double vectors; the
+   vectors of the other levels are float, and so is their BI (BIf).
+   These levels only compute corrections for levmax, where the
+   residual is still updated in double, so the cycle acts as an
+   iterative refinement and converges to the same accuracy. The grid
+   transfers are done in double through the two vectors x and y,
+   which have the size of levmax-1. */
+static double multi_grid_float(struct All_variables *E, double **d1,
+                               double **F, double acc, int hl)
+{
+    double residual,AudotAu,alpha;
+    int m,i,Vn,Vnmax,cycles,lev,ulev,dlev,top;
+    size_t mark;
+
+    void interp_vector();
+    void project_vector();
+    void gauss_seidel();
+    void strip_bcs_from_residual();
+    double global_vdot();
+    double global_vdot_float();
+
+    const int levmin = E->mesh.levmin;
+    const int levmax = E->mesh.levmax;
+    const int neq = E->lmesh.NEQ[levmax];
+
+    double *res[NCS],*AU[NCS],*vel[NCS],*del_vel[NCS];
+    double *x[NCS],*y[NCS];
+    float *resf[MAX_LEVELS][NCS],*AUf[MAX_LEVELS][NCS];
+    float *velf[MAX_LEVELS][NCS],*del_velf[MAX_LEVELS][NCS];
+    float *flf[MAX_LEVELS][NCS];
+
+    mark = solver_workspace_mark(E);
+    for(m=1;m<=E->sphere.caps_per_proc;m++)    {
+      del_vel[m] = solver_workspace_alloc(E,neq+1);
+      AU[m] = solver_workspace_alloc(E,neq+1);
+      vel[m] = solver_workspace_alloc(E,neq+1);
+      res[m] = solver_workspace_alloc(E,neq);
+      x[m] = solver_workspace_alloc(E,E->lmesh.NEQ[levmax-1]+1);
+      y[m] = solver_workspace_alloc(E,E->lmesh.NEQ[levmax-1]+1);
+      for(lev=levmin;lev<levmax;lev++) {
+        del_velf[lev][m] = solver_workspace_alloc_float(E,E->lmesh.NEQ[lev]+1);
+        AUf[lev][m] = solver_workspace_alloc_float(E,E->lmesh.NEQ[lev]+1);
+        velf[lev][m] = solver_workspace_alloc_float(E,E->lmesh.NEQ[lev]+1);
+        resf[lev][m] = solver_workspace_alloc_float(E,E->lmesh.NEQ[lev]);
+        flf[lev][m] = solver_workspace_alloc_float(E,E->lmesh.NEQ[lev]);
+      }
+    }
+
+    Vnmax = E->control.mg_cycle;
+
+        /* Project residual onto all the lower levels */
+
+    project_vector(E,levmax,F,x,1);
+    strip_bcs_from_residual(E,x,levmax-1);
+    vector_to_float(E,levmax-1,x,flf[levmax-1]);
+    for(lev=levmax-1;lev>levmin;lev--)
+      project_vector_float(E,lev,flf[lev],flf[lev-1],x,y);
+
+        /* Solve for the lowest level */
+
+    coarse_solve_float(E,velf[levmin],flf[levmin],AUf[levmin],x,y);
+
+    for(lev=levmin+1;lev<=levmax;lev++) {
+      top = (lev==levmax);
+
+                         /* Utilize coarse solution and smooth at this level */
+      if (top) {
+        vector_to_double(E,levmax-1,velf[levmax-1],x);
+        interp_vector(E,levmax-1,x,vel);
+        strip_bcs_from_residual(E,vel,levmax);
+        for(m=1;m<=E->sphere.caps_per_proc;m++)
+          for(i=0;i<neq;i++)
+            res[m][i] = F[m][i];
+      }
+      else {
+        interp_vector_float(E,lev-1,velf[lev-1],velf[lev],x,y);
+        for(m=1;m<=E->sphere.caps_per_proc;m++)
+          for(i=0;i<E->lmesh.NEQ[lev];i++)
+            resf[lev][m][i] = flf[lev][m][i];
+      }
+
+      for(Vn=1;Vn<=Vnmax;Vn++)   {
+                                        /*    Downward stoke of the V    */
+        dlev = lev;
+        if (top) {
+          cycles = E->control.v_steps_high;
+          gauss_seidel(E,vel,res,AU,0.01,&cycles,levmax,1);
+
+          for(m=1;m<=E->sphere.caps_per_proc;m++)
+            for(i=0;i<neq;i++)
+              res[m][i] -= AU[m][i];
+
+          project_vector(E,levmax,res,x,1);
+          strip_bcs_from_residual(E,x,levmax-1);
+          vector_to_float(E,levmax-1,x,resf[levmax-1]);
+          dlev--;
+        }
+
+        for (;dlev>=levmin+1;dlev--)   {
+          gauss_seidel_float(E,velf[dlev],resf[dlev],AUf[dlev],
+                             E->control.down_heavy,dlev,(dlev==lev));
+
+          for(m=1;m<=E->sphere.caps_per_proc;m++)
+            for(i=0;i<E->lmesh.NEQ[dlev];i++)
+              resf[dlev][m][i] -= AUf[dlev][m][i];
+
+          project_vector_float(E,dlev,resf[dlev],resf[dlev-1],x,y);
+        }
+
+                                        /*    Bottom of the V    */
+        coarse_solve_float(E,velf[levmin],resf[levmin],AUf[levmin],x,y);
+
+                                        /*    Upward stoke of the V    */
+        for (ulev=levmin+1;ulev<=lev && ulev<levmax;ulev++)   {
+          interp_vector_float(E,ulev-1,velf[ulev-1],del_velf[ulev],x,y);
+          gauss_seidel_float(E,del_velf[ulev],resf[ulev],AUf[ulev],
+                             E->control.up_heavy,ulev,1);
+
+          AudotAu = global_vdot_float(E,AUf[ulev],AUf[ulev],ulev);
+          alpha = global_vdot_float(E,AUf[ulev],resf[ulev],ulev)/AudotAu;
+
+          for(m=1;m<=E->sphere.caps_per_proc;m++)
+            for(i=0;i<E->lmesh.NEQ[ulev];i++)
+              velf[ulev][m][i] += alpha*del_velf[ulev][m][i];
+        }
+
+        if (top) {
+          vector_to_double(E,levmax-1,velf[levmax-1],x);
+          interp_vector(E,levmax-1,x,del_vel);
+          strip_bcs_from_residual(E,del_vel,levmax);
+          cycles = E->control.v_steps_high;
+          gauss_seidel(E,del_vel,res,AU,0.01,&cycles,levmax,1);
+
+          AudotAu = global_vdot(E,AU,AU,levmax);
+          alpha = global_vdot(E,AU,res,levmax)/AudotAu;
+
+          for(m=1;m<=E->sphere.caps_per_proc;m++)
+            for(i=0;i<neq;i++)   {
+              vel[m][i] += alpha*del_vel[m][i];
+              res[m][i] -= alpha*AU[m][i];
+            }
+        }
+      }
+    }
+
+    for(m=1;m<=E->sphere.caps_per_proc;m++)
+      for(i=0;i<neq;i++)   {
+        F[m][i] = res[m][i];
+        d1[m][i] += vel[m][i];
+      }
+
+    residual = sqrt(global_vdot(E,F,F,hl));
+
+    solver_workspace_release(E, mark);
+
+    return(residual);
+}
+
+
+/* Damped Jacobi smoother of the matrix-free level (matrix_free=on),
+   which has no nodal matrix to sweep through. Each step is one
+   matrix-free product, which also leaves Ad = A d0 for the residual. */
+static void jacobi_matrix_free(struct All_variables *E,
+                               double **d0, double **F, double **Ad,
+                               int steps, int level, int guess)
+{
+    int m,i,count;
+    void n_assemble_del2_u();
+
+    const int neq=E->lmesh.NEQ[level];
+    const double omega=E->control.mg_jacobi_omega;
+
+    if(guess)
+      n_assemble_del2_u(E,d0,Ad,level,1);
+    else
+      for (m=1;m<=E->sphere.caps_per_proc;m++)
+        for(i=0;i<neq;i++)
+          d0[m][i] = Ad[m][i] = 0.0;
+
+    for(count=0;count<steps;count++) {
+      for (m=1;m<=E->sphere.caps_per_proc;m++)
+        for(i=0;i<neq;i++)
+          d0[m][i] += omega*(F[m][i] - Ad[m][i])*E->BI[level][m][i];
+
+      n_assemble_del2_u(E,d0,Ad,level,1);
+    }
+
+    return;
+}
+
+
 /* ============================================================================
    Multigrid Gauss-Seidel relaxation scheme which requires the storage of local
    information, otherwise some other method is required. NOTE this is a bit worse
    than real gauss-seidel because it relaxes all the equations for a node at one
    time (Jacobi at a node). It does the job though.
+
+   mg_smoother=0 sweeps the nodes in their natural order, mg_smoother=1 uses
+   the multicolor sweep above, which can run with OpenMP threads. mg_sor is
+   the over-relaxation factor of both. With block_csr the nodes read the
+   corrections of all their neighbours from the block-CSR rows instead.
+   With mg_single_precision the levels below levmax are smoothed by
+   gauss_seidel_float() instead, see multi_grid_float(). With matrix_free levmax
+   is smoothed by damped Jacobi instead, see jacobi_matrix_free().
    ============================================================================ */
 
 void gauss_seidel(E,d0,F,Ad,acc,cycles,level,guess)
@@ -614,32 +1528,28 @@ void gauss_seidel(E,d0,F,Ad,acc,cycles,level,guess)
 {
 
     int count,i,j,k,l,m,ns,steps;
-    int *C;
     int eqn1,eqn2,eqn3;
 
     void parallel_process_termination();
     void n_assemble_del2_u();
 
-    double U1,U2,U3,UU;
     double sor,residual,global_vdot();
 
-    higher_precision *B1,*B2,*B3;
-
-
     const int dims=E->mesh.nsd;
     const int ends=enodes[dims];
     const int n=loc_mat_size[E->mesh.nsd];
     const int neq=E->lmesh.NEQ[level];
     const int num_nodes=E->lmesh.NNO[level];
-    const int nox=E->lmesh.NOX[level];
-    const int noz=E->lmesh.NOY[level];
-    const int noy=E->lmesh.NOZ[level];
-    const int max_eqn=14*dims;
 
     const double zeroo = 0.0;
 
     steps=*cycles;
-    sor = 1.3;
+    sor = E->control.mg_sor;
+
+    if(MATRIX_FREE_LEVEL(E,level)) {
+      jacobi_matrix_free(E,d0,F,Ad,steps,level,guess);
+      return;
+    }
 
     if(guess) {
       n_assemble_del2_u(E,d0,Ad,level,1);
@@ -668,52 +1578,27 @@ void gauss_seidel(E,d0,F,Ad,acc,cycles,level,guess)
 	    eqn1=E->ID[level][m][i].doff[1];
 	    eqn2=E->ID[level][m][i].doff[2];
 	    eqn3=E->ID[level][m][i].doff[3];
-	    E->temp[m][eqn1] = (F[m][eqn1] - Ad[m][eqn1])*E->BI[level][m][eqn1];
-	    E->temp[m][eqn2] = (F[m][eqn2] - Ad[m][eqn2])*E->BI[level][m][eqn2];
-	    E->temp[m][eqn3] = (F[m][eqn3] - Ad[m][eqn3])*E->BI[level][m][eqn3];
+	    E->temp[m][eqn1] = sor*(F[m][eqn1] - Ad[m][eqn1])*E->BI[level][m][eqn1];
+	    E->temp[m][eqn2] = sor*(F[m][eqn2] - Ad[m][eqn2])*E->BI[level][m][eqn2];
+	    E->temp[m][eqn3] = sor*(F[m][eqn3] - Ad[m][eqn3])*E->BI[level][m][eqn3];
 	    E->temp1[m][eqn1] = Ad[m][eqn1];
 	    E->temp1[m][eqn2] = Ad[m][eqn2];
 	    E->temp1[m][eqn3] = Ad[m][eqn3];
             }
 
       for (m=1;m<=E->sphere.caps_per_proc;m++)
- 	for(i=1;i<=E->lmesh.NNO[level];i++)     {
-
-	    eqn1=E->ID[level][m][i].doff[1];
-	    eqn2=E->ID[level][m][i].doff[2];
-	    eqn3=E->ID[level][m][i].doff[3];
-            C=E->Node_map[level][m]+(i-1)*max_eqn;
-	    B1=E->Eqn_k1[level][m]+(i-1)*max_eqn;
-	    B2=E->Eqn_k2[level][m]+(i-1)*max_eqn;
- 	    B3=E->Eqn_k3[level][m]+(i-1)*max_eqn;
-
-                 /* Ad on boundaries differs after the following operation, but
-                  no communications are needed yet, because boundary Ad will
-                  not be used for the G-S iterations for interior nodes */
-
-            for(j=3;j<max_eqn;j++)  {
-                 UU = E->temp[m][C[j]];
-                 Ad[m][eqn1] += B1[j]*UU;
-                 Ad[m][eqn2] += B2[j]*UU;
-                 Ad[m][eqn3] += B3[j]*UU;
-                 }
-
-            if (!(E->NODE[level][m][i]&OFFSIDE))   {
-               E->temp[m][eqn1] = (F[m][eqn1] - Ad[m][eqn1])*E->BI[level][m][eqn1];
-               E->temp[m][eqn2] = (F[m][eqn2] - Ad[m][eqn2])*E->BI[level][m][eqn2];
-               E->temp[m][eqn3] = (F[m][eqn3] - Ad[m][eqn3])*E->BI[level][m][eqn3];
-	       }
-
-                 /* Ad on boundaries differs after the following operation */
-	    for(j=0;j<max_eqn;j++)
-		    Ad[m][C[j]]  += B1[j]*E->temp[m][eqn1]
-                                 +  B2[j]*E->temp[m][eqn2]
-                                 +  B3[j]*E->temp[m][eqn3];
-
-	    d0[m][eqn1] += E->temp[m][eqn1];
-	    d0[m][eqn2] += E->temp[m][eqn2];
-	    d0[m][eqn3] += E->temp[m][eqn3];
-  	    }
+        if(E->control.mg_smoother)
+          gauss_seidel_colored(E,d0[m],F[m],Ad[m],level,m,sor);
+        else if(E->control.block_csr)
+ 	  for(i=1;i<=E->lmesh.NNO[level];i++)
+            gauss_seidel_bsr_node(E,d0[m],F[m],Ad[m],level,m,i,sor);
+        else
+ 	  for(i=1;i<=E->lmesh.NNO[level];i++)
+            gauss_seidel_node(E,d0[m],F[m],Ad[m],level,m,i,sor);
+
+      if(E->control.block_csr)
+        for (m=1;m<=E->sphere.caps_per_proc;m++)
+          gauss_seidel_bsr_update(E,Ad[m],level,m);
 
       for (m=1;m<=E->sphere.caps_per_proc;m++)
  	for(i=1;i<=E->lmesh.NNO[level];i++)
@@ -754,6 +1639,7 @@ void gauss_seidel(E,d0,F,Ad,acc,cycles,level,guess)
     return;
 
 }
+
 #endif /* !USE_CUDA */
 
 /* Fast (conditional) determinant for 3x3 or 2x2 ... otherwise calls general routine */
@@ -143,7 +143,7 @@ void ggrd_init_tracer_flavors(struct All_variables *E)
   for (j=1;j<=E->sphere.caps_per_proc;j++) {
     number_of_tracers = E->trace.ntracers[j];
     for (kk=1;kk <= number_of_tracers;kk++) {
-      rad = E->trace.basicq[j][2][kk]; /* tracer radius */
+      rad = tracer_basicq(E,j,kk)[2]; /* tracer radius */
 
       this_layer = layers_r(E,rad);
       if((only_one_layer && (this_layer == -E->trace.ggrd_layers)) ||
@@ -151,8 +151,8 @@ void ggrd_init_tracer_flavors(struct All_variables *E)
 	/*
 	   in top layers
 	*/
-	phi =   E->trace.basicq[j][1][kk];
-	theta = E->trace.basicq[j][0][kk];
+	phi =   tracer_basicq(E,j,kk)[1];
+	theta = tracer_basicq(E,j,kk)[0];
 	/* interpolate from grid */
 	if(!ggrd_grdtrack_interpolate_tp((double)theta,(double)phi,
 					 ggrd_ict,&indbl,FALSE,shift_to_pos_lon)){
@@ -167,10 +167,10 @@ void ggrd_init_tracer_flavors(struct All_variables *E)
 	  else
 	    indbl = 1.0;
 	}
-	E->trace.extraq[j][0][kk]= indbl;
+	tracer_extraq(E,j,kk)[0]= indbl;
       }else{
 	/* below */
-	E->trace.extraq[j][0][kk] = 0.0;
+	tracer_extraq(E,j,kk)[0] = 0.0;
       }
     }
   }
@@ -465,6 +465,45 @@ float *sphc,*sphs;
 
 /* ================================================== */
 
+/* sum n double coeff. (e.g. of many layers) across processors
+   in horizontal direction */
+void sum_across_surf_sph(struct All_variables *E, double *sph, int n)
+{
+    double *temp;
+    int j;
+
+    temp = (double *) malloc(n*sizeof(double));
+
+    MPI_Allreduce(sph,temp,n,MPI_DOUBLE,MPI_SUM,E->parallel.horizontal_comm);
+
+    for (j=0;j<n;j++)
+        sph[j] = temp[j];
+
+    free((void *)temp);
+    return;
+}
+
+
+/* sum n double coeff. across all processors, in horizontal and z
+   directions at once */
+void sum_across_all_sph(struct All_variables *E, double *sph, int n)
+{
+    double *temp;
+    int j;
+
+    temp = (double *) malloc(n*sizeof(double));
+
+    MPI_Allreduce(sph,temp,n,MPI_DOUBLE,MPI_SUM,E->parallel.world);
+
+    for (j=0;j<n;j++)
+        sph[j] = temp[j];
+
+    free((void *)temp);
+    return;
+}
+
+/* ================================================== */
+
 
 float global_fvdot(E,A,B,lev)
    struct All_variables *E;
@@ -531,17 +570,33 @@ double kineticE_radial(E,A,lev)
   return (prod);
 }
 
-double global_vdot(E,A,B,lev)
+/* sum local[0..n-1] over all processors in one reduction */
+void global_dsum(struct All_variables *E, double *local, double *sum, int n)
+{
+  double time0 = MPI_Wtime();
+
+  MPI_Allreduce(local, sum, n, MPI_DOUBLE, MPI_SUM, E->parallel.world);
+
+  E->parallel.allreduce_calls++;
+  E->parallel.allreduce_time += MPI_Wtime() - time0;
+
+  return;
+}
+
+
+/* The products and norms below are the sums of these local parts.
+   Several of them can share one reduction with global_dsum(). */
+
+double local_vdot(E,A,B,lev)
    struct All_variables *E;
    double **A,**B;
    int lev;
 
 {
   int m,i,neq;
-  double prod, temp,temp1;
+  double temp,temp1;
 
     temp = 0.0;
-    prod = 0.0;
 
   for (m=1;m<=E->sphere.caps_per_proc;m++)  {
     neq=E->lmesh.NEQ[lev];
@@ -556,46 +611,38 @@ double global_vdot(E,A,B,lev)
 
     }
 
-  MPI_Allreduce(&temp, &prod,1,MPI_DOUBLE,MPI_SUM,E->parallel.world);
-
-  return (prod);
+  return (temp);
 }
 
 
-double global_pdot(E,A,B,lev)
+double local_pdot(E,A,B,lev)
    struct All_variables *E;
    double **A,**B;
    int lev;
 
 {
   int i,m,npno;
-  double prod, temp;
-
-  npno=E->lmesh.NPNO[lev];
+  double temp;
 
   temp = 0.0;
-  prod = 0.0;
   for (m=1;m<=E->sphere.caps_per_proc;m++)  {
     npno=E->lmesh.NPNO[lev];
     for (i=1;i<=npno;i++)
       temp += A[m][i]*B[m][i];
     }
 
-  MPI_Allreduce(&temp, &prod,1,MPI_DOUBLE,MPI_SUM,E->parallel.world);
-
-  return (prod);
+  return (temp);
 }
 
 
-/* return ||V||^2 */
-double global_v_norm2(struct All_variables *E,  double **V)
+/* local part of ||V||^2 * volume */
+double local_v_norm2(struct All_variables *E,  double **V)
 {
-    int i, m, d;
+    int i, m;
     int eqn1, eqn2, eqn3;
-    double prod, temp;
+    double temp;
 
     temp = 0.0;
-    prod = 0.0;
     for (m=1; m<=E->sphere.caps_per_proc; m++)
         for (i=1; i<=E->lmesh.nno; i++) {
             eqn1 = E->id[m][i].doff[1];
@@ -607,40 +654,34 @@ double global_v_norm2(struct All_variables *E,  double **V)
                      V[m][eqn3] * V[m][eqn3]) * E->NMass[m][i];
         }
 
-    MPI_Allreduce(&temp, &prod, 1, MPI_DOUBLE, MPI_SUM, E->parallel.world);
-
-    return (prod/E->mesh.volume);
+    return (temp);
 }
 
 
-/* return ||P||^2 */
-double global_p_norm2(struct All_variables *E,  double **P)
+/* local part of ||P||^2 * volume */
+double local_p_norm2(struct All_variables *E,  double **P)
 {
     int i, m;
-    double prod, temp;
+    double temp;
 
     temp = 0.0;
-    prod = 0.0;
     for (m=1; m<=E->sphere.caps_per_proc; m++)
         for (i=1; i<=E->lmesh.npno; i++) {
             /* L2 norm */
             temp += P[m][i] * P[m][i] * E->eco[m][i].area;
         }
 
-    MPI_Allreduce(&temp, &prod, 1, MPI_DOUBLE, MPI_SUM, E->parallel.world);
-
-    return (prod/E->mesh.volume);
+    return (temp);
 }
 
 
-/* return ||A||^2, where A_i is \int{div(u) d\Omega_i} */
-double global_div_norm2(struct All_variables *E,  double **A)
+/* local part of ||A||^2 * volume */
+double local_div_norm2(struct All_variables *E,  double **A)
 {
     int i, m;
-    double prod, temp;
+    double temp;
 
     temp = 0.0;
-    prod = 0.0;
     for (m=1; m<=E->sphere.caps_per_proc; m++)
         for (i=1; i<=E->lmesh.npno; i++) {
             /* L2 norm of div(u) */
@@ -650,7 +691,98 @@ double global_div_norm2(struct All_variables *E,  double **A)
             /*temp += fabs(A[m][i]);*/
         }
 
-    MPI_Allreduce(&temp, &prod, 1, MPI_DOUBLE, MPI_SUM, E->parallel.world);
+    return (temp);
+}
+
+
+double global_vdot(E,A,B,lev)
+   struct All_variables *E;
+   double **A,**B;
+   int lev;
+
+{
+  double prod, temp;
+
+  temp = local_vdot(E,A,B,lev);
+  global_dsum(E,&temp,&prod,1);
+
+  return (prod);
+}
+
+
+/* global_vdot() of two float vectors of a level below levmax
+   (mg_single_precision), summed in double */
+double global_vdot_float(struct All_variables *E, float **A, float **B, int lev)
+{
+  int m,i,j;
+  double prod, temp, temp1;
+
+  temp = 0.0;
+  for (m=1;m<=E->sphere.caps_per_proc;m++)  {
+    temp1 = 0.0;
+    for (i=0;i<E->lmesh.NEQ[lev];i++)
+      temp += (double)A[m][i]*B[m][i];
+
+    for (i=1;i<=E->parallel.Skip_neq[lev][m];i++) {
+      j = E->parallel.Skip_id[lev][m][i];
+      temp1 += (double)A[m][j]*B[m][j];
+    }
+
+    temp -= temp1;
+  }
+
+  global_dsum(E,&temp,&prod,1);
+
+  return (prod);
+}
+
+
+double global_pdot(E,A,B,lev)
+   struct All_variables *E;
+   double **A,**B;
+   int lev;
+
+{
+  double prod, temp;
+
+  temp = local_pdot(E,A,B,lev);
+  global_dsum(E,&temp,&prod,1);
+
+  return (prod);
+}
+
+
+/* return ||V||^2 */
+double global_v_norm2(struct All_variables *E,  double **V)
+{
+    double prod, temp;
+
+    temp = local_v_norm2(E,V);
+    global_dsum(E,&temp,&prod,1);
+
+    return (prod/E->mesh.volume);
+}
+
+
+/* return ||P||^2 */
+double global_p_norm2(struct All_variables *E,  double **P)
+{
+    double prod, temp;
+
+    temp = local_p_norm2(E,P);
+    global_dsum(E,&temp,&prod,1);
+
+    return (prod/E->mesh.volume);
+}
+
+
+/* return ||A||^2, where A_i is \int{div(u) d\Omega_i} */
+double global_div_norm2(struct All_variables *E,  double **A)
+{
+    double prod, temp;
+
+    temp = local_div_norm2(E,A);
+    global_dsum(E,&temp,&prod,1);
 
     return (prod/E->mesh.volume);
 }
@@ -1020,6 +1152,7 @@ void remove_rigid_rot(struct All_variables *E)
       }
     }
 #endif
+    E->sphere.V_stamp++;
 
     return;
 
@@ -403,6 +403,9 @@ void read_initial_settings(struct All_variables *E)
 
 
   input_boolean("node_assemble",&(E->control.NASSEMBLE),"off",m);
+  input_boolean("block_csr",&(E->control.block_csr),"off",m);
+  input_boolean("overlap_exchange",&(E->control.overlap_exchange),"off",m);
+  input_int("omp_threads",&(E->control.omp_threads),"0,0,nomax",m);
   /* general mesh structure */
 
   input_boolean("verbose",&(E->control.verbose),"off",m);
@@ -446,6 +449,10 @@ void read_initial_settings(struct All_variables *E)
   input_int("zero_elapsed_time",&(E->control.zero_elapsed_time),"0",m);
 
   input_int("output_ll_max",&(E->output.llmax),"1",m);
+  input_boolean("compact_sph_tables",&(E->sphere.compact_tables),"off",m);
+  input_boolean("float_sph_tables",&(E->sphere.float_tables),"off",m);
+  if (E->sphere.float_tables)
+      E->sphere.compact_tables = 1;
 
   input_int("topvbc",&(E->mesh.topvbc),"0",m);
   input_int("botvbc",&(E->mesh.botvbc),"0",m);
@@ -682,6 +689,16 @@ void read_initial_settings(struct All_variables *E)
   input_int("mg_cycle",&(E->control.mg_cycle),"2,0,nomax",m);
   input_int("down_heavy",&(E->control.down_heavy),"1,0,nomax",m);
   input_int("up_heavy",&(E->control.up_heavy),"1,0,nomax",m);
+  input_int("mg_smoother",&(E->control.mg_smoother),"0,0,1",m);
+  input_double("mg_sor",&(E->control.mg_sor),"1.0,0.0,2.0",m);
+  input_boolean("mg_krylov",&(E->control.mg_krylov),"off",m);
+  input_boolean("mg_coarse_direct",&(E->control.mg_coarse_direct),"off",m);
+  input_boolean("pipelined_cg",&(E->control.pipelined_cg),"off",m);
+  input_boolean("mg_single_precision",&(E->control.mg_single_precision),"off",m);
+  input_boolean("matrix_free",&(E->control.matrix_free),"off",m);
+  input_boolean("stiffness_cache",&(E->control.stiffness_cache),"off",m);
+  input_double("stiffness_update_tol",&(E->control.stiffness_update_tol),"0.0,0.0,nomax",m);
+  input_double("mg_jacobi_omega",&(E->control.mg_jacobi_omega),"0.5,0.0,1.0",m);
   input_double("accuracy",&(E->control.accuracy),"1.0e-4,0.0,1.0",m);
   input_double("inner_accuracy_scale",&(E->control.inner_accuracy_scale),"1.0,0.000001,1.0",m);
 
@@ -859,6 +876,16 @@ void check_settings_consistency(struct All_variables *E)
 							 */
     }
 
+#ifndef _OPENMP
+    if(E->control.omp_threads) {
+        /* threaded kernels need an OpenMP build */
+        if(E->parallel.me == 0)
+            fprintf(stderr,"WARNING: omp_threads=%d, but CitcomS was built without OpenMP. Using one thread per process.\n",
+                    E->control.omp_threads);
+        E->control.omp_threads = 0;
+    }
+#endif
+
     if (strcmp(E->output.vtk_format, "binary") == 0) {
 #ifndef USE_GZDIR
         /* zlib is required for vtk binary output */
@@ -1234,19 +1261,30 @@ void allocate_velocity_vars(E)
 
   }       /* end for cap j */
 
+  E->sphere.V_stamp = 0;
+
   for(l=E->mesh.gridmin;l<=E->mesh.gridmax;l++)
     for (j=1;j<=E->sphere.caps_per_proc;j++)   {
       E->lmesh.NEQ[l] = E->lmesh.NNOV[l] * E->mesh.nsd;
 
-      E->BI[l][j] = (double *) malloc((E->lmesh.NEQ[l])*sizeof(double));
+      /* with mg_single_precision, BI of the lower levels is only
+         kept in float; construct_stiffness_B_matrix() assembles it
+         in the solver workspace */
+      if (E->control.mg_single_precision && l<E->mesh.gridmax) {
+        E->BI[l][j] = NULL;
+        E->BIf[l][j] = (float *) malloc((E->lmesh.NEQ[l])*sizeof(float));
+      }
+      else
+        E->BI[l][j] = (double *) malloc((E->lmesh.NEQ[l])*sizeof(double));
       k = (E->lmesh.NOX[l]*E->lmesh.NOZ[l]+E->lmesh.NOX[l]*E->lmesh.NOY[l]+
           E->lmesh.NOY[l]*E->lmesh.NOZ[l])*6;
       E->zero_resid[l][j] = (int *) malloc((k+2)*sizeof(int));
       E->parallel.Skip_id[l][j] = (int *) malloc((k+2)*sizeof(int));
 
-      for(i=0;i<E->lmesh.NEQ[l];i++) {
-         E->BI[l][j][i]=0.0;
-         }
+      if (E->BI[l][j])
+        for(i=0;i<E->lmesh.NEQ[l];i++) {
+           E->BI[l][j][i]=0.0;
+           }
 
       }   /* end for j & l */
 
@@ -1497,6 +1535,7 @@ void initial_velocity(E)
         E->sphere.cap[m].V[2][i]=0.0;
         E->sphere.cap[m].V[3][i]=0.0;
         }
+    E->sphere.V_stamp++;
 
     return;
 }
@@ -1855,6 +1894,10 @@ void output_init(struct  All_variables *E)
 void output_finalize(struct  All_variables *E)
 {
   char message[255],files[255];
+
+  /* wait for the background writer */
+  output_flush(E);
+
   if (E->fp)
     fclose(E->fp);
   if (E->fptime)
@@ -2017,6 +2060,9 @@ void print_all_config_parameters(struct All_variables *E)
     fprintf(fp, "# CitcomS.solver.vsolver\n");
     fprintf(fp, "Solver=%s\n", E->control.SOLVER_TYPE); 
     fprintf(fp, "node_assemble=%d\n", E->control.NASSEMBLE);
+    fprintf(fp, "block_csr=%d\n", E->control.block_csr);
+    fprintf(fp, "overlap_exchange=%d\n", E->control.overlap_exchange);
+    fprintf(fp, "omp_threads=%d\n", E->control.omp_threads);
     fprintf(fp, "precond=%d\n", E->control.precondition);
     fprintf(fp, "accuracy=%g\n", E->control.accuracy);
     fprintf(fp, "uzawa=%s\n", E->control.uzawa);
@@ -2024,6 +2070,16 @@ void print_all_config_parameters(struct All_variables *E)
     fprintf(fp, "mg_cycle=%d\n", E->control.mg_cycle);
     fprintf(fp, "down_heavy=%d\n", E->control.down_heavy);
     fprintf(fp, "up_heavy=%d\n", E->control.up_heavy);
+    fprintf(fp, "mg_smoother=%d\n", E->control.mg_smoother);
+    fprintf(fp, "mg_sor=%g\n", E->control.mg_sor);
+    fprintf(fp, "mg_krylov=%d\n", E->control.mg_krylov);
+    fprintf(fp, "mg_coarse_direct=%d\n", E->control.mg_coarse_direct);
+    fprintf(fp, "pipelined_cg=%d\n", E->control.pipelined_cg);
+    fprintf(fp, "mg_single_precision=%d\n", E->control.mg_single_precision);
+    fprintf(fp, "matrix_free=%d\n", E->control.matrix_free);
+    fprintf(fp, "stiffness_cache=%d\n", E->control.stiffness_cache);
+    fprintf(fp, "stiffness_update_tol=%g\n", E->control.stiffness_update_tol);
+    fprintf(fp, "mg_jacobi_omega=%g\n", E->control.mg_jacobi_omega);
     fprintf(fp, "vlowstep=%d\n", E->control.v_steps_low);
     fprintf(fp, "vhighstep=%d\n", E->control.v_steps_high);
     fprintf(fp, "max_mg_cycles=%d\n", E->control.max_mg_cycles);
@@ -2124,7 +2180,10 @@ void print_all_config_parameters(struct All_variables *E)
     fprintf(fp, "# CitcomS.solver.output\n");
     fprintf(fp, "output_format=%s\n", E->output.format);
     fprintf(fp, "output_optional=%s\n", E->output.optional);
+    fprintf(fp, "output_async=%d\n", E->output.async);
     fprintf(fp, "output_ll_max=%d\n", E->output.llmax);
+    fprintf(fp, "compact_sph_tables=%d\n", E->sphere.compact_tables);
+    fprintf(fp, "float_sph_tables=%d\n", E->sphere.float_tables);
     fprintf(fp, "self_gravitation=%d\n", E->control.self_gravitation);
     fprintf(fp, "use_cbf_topo=%d\n", E->control.use_cbf_topo);
     fprintf(fp, "cb_block_size=%d\n", E->output.cb_block_size);
@@ -2135,6 +2194,7 @@ void print_all_config_parameters(struct All_variables *E)
     fprintf(fp, "cache_mdc_nelmts=%d\n", E->output.cache_mdc_nelmts);
     fprintf(fp, "cache_rdcc_nelmts=%d\n", E->output.cache_rdcc_nelmts);
     fprintf(fp, "cache_rdcc_nbytes=%d\n", E->output.cache_rdcc_nbytes);
+    fprintf(fp, "output_tracer_stride=%d\n", E->output.tracer_stride);
     fprintf(fp, "write_q_files=%d\n", E->output.write_q_files);
     fprintf(fp, "vtk_format=%s\n", E->output.vtk_format);
     fprintf(fp, "gzdir_vtkio=%d\n", E->output.gzdir.vtk_io);
@@ -2202,6 +2262,11 @@ void print_all_config_parameters(struct All_variables *E)
       fprintf(fp, "\n");
     }
     fprintf(fp, "itracer_warnings=%d\n", E->trace.itracer_warnings);
+    fprintf(fp, "tracer_sort_every=%d\n", E->trace.sort_every);
+    fprintf(fp, "tracer_balance=%d\n", E->trace.balance);
+    fprintf(fp, "tracer_integrator=%d\n", E->trace.integrator);
+    fprintf(fp, "tracer_substeps=%d\n", E->trace.substeps);
+    fprintf(fp, "tracer_courant=%g\n", E->trace.courant);
     fprintf(fp, "regular_grid_deltheta=%g\n", E->trace.deltheta[0]);
     fprintf(fp, "regular_grid_delphi=%g\n", E->trace.delphi[0]);
     fprintf(fp, "chemical_buoyancy=%d\n", E->composition.ichemical_buoyancy);
@@ -55,6 +55,7 @@ void v_from_vector(E)
                 E->sphere.cap[m].V[3][node] = E->sphere.cap[m].VB[3][node];
         }
     }
+    E->sphere.V_stamp++;
 
     return;
 }
@@ -114,6 +115,7 @@ void v_from_vector_pseudo_surf(E)
             fprintf(stderr,"global_max_error=%e stop_topo_loop=%d\n",global_max_error,E->monitor.stop_topo_loop);
 
     }
+    E->sphere.V_stamp++;
 
     return;
 }
@@ -31,8 +31,12 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <math.h>
 #include <mpi.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include "element_definitions.h"
 #include "global_defs.h"
 #include "parsing.h"
@@ -53,6 +57,14 @@ void output_tracer(struct All_variables *, int);
 void output_pressure(struct All_variables *, int);
 void output_heating(struct All_variables *, int);
 
+static void output_prepare(struct All_variables *, int);
+static void output_write(struct All_variables *, int);
+#ifdef HAVE_PTHREAD
+static void output_async_write(struct All_variables *, int);
+static void output_free_copies(struct OUTPUT_ASYNC *);
+static void output_writer_exit(char *);
+#endif
+
 extern void parallel_process_termination();
 extern void heat_flux(struct All_variables *);
 extern void get_STD_topo(struct All_variables *, float**, float**,
@@ -94,6 +106,22 @@ void output_common_input(struct All_variables *E)
       //      E->output.gzdir.vtk_io,E->output.gzdir.vtk_base_save);
     }
 
+    /* write the ascii output in a background thread */
+    input_boolean("output_async", &(E->output.async), "off", m);
+    E->output.async_writer = NULL;
+    if (E->output.async && strcmp(E->output.format, "ascii") != 0) {
+        if(E->parallel.me == 0)
+            fprintf(stderr, "output_async is only available for output_format=ascii, ignored\n");
+        E->output.async = 0;
+    }
+#ifndef HAVE_PTHREAD
+    if (E->output.async) {
+        if(E->parallel.me == 0)
+            fprintf(stderr, "output_async needs pthreads, which this build lacks, ignored\n");
+        E->output.async = 0;
+    }
+#endif
+
     if(strcmp(E->output.format, "vtk") == 0) {
         input_string("vtk_format", E->output.vtk_format, "ascii",m);
         if (strcmp(E->output.vtk_format, "binary") != 0 &&
@@ -121,6 +149,75 @@ void output(struct All_variables *E, int cycles)
   }
 
 
+  /* the computations need all processors; the files are then
+     written here or by the background writer */
+  output_prepare(E, cycles);
+
+#ifdef HAVE_PTHREAD
+  if (E->output.async)
+      output_async_write(E, cycles);
+  else
+#endif
+      output_write(E, cycles);
+
+  return;
+}
+
+
+/* Computes what the output of this step needs besides the solution. */
+
+static void output_prepare(struct All_variables *E, int cycles)
+{
+  void compute_geoid();
+  void compute_horiz_avg();
+  void allocate_STD_mem();
+  void compute_nodal_stress();
+  void free_STD_mem();
+  float *SXX[NCS],*SYY[NCS],*SXY[NCS],*SXZ[NCS],*SZY[NCS],*SZZ[NCS];
+  float *divv[NCS],*vorv[NCS];
+
+  /* heat flux and topography */
+  if((E->output.write_q_files == 0) || (cycles == 0) ||
+     (cycles % E->output.write_q_files)!=0)
+      heat_flux(E);
+  /* else, the heat flux will have been computed already */
+
+  if(E->control.use_cbf_topo){
+    get_CBF_topo(E,E->slice.tpg,E->slice.tpgb);
+
+  }else{
+    get_STD_topo(E,E->slice.tpg,E->slice.tpgb,E->slice.divg,E->slice.vort,cycles);
+  }
+
+  /* compute geoid (in spherical harmonics coeff) */
+  if (E->output.geoid)		/* this needs to be called after the
+				   surface and bottom topo has been
+				   computed! */
+      compute_geoid(E);
+
+  /* for CBF topo, stress will not have been computed */
+  if (E->output.stress && E->control.use_cbf_topo) {
+    allocate_STD_mem(E, SXX, SYY, SZZ, SXY, SXZ, SZY, divv, vorv);
+    compute_nodal_stress(E, SXX, SYY, SZZ, SXY, SXZ, SZY, divv, vorv);
+    free_STD_mem(E, SXX, SYY, SZZ, SXY, SXZ, SZY, divv, vorv);
+  }
+
+  if (E->output.horiz_avg)
+      compute_horiz_avg(E);
+
+  /* binary, written right away */
+  if (E->output.seismic)
+      output_seismic(E, cycles);
+
+  return;
+}
+
+
+/* Writes the output files of this step. Only reads E, so that it can
+   run on a snapshot in the background writer. */
+
+static void output_write(struct All_variables *E, int cycles)
+{
   output_velo(E, cycles);
   output_visc(E, cycles);
 #ifdef CITCOM_ALLOW_ANISOTROPIC_VISC
@@ -132,10 +229,8 @@ void output(struct All_variables *E, int cycles)
 
   /* optional output below */
 
-  /* compute and output geoid (in spherical harmonics coeff) */
-  if (E->output.geoid)		/* this needs to be called after the
-				   surface and bottom topo has been
-				   computed! */
+  /* output geoid (in spherical harmonics coeff) */
+  if (E->output.geoid)
       output_geoid(E, cycles);
 
   if (E->output.stress){
@@ -147,9 +242,6 @@ void output(struct All_variables *E, int cycles)
   if (E->output.horiz_avg)
       output_horiz_avg(E, cycles);
 
-  if (E->output.seismic)
-      output_seismic(E, cycles);
-
   if(E->output.tracer && E->control.tracer)
       output_tracer(E, cycles);
 
@@ -176,6 +268,10 @@ FILE* output_open(char *filename, char *mode)
     if (!fp1) {
       fprintf(stderr,"Cannot open file '%s' for '%s'\n",
 	      filename,mode);
+#ifdef HAVE_PTHREAD
+      /* returns only if this is not the output_async writer */
+      output_writer_exit(filename);
+#endif
       parallel_process_termination();
     }
   }
@@ -389,17 +485,7 @@ void output_surf_botm(struct All_variables *E, int cycles)
   FILE* fp2;
   float *topo;
 
-  if((E->output.write_q_files == 0) || (cycles == 0) ||
-     (cycles % E->output.write_q_files)!=0)
-      heat_flux(E);
-  /* else, the heat flux will have been computed already */
-
-  if(E->control.use_cbf_topo){
-    get_CBF_topo(E,E->slice.tpg,E->slice.tpgb);
-
-  }else{
-    get_STD_topo(E,E->slice.tpg,E->slice.tpgb,E->slice.divg,E->slice.vort,cycles);
-  }
+  /* heat flux and topography are computed in output_prepare() */
 
   if (E->output.surf && (E->parallel.me_loc[3]==E->parallel.nprocz-1)) {
     sprintf(output_file,"%s.surf.%d.%d", E->control.data_file,
@@ -446,12 +532,11 @@ void output_surf_botm(struct All_variables *E, int cycles)
 
 void output_geoid(struct All_variables *E, int cycles)
 {
-    void compute_geoid();
     int ll, mm, p;
     char output_file[255];
     FILE *fp1;
 
-    compute_geoid(E);
+    /* the geoid is computed in output_prepare() */
 
     if (E->parallel.me == (E->parallel.nprocz-1))  {
         sprintf(output_file, "%s.geoid.%d.%d", E->control.data_file,
@@ -489,18 +574,9 @@ void output_stress(struct All_variables *E, int cycles)
   int m, node;
   char output_file[255];
   FILE *fp1;
- /* for stress computation */
-  void allocate_STD_mem();
-  void compute_nodal_stress();
-  void free_STD_mem();
-  float *SXX[NCS],*SYY[NCS],*SXY[NCS],*SXZ[NCS],*SZY[NCS],*SZZ[NCS];
-  float *divv[NCS],*vorv[NCS];
-  /*  */
-  if(E->control.use_cbf_topo)	{/* for CBF topo, stress will not have been computed */
-    allocate_STD_mem(E, SXX, SYY, SZZ, SXY, SXZ, SZY, divv, vorv);
-    compute_nodal_stress(E, SXX, SYY, SZZ, SXY, SXZ, SZY, divv, vorv);
-    free_STD_mem(E, SXX, SYY, SZZ, SXY, SXZ, SZY, divv, vorv);
-  }
+
+  /* with CBF topo, the stress is computed in output_prepare() */
+
   sprintf(output_file,"%s.stress.%d.%d", E->control.data_file,
           E->parallel.me, cycles);
   fp1 = output_open(output_file, "w");
@@ -526,15 +602,12 @@ void output_stress(struct All_variables *E, int cycles)
 void output_horiz_avg(struct All_variables *E, int cycles)
 {
   /* horizontal average output of temperature, composition and rms velocity*/
-  void compute_horiz_avg();
+  /* the averages are computed in output_prepare() */
 
   int j;
   char output_file[255];
   FILE *fp1;
 
-  /* compute horizontal average here.... */
-  compute_horiz_avg(E);
-
   /* only the first nprocz processors need to output */
 
   if (E->parallel.me<E->parallel.nprocz)  {
@@ -684,13 +757,13 @@ void output_tracer(struct All_variables *E, int cycles)
       for(n=1;n<=E->trace.ntracers[j];n++) {
           /* write basic quantities (coordinate) */
           fprintf(fp1,"%.12e %.12e %.12e",
-                  E->trace.basicq[j][0][n],
-                  E->trace.basicq[j][1][n],
-                  E->trace.basicq[j][2][n]);
+                  tracer_basicq(E,j,n)[0],
+                  tracer_basicq(E,j,n)[1],
+                  tracer_basicq(E,j,n)[2]);
 
           /* write extra quantities */
           for (i=0; i<E->trace.number_of_extra_quantities; i++) {
-              fprintf(fp1," %.12e", E->trace.extraq[j][i][n]);
+              fprintf(fp1," %.12e", tracer_extraq(E,j,n)[i]);
           }
           fprintf(fp1, "\n");
       }
@@ -817,3 +890,276 @@ void output_time(struct All_variables *E, int cycles)
 
   return;
 }
+
+
+#ifdef HAVE_PTHREAD
+
+/**********************************************************************/
+/* Asynchronous output (output_async=on).                             */
+/*                                                                    */
+/* At an output step, output_prepare() does the computations on all   */
+/* processors as usual. The fields that output_write() reads are then */
+/* copied into a snapshot: a copy of E whose pointers to these fields */
+/* point to the copies. A writer thread formats and writes the files  */
+/* from the snapshot while the solver goes on. The writer does no     */
+/* communication. Only one write is in flight; output_flush() waits   */
+/* for it, at the next output step, at checkpoints and at the end.    */
+/* MPI is not initialized for threads, so the writer cannot stop the  */
+/* run: if a file cannot be opened, it leaves, and output_flush()     */
+/* stops the run from the main thread.                                */
+
+struct OUTPUT_ASYNC {
+    pthread_t thread;
+    int busy;                   /* a write is in flight */
+    int failed;                 /* the writer could not open a file */
+    int cycles;
+    struct All_variables S;     /* the snapshot */
+
+    /* copies made for the snapshot */
+    int ncopies;
+    int maxcopies;
+    void **copies;
+};
+
+
+static void *output_copy(struct OUTPUT_ASYNC *a, const void *src, size_t size)
+{
+    void *p;
+
+    if (a->ncopies == a->maxcopies) {
+        a->maxcopies += 64;
+        a->copies = (void **)realloc(a->copies, a->maxcopies*sizeof(void *));
+    }
+
+    if ((p = malloc(size)) == NULL || a->copies == NULL) {
+        fprintf(stderr, "Error while allocating memory for output_async\n");
+        abort();
+    }
+    memcpy(p, src, size);
+
+    a->copies[a->ncopies++] = p;
+    return p;
+}
+
+
+/* the OUTPUT_ASYNC of the writer, in the writer thread only */
+static pthread_key_t output_writer_key;
+static pthread_once_t output_writer_once = PTHREAD_ONCE_INIT;
+
+static void output_writer_key_create(void)
+{
+    pthread_key_create(&output_writer_key, NULL);
+}
+
+
+static void *output_writer(void *arg)
+{
+    struct OUTPUT_ASYNC *a = (struct OUTPUT_ASYNC *)arg;
+
+    pthread_setspecific(output_writer_key, a);
+    output_write(&(a->S), a->cycles);
+
+    return NULL;
+}
+
+
+/* called by output_open() when a file cannot be opened: in the
+   writer, note the failure and end the thread */
+static void output_writer_exit(char *filename)
+{
+    struct OUTPUT_ASYNC *a;
+
+    pthread_once(&output_writer_once, output_writer_key_create);
+    a = (struct OUTPUT_ASYNC *)pthread_getspecific(output_writer_key);
+    if (a == NULL)
+        return;
+
+    a->failed = 1;
+    pthread_exit(NULL);
+}
+
+
+static void output_async_write(struct All_variables *E, int cycles)
+{
+    struct OUTPUT_ASYNC *a;
+    struct All_variables *S;
+    int j, k, b, nb;
+
+    const int lev = E->mesh.levmax;
+    const int nno = E->lmesh.nno;
+    const int nel = E->lmesh.nel;
+    const int nsf = E->lmesh.nsf;
+    const int noz = E->lmesh.noz;
+    const int ncomp = E->composition.ncomp;
+    const size_t fnode = (nno+1)*sizeof(float);
+    const size_t dnode = (nno+1)*sizeof(double);
+    const size_t fsurf = (nsf+2)*sizeof(float);
+    const size_t delem = (nel+1)*sizeof(double);
+
+    /* wait for the previous write */
+    output_flush(E);
+
+    if (E->output.async_writer == NULL) {
+        a = (struct OUTPUT_ASYNC *)malloc(sizeof(struct OUTPUT_ASYNC));
+        if (a == NULL) {
+            fprintf(stderr, "Error while allocating memory for output_async\n");
+            abort();
+        }
+        a->busy = 0;
+        a->failed = 0;
+        a->ncopies = 0;
+        a->maxcopies = 0;
+        a->copies = NULL;
+        E->output.async_writer = a;
+    }
+    a = E->output.async_writer;
+    S = &(a->S);
+
+    memcpy(S, E, sizeof(struct All_variables));
+    a->cycles = cycles;
+
+    for (j=1;j<=E->sphere.caps_per_proc;j++) {
+
+        /* velo and visc */
+        for (k=1;k<=3;k++)
+            S->sphere.cap[j].V[k] = output_copy(a, E->sphere.cap[j].V[k], fnode);
+        S->T[j] = output_copy(a, E->T[j], dnode);
+        S->VI[lev][j] = output_copy(a, E->VI[lev][j], fnode);
+
+#ifdef CITCOM_ALLOW_ANISOTROPIC_VISC
+        if (E->viscosity.allow_anisotropic_viscosity) {
+            S->VI2[lev][j] = output_copy(a, E->VI2[lev][j], fnode);
+            S->VIn1[lev][j] = output_copy(a, E->VIn1[lev][j], fnode);
+            S->VIn2[lev][j] = output_copy(a, E->VIn2[lev][j], fnode);
+            S->VIn3[lev][j] = output_copy(a, E->VIn3[lev][j], fnode);
+        }
+#endif
+
+        /* surf and botm */
+        S->slice.tpg[j] = output_copy(a, E->slice.tpg[j], fsurf);
+        S->slice.tpgb[j] = output_copy(a, E->slice.tpgb[j], fsurf);
+        S->slice.shflux[j] = output_copy(a, E->slice.shflux[j], fsurf);
+        S->slice.bhflux[j] = output_copy(a, E->slice.bhflux[j], fsurf);
+        if (E->control.pseudo_free_surf)
+            S->slice.freesurf[j] = output_copy(a, E->slice.freesurf[j], fsurf);
+
+        if (E->output.stress)
+            S->gstress[j] = output_copy(a, E->gstress[j], (6*nno+1)*sizeof(float));
+
+        if (E->output.pressure)
+            S->NP[j] = output_copy(a, E->NP[j], fnode);
+
+        /* the tracer records, block by block */
+        if (E->output.tracer && E->control.tracer && E->trace.ntracers[j] > 0) {
+            nb = (E->trace.ntracers[j] >> TRACER_BLOCK_BITS) + 1;
+            S->trace.store[j].q = output_copy(a, E->trace.store[j].q,
+                                              nb*sizeof(double *));
+            for (b=0; b<nb; b++)
+                S->trace.store[j].q[b] =
+                    output_copy(a, E->trace.store[j].q[b],
+                                TRACER_BLOCK*E->trace.number_of_tracer_quantities*sizeof(double));
+            S->trace.store[j].elem = NULL;
+        }
+
+        if (E->composition.on) {
+            if (E->output.comp_nd) {
+                S->composition.comp_node[j] =
+                    output_copy(a, E->composition.comp_node[j], ncomp*sizeof(double *));
+                for (k=0; k<ncomp; k++)
+                    S->composition.comp_node[j][k] =
+                        output_copy(a, E->composition.comp_node[j][k], dnode);
+            }
+            if (E->output.comp_el) {
+                S->composition.comp_el[j] =
+                    output_copy(a, E->composition.comp_el[j], ncomp*sizeof(double *));
+                for (k=0; k<ncomp; k++)
+                    S->composition.comp_el[j][k] =
+                        output_copy(a, E->composition.comp_el[j][k], delem);
+            }
+        }
+
+        if (E->output.heating && E->control.disptn_number != 0) {
+            S->heating_adi[j] = output_copy(a, E->heating_adi[j], delem);
+            S->heating_visc[j] = output_copy(a, E->heating_visc[j], delem);
+            S->heating_latent[j] = output_copy(a, E->heating_latent[j], delem);
+        }
+    }
+
+    if (E->output.geoid)
+        for (k=0; k<2; k++) {
+            S->sphere.harm_geoid[k] =
+                output_copy(a, E->sphere.harm_geoid[k], E->sphere.hindice*sizeof(float));
+            S->sphere.harm_geoid_from_tpgt[k] =
+                output_copy(a, E->sphere.harm_geoid_from_tpgt[k], E->sphere.hindice*sizeof(float));
+            S->sphere.harm_geoid_from_bncy[k] =
+                output_copy(a, E->sphere.harm_geoid_from_bncy[k], E->sphere.hindice*sizeof(float));
+        }
+
+    if (E->output.horiz_avg) {
+        S->Have.T = output_copy(a, E->Have.T, (noz+2)*sizeof(float));
+        S->Have.V[1] = output_copy(a, E->Have.V[1], (noz+2)*sizeof(float));
+        S->Have.V[2] = output_copy(a, E->Have.V[2], (noz+2)*sizeof(float));
+        if (E->composition.on) {
+            S->Have.C = output_copy(a, E->Have.C, (ncomp+1)*sizeof(float *));
+            for (k=0; k<ncomp; k++)
+                S->Have.C[k] = output_copy(a, E->Have.C[k], (noz+2)*sizeof(float));
+        }
+    }
+
+    if (E->composition.on && (E->output.comp_nd || E->output.comp_el)) {
+        S->composition.initial_bulk_composition =
+            output_copy(a, E->composition.initial_bulk_composition, ncomp*sizeof(double));
+        S->composition.bulk_composition =
+            output_copy(a, E->composition.bulk_composition, ncomp*sizeof(double));
+    }
+
+    pthread_once(&output_writer_once, output_writer_key_create);
+    if (pthread_create(&(a->thread), NULL, output_writer, a) != 0) {
+        /* no thread, write here */
+        output_write(S, cycles);
+        output_free_copies(a);
+        return;
+    }
+    a->busy = 1;
+
+    return;
+}
+
+
+static void output_free_copies(struct OUTPUT_ASYNC *a)
+{
+    int i;
+
+    for (i=0; i<a->ncopies; i++)
+        free(a->copies[i]);
+    a->ncopies = 0;
+
+    return;
+}
+
+
+#endif /* HAVE_PTHREAD */
+
+
+/* Waits until the files of the last output step are written. */
+
+void output_flush(struct All_variables *E)
+{
+#ifdef HAVE_PTHREAD
+    struct OUTPUT_ASYNC *a = E->output.async_writer;
+
+    if (a == NULL || !a->busy)
+        return;
+
+    pthread_join(a->thread, NULL);
+    a->busy = 0;
+    output_free_copies(a);
+
+    if (a->failed) {
+        fprintf(stderr, "output_async: output of step %d failed\n", a->cycles);
+        parallel_process_termination();
+    }
+#endif
+
+    return;
+}
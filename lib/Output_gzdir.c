@@ -1094,13 +1094,13 @@ void gzdir_output_tracer(struct All_variables *E, int cycles)
       for(n=1;n<=E->trace.ntracers[j];n++) {
           /* write basic quantities (coordinate) */
           gzprintf(fp1,"%9.5e %9.5e %9.5e",
-                  E->trace.basicq[j][0][n],
-                  E->trace.basicq[j][1][n],
-                  E->trace.basicq[j][2][n]);
+                  tracer_basicq(E,j,n)[0],
+                  tracer_basicq(E,j,n)[1],
+                  tracer_basicq(E,j,n)[2]);
 
           /* write extra quantities */
           for (i=0; i<E->trace.number_of_extra_quantities; i++) {
-              gzprintf(fp1," %9.5e", E->trace.extraq[j][i][n]);
+              gzprintf(fp1," %9.5e", tracer_extraq(E,j,n)[i]);
           }
           gzprintf(fp1, "\n");
       }
@@ -262,6 +262,9 @@ void h5input_params(struct All_variables *E)
     input_int("cache_rdcc_nelmts", &(E->output.cache_rdcc_nelmts), "521", m);
     input_int("cache_rdcc_nbytes", &(E->output.cache_rdcc_nbytes), "1048576", m);
 
+    /* write every n-th tracer only */
+    input_int("output_tracer_stride", &(E->output.tracer_stride), "1,1,nomax", m);
+
 #endif
 }
 
@@ -280,7 +283,7 @@ static void h5output_const(struct All_variables *E)
     h5output_meta(E);
     h5output_coord(E);
     h5output_connectivity(E);
-    /*h5output_material(E);*/
+    h5output_material(E);
 
     h5output_close(E);
 }
@@ -303,7 +306,7 @@ static void h5output_timedep(struct All_variables *E, int cycles)
     h5output_surf_botm(E, cycles);
 
     /* output tracer location if using tracer */
-    if(E->control.tracer == 1)
+    if(E->control.tracer == 1 && E->output.tracer == 1)
         h5output_tracer(E, cycles);
 
     /* optional output below */
@@ -713,10 +716,214 @@ void h5output_stress(struct All_variables *E, int cycles)
 
 void h5output_material(struct All_variables *E)
 {
+    hid_t dataset;
+    herr_t status;
+
+    int rank = 2;
+    hsize_t dims[2];
+    hsize_t memdims[2];
+    hsize_t offset[2];
+    hsize_t stride[2];
+    hsize_t count[2];
+    hsize_t block[2];
+
+    int p;
+    int px = E->parallel.me_loc[1];
+    int py = E->parallel.me_loc[2];
+    int pz = E->parallel.me_loc[3];
+    int nprocx = E->parallel.nprocx;
+    int nprocy = E->parallel.nprocy;
+    int nprocz = E->parallel.nprocz;
+    int procs_per_cap = nprocx * nprocy * nprocz;
+
+    int e;
+    int nel = E->lmesh.nel;
+
+    int *data;
+
+    /* process id (local to cap), elements ordered as in /connectivity */
+    p = pz + px*nprocz + py*nprocz*nprocx;
+
+    dims[0] = E->sphere.caps;
+    dims[1] = nel * procs_per_cap;
+
+    memdims[0] = 1;
+    memdims[1] = nel;
+
+    offset[0] = E->hdf5.cap;
+    offset[1] = nel * p;
+
+    stride[0] = 1;
+    stride[1] = 1;
+
+    count[0] = 1;
+    count[1] = 1;
+
+    block[0] = 1;
+    block[1] = nel;
+
+    data = (int *)malloc(nel * sizeof(int));
+
+    for(e = 0; e < nel; e++)
+        data[e] = E->mat[1][e+1];
+
+    /* Create /material dataset */
+    h5create_dataset(E->hdf5.file_id, "material", "material of elements",
+                     H5T_NATIVE_INT, rank, dims, NULL, NULL);
+
+    dataset = H5Dopen(E->hdf5.file_id, "/material");
+
+    status = h5write_dataset(dataset, H5T_NATIVE_INT, data, rank, memdims,
+                             offset, stride, count, block, 1, 1);
+
+    status = H5Dclose(dataset);
+
+    free(data);
 }
 
+
+/****************************************************************************
+ * Tracers                                                                  *
+ ****************************************************************************/
+
+/* The tracers of all processes are written as the rows of /tracer/coord
+ * (theta, phi, r) and /tracer/extra (the extra quantities, e.g. flavor),
+ * in the order of the processes. /tracer/count gives the number of rows
+ * of each process, so that a reader can find the rows of any process.
+ * With output_tracer_stride > 1, only every n-th tracer of a process is
+ * written; such a file cannot be used for restart.
+ */
 void h5output_tracer(struct All_variables *E, int cycles)
 {
+    hid_t group;
+    hid_t dataset;
+    herr_t status;
+
+    int rank = 2;
+    hsize_t dims[2];
+    hsize_t memdims[2];
+    hsize_t offset[2];
+    hsize_t stride[2];
+    hsize_t count[2];
+    hsize_t block[2];
+
+    int me = E->parallel.me;
+    int nproc = E->parallel.nproc;
+    int every = E->output.tracer_stride;
+    int nextra = E->trace.number_of_extra_quantities;
+
+    int i, n, kk, p;
+    int *ntracers;
+    hsize_t start, total;
+
+    double *q;
+    double *coord;
+    double *extra;
+
+    /* number of tracers written by each process */
+    n = (E->trace.ntracers[1] + every - 1) / every;
+
+    ntracers = (int *)malloc(nproc * sizeof(int));
+    MPI_Allgather(&n, 1, MPI_INT, ntracers, 1, MPI_INT, E->parallel.world);
+
+    start = 0;
+    total = 0;
+    for(p = 0; p < nproc; p++)
+    {
+        if (p == me)
+            start = total;
+        total += ntracers[p];
+    }
+
+    /* prepare the data */
+    coord = (double *)malloc((3*n + 1) * sizeof(double));
+    extra = (double *)malloc((nextra*n + 1) * sizeof(double));
+
+    for(kk = 1, i = 0; kk <= E->trace.ntracers[1]; kk += every, i++)
+    {
+        q = tracer_basicq(E, 1, kk);
+        coord[3*i+0] = q[0];
+        coord[3*i+1] = q[1];
+        coord[3*i+2] = q[2];
+
+        q = tracer_extraq(E, 1, kk);
+        for(p = 0; p < nextra; p++)
+            extra[nextra*i+p] = q[p];
+    }
+
+    /* Create /tracer/ group */
+    group = h5create_group(E->hdf5.file_id, "tracer", (size_t)0);
+    status = set_attribute_int(group, "stride", every);
+    status = set_attribute_int(group, "nextra", nextra);
+
+    /* without any tracer there are no rows, and no coord or extra
+     * dataset; /tracer/count is all zeros
+     */
+    if (total > 0)
+    {
+        dims[0] = total;
+        dims[1] = 3;
+        h5create_dataset(group, "coord", "tracer coordinates (theta, phi, r)",
+                         H5T_NATIVE_DOUBLE, rank, dims, NULL, NULL);
+        if (nextra > 0)
+        {
+            dims[1] = nextra;
+            h5create_dataset(group, "extra", "extra tracer quantities",
+                             H5T_NATIVE_DOUBLE, rank, dims, NULL, NULL);
+        }
+    }
+    dims[0] = nproc;
+    h5create_dataset(group, "count", "number of tracers of each process",
+                     H5T_NATIVE_INT, 1, dims, NULL, NULL);
+    status = H5Gclose(group);
+
+    /* each process writes its own rows */
+    offset[0] = start;
+    offset[1] = 0;
+
+    stride[0] = 1;
+    stride[1] = 1;
+
+    count[0] = 1;
+    count[1] = 1;
+
+    memdims[0] = n;
+    memdims[1] = 3;
+    block[0] = n;
+    block[1] = 3;
+
+    if (total > 0)
+    {
+        dataset = H5Dopen(E->hdf5.file_id, "/tracer/coord");
+        status = h5write_dataset(dataset, H5T_NATIVE_DOUBLE, coord, rank,
+                                 memdims, offset, stride, count, block, 1, 1);
+        status = H5Dclose(dataset);
+    }
+
+    if (total > 0 && nextra > 0)
+    {
+        memdims[1] = nextra;
+        block[1] = nextra;
+
+        dataset = H5Dopen(E->hdf5.file_id, "/tracer/extra");
+        status = h5write_dataset(dataset, H5T_NATIVE_DOUBLE, extra, rank,
+                                 memdims, offset, stride, count, block, 1, 1);
+        status = H5Dclose(dataset);
+    }
+
+    /* the counts are written by the first process */
+    memdims[0] = nproc;
+    offset[0] = 0;
+    block[0] = nproc;
+
+    dataset = H5Dopen(E->hdf5.file_id, "/tracer/count");
+    status = h5write_dataset(dataset, H5T_NATIVE_INT, ntracers, 1, memdims,
+                             offset, stride, count, block, 0, (me == 0));
+    status = H5Dclose(dataset);
+
+    free(coord);
+    free(extra);
+    free(ntracers);
 }
 
 /****************************************************************************
@@ -1997,8 +2204,21 @@ static herr_t h5write_dataset(hid_t dset_id,
     hid_t dxpl_id;      /* dataset transfer property list identifier */
     herr_t status;
 
+    int d;
+    hsize_t npoints;
+
+    /* a process with nothing to write (e.g. no tracers) still has to
+     * take part in a collective write, with empty selections
+     */
+    npoints = 1;
+    for(d = 0; d < rank; d++)
+        npoints *= memdims[d];
+
     /* create memory dataspace */
-    memspace = H5Screate_simple(rank, memdims, NULL);
+    if (npoints > 0)
+        memspace = H5Screate_simple(rank, memdims, NULL);
+    else
+        memspace = H5Screate(H5S_SCALAR);
     if (memspace < 0)
     {
         /*TODO: print error*/
@@ -2015,8 +2235,14 @@ static herr_t h5write_dataset(hid_t dset_id,
     }
 
     /* hyperslab selection */
-    status = H5Sselect_hyperslab(filespace, H5S_SELECT_SET,
-                                 offset, stride, count, block);
+    if (npoints > 0)
+        status = H5Sselect_hyperslab(filespace, H5S_SELECT_SET,
+                                     offset, stride, count, block);
+    else
+    {
+        status = H5Sselect_none(filespace);
+        status = H5Sselect_none(memspace);
+    }
     if (status < 0)
     {
         /*TODO: print error*/
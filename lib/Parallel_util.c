@@ -62,6 +62,360 @@ void parallel_process_sync(struct All_variables *E)
   }
 
 
+/* ============================================
+   persistent exchange plans. A plan is described with
+   exchange_plan_message() and exchange_plan_append(), then
+   exchange_plan_commit() allocates the buffers and sets up the
+   persistent requests once. exchange_plan_execute() adds the
+   received values to U, phase by phase.
+   ============================================ */
+
+struct EXCHANGE_PLAN *exchange_plan_create(MPI_Datatype type)
+{
+  struct EXCHANGE_PLAN *plan;
+
+  plan = (struct EXCHANGE_PLAN *) malloc(sizeof(struct EXCHANGE_PLAN));
+  plan->type = type;
+  plan->nphase = 0;
+  plan->phase[0] = 0;
+  plan->nmsg = 0;
+  plan->msg = NULL;
+  plan->request = NULL;
+  plan->sbuf = plan->rbuf = NULL;
+
+  return plan;
+}
+
+
+/* start a new message to proc in phase (phases are added in order) */
+void exchange_plan_message(struct EXCHANGE_PLAN *plan, int phase, int proc)
+{
+  struct EXCHANGE_MSG *msg;
+
+  while (plan->nphase <= phase) {
+    plan->nphase++;
+    plan->phase[plan->nphase] = plan->nmsg;
+  }
+
+  plan->nmsg++;
+  plan->phase[plan->nphase] = plan->nmsg;
+  plan->msg = (struct EXCHANGE_MSG *)
+    realloc(plan->msg, plan->nmsg*sizeof(struct EXCHANGE_MSG));
+
+  msg = &plan->msg[plan->nmsg-1];
+  msg->proc = proc;
+  msg->n = 0;
+  msg->cap = msg->id = NULL;
+
+  return;
+}
+
+
+/* append list[1..n].pass[k] of cap m to the last message */
+void exchange_plan_append(struct EXCHANGE_PLAN *plan, int m,
+                          struct PASS *list, int k, int n)
+{
+  int j;
+  struct EXCHANGE_MSG *msg = &plan->msg[plan->nmsg-1];
+
+  msg->cap = (int *) realloc(msg->cap, (msg->n+n+1)*sizeof(int));
+  msg->id = (int *) realloc(msg->id, (msg->n+n+1)*sizeof(int));
+  for (j=1;j<=n;j++) {
+    msg->cap[msg->n] = m;
+    msg->id[msg->n] = list[j].pass[k];
+    msg->n++;
+  }
+
+  return;
+}
+
+
+/* tag of message i of phase p: one more than the number of messages
+   to the same processor before it in the phase */
+static int exchange_plan_tag(struct EXCHANGE_PLAN *plan, int p, int i)
+{
+  int j,tag;
+
+  tag = 1;
+  for (j=plan->phase[p];j<i;j++)
+    if (plan->msg[j].proc == plan->msg[i].proc)
+      tag++;
+
+  return tag;
+}
+
+
+void exchange_plan_commit(struct All_variables *E, struct EXCHANGE_PLAN *plan)
+{
+  int i,p,size,total,nreq;
+  struct EXCHANGE_MSG *msg;
+  char *sbuf,*rbuf;
+
+  MPI_Type_size(plan->type, &size);
+
+  total = 0;
+  for (i=0;i<plan->nmsg;i++) {
+    plan->msg[i].offset = total;
+    total += plan->msg[i].n;
+  }
+  plan->sbuf = malloc((total+1)*size);
+  plan->rbuf = malloc((total+1)*size);
+  plan->request = (MPI_Request *) malloc((2*plan->nmsg+1)*sizeof(MPI_Request));
+
+  sbuf = (char *) plan->sbuf;
+  rbuf = (char *) plan->rbuf;
+
+  /* in each phase, all sends are started before the receives. The
+     n-th message of a phase between two processors has tag n+1 on
+     both sides: MPI_Startall() does not order the requests, so equal
+     tags could match the messages of one pair the wrong way round */
+  nreq = 0;
+  for (p=0;p<plan->nphase;p++) {
+    plan->req[p] = nreq;
+    for (i=plan->phase[p];i<plan->phase[p+1];i++) {
+      msg = &plan->msg[i];
+      if (msg->proc != E->parallel.me && msg->proc != -1)
+        MPI_Send_init(sbuf+msg->offset*size, msg->n, plan->type, msg->proc,
+                      exchange_plan_tag(plan, p, i), E->parallel.world,
+                      &plan->request[nreq++]);
+    }
+    for (i=plan->phase[p];i<plan->phase[p+1];i++) {
+      msg = &plan->msg[i];
+      if (msg->proc != E->parallel.me && msg->proc != -1)
+        MPI_Recv_init(rbuf+msg->offset*size, msg->n, plan->type, msg->proc,
+                      exchange_plan_tag(plan, p, i), E->parallel.world,
+                      &plan->request[nreq++]);
+    }
+  }
+  plan->req[plan->nphase] = nreq;
+
+  return;
+}
+
+
+/* release the persistent requests and the buffers of a plan */
+static void exchange_plan_free(struct EXCHANGE_PLAN *plan)
+{
+  int i;
+
+  if (plan == NULL)
+    return;
+
+  for (i=0;i<plan->req[plan->nphase];i++)
+    MPI_Request_free(&plan->request[i]);
+
+  for (i=0;i<plan->nmsg;i++) {
+    free(plan->msg[i].cap);
+    free(plan->msg[i].id);
+  }
+  free(plan->msg);
+  free(plan->request);
+  free(plan->sbuf);
+  free(plan->rbuf);
+  free(plan);
+
+  return;
+}
+
+
+/* free the exchange plans of all levels, before MPI_Finalize() */
+void exchange_plans_free(struct All_variables *E)
+{
+  int lev;
+
+  for (lev=E->mesh.gridmin;lev<=E->mesh.gridmax;lev++) {
+    exchange_plan_free(E->parallel.plan_id_d[lev]);
+    exchange_plan_free(E->parallel.plan_id_f[lev]);
+    exchange_plan_free(E->parallel.plan_node_d[lev]);
+    exchange_plan_free(E->parallel.plan_node_f[lev]);
+  }
+
+  return;
+}
+
+
+static void exchange_plan_pack(struct EXCHANGE_PLAN *plan,
+                               struct EXCHANGE_MSG *msg, void **U)
+{
+  int j;
+
+  if (plan->type == MPI_FLOAT) {
+    float *S = (float *) plan->sbuf + msg->offset;
+    for (j=0;j<msg->n;j++)
+      S[j] = ((float **) U)[msg->cap[j]][msg->id[j]];
+  }
+  else {
+    double *S = (double *) plan->sbuf + msg->offset;
+    for (j=0;j<msg->n;j++)
+      S[j] = ((double **) U)[msg->cap[j]][msg->id[j]];
+  }
+
+  return;
+}
+
+
+static void exchange_plan_unpack(struct EXCHANGE_PLAN *plan,
+                                 struct EXCHANGE_MSG *msg, void *buf, void **U)
+{
+  int j;
+
+  if (plan->type == MPI_FLOAT) {
+    float *R = (float *) buf + msg->offset;
+    for (j=0;j<msg->n;j++)
+      ((float **) U)[msg->cap[j]][msg->id[j]] += R[j];
+  }
+  else {
+    double *R = (double *) buf + msg->offset;
+    for (j=0;j<msg->n;j++)
+      ((double **) U)[msg->cap[j]][msg->id[j]] += R[j];
+  }
+
+  return;
+}
+
+
+static void exchange_plan_phase_start(struct All_variables *E,
+                                      struct EXCHANGE_PLAN *plan,
+                                      void **U, int p)
+{
+  int i;
+
+  for (i=plan->phase[p];i<plan->phase[p+1];i++)
+    exchange_plan_pack(plan, &plan->msg[i], U);
+
+  MPI_Startall(plan->req[p+1]-plan->req[p], plan->request+plan->req[p]);
+
+  for (i=plan->phase[p];i<plan->phase[p+1];i++)
+    if (plan->msg[i].proc == E->parallel.me || plan->msg[i].proc == -1)
+      exchange_plan_unpack(plan, &plan->msg[i], plan->sbuf, U);
+
+  return;
+}
+
+
+static void exchange_plan_phase_finish(struct All_variables *E,
+                                       struct EXCHANGE_PLAN *plan,
+                                       void **U, int p)
+{
+  int i;
+
+  MPI_Waitall(plan->req[p+1]-plan->req[p], plan->request+plan->req[p],
+              MPI_STATUSES_IGNORE);
+
+  for (i=plan->phase[p];i<plan->phase[p+1];i++)
+    if (plan->msg[i].proc != E->parallel.me && plan->msg[i].proc != -1)
+      exchange_plan_unpack(plan, &plan->msg[i], plan->rbuf, U);
+
+  return;
+}
+
+
+/* split-phase exchange: exchange_plan_start() posts the first phase and
+   returns, so that the caller can work on entries of U that are not in
+   the plan; exchange_plan_finish() completes all phases */
+void exchange_plan_start(struct All_variables *E, struct EXCHANGE_PLAN *plan,
+                         void **U, int lev)
+{
+  double time0 = MPI_Wtime();
+
+  if (plan->nphase > 0)
+    exchange_plan_phase_start(E, plan, U, 0);
+
+  E->parallel.exchange_time[lev] += MPI_Wtime() - time0;
+
+  return;
+}
+
+
+void exchange_plan_finish(struct All_variables *E, struct EXCHANGE_PLAN *plan,
+                          void **U, int lev)
+{
+  int p;
+  double time0 = MPI_Wtime();
+
+  for (p=0;p<plan->nphase;p++) {
+    if (p > 0)
+      exchange_plan_phase_start(E, plan, U, p);
+    exchange_plan_phase_finish(E, plan, U, p);
+  }
+
+  E->parallel.exchange_calls[lev]++;
+  E->parallel.exchange_time[lev] += MPI_Wtime() - time0;
+
+  return;
+}
+
+
+void exchange_plan_execute(struct All_variables *E, struct EXCHANGE_PLAN *plan,
+                           void **U, int lev)
+{
+  exchange_plan_start(E, plan, U, lev);
+  exchange_plan_finish(E, plan, U, lev);
+
+  return;
+}
+
+
+/* like exchange_plan_execute(), but each shared entry of U ends up with
+   the smallest value of its copies instead of their sum (MPI_DOUBLE
+   plans only) */
+void exchange_plan_min(struct All_variables *E, struct EXCHANGE_PLAN *plan,
+                       double **U)
+{
+  int i,j,p;
+  double *R;
+  struct EXCHANGE_MSG *msg;
+
+  for (p=0;p<plan->nphase;p++) {
+    for (i=plan->phase[p];i<plan->phase[p+1];i++)
+      exchange_plan_pack(plan, &plan->msg[i], (void **) U);
+
+    MPI_Startall(plan->req[p+1]-plan->req[p], plan->request+plan->req[p]);
+    MPI_Waitall(plan->req[p+1]-plan->req[p], plan->request+plan->req[p],
+                MPI_STATUSES_IGNORE);
+
+    for (i=plan->phase[p];i<plan->phase[p+1];i++) {
+      msg = &plan->msg[i];
+      if (msg->proc == E->parallel.me || msg->proc == -1)
+        R = (double *) plan->sbuf + msg->offset;
+      else
+        R = (double *) plan->rbuf + msg->offset;
+      for (j=0;j<msg->n;j++)
+        if (R[j] < U[msg->cap[j]][msg->id[j]])
+          U[msg->cap[j]][msg->id[j]] = R[j];
+    }
+  }
+
+  return;
+}
+
+
+/* time spent in the halo exchanges of each level and in the global
+   reductions of the solvers, maximum over processors */
+void parallel_exchange_time_report(struct All_variables *E)
+{
+  int lev;
+  double time[MAX_LEVELS];
+
+  MPI_Reduce(E->parallel.exchange_time, time, MAX_LEVELS, MPI_DOUBLE,
+             MPI_MAX, 0, E->parallel.world);
+
+  if (E->parallel.me == 0)
+    for(lev=E->mesh.gridmax;lev>=E->mesh.gridmin;lev--)
+      fprintf(E->fp,"Exchange time at level %d = %f (%d calls)\n",
+              lev, time[lev], E->parallel.exchange_calls[lev]);
+
+  MPI_Reduce(&E->parallel.allreduce_time, time, 1, MPI_DOUBLE,
+             MPI_MAX, 0, E->parallel.world);
+
+  if (E->parallel.me == 0)
+    fprintf(E->fp,"Solver reduction time = %f (%d calls)\n",
+            time[0], E->parallel.allreduce_calls);
+
+  return;
+}
+
+
 /* ==========================   */
 
  double CPU_time0()
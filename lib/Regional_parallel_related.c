@@ -40,6 +40,7 @@ static void set_vertical_communicator(struct All_variables*);
 
 static void exchange_node_d(struct All_variables *, double**, int);
 static void exchange_node_f(struct All_variables *, float**, int);
+static void regional_exchange_plans(struct All_variables *);
 
 
 /* ============================================ */
@@ -590,6 +591,8 @@ void regional_parallel_communication_routs_v(E)
 
       }        /* end for level */
 
+  regional_exchange_plans(E);
+
   if(E->control.verbose) {
     for(lev=E->mesh.gridmax;lev>=E->mesh.gridmin;lev--) {
       fprintf(E->fp_out,"output_communication route surface for lev=%d \n",lev);
@@ -721,71 +724,114 @@ void regional_parallel_communication_routs_s(E)
 
 
 /* ================================================
-WARNING: BUGS AHEAD
+ build the persistent exchange plans of level lev.
 
-   for (m=1;m<=E->sphere.caps_per_proc;m++)    {
-     for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
+ The passes are summed direction by direction (x, y, then z)
+ so that edge and corner nodes collect the contributions of
+ all their neighbours. The two passes of one direction touch
+ opposite faces and run together as one phase.
+ ================================================ */
 
-       sizeofk = (1+E->parallel.NUM_NEQ[lev][m].pass[k])*sizeof(double);
-       S[k]=(double *)malloc( sizeofk );
-       R[k]=(double *)malloc( sizeofk );
-       }
-      }
+static void regional_exchange_plan(E, plan, lev, list, num)
+  struct All_variables *E;
+  struct EXCHANGE_PLAN *plan;
+  int lev;
+  struct PASS **list, *num;
+{
+  int m,k,ii,dir;
+
+  for (m=1;m<=E->sphere.caps_per_proc;m++) {
+    k = 0;
+    for (ii=1;ii<=6;ii++) {
+      if (E->parallel.NUM_PASS[lev][m].bound[6*(m-1)+ii] != 1)
+        continue;
+      k++;
+      dir = (ii-1)/2;
+      exchange_plan_message(plan, dir, E->parallel.PROCESSOR[lev][m].pass[k]);
+      exchange_plan_append(plan, m, list[m], k, num[m].pass[k]);
+    }
+  }
 
-This piece of code contain a bug. Arrays S and R are allocated for each m.
-But most of the memory is leaked.
+  exchange_plan_commit(E, plan);
 
-In this version of CitcomS, sphere.caps_per_proc is always equal to one.
-So, this bug won't manifest itself. But in other version of CitcomS, it will.
+  return;
+}
+
+
+static void regional_exchange_plans(E)
+  struct All_variables *E;
+{
+  int lev;
+
+  for(lev=E->mesh.gridmax;lev>=E->mesh.gridmin;lev--) {
+    E->parallel.plan_id_d[lev] = exchange_plan_create(MPI_DOUBLE);
+    regional_exchange_plan(E, E->parallel.plan_id_d[lev], lev,
+                           E->parallel.EXCHANGE_ID[lev], E->parallel.NUM_NEQ[lev]);
+
+    E->parallel.plan_id_f[lev] = NULL;
+    if (E->control.mg_single_precision && lev < E->mesh.gridmax) {
+      E->parallel.plan_id_f[lev] = exchange_plan_create(MPI_FLOAT);
+      regional_exchange_plan(E, E->parallel.plan_id_f[lev], lev,
+                             E->parallel.EXCHANGE_ID[lev], E->parallel.NUM_NEQ[lev]);
+    }
+
+    E->parallel.plan_node_d[lev] = exchange_plan_create(MPI_DOUBLE);
+    regional_exchange_plan(E, E->parallel.plan_node_d[lev], lev,
+                           E->parallel.EXCHANGE_NODE[lev], E->parallel.NUM_NODE[lev]);
+
+    E->parallel.plan_node_f[lev] = exchange_plan_create(MPI_FLOAT);
+    regional_exchange_plan(E, E->parallel.plan_node_f[lev], lev,
+                           E->parallel.EXCHANGE_NODE[lev], E->parallel.NUM_NODE[lev]);
+
+    E->parallel.exchange_calls[lev] = 0;
+    E->parallel.exchange_time[lev] = 0.0;
+  }
+
+  return;
+}
 
-by Tan2 7/21, 2003
-================================================ */
 
 void regional_exchange_id_d(E, U, lev)
  struct All_variables *E;
  double **U;
  int lev;
  {
-
- int ii,j,jj,m,k;
- double *S[27],*R[27];
- int sizeofk;
-
- MPI_Status status;
-
- for (m=1;m<=E->sphere.caps_per_proc;m++)    {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-     sizeofk = (1+E->parallel.NUM_NEQ[lev][m].pass[k])*sizeof(double);
-     S[k]=(double *)malloc( sizeofk );
-     R[k]=(double *)malloc( sizeofk );
-   }
+   exchange_plan_execute(E, E->parallel.plan_id_d[lev], (void **) U, lev);
+   return;
  }
 
- for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-
-     for (j=1;j<=E->parallel.NUM_NEQ[lev][m].pass[k];j++)
-       S[k][j-1] = U[m][ E->parallel.EXCHANGE_ID[lev][m][j].pass[k] ];
 
-     MPI_Sendrecv(S[k],E->parallel.NUM_NEQ[lev][m].pass[k],MPI_DOUBLE,
-		  E->parallel.PROCESSOR[lev][m].pass[k],1,
-		  R[k],E->parallel.NUM_NEQ[lev][m].pass[k],MPI_DOUBLE,
-		  E->parallel.PROCESSOR[lev][m].pass[k],1,
-		  E->parallel.world,&status);
-
-     for (j=1;j<=E->parallel.NUM_NEQ[lev][m].pass[k];j++)
-       U[m][ E->parallel.EXCHANGE_ID[lev][m][j].pass[k] ] += R[k][j-1];
+/* split-phase version of regional_exchange_id_d, for overlapping the
+   exchange with computation on the entries that are not exchanged */
+void regional_exchange_id_d_start(E, U, lev)
+ struct All_variables *E;
+ double **U;
+ int lev;
+ {
+   exchange_plan_start(E, E->parallel.plan_id_d[lev], (void **) U, lev);
+   return;
+ }
 
-   }           /* for k */
- }     /* for m */         /* finish sending */
 
- for (m=1;m<=E->sphere.caps_per_proc;m++)
- for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-   free((void*) S[k]);
-   free((void*) R[k]);
+void regional_exchange_id_d_finish(E, U, lev)
+ struct All_variables *E;
+ double **U;
+ int lev;
+ {
+   exchange_plan_finish(E, E->parallel.plan_id_d[lev], (void **) U, lev);
+   return;
  }
 
- return;
+
+/* float version of regional_exchange_id_d, for the levels below levmax
+   with mg_single_precision */
+void regional_exchange_id_f(E, U, lev)
+ struct All_variables *E;
+ float **U;
+ int lev;
+ {
+   exchange_plan_execute(E, E->parallel.plan_id_f[lev], (void **) U, lev);
+   return;
  }
 
 
@@ -796,47 +842,10 @@ static void exchange_node_d(E, U, lev)
  double **U;
  int lev;
  {
-
- int ii,j,jj,m,k;
- double *S[27],*R[27];
- int sizeofk;
-
- MPI_Status status;
-
- for (m=1;m<=E->sphere.caps_per_proc;m++)    {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-     sizeofk = (1+E->parallel.NUM_NODE[lev][m].pass[k])*sizeof(double);
-     S[k]=(double *)malloc( sizeofk );
-     R[k]=(double *)malloc( sizeofk );
-   }   /* end for k */
+   exchange_plan_execute(E, E->parallel.plan_node_d[lev], (void **) U, lev);
+   return;
  }
 
- for(m=1;m<=E->sphere.caps_per_proc;m++)     {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)   {
-
-     for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[k];j++)
-       S[k][j-1] = U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[k] ];
-
-     MPI_Sendrecv(S[k],E->parallel.NUM_NODE[lev][m].pass[k],MPI_DOUBLE,
-		  E->parallel.PROCESSOR[lev][m].pass[k],1,
-		  R[k],E->parallel.NUM_NODE[lev][m].pass[k],MPI_DOUBLE,
-		  E->parallel.PROCESSOR[lev][m].pass[k],1,
-		  E->parallel.world,&status);
-
-     for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[k];j++)
-       U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[k] ] += R[k][j-1];
-   }
- }
-
- for (m=1;m<=E->sphere.caps_per_proc;m++)
- for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-   free((void*) S[k]);
-   free((void*) R[k]);
- }
-
- return;
-}
-
 /* ================================================ */
 /* ================================================ */
 
@@ -845,49 +854,9 @@ static void exchange_node_f(E, U, lev)
  float **U;
  int lev;
 {
-
- int ii,j,jj,m,k;
- float *S[27],*R[27];
- int sizeofk;
-
- MPI_Status status;
-
- for (m=1;m<=E->sphere.caps_per_proc;m++)    {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-     sizeofk = (1+E->parallel.NUM_NODE[lev][m].pass[k])*sizeof(float);
-     S[k]=(float *)malloc( sizeofk );
-     R[k]=(float *)malloc( sizeofk );
-   }   /* end for k */
- }
-
-
- for (m=1;m<=E->sphere.caps_per_proc;m++)     {
-   for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)   {
-
-     for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[k];j++)
-       S[k][j-1] = U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[k] ];
-
-     MPI_Sendrecv(S[k],E->parallel.NUM_NODE[lev][m].pass[k],MPI_FLOAT,
-		  E->parallel.PROCESSOR[lev][m].pass[k],1,
-		  R[k],E->parallel.NUM_NODE[lev][m].pass[k],MPI_FLOAT,
-		  E->parallel.PROCESSOR[lev][m].pass[k],1,
-		  E->parallel.world,&status);
-
-     for (j=1;j<=E->parallel.NUM_NODE[lev][m].pass[k];j++)
-       U[m][ E->parallel.EXCHANGE_NODE[lev][m][j].pass[k] ] += R[k][j-1];
-   }
- }
-
-
- for (m=1;m<=E->sphere.caps_per_proc;m++)
- for (k=1;k<=E->parallel.TNUM_PASS[lev][m];k++)  {
-   free((void*) S[k]);
-   free((void*) R[k]);
- }
-
-
- return;
- }
+   exchange_plan_execute(E, E->parallel.plan_node_f[lev], (void **) U, lev);
+   return;
+}
 /* ================================================ */
 /* ================================================ */
 
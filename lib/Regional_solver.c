@@ -50,6 +50,9 @@ void regional_parallel_domain_boundary_nodes(struct All_variables *);
 void regional_parallel_communication_routs_v(struct All_variables *);
 void regional_parallel_communication_routs_s(struct All_variables *);
 void regional_exchange_id_d(struct All_variables *, double **, int);
+void regional_exchange_id_f(struct All_variables *, float **, int);
+void regional_exchange_id_d_start(struct All_variables *, double **, int);
+void regional_exchange_id_d_finish(struct All_variables *, double **, int);
 
 /* Read_input_from_files.c */
 void regional_read_input_files_for_timesteps(struct All_variables *, int, int);
@@ -81,6 +84,9 @@ void regional_solver_init(struct All_variables *E)
     E->solver.parallel_communication_routs_v = regional_parallel_communication_routs_v;
     E->solver.parallel_communication_routs_s = regional_parallel_communication_routs_s;
     E->solver.exchange_id_d = regional_exchange_id_d;
+    E->solver.exchange_id_f = regional_exchange_id_f;
+    E->solver.exchange_id_d_start = regional_exchange_id_d_start;
+    E->solver.exchange_id_d_finish = regional_exchange_id_d_finish;
 
     /* Read_input_from_files.c */
     E->solver.read_input_files_for_timesteps = regional_read_input_files_for_timesteps;
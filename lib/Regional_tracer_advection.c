@@ -34,6 +34,7 @@
 
 #include <mpi.h>
 #include <math.h>
+#include <string.h>
 #include <sys/types.h>
 #ifdef HAVE_MALLOC_H
 #include <malloc.h>
@@ -525,50 +526,99 @@ void regional_get_velocity(struct All_variables *E,
                            double theta, double phi, double rad,
                            double *velocity_vector)
 {
-    void velo_from_element_d();
+    update_tracer_velocity_cache(E);
+    regional_get_velocities(E, m, nelem, 1, &theta, &phi, &rad,
+                            &velocity_vector[1], &velocity_vector[2],
+                            &velocity_vector[3]);
+    return;
+}
 
-    double shp[9], VV[4][9], tmp;
-    int n, d, node;
-    const int sphere_key = 0;
 
-    /* get shape functions at (theta, phi, rad) */
-    regional_get_shape_functions(E, shp, nelem, theta, phi, rad);
+/******** GET VELOCITIES *************************************/
+/*                                                           */
+/* Same as regional_get_velocity(), for n tracers that all   */
+/* lie in element nelem. The nodal velocities and the size   */
+/* of the element are loaded once for all of them.           */
 
+void regional_get_velocities(struct All_variables *E,
+                             int m, int nelem, int n,
+                             double *theta, double *phi, double *rad,
+                             double *vx, double *vy, double *vz)
+{
+    double radbounds[2];
+    double VV[4][9];
 
     /* get cartesian velocity */
-    velo_from_element_d(E, VV, m, nelem, sphere_key);
-
+    tracer_velo_from_element(E, VV, m, nelem);
+    tracer_element_radii(E, m, nelem, radbounds);
 
-    /*** comment by Tan2 1/25/2005
-         Interpolate the velocity on the tracer position
-    ***/
+    regional_get_element_velocities(E, m, nelem, radbounds, VV, n,
+                                    theta, phi, rad, vx, vy, vz);
+    return;
+}
 
-    for(d=1; d<=3; d++)
-        velocity_vector[d] = 0;
 
+/******** GET ELEMENT VELOCITIES *****************************/
+/*                                                           */
+/* Same as regional_get_velocities(), with the radii of the  */
+/* bottom and top nodes and the Cartesian nodal velocities   */
+/* of the element given. The element may belong to another   */
+/* processor of the same column (tracer_balance); the local  */
+/* element nelem of the same column gives its lateral size.  */
 
-    for(d=1; d<=3; d++) {
-        for(n=1; n<=8; n++)
-            velocity_vector[d] += VV[d][n] * shp[n];
-    }
+void regional_get_element_velocities(struct All_variables *E,
+                                     int m, int nelem, double radbounds[2],
+                                     double VV[4][9], int n,
+                                     double *theta, double *phi, double *rad,
+                                     double *vx, double *vy, double *vz)
+{
+    double x0, y0, z0;
+    double dx, dy, dz;
+    double tr_dx, tr_dy, tr_dz;
+    double volume;
+    double shp1, shp2, shp3, shp4, shp5, shp6, shp7, shp8;
+    int e, i, j, t;
+    int elx, elz;
 
+    elx = E->lmesh.elx;
+    elz = E->lmesh.elz;
 
-    /* * debug **
-    for(d=1; d<=3; d++) {
-        fprintf(E->trace.fpt, "VV: %e %e %e %e %e %e %e %e: %e\n",
-                VV[d][1], VV[d][2], VV[d][3], VV[d][4],
-                VV[d][5], VV[d][6], VV[d][7], VV[d][8],
-                velocity_vector[d]);
-    }
+    e = nelem - 1;
+    i = (e / elz) % elx;
+    j = e / (elz*elx);
 
-    tmp = 0;
-    for(n=1; n<=8; n++)
-        tmp += E->sx[m][1][E->ien[m][nelem].node[n]] * shp[n];
+    x0 = E->trace.x_space[i];
+    dx = E->trace.x_space[i+1] - x0;
+    y0 = E->trace.y_space[j];
+    dy = E->trace.y_space[j+1] - y0;
+    z0 = radbounds[0];
+    dz = radbounds[1] - z0;
 
-    fprintf(E->trace.fpt, "THETA: %e -> %e\n", theta, tmp);
+    volume = dx*dz*dy;
 
-    fflush(E->trace.fpt);
-    */
+    /* trilinear shape functions, see regional_get_shape_functions() */
+
+    for(t=0; t<n; t++) {
+        tr_dx = theta[t] - x0;
+        tr_dy = phi[t] - y0;
+        tr_dz = rad[t] - z0;
+
+        shp1 = (dx-tr_dx) * (dy-tr_dy) * (dz-tr_dz) / volume;
+        shp2 = tr_dx      * (dy-tr_dy) * (dz-tr_dz) / volume;
+        shp3 = tr_dx      * tr_dy      * (dz-tr_dz) / volume;
+        shp4 = (dx-tr_dx) * tr_dy      * (dz-tr_dz) / volume;
+        shp5 = (dx-tr_dx) * (dy-tr_dy) * tr_dz      / volume;
+        shp6 = tr_dx      * (dy-tr_dy) * tr_dz      / volume;
+        shp7 = tr_dx      * tr_dy      * tr_dz      / volume;
+        shp8 = (dx-tr_dx) * tr_dy      * tr_dz      / volume;
+
+        vx[t] = VV[1][1]*shp1 + VV[1][2]*shp2 + VV[1][3]*shp3 + VV[1][4]*shp4
+            + VV[1][5]*shp5 + VV[1][6]*shp6 + VV[1][7]*shp7 + VV[1][8]*shp8;
+        vy[t] = VV[2][1]*shp1 + VV[2][2]*shp2 + VV[2][3]*shp3 + VV[2][4]*shp4
+            + VV[2][5]*shp5 + VV[2][6]*shp6 + VV[2][7]*shp7 + VV[2][8]*shp8;
+        vz[t] = VV[3][1]*shp1 + VV[3][2]*shp2 + VV[3][3]*shp3 + VV[3][4]*shp4
+            + VV[3][5]*shp5 + VV[3][6]*shp6 + VV[3][7]*shp7 + VV[3][8]*shp8;
+    }
 
     return;
 }
@@ -984,12 +1034,9 @@ static void put_found_tracers(struct All_variables *E,
             if (E->trace.ntracers[j] > (E->trace.max_ntracers[j]-5))
                 expand_tracer_arrays(E, j);
 
-            for (pp=0; pp<E->trace.number_of_basic_quantities; pp++)
-                E->trace.basicq[j][pp][ilast] = recv[ipos+pp];
-
-            ipos += E->trace.number_of_basic_quantities;
-            for (pp=0; pp<E->trace.number_of_extra_quantities; pp++)
-                E->trace.extraq[j][pp][ilast] = recv[ipos+pp];
+            /* received tracers have the layout of a record */
+            memcpy(tracer_basicq(E,j,ilast), &recv[ipos],
+                   E->trace.number_of_tracer_quantities*sizeof(double));
 
 
             /* found the element */
@@ -1004,7 +1051,7 @@ static void put_found_tracers(struct All_variables *E,
                 exit(10);
             }
 
-            E->trace.ielement[j][ilast] = iel;
+            tracer_element(E,j,ilast) = iel;
 
         }
         else {
@@ -27,11 +27,14 @@
  */
 #include "element_definitions.h"
 #include "global_defs.h"
+#include "parallel_related.h"
 #include <math.h>
 #ifdef CITCOM_ALLOW_ANISOTROPIC_VISC
 #include "anisotropic_viscosity.h"
 #endif
 
+void myerror(struct All_variables *,char *);
+
 void set_mg_defaults(E)
      struct All_variables *E;
 { void assemble_forces_iterative();
@@ -722,3 +725,364 @@ void project_vector(E,start_lev,AU,AD,ic)
 
  return;
   }
+
+
+/* =====================================================
+   Direct solver for the coarsest level. The levmin matrix is gathered
+   onto processor 0 and factorized there each time the stiffness matrix
+   is rebuilt. Each coarse solve is then one gather and one scatter,
+   instead of up to v_steps_low Gauss-Seidel sweeps with one halo
+   exchange each. The factorization is dense and serial, so levmin is
+   limited to MAX_COARSE_DIRECT equations.
+   ===================================================== */
+
+void coarse_solver_setup(E)
+     struct All_variables *E;
+{
+    int m,i,k,start,owned,base,ok;
+    int *sgid;
+    double *num[NCS];
+    struct COARSE_SOLVER *cs = &E->coarse;
+
+    const int lev=E->mesh.levmin;
+    const int neq=E->lmesh.NEQ[lev];
+    const int me=E->parallel.me;
+
+    cs->count = E->sphere.caps_per_proc*neq;
+    start = base = 0;
+    ok = 1;
+    MPI_Exscan(&cs->count,&start,1,MPI_INT,MPI_SUM,E->parallel.world);
+    if (me==0) start = 0;
+
+    /* a shared equation belongs to the copy with the smallest
+       tentative number; the owners then number their equations
+       consecutively, and the numbers are passed on to the copies */
+    for(m=1;m<=E->sphere.caps_per_proc;m++) {
+      num[m] = (double *)malloc((neq+1)*sizeof(double));
+      for(i=0;i<neq;i++)
+        num[m][i] = start + (m-1)*neq + i;
+    }
+
+    exchange_plan_min(E,E->parallel.plan_id_d[lev],num);
+
+    owned = 0;
+    for(m=1;m<=E->sphere.caps_per_proc;m++)
+      for(i=0;i<neq;i++)
+        if (num[m][i] == start + (m-1)*neq + i)
+          owned++;
+
+    MPI_Exscan(&owned,&base,1,MPI_INT,MPI_SUM,E->parallel.world);
+    if (me==0) base = 0;
+    MPI_Allreduce(&owned,&cs->n,1,MPI_INT,MPI_SUM,E->parallel.world);
+
+    if (cs->n > MAX_COARSE_DIRECT) {
+      if (me==0)
+        fprintf(stderr,"mg_coarse_direct: the lowest level has %d equations, at most %d are allowed\n",
+                cs->n,MAX_COARSE_DIRECT);
+      myerror(E,"Error: the lowest multigrid level is too large for mg_coarse_direct");
+    }
+
+    k = base;
+    for(m=1;m<=E->sphere.caps_per_proc;m++)
+      for(i=0;i<neq;i++)
+        if (num[m][i] == start + (m-1)*neq + i)
+          num[m][i] = k++;
+        else
+          num[m][i] = 1.0e30;
+
+    exchange_plan_min(E,E->parallel.plan_id_d[lev],num);
+
+    for(m=1;m<=E->sphere.caps_per_proc;m++) {
+      cs->gid[m] = (int *)malloc((neq+1)*sizeof(int));
+      for(i=0;i<neq;i++)
+        cs->gid[m][i] = (int) num[m][i];
+      free((void *) num[m]);
+    }
+
+    cs->buf = (double *)malloc((cs->count+1)*sizeof(double));
+
+    if (me==0) {
+      cs->counts = (int *)malloc(E->parallel.nproc*sizeof(int));
+      cs->displs = (int *)malloc(E->parallel.nproc*sizeof(int));
+    }
+    MPI_Gather(&cs->count,1,MPI_INT,cs->counts,1,MPI_INT,0,E->parallel.world);
+
+    if (me==0) {
+      cs->total = 0;
+      for(i=0;i<E->parallel.nproc;i++) {
+        cs->displs[i] = cs->total;
+        cs->total += cs->counts[i];
+      }
+      cs->rgid = (int *)malloc((cs->total+1)*sizeof(int));
+      cs->rbuf = (double *)malloc((cs->total+1)*sizeof(double));
+      cs->y = (double *)malloc((cs->n+1)*sizeof(double));
+      cs->L = (double *)malloc((size_t)cs->n*cs->n*sizeof(double));
+      ok = (cs->L != NULL);
+
+      fprintf(E->fp,"Coarse grid direct solver: %d equations\n",cs->n);
+      fflush(E->fp);
+    }
+    MPI_Bcast(&ok,1,MPI_INT,0,E->parallel.world);
+    if (!ok)
+      myerror(E,"Error: coarse grid matrix too large for mg_coarse_direct");
+
+    sgid = (int *)malloc((cs->count+1)*sizeof(int));
+    k = 0;
+    for(m=1;m<=E->sphere.caps_per_proc;m++)
+      for(i=0;i<neq;i++)
+        sgid[k++] = cs->gid[m][i];
+    MPI_Gatherv(sgid,cs->count,MPI_INT,cs->rgid,cs->counts,cs->displs,
+                MPI_INT,0,E->parallel.world);
+    free((void *) sgid);
+
+    return;
+}
+
+
+/* (row, col, value) of the nonzero levmin entries of this processor,
+   in global numbers. The nodal matrix holds each node's row towards its
+   lower neighbours; the other half follows from the symmetry */
+static double *coarse_entries_nodal(struct All_variables *E, int *nt)
+{
+    int m,e,d,i,eqn,k;
+    int *C,*gid;
+    double *t;
+    higher_precision *B[4];
+
+    const int lev=E->mesh.levmin;
+    const int neq=E->lmesh.NEQ[lev];
+    const int nno=E->lmesh.NNO[lev];
+    const int max_eqn=14*E->mesh.nsd;
+
+    t = (double *)malloc((6*E->sphere.caps_per_proc*nno*max_eqn*3+1)*sizeof(double));
+    k = 0;
+    for(m=1;m<=E->sphere.caps_per_proc;m++) {
+      gid = E->coarse.gid[m];
+      for(e=1;e<=nno;e++) {
+        C = E->Node_map[lev][m] + (e-1)*max_eqn;
+        B[1] = E->Eqn_k1[lev][m] + (e-1)*max_eqn;
+        B[2] = E->Eqn_k2[lev][m] + (e-1)*max_eqn;
+        B[3] = E->Eqn_k3[lev][m] + (e-1)*max_eqn;
+        for(d=1;d<=3;d++) {
+          eqn = E->ID[lev][m][e].doff[d];
+          for(i=0;i<max_eqn;i++) {
+            if (C[i]==neq || B[d][i]==0.0)
+              continue;
+            t[k++] = gid[C[i]];
+            t[k++] = gid[eqn];
+            t[k++] = B[d][i];
+            if (i>=3) {
+              t[k++] = gid[eqn];
+              t[k++] = gid[C[i]];
+              t[k++] = B[d][i];
+            }
+          }
+        }
+      }
+    }
+
+    *nt = k;
+    return t;
+}
+
+
+/* the same from the block-CSR rows, which hold both halves */
+static double *coarse_entries_bsr(struct All_variables *E, int *nt)
+{
+    int m,e,b,r,c,k;
+    int *gid;
+    double *t;
+    higher_precision *K;
+
+    const int lev=E->mesh.levmin;
+    const int nno=E->lmesh.NNO[lev];
+
+    k = 0;
+    for(m=1;m<=E->sphere.caps_per_proc;m++)
+      k += 27*E->Bsr_ptr[lev][m][nno];
+    t = (double *)malloc((k+1)*sizeof(double));
+
+    k = 0;
+    for(m=1;m<=E->sphere.caps_per_proc;m++) {
+      gid = E->coarse.gid[m];
+      for(e=1;e<=nno;e++)
+        for(b=E->Bsr_ptr[lev][m][e-1];b<E->Bsr_ptr[lev][m][e];b++) {
+          K = E->Bsr_k[lev][m] + 9*b;
+          for(r=0;r<3;r++)
+            for(c=0;c<3;c++) {
+              if (K[3*r+c]==0.0)
+                continue;
+              t[k++] = gid[E->ID[lev][m][e].doff[r+1]];
+              t[k++] = gid[E->Bsr_col[lev][m][b]+c];
+              t[k++] = K[3*r+c];
+            }
+        }
+    }
+
+    *nt = k;
+    return t;
+}
+
+
+/* assemble the global levmin matrix from the nodal matrices of all
+   processors and factorize it, K = L L^T */
+void coarse_solver_factor(E)
+     struct All_variables *E;
+{
+    int i,j,k,nt,row,col,total,ok,null_space;
+    int *tcounts,*tdispls;
+    double *t,*rt,*L;
+    double sum,diag;
+    struct COARSE_SOLVER *cs = &E->coarse;
+
+    const int n=cs->n;
+
+    /* (row, col, value) of the local entries, in global numbers */
+    if (E->control.block_csr)
+      t = coarse_entries_bsr(E,&nt);
+    else
+      t = coarse_entries_nodal(E,&nt);
+
+    tcounts = tdispls = NULL;
+    rt = NULL;
+    ok = 1;
+    if (E->parallel.me==0)  {
+      tcounts = (int *)malloc(E->parallel.nproc*sizeof(int));
+      tdispls = (int *)malloc(E->parallel.nproc*sizeof(int));
+    }
+    MPI_Gather(&nt,1,MPI_INT,tcounts,1,MPI_INT,0,E->parallel.world);
+
+    total = 0;
+    if (E->parallel.me==0)  {
+      for(i=0;i<E->parallel.nproc;i++) {
+        tdispls[i] = total;
+        total += tcounts[i];
+      }
+      rt = (double *)malloc((total+1)*sizeof(double));
+    }
+    MPI_Gatherv(t,nt,MPI_DOUBLE,rt,tcounts,tdispls,MPI_DOUBLE,0,E->parallel.world);
+    free((void *) t);
+
+    if (E->parallel.me==0)  {
+      L = cs->L;
+      for(i=0;i<n*n;i++)
+        L[i] = 0.0;
+      for(k=0;k<total;k+=3) {
+        row = (int) rt[k];
+        col = (int) rt[k+1];
+        L[(size_t)row*n+col] += rt[k+2];
+      }
+
+      /* the rows and columns of fixed velocities are empty */
+      for(i=0;i<n;i++)
+        if (L[(size_t)i*n+i]==0.0)
+          L[(size_t)i*n+i] = 1.0;
+
+      /* Cholesky factor in the lower triangle. In a full sphere with
+         free slip on both surfaces the rigid rotations are in the null
+         space of K, and their pivots vanish to the round-off of the
+         single precision nodal matrix; those equations are taken out
+         and solved as x = 0. Anywhere else a vanishing pivot means
+         that K is singular, which is an error */
+      null_space = (E->sphere.caps == 12 && !E->mesh.topvbc && !E->mesh.botvbc);
+      cs->npin = 0;
+      for(j=0;j<n && ok;j++) {
+        diag = sum = L[(size_t)j*n+j];
+        for(k=0;k<j;k++)
+          sum -= L[(size_t)j*n+k]*L[(size_t)j*n+k];
+        if (sum <= 1.0e-4*diag) {
+          if (!null_space || sum < -1.0e-4*diag || cs->npin == MAX_COARSE_PIN) {
+            fprintf(stderr,"coarse_solver_factor: pivot of equation %d is %e of its diagonal\n",
+                    j,sum/diag);
+            ok = 0;
+            break;
+          }
+          cs->pin[cs->npin++] = j;
+          for(k=0;k<j;k++)
+            L[(size_t)j*n+k] = 0.0;
+          L[(size_t)j*n+j] = 1.0;
+          for(i=j+1;i<n;i++)
+            L[(size_t)i*n+j] = 0.0;
+          continue;
+        }
+        L[(size_t)j*n+j] = sqrt(sum);
+        for(i=j+1;i<n;i++) {
+          sum = L[(size_t)i*n+j];
+          for(k=0;k<j;k++)
+            sum -= L[(size_t)i*n+k]*L[(size_t)j*n+k];
+          L[(size_t)i*n+j] = sum/L[(size_t)j*n+j];
+        }
+      }
+
+      if (E->control.verbose) {
+        fprintf(E->fp,"Coarse grid factorization: %d null space equations\n",cs->npin);
+        fflush(E->fp);
+      }
+
+      free((void *) rt);
+      free((void *) tcounts);
+      free((void *) tdispls);
+    }
+
+    MPI_Bcast(&ok,1,MPI_INT,0,E->parallel.world);
+    if (!ok)
+      myerror(E,"Error: coarse grid matrix is singular or not positive definite");
+
+    return;
+}
+
+
+/* x = K^-1 b on levmin */
+void coarse_solve(E,x,b)
+     struct All_variables *E;
+     double **x,**b;
+{
+    int m,i,k;
+    double *L,*y;
+    struct COARSE_SOLVER *cs = &E->coarse;
+
+    const int lev=E->mesh.levmin;
+    const int neq=E->lmesh.NEQ[lev];
+    const int n=cs->n;
+
+    k = 0;
+    for(m=1;m<=E->sphere.caps_per_proc;m++)
+      for(i=0;i<neq;i++)
+        cs->buf[k++] = b[m][i];
+
+    MPI_Gatherv(cs->buf,cs->count,MPI_DOUBLE,cs->rbuf,cs->counts,cs->displs,
+                MPI_DOUBLE,0,E->parallel.world);
+
+    if (E->parallel.me==0)  {
+      L = cs->L;
+      y = cs->y;
+      for(k=0;k<cs->total;k++)
+        y[cs->rgid[k]] = cs->rbuf[k];
+      for(k=0;k<cs->npin;k++)
+        y[cs->pin[k]] = 0.0;
+
+      for(i=0;i<n;i++) {
+        for(k=0;k<i;k++)
+          y[i] -= L[(size_t)i*n+k]*y[k];
+        y[i] /= L[(size_t)i*n+i];
+      }
+      for(i=n-1;i>=0;i--) {
+        y[i] /= L[(size_t)i*n+i];
+        for(k=0;k<i;k++)
+          y[k] -= L[(size_t)i*n+k]*y[i];
+      }
+
+      for(k=0;k<cs->total;k++)
+        cs->rbuf[k] = y[cs->rgid[k]];
+    }
+
+    MPI_Scatterv(cs->rbuf,cs->counts,cs->displs,MPI_DOUBLE,cs->buf,cs->count,
+                 MPI_DOUBLE,0,E->parallel.world);
+
+    k = 0;
+    for(m=1;m<=E->sphere.caps_per_proc;m++)
+      for(i=0;i<neq;i++)
+        x[m][i] = cs->buf[k++];
+
+    return;
+}
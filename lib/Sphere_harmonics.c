@@ -8,6 +8,8 @@
 #include <stdlib.h>
 
 static void compute_sphereh_table(struct All_variables *);
+void sphere_expansion_layers(struct All_variables *, int, float ***, double *);
+void sum_across_surf_sph(struct All_variables *, double *, int);
 
 /*   ======================================================================
      ======================================================================  */
@@ -42,6 +44,12 @@ void set_sphere_harmonics(E)
 
     compute_sphereh_table(E);
 
+    if (E->sphere.compact_tables && E->parallel.me == 0 && E->fp) {
+        fprintf(E->fp, "Compact sph. harm. tables: %d colatitudes, %d longitudes for %d surface nodes\n",
+                E->sphere.nlat[1], E->sphere.nlon[1], E->lmesh.nsf);
+        fflush(E->fp);
+    }
+
     return;
 }
 
@@ -97,6 +105,62 @@ double modified_plgndr_a(int l, int m, double t)
 }
 
 
+/* The same as modified_plgndr_a(), for all ll and mm at once:
+   plm[hindex[ll][mm]] = modified_plgndr_a(ll,mm,t). The recurrence
+   over ll is done once per mm instead of once per (ll,mm). */
+static void plgndr_row(struct All_variables *E, double t, double *plm)
+{
+    int i,ll,m;
+    double x,fact1,fact2,fact,pll,pmm,pmmp1,pmm0,somx2,gact1,gact2;
+    const double three=3.0;
+    const double two=2.0;
+    const double one=1.0;
+    const double norm=sqrt(4.0*M_PI);
+    const int lmax=E->output.llmax;
+
+    x = cos(t);
+    somx2=sqrt((one-x)*(one+x));
+
+    /* pmm of order m, by the same product as modified_plgndr_a() */
+    pmm0=one;
+    gact1= three;
+    gact2= two;
+
+    for (m=0;m<=lmax;m++) {
+        if (m>0) {
+            fact=sqrt(gact1/gact2);
+            pmm0 = -pmm0*fact*somx2;
+            gact1+=  two;
+            gact2+=  two;
+        }
+        pmm = pmm0;
+
+        plm[E->sphere.hindex[m][m]] = pmm;
+        if (m+1<=lmax) {
+            pmmp1 = x*sqrt(two*m+three)*pmm;
+            plm[E->sphere.hindex[m+1][m]] = pmmp1;
+            for (ll=m+2;ll<=lmax;ll++)  {
+                fact1= sqrt((4.0*ll*ll-one)*(double)(ll-m)/(double)(ll+m));
+                fact2= sqrt((2.0*ll+one)*(ll-m)*(ll+m-one)*(ll-m-one)
+                            /(double)((two*ll-three)*(ll+m)));
+                pll = ( x*fact1*pmmp1-fact2*pmm)/(ll-m);
+                pmm = pmmp1;
+                pmmp1 = pll;
+                plm[E->sphere.hindex[ll][m]] = pll;
+            }
+        }
+
+        for (ll=m;ll<=lmax;ll++) {
+            i = E->sphere.hindex[ll][m];
+            plm[i] /= norm;
+            if (m!=0) plm[i] *= sqrt(two);
+        }
+    }
+
+    return;
+}
+
+
 /* =========================================================
    expand the field TG into spherical harmonics
    ========================================================= */
@@ -104,47 +168,148 @@ void sphere_expansion(E,TG,sphc,sphs)
      struct All_variables *E;
      float **TG,*sphc,*sphs;
 {
-    int el,nint,d,p,i,m,j,es,mm,ll,rand();
+    int p;
+    double *sph;
     void sum_across_surf_sph1();
 
-    for (i=0;i<E->sphere.hindice;i++)    {
-        sphc[i] = 0.0;
-        sphs[i] = 0.0;
+    sph = (double *)malloc(2*E->sphere.hindice*sizeof(double));
+
+    sphere_expansion_layers(E, 1, &TG, sph);
+
+    for (p=0;p<E->sphere.hindice;p++)    {
+        sphc[p] = sph[p];
+        sphs[p] = sph[E->sphere.hindice+p];
     }
 
-    for (m=1;m<=E->sphere.caps_per_proc;m++)
-        for (es=1;es<=E->lmesh.snel;es++)   {
+    sum_across_surf_sph1(E,sphc,sphs);
 
-            for (ll=0;ll<=E->output.llmax;ll++)
-                for (mm=0; mm<=ll; mm++)   {
+    free(sph);
+    return;
+}
 
-                    p = E->sphere.hindex[ll][mm];
 
-                    for(nint=1;nint<=onedvpoints[E->mesh.nsd];nint++)   {
-                        for(d=1;d<=onedvpoints[E->mesh.nsd];d++)   {
-                            j = E->sien[m][es].node[d];
-                            sphc[p] += TG[m][E->sien[m][es].node[d]]
-                                * E->sphere.tablesplm[m][j][p]
-                                * E->sphere.tablescosf[m][j][mm]
-                                * E->M.vpt[GMVINDEX(d,nint)]
-                                * E->surf_det[m][nint][es];
-                            sphs[p] += TG[m][E->sien[m][es].node[d]]
-                                * E->sphere.tablesplm[m][j][p]
-                                * E->sphere.tablessinf[m][j][mm]
-                                * E->M.vpt[GMVINDEX(d,nint)]
-                                * E->surf_det[m][nint][es];
-                        }
-                    }
+/* =========================================================
+   expand the fields TG[0..nlayers-1] into spherical harmonics
+   at once, as the product of the (layers x surface nodes)
+   matrix of the fields, weighted by the surface quadrature,
+   and the (surface nodes x harmonics) matrix of the tables.
+
+   The coeff. of layer l are sph[l*2*hindice+p] (cos) and
+   sph[l*2*hindice+hindice+p] (sin). They are NOT summed
+   across processors; the caller does a single reduction.
+   ========================================================= */
 
-                }       /* end for ll and mm  */
+/* number of coeff. in a column block of the product */
+#define SPH_BLOCK 256
 
+/* coeff. p0..p1-1 of the row of surface node n in the tables,
+   weighted by the quadrature */
+static void sphere_table_row(struct All_variables *E, int m, int n,
+                             int p0, int p1, const int *pmm,
+                             double *cs, double *sn)
+{
+    int p;
+    double plm;
+    const double w = E->sphere.tablesw[m][n];
+    const int lmax1 = E->output.llmax + 1;
+
+    if (!E->sphere.compact_tables) {
+        const double *P = E->sphere.tablesplm[m][n];
+        const double *C = E->sphere.tablescosf[m][n];
+        const double *S = E->sphere.tablessinf[m][n];
+
+        for (p=p0; p<p1; p++) {
+            plm = w * P[p];
+            cs[p-p0] = plm * C[pmm[p]];
+            sn[p-p0] = plm * S[pmm[p]];
+        }
+    }
+    else if (!E->sphere.float_tables) {
+        const double *P = E->sphere.ctable[m]
+            + E->sphere.clat[m][n]*E->sphere.hindice;
+        const double *C = E->sphere.ctable[m]
+            + E->sphere.nlat[m]*E->sphere.hindice
+            + E->sphere.clon[m][n]*2*lmax1;
+        const double *S = C + lmax1;
+
+        for (p=p0; p<p1; p++) {
+            plm = w * P[p];
+            cs[p-p0] = plm * C[pmm[p]];
+            sn[p-p0] = plm * S[pmm[p]];
         }
+    }
+    else {
+        const float *P = E->sphere.ctablef[m]
+            + E->sphere.clat[m][n]*E->sphere.hindice;
+        const float *C = E->sphere.ctablef[m]
+            + E->sphere.nlat[m]*E->sphere.hindice
+            + E->sphere.clon[m][n]*2*lmax1;
+        const float *S = C + lmax1;
+
+        for (p=p0; p<p1; p++) {
+            plm = w * P[p];
+            cs[p-p0] = plm * C[pmm[p]];
+            sn[p-p0] = plm * S[pmm[p]];
+        }
+    }
 
-    sum_across_surf_sph1(E,sphc,sphs);
+    return;
+}
+
+void sphere_expansion_layers(struct All_variables *E, int nlayers,
+                             float ***TG, double *sph)
+{
+    int m, n, l, p, p0, p1, ll, mm, ib, nblocks;
+    int *pmm;
+    double w, cs[SPH_BLOCK], sn[SPH_BLOCK];
+    double *c, *s;
+
+    const int hindice = E->sphere.hindice;
+    const int stride = 2*hindice;
+
+    for (p=0; p<nlayers*stride; p++)
+        sph[p] = 0.0;
+
+    /* order mm of each coeff. */
+    pmm = (int *)malloc(hindice*sizeof(int));
+    for (ll=0;ll<=E->output.llmax;ll++)
+        for (mm=0; mm<=ll; mm++)
+            pmm[E->sphere.hindex[ll][mm]] = mm;
+
+    nblocks = (hindice + SPH_BLOCK - 1) / SPH_BLOCK;
+
+    for (m=1;m<=E->sphere.caps_per_proc;m++) {
+        /* each thread owns a block of coeff. of all layers */
+#ifdef _OPENMP
+#pragma omp parallel for private(ib,p0,p1,p,n,l,w,cs,sn,c,s) schedule(dynamic,1) if(E->control.omp_threads)
+#endif
+        for (ib=0; ib<nblocks; ib++) {
+            p0 = ib*SPH_BLOCK;
+            p1 = min(p0+SPH_BLOCK, hindice);
+
+            for (n=1;n<=E->lmesh.nsf;n++) {
+                /* row n of the tables, weighted */
+                sphere_table_row(E, m, n, p0, p1, pmm, cs, sn);
+
+                for (l=0; l<nlayers; l++) {
+                    w = TG[l][m][n];
+                    c = sph + l*stride;
+                    s = c + hindice;
+                    for (p=p0; p<p1; p++) {
+                        c[p] += w * cs[p-p0];
+                        s[p] += w * sn[p-p0];
+                    }
+                }
+            }
+        }
+    }
 
+    free(pmm);
     return;
 }
 
+#undef SPH_BLOCK
+
 
 void debug_sphere_expansion(struct All_variables *E)
 {
@@ -153,56 +318,195 @@ void debug_sphere_expansion(struct All_variables *E)
      */
     int m, i, j, k, p, node;
     int ll, mm;
-    float *TT[NCS], *sph_harm[2];
-
-    for(m=1;m<=E->sphere.caps_per_proc;m++)
-        TT[m] = (float *) malloc ((E->lmesh.nsf+1)*sizeof(float));
+    float ***TT;
+    double *sph_harm, *c;
+    const int noz = E->lmesh.noz;
+
+    /* one layer per horizontal slice */
+    TT = (float ***) malloc(noz*sizeof(float **));
+    for(k=0;k<noz;k++)  {
+        TT[k] = (float **) malloc((E->sphere.caps_per_proc+1)*sizeof(float *));
+        for(m=1;m<=E->sphere.caps_per_proc;m++)
+            TT[k][m] = (float *) malloc ((E->lmesh.nsf+1)*sizeof(float));
+    }
 
-    /* sin coeff */
-    sph_harm[0] = (float*)malloc(E->sphere.hindice*sizeof(float));
-    /* cos coeff */
-    sph_harm[1] = (float*)malloc(E->sphere.hindice*sizeof(float));
+    /* cos and sin coeff of all layers */
+    sph_harm = (double *)malloc(noz*2*E->sphere.hindice*sizeof(double));
 
-    for(k=1;k<=E->lmesh.noz;k++)  {
+    for(k=1;k<=noz;k++)
         for(m=1;m<=E->sphere.caps_per_proc;m++)
             for(i=1;i<=E->lmesh.noy;i++)
                 for(j=1;j<=E->lmesh.nox;j++)  {
                     node= k + (j-1)*E->lmesh.noz + (i-1)*E->lmesh.nox*E->lmesh.noz;
                     p = j + (i-1)*E->lmesh.nox;
-                    TT[m][p] = E->T[m][node];
+                    TT[k-1][m][p] = E->T[m][node];
                 }
 
-        /* expand TT into spherical harmonics */
-        sphere_expansion(E, TT, sph_harm[0], sph_harm[1]);
+    /* expand TT into spherical harmonics */
+    sphere_expansion_layers(E, noz, TT, sph_harm);
+    sum_across_surf_sph(E, sph_harm, noz*2*E->sphere.hindice);
 
-        /* only the first nprocz CPU needs output */
-        if(E->parallel.me < E->parallel.nprocz) {
+    /* only the first nprocz CPU needs output */
+    if(E->parallel.me < E->parallel.nprocz) {
+        for(k=1;k<=noz;k++) {
+            c = sph_harm + (k-1)*2*E->sphere.hindice;
             for (ll=0;ll<=E->output.llmax;ll++)
                 for (mm=0; mm<=ll; mm++)   {
                     p = E->sphere.hindex[ll][mm];
                     fprintf(stderr, "T expanded layer=%d ll=%d mm=%d -- %12g %12g\n",
                             k+E->lmesh.nzs-1, ll, mm,
-                            sph_harm[0][p], sph_harm[1][p]);
+                            (float)c[p], (float)c[E->sphere.hindice+p]);
                 }
         }
     }
 
+    for(k=0;k<noz;k++)  {
+        for(m=1;m<=E->sphere.caps_per_proc;m++)
+            free(TT[k][m]);
+        free(TT[k]);
+    }
+    free(TT);
+    free(sph_harm);
+
     return;
 }
 
 
 /* ==================================================*/
 /* ==================================================*/
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* The distinct values of x[1..n] go to u[0..nu-1], in increasing
+   order, and x[i] == u[idx[i]]. Returns nu. */
+static int distinct_values(int n, const double *x, double *u, int *idx)
+{
+    int i, nu;
+    double *v;
+
+    for (i=0; i<n; i++)
+        u[i] = x[i+1];
+    qsort(u, n, sizeof(double), compare_doubles);
+
+    nu = 0;
+    for (i=0; i<n; i++)
+        if (nu == 0 || u[i] != u[nu-1])
+            u[nu++] = u[i];
+
+    for (i=1; i<=n; i++) {
+        v = (double *)bsearch(&x[i], u, nu, sizeof(double), compare_doubles);
+        idx[i] = v - u;
+    }
+
+    return nu;
+}
+
+
+/* Compact tables (compact_sph_tables=on): P_lm depends only on the
+   colatitude and cos/sin(mm*phi) only on the longitude, so the tables
+   are kept once per distinct colatitude and longitude of the surface
+   nodes, in a single allocation per cap, in double or in float
+   (float_sph_tables=on). */
+static void compute_compact_sphereh_table(struct All_variables *E, int m)
+{
+    int j, k, mm, size;
+    int nlat, nlon;
+    double *theta, *phi, *lat, *lon, *row, *P, *C;
+
+    const int nsf = E->lmesh.nsf;
+    const int lmax1 = E->output.llmax + 1;
+    const int hindice = E->sphere.hindice;
+
+    theta = (double *)malloc((nsf+1)*sizeof(double));
+    phi = (double *)malloc((nsf+1)*sizeof(double));
+    lat = (double *)malloc(nsf*sizeof(double));
+    lon = (double *)malloc(nsf*sizeof(double));
+
+    for (j=1;j<=nsf;j++)  {
+        theta[j] = E->sx[m][1][j*E->lmesh.noz];
+        phi[j] = E->sx[m][2][j*E->lmesh.noz];
+    }
+
+    /* node index into the colatitudes and longitudes */
+    E->sphere.clat[m] = (int *)malloc(2*(nsf+1)*sizeof(int));
+    E->sphere.clon[m] = E->sphere.clat[m] + nsf+1;
+
+    nlat = distinct_values(nsf, theta, lat, E->sphere.clat[m]);
+    nlon = distinct_values(nsf, phi, lon, E->sphere.clon[m]);
+    E->sphere.nlat[m] = nlat;
+    E->sphere.nlon[m] = nlon;
+
+    /* P_lm of each colatitude, then cos and sin of each longitude */
+    size = nlat*hindice + nlon*2*lmax1;
+    E->sphere.ctable[m] = NULL;
+    E->sphere.ctablef[m] = NULL;
+
+    if (!E->sphere.float_tables) {
+        E->sphere.ctable[m] = (double *)malloc(size*sizeof(double));
+        P = E->sphere.ctable[m];
+        row = NULL;
+    }
+    else {
+        E->sphere.ctablef[m] = (float *)malloc(size*sizeof(float));
+        P = row = (double *)malloc(hindice*sizeof(double));
+    }
+
+    for (k=0; k<nlat; k++) {
+        if (!E->sphere.float_tables)
+            plgndr_row(E, lat[k], P + k*hindice);
+        else {
+            plgndr_row(E, lat[k], row);
+            for (j=0; j<hindice; j++)
+                E->sphere.ctablef[m][k*hindice+j] = row[j];
+        }
+    }
+
+    for (k=0; k<nlon; k++)
+        for (mm=0; mm<lmax1; mm++) {
+            j = nlat*hindice + k*2*lmax1 + mm;
+            if (!E->sphere.float_tables) {
+                C = E->sphere.ctable[m];
+                C[j] = cos( (double)(mm)*lon[k] );
+                C[j+lmax1] = sin( (double)(mm)*lon[k] );
+            }
+            else {
+                E->sphere.ctablef[m][j] = cos( (double)(mm)*lon[k] );
+                E->sphere.ctablef[m][j+lmax1] = sin( (double)(mm)*lon[k] );
+            }
+        }
+
+    free(theta);
+    free(phi);
+    free(lat);
+    free(lon);
+    if (row) free(row);
+
+    return;
+}
+
+
 static void  compute_sphereh_table(E)
      struct All_variables *E;
 {
-    double modified_plgndr_a();
-
-    int m,node,ll,mm,i,j,p;
+    int m,node,mm,i,j,es,d,nint;
     double t,f,mmf;
-    
+
 
     for(m=1;m<=E->sphere.caps_per_proc;m++)  {
+        E->sphere.tablesw[m] = (double *) malloc((E->lmesh.nsf+1)*sizeof(double));
+
+        if (E->sphere.compact_tables) {
+            compute_compact_sphereh_table(E, m);
+            continue;
+        }
+
         E->sphere.tablesplm[m]   = (double **) malloc((E->lmesh.nsf+1)*sizeof(double*));
         E->sphere.tablescosf[m] = (double **) malloc((E->lmesh.nsf+1)*sizeof(double*));
         E->sphere.tablessinf[m] = (double **) malloc((E->lmesh.nsf+1)*sizeof(double*));
@@ -212,9 +516,7 @@ static void  compute_sphereh_table(E)
             E->sphere.tablescosf[m][i]= (double *)malloc((E->output.llmax+1)*sizeof(double));
             E->sphere.tablessinf[m][i]= (double *)malloc((E->output.llmax+1)*sizeof(double));
         }
-    }
 
-    for(m=1;m<=E->sphere.caps_per_proc;m++)  {
         for (j=1;j<=E->lmesh.nsf;j++)  {
             node = j*E->lmesh.noz;
             f=E->sx[m][2][node];
@@ -225,14 +527,23 @@ static void  compute_sphereh_table(E)
                 E->sphere.tablessinf[m][j][mm] = sin( mmf );
             }
 
-            for (ll=0;ll<=E->output.llmax;ll++)
-                for (mm=0;mm<=ll;mm++)  {
-                    p = E->sphere.hindex[ll][mm];
-                    E->sphere.tablesplm[m][j][p] = modified_plgndr_a(ll,mm,t) ;
-                }
+            plgndr_row(E, t, E->sphere.tablesplm[m][j]);
         }
     }
 
+    for(m=1;m<=E->sphere.caps_per_proc;m++)  {
+        /* surface quadrature lumped onto the nodes */
+        for (j=1;j<=E->lmesh.nsf;j++)
+            E->sphere.tablesw[m][j] = 0.0;
+
+        for (es=1;es<=E->lmesh.snel;es++)
+            for(d=1;d<=onedvpoints[E->mesh.nsd];d++)   {
+                j = E->sien[m][es].node[d];
+                for(nint=1;nint<=onedvpoints[E->mesh.nsd];nint++)
+                    E->sphere.tablesw[m][j] += E->M.vpt[GMVINDEX(d,nint)]
+                        * E->surf_det[m][nint][es];
+            }
+    }
+
     return;
 }
-
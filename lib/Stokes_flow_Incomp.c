@@ -34,6 +34,7 @@
 #include <sys/types.h>
 #include "element_definitions.h"
 #include "global_defs.h"
+#include "drive_solvers.h"
 #include <stdlib.h>
 
 void myerror(struct All_variables *,char *);
@@ -97,14 +98,16 @@ static double momentum_eqn_residual(struct All_variables *E,
     double global_v_norm2();
 
     int i, m;
+    size_t mark;
     double *r1[NCS], *r2[NCS];
     double res;
     const int lev = E->mesh.levmax;
     const int neq = E->lmesh.neq;
 
+    mark = solver_workspace_mark(E);
     for(m=1; m<=E->sphere.caps_per_proc; m++) {
-        r1[m] = malloc((neq+1)*sizeof(double));
-        r2[m] = malloc((neq+1)*sizeof(double));
+        r1[m] = solver_workspace_alloc(E, neq+1);
+        r2[m] = solver_workspace_alloc(E, neq+1);
     }
 
     /* r2 = F - grad(P) - K*V */
@@ -118,10 +121,7 @@ static double momentum_eqn_residual(struct All_variables *E,
 
     res = sqrt(global_v_norm2(E, r2));
 
-    for(m=1; m<=E->sphere.caps_per_proc; m++) {
-        free(r1[m]);
-        free(r2[m]);
-    }
+    solver_workspace_release(E, mark);
     return(res);
 }
 
@@ -190,15 +190,18 @@ static void solve_Ahat_p_fhat_CG(struct All_variables *E,
                                  double imp, int *steps_max)
 {
     int m, j, count, valid, lev, npno, neq;
+    size_t mark;
 
     double *r1[NCS], *r2[NCS], *z1[NCS], *s1[NCS], *s2[NCS], *cu[NCS];
-    double *F[NCS];
+    double *F[NCS], *dv[NCS];
     double *shuffle[NCS];
     double alpha, delta, r0dotz0, r1dotz1;
     double v_res;
     double inner_imp;
+    double local[6], sum[6];
     double global_pdot();
-    double global_v_norm2(), global_p_norm2(), global_div_norm2();
+    double local_pdot(), local_v_norm2(), local_p_norm2(), local_div_norm2();
+    void global_dsum();
 
     double time0, CPU_time0();
     double v_norm, p_norm;
@@ -221,14 +224,16 @@ static void solve_Ahat_p_fhat_CG(struct All_variables *E,
     neq = E->lmesh.neq;
     lev = E->mesh.levmax;
 
+    mark = solver_workspace_mark(E);
     for (m=1; m<=E->sphere.caps_per_proc; m++)   {
-        F[m] = (double *)malloc(neq*sizeof(double));
-        r1[m] = (double *)malloc((npno+1)*sizeof(double));
-        r2[m] = (double *)malloc((npno+1)*sizeof(double));
-        z1[m] = (double *)malloc((npno+1)*sizeof(double));
-        s1[m] = (double *)malloc((npno+1)*sizeof(double));
-        s2[m] = (double *)malloc((npno+1)*sizeof(double));
-        cu[m] = (double *)malloc((npno+1)*sizeof(double));
+        F[m] = solver_workspace_alloc(E, neq);
+        r1[m] = solver_workspace_alloc(E, npno+1);
+        r2[m] = solver_workspace_alloc(E, npno+1);
+        z1[m] = solver_workspace_alloc(E, npno+1);
+        s1[m] = solver_workspace_alloc(E, npno+1);
+        s2[m] = solver_workspace_alloc(E, npno+1);
+        cu[m] = solver_workspace_alloc(E, npno+1);
+        dv[m] = solver_workspace_alloc(E, npno+1);
     }
 
     time0 = CPU_time0();
@@ -270,9 +275,21 @@ static void solve_Ahat_p_fhat_CG(struct All_variables *E,
                 r1[m][j] += cu[m][j];
             }
 
-    E->monitor.vdotv = global_v_norm2(E, V);
-    E->monitor.incompressibility = sqrt(global_div_norm2(E, r1)
+    /* preconditioner BPI ~= inv(K), z1 = BPI*r1 */
+    for(m=1; m<=E->sphere.caps_per_proc; m++)
+        for(j=1; j<=npno; j++)
+            z1[m][j] = E->BPI[lev][m][j] * r1[m][j];
+
+    /* the norms and <r1, z1> share one reduction */
+    local[0] = local_v_norm2(E, V);
+    local[1] = local_div_norm2(E, r1);
+    local[2] = local_pdot(E, r1, z1, lev);
+    global_dsum(E, local, sum, 3);
+
+    E->monitor.vdotv = sum[0] / E->mesh.volume;
+    E->monitor.incompressibility = sqrt(sum[1] / E->mesh.volume
                                         / (1e-32 + E->monitor.vdotv));
+    r1dotz1 = sum[2];
 
     v_norm = sqrt(E->monitor.vdotv);
     p_norm = sqrt(E->monitor.pdotp);
@@ -293,14 +310,8 @@ static void solve_Ahat_p_fhat_CG(struct All_variables *E,
     while( (count < *steps_max) && keep_iterating(E, imp, converging) ) {
         /* require two consecutive converging iterations to quit the while-loop */
 
-        /* preconditioner BPI ~= inv(K), z1 = BPI*r1 */
-        for(m=1; m<=E->sphere.caps_per_proc; m++)
-            for(j=1; j<=npno; j++)
-                z1[m][j] = E->BPI[lev][m][j] * r1[m][j];
-
-
-        /* r1dotz1 = <r1, z1> */
-        r1dotz1 = global_pdot(E, r1, z1, lev);
+        /* z1 = BPI*r1 and r1dotz1 = <r1, z1> were computed together
+           with the residuals of the previous iteration */
         assert(r1dotz1 != 0.0  /* Division by zero in head of incompressibility iteration */);
 
         /* update search direction */
@@ -352,23 +363,38 @@ static void solve_Ahat_p_fhat_CG(struct All_variables *E,
                 V[m][j] -= alpha * E->u1[m][j];
 
 
-        /* compute velocity and incompressibility residual */
-        E->monitor.vdotv = global_v_norm2(E, V);
-        E->monitor.pdotp = global_p_norm2(E, P);
-        v_norm = sqrt(E->monitor.vdotv);
-        p_norm = sqrt(E->monitor.pdotp);
-        dvelocity = alpha * sqrt(global_v_norm2(E, E->u1) / (1e-32 + E->monitor.vdotv));
-        dpressure = alpha * sqrt(global_p_norm2(E, s2) / (1e-32 + E->monitor.pdotp));
+        /* preconditioner for the next iteration, z1 = BPI*r2 */
+        for(m=1; m<=E->sphere.caps_per_proc; m++)
+            for(j=1; j<=npno; j++)
+                z1[m][j] = E->BPI[lev][m][j] * r2[m][j];
 
-       
 
-        assemble_div_u(E, V, z1, lev);
+        assemble_div_u(E, V, dv, lev);
         if(E->control.inv_gruneisen != 0)
             for(m=1;m<=E->sphere.caps_per_proc;m++)
                 for(j=1;j<=npno;j++) {
-                    z1[m][j] += cu[m][j];
+                    dv[m][j] += cu[m][j];
             }
-        E->monitor.incompressibility = sqrt(global_div_norm2(E, z1)
+
+
+        /* compute velocity and incompressibility residual, together
+           with <r2, z1> for the next iteration, in a single reduction */
+        local[0] = local_v_norm2(E, V);
+        local[1] = local_p_norm2(E, P);
+        local[2] = local_v_norm2(E, E->u1);
+        local[3] = local_p_norm2(E, s2);
+        local[4] = local_div_norm2(E, dv);
+        local[5] = local_pdot(E, r2, z1, lev);
+        global_dsum(E, local, sum, 6);
+
+        E->monitor.vdotv = sum[0] / E->mesh.volume;
+        E->monitor.pdotp = sum[1] / E->mesh.volume;
+        v_norm = sqrt(E->monitor.vdotv);
+        p_norm = sqrt(E->monitor.pdotp);
+        dvelocity = alpha * sqrt(sum[2] / E->mesh.volume / (1e-32 + E->monitor.vdotv));
+        dpressure = alpha * sqrt(sum[3] / E->mesh.volume / (1e-32 + E->monitor.pdotp));
+
+        E->monitor.incompressibility = sqrt(sum[4] / E->mesh.volume
                                             / (1e-32 + E->monitor.vdotv));
 
         count++;
@@ -415,6 +441,7 @@ static void solve_Ahat_p_fhat_CG(struct All_variables *E,
 
         /* shift <r0, z0> = <r1, z1> */
         r0dotz0 = r1dotz1;
+        r1dotz1 = sum[5];
 	if((E->sphere.caps == 12) && (E->control.inner_remove_rigid_rotation)){
 	  /* allow for removal of net rotation at each iterative step
 	     (expensive) */
@@ -435,15 +462,7 @@ static void solve_Ahat_p_fhat_CG(struct All_variables *E,
             }
 
 
-    for(m=1; m<=E->sphere.caps_per_proc; m++) {
-        free((void *) F[m]);
-        free((void *) r1[m]);
-        free((void *) r2[m]);
-        free((void *) z1[m]);
-        free((void *) s1[m]);
-        free((void *) s2[m]);
-        free((void *) cu[m]);
-    }
+    solver_workspace_release(E, mark);
 
     *steps_max=count;
 
@@ -472,6 +491,7 @@ static void solve_Ahat_p_fhat_BiCG(struct All_variables *E,
     int npno, neq;
     int m, j, count, lev;
     int valid;
+    size_t mark;
 
     double alpha, beta, omega,inner_imp;
     double r0dotrt, r1dotrt;
@@ -493,20 +513,21 @@ static void solve_Ahat_p_fhat_BiCG(struct All_variables *E,
     neq = E->lmesh.neq;
     lev = E->mesh.levmax;
 
+    mark = solver_workspace_mark(E);
     for (m=1; m<=E->sphere.caps_per_proc; m++)   {
-        F[m] = (double *)malloc(neq*sizeof(double));
-        r1[m] = (double *)malloc((npno+1)*sizeof(double));
-        r2[m] = (double *)malloc((npno+1)*sizeof(double));
-        pt[m] = (double *)malloc((npno+1)*sizeof(double));
-        p1[m] = (double *)malloc((npno+1)*sizeof(double));
-        p2[m] = (double *)malloc((npno+1)*sizeof(double));
-        rt[m] = (double *)malloc((npno+1)*sizeof(double));
-        v0[m] = (double *)malloc((npno+1)*sizeof(double));
-        s0[m] = (double *)malloc((npno+1)*sizeof(double));
-        st[m] = (double *)malloc((npno+1)*sizeof(double));
-        t0[m] = (double *)malloc((npno+1)*sizeof(double));
-
-        u0[m] = (double *)malloc(neq*sizeof(double));
+        F[m] = solver_workspace_alloc(E, neq);
+        r1[m] = solver_workspace_alloc(E, npno+1);
+        r2[m] = solver_workspace_alloc(E, npno+1);
+        pt[m] = solver_workspace_alloc(E, npno+1);
+        p1[m] = solver_workspace_alloc(E, npno+1);
+        p2[m] = solver_workspace_alloc(E, npno+1);
+        rt[m] = solver_workspace_alloc(E, npno+1);
+        v0[m] = solver_workspace_alloc(E, npno+1);
+        s0[m] = solver_workspace_alloc(E, npno+1);
+        st[m] = solver_workspace_alloc(E, npno+1);
+        t0[m] = solver_workspace_alloc(E, npno+1);
+
+        u0[m] = solver_workspace_alloc(E, neq);
     }
 
     time0 = CPU_time0();
@@ -728,21 +749,7 @@ static void solve_Ahat_p_fhat_BiCG(struct All_variables *E,
     } /* end loop for conjugate gradient */
 
 
-    for(m=1; m<=E->sphere.caps_per_proc; m++) {
-    	free((void *) F[m]);
-        free((void *) r1[m]);
-        free((void *) r2[m]);
-        free((void *) pt[m]);
-        free((void *) p1[m]);
-        free((void *) p2[m]);
-        free((void *) rt[m]);
-        free((void *) v0[m]);
-        free((void *) s0[m]);
-        free((void *) st[m]);
-        free((void *) t0[m]);
-
-        free((void *) u0[m]);
-    }
+    solver_workspace_release(E, mark);
 
     *steps_max=count;
 
@@ -761,6 +768,7 @@ static void solve_Ahat_p_fhat_iterCG(struct All_variables *E,
 {
     int m, i;
     int cycles, num_of_loop;
+    size_t mark;
     double relative_err_v, relative_err_p;
     double *old_v[NCS], *old_p[NCS],*diff_v[NCS],*diff_p[NCS];
     double div_res;
@@ -772,11 +780,12 @@ static void solve_Ahat_p_fhat_iterCG(struct All_variables *E,
     double global_div_norm2();
     void assemble_div_rho_u();
     
+    mark = solver_workspace_mark(E);
     for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-    	old_v[m] = (double *)malloc(neq*sizeof(double));
-    	diff_v[m] = (double *)malloc(neq*sizeof(double));
-    	old_p[m] = (double *)malloc((npno+1)*sizeof(double));
-    	diff_p[m] = (double *)malloc((npno+1)*sizeof(double));
+    	old_v[m] = solver_workspace_alloc(E, neq);
+    	diff_v[m] = solver_workspace_alloc(E, neq);
+    	old_p[m] = solver_workspace_alloc(E, npno+1);
+    	diff_p[m] = solver_workspace_alloc(E, npno+1);
     }
 
     cycles = E->control.p_iterations;
@@ -825,12 +834,7 @@ static void solve_Ahat_p_fhat_iterCG(struct All_variables *E,
 
     } /* end of while */
 
-    for (m=1;m<=E->sphere.caps_per_proc;m++)   {
-    	free((void *) old_v[m]);
-    	free((void *) old_p[m]);
-	free((void *) diff_v[m]);
-	free((void *) diff_p[m]);
-    }
+    solver_workspace_release(E, mark);
 
     return;
 }
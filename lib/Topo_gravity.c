@@ -32,6 +32,8 @@
 
 void myerror(struct All_variables *, char *);
 void sphere_expansion(struct All_variables *, float **, float *, float *);
+void sphere_expansion_layers(struct All_variables *, int, float ***, double *);
+void sum_across_all_sph(struct All_variables *, double *, int);
 void sum_across_depth_sph1(struct All_variables *, float *, float *);
 void broadcast_vertical(struct All_variables *, float *, float *, int);
 long double lg_pow(long double, int);
@@ -594,10 +596,12 @@ static void geoid_from_buoyancy(struct All_variables *E,
      * and dimensionalized (data.density). dlayer needs to be dimensionalized.
      */
 
-    int m,k,ll,mm,node,i,j,p,noz,snode,nxnz;
-    float *TT[NCS],radius,*geoid[2],dlayer,con1,grav,scaling2,scaling,radius_m;
+    int m,k,ll,mm,node,i,j,p,noz,snode,nxnz,nlayers;
+    float ***TT,radius,dlayer,con1,grav,scaling2,scaling,radius_m;
     float cont, conb;
-    double buoy2rho;
+    double buoy2rho, *sph, *geoid, *c, *s;
+
+    const int hindice = E->sphere.hindice;
 
     /* some constants */
     nxnz = E->lmesh.nox*E->lmesh.noz;
@@ -610,24 +614,23 @@ static void geoid_from_buoyancy(struct All_variables *E,
     scaling = 4.0 * M_PI * 1.0e3 * E->data.radius_km * E->data.grav_const
         / E->data.grav_acc;
 
-    /* density of one layer */
-    for(m=1;m<=E->sphere.caps_per_proc;m++)
-        TT[m] = (float *) malloc ((E->lmesh.nsf+1)*sizeof(float));
+    /* density of each layer, notice the range of layers is [1,noz) */
+    nlayers = E->lmesh.noz - 1;
+    TT = (float ***) malloc(nlayers*sizeof(float **));
+    for(k=0;k<nlayers;k++) {
+        TT[k] = (float **) malloc((E->sphere.caps_per_proc+1)*sizeof(float *));
+        for(m=1;m<=E->sphere.caps_per_proc;m++)
+            TT[k][m] = (float *) malloc ((E->lmesh.nsf+1)*sizeof(float));
+    }
 
-    /* cos coeff */
-    geoid[0] = (float*)malloc(E->sphere.hindice*sizeof(float));
-    /* sin coeff */
-    geoid[1] = (float*)malloc(E->sphere.hindice*sizeof(float));
+    /* cos and sin coeff of each layer */
+    sph = (double *) malloc(nlayers*2*hindice*sizeof(double));
 
-    /* reset arrays */
-    for (p = 0; p < E->sphere.hindice; p++) {
-        harm_geoid[0][p] = 0;
-        harm_geoid[1][p] = 0;
-        harm_geoidb[0][p] = 0;
-        harm_geoidb[1][p] = 0;
-    }
+    /* cos and sin coeff of geoid at the surface, then at the CMB */
+    geoid = (double *) malloc(4*hindice*sizeof(double));
+    for (p = 0; p < 4*hindice; p++)
+        geoid[p] = 0;
 
-    /* loop over each layer, notice the range is [1,noz) */
     for(k=1;k<E->lmesh.noz;k++)  {
         /* correction for variable gravity */
         grav = 0.5 * (E->refstate.gravity[k] + E->refstate.gravity[k+1]);
@@ -639,12 +642,17 @@ static void geoid_from_buoyancy(struct All_variables *E,
                     p = j + (i-1)*E->lmesh.nox;
                     /* convert non-dimensional buoyancy to */
                     /* dimensional density */
-                    TT[m][p] = (E->buoyancy[m][node]+E->buoyancy[m][node+1])
+                    TT[k-1][m][p] = (E->buoyancy[m][node]+E->buoyancy[m][node+1])
                         * 0.5 * buoy2rho;
                 }
+    }
 
-        /* expand TT into spherical harmonics */
-        sphere_expansion(E,TT,geoid[0],geoid[1]);
+    /* expand TT of all layers into spherical harmonics */
+    sphere_expansion_layers(E, nlayers, TT, sph);
+
+    for(k=1;k<E->lmesh.noz;k++)  {
+        c = sph + (k-1)*2*hindice;
+        s = c + hindice;
 
         /* thickness of the layer */
         dlayer = (E->sx[1][3][k+1]-E->sx[1][3][k])*radius_m;
@@ -660,27 +668,36 @@ static void geoid_from_buoyancy(struct All_variables *E,
 
             for (mm=0;mm<=ll;mm++)   {
                 p = E->sphere.hindex[ll][mm];
-                harm_geoid[0][p] += con1*cont*geoid[0][p];
-                harm_geoid[1][p] += con1*cont*geoid[1][p];
-                harm_geoidb[0][p] += con1*conb*geoid[0][p];
-                harm_geoidb[1][p] += con1*conb*geoid[1][p];
+                geoid[p]           += con1*cont*c[p];
+                geoid[hindice+p]   += con1*cont*s[p];
+                geoid[2*hindice+p] += con1*conb*c[p];
+                geoid[3*hindice+p] += con1*conb*s[p];
             }
         }
 
         //if(E->parallel.me==0)  fprintf(stderr,"layer %d %.5e %g %g %g\n",k,radius,dlayer,con1,con2);
     }
 
-    /* accumulate geoid from all layers to the surface (top processors) */
-    sum_across_depth_sph1(E, harm_geoid[0], harm_geoid[1]);
+    /* accumulate geoid from all layers and all processors, to the
+       surface and to the CMB */
+    sum_across_all_sph(E, geoid, 4*hindice);
 
-    /* accumulate geoid from all layers to the CMB (bottom processors) */
-    sum_across_depth_sph1(E, harm_geoidb[0], harm_geoidb[1]);
+    for (p = 0; p < hindice; p++) {
+        harm_geoid[0][p] = geoid[p];
+        harm_geoid[1][p] = geoid[hindice+p];
+        harm_geoidb[0][p] = geoid[2*hindice+p];
+        harm_geoidb[1][p] = geoid[3*hindice+p];
+    }
 
-    for(m=1;m<=E->sphere.caps_per_proc;m++)
-        free ((void *)TT[m]);
+    for(k=0;k<nlayers;k++) {
+        for(m=1;m<=E->sphere.caps_per_proc;m++)
+            free ((void *)TT[k][m]);
+        free ((void *)TT[k]);
+    }
+    free ((void *)TT);
 
-    free ((void *)geoid[0]);
-    free ((void *)geoid[1]);
+    free ((void *)sph);
+    free ((void *)geoid);
     return;
 }
 
@@ -696,7 +713,9 @@ static void expand_topo_sph_harm(struct All_variables *E,
 
     float scaling, stress_scaling, topo_scaling1,topo_scaling2;
     float den_contrast1, den_contrast2, grav1, grav2;
-    int i, j;
+    float **TG[2];
+    double *sph, *topo;
+    int i, j, nlayers, itop = -1, ibot = -1;
 
     stress_scaling = E->data.ref_viscosity*E->data.therm_diff/
         (E->data.radius_km*E->data.radius_km*1e6);
@@ -719,32 +738,47 @@ static void expand_topo_sph_harm(struct All_variables *E,
     scaling = 4.0 * M_PI * 1.0e3 * E->data.radius_km * E->data.grav_const
         / E->data.grav_acc;
 
+    /* the top processors expand the surface topography, the bottom
+       processors the bottom topography, in one pass */
+    nlayers = 0;
     if (E->parallel.me_loc[3] == E->parallel.nprocz-1) {
-        /* expand surface topography into sph. harm. */
-        sphere_expansion(E, E->slice.tpg, tpgt[0], tpgt[1]);
-
-        /* dimensionalize surface topography */
-        for (j=0; j<2; j++)
-            for (i=0; i<E->sphere.hindice; i++) {
-                tpgt[j][i] *= topo_scaling1;
-            }
+        TG[nlayers] = E->slice.tpg;
+        itop = nlayers++;
+    }
+    if (E->parallel.me_loc[3] == 0) {
+        TG[nlayers] = E->slice.tpgb;
+        ibot = nlayers++;
     }
 
+    sph = (double *) malloc(4*E->sphere.hindice*sizeof(double));
+    topo = (double *) malloc(4*E->sphere.hindice*sizeof(double));
+    for (i=0; i<4*E->sphere.hindice; i++)
+        topo[i] = 0;
 
-    if (E->parallel.me_loc[3] == 0) {
-        /* expand bottom topography into sph. harm. */
-        sphere_expansion(E, E->slice.tpgb, tpgb[0], tpgb[1]);
+    if (nlayers)
+        sphere_expansion_layers(E, nlayers, TG, sph);
 
-        /* dimensionalize bottom topography */
-        for (j=0; j<2; j++)
-            for (i=0; i<E->sphere.hindice; i++) {
-                tpgb[j][i] *= topo_scaling2;
-            }
-    }
+    /* dimensionalize surface and bottom topography */
+    if (itop >= 0)
+        for (i=0; i<2*E->sphere.hindice; i++)
+            topo[i] = sph[itop*2*E->sphere.hindice+i] * topo_scaling1;
 
-    /* send arrays to all processors in the same vertical column */
-    broadcast_vertical(E, tpgb[0], tpgb[1], 0);
-    broadcast_vertical(E, tpgt[0], tpgt[1], E->parallel.nprocz-1);
+    if (ibot >= 0)
+        for (i=0; i<2*E->sphere.hindice; i++)
+            topo[2*E->sphere.hindice+i] = sph[ibot*2*E->sphere.hindice+i] * topo_scaling2;
+
+    /* sum across the surface and send to all processors in the same
+       vertical column */
+    sum_across_all_sph(E, topo, 4*E->sphere.hindice);
+
+    for (j=0; j<2; j++)
+        for (i=0; i<E->sphere.hindice; i++) {
+            tpgt[j][i] = topo[j*E->sphere.hindice+i];
+            tpgb[j][i] = topo[(2+j)*E->sphere.hindice+i];
+        }
+
+    free(sph);
+    free(topo);
 
     return;
 }
@@ -40,11 +40,17 @@
 */
 
 #include <math.h>
+#include <string.h>
+#include "element_definitions.h"
 #include "global_defs.h"
 #include "parsing.h"
 #include "parallel_related.h"
 #include "composition_related.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #ifdef USE_GGRD
 #include "ggrd_handling.h"
 #endif
@@ -54,6 +60,22 @@ int open_file_zipped(char *, FILE **,struct All_variables *);
 void gzip_file(char *);
 #endif
 
+/* interpolation work lent to (and borrowed from) the vertical
+   neighbors in one call of get_tracer_velocities() */
+struct TRACER_LOAN {
+    int npartner;
+    int proc[3];
+    int nlend[3];
+    int nborrow[3];
+    int lend_start[3];
+    double *lent[3];
+    double *returned[3];
+    double *borrowed[3];
+    double *result[3];
+    int nrequest;
+    MPI_Request request[12];
+};
+
 int icheck_that_processor_shell(struct All_variables *E,
                                        int j, int nprocessor, double rad);
 void expand_later_array(struct All_variables *E, int j);
@@ -69,8 +91,27 @@ int regional_icheck_cap(struct All_variables *E, int icap,
                         double x, double y, double z, double rad);
 
 static void find_tracers(struct All_variables *E);
-static void predict_tracers(struct All_variables *E);
-static void correct_tracers(struct All_variables *E);
+static void thread_stats_setup(struct All_variables *E);
+static void merge_thread_stats(struct All_variables *E);
+static double *get_tracer_velocities(struct All_variables *E, int j);
+static int lend_tracer_work(struct All_variables *E, int j,
+                            struct TRACER_LOAN *loan);
+static void return_tracer_work(struct All_variables *E, int j,
+                               struct TRACER_LOAN *loan);
+static void report_tracer_balance(struct All_variables *E);
+static void bucket_tracers(struct All_variables *E, int j);
+static void sort_tracers(struct All_variables *E);
+static void return_block_to_pool(struct All_variables *E,
+                                 double *q, int *elem);
+static void trim_tracer_pool(struct All_variables *E);
+static int count_tracer_substeps(struct All_variables *E);
+static void predict_tracers(struct All_variables *E, double dt);
+static void correct_tracers(struct All_variables *E, double dt);
+static void runge_kutta_tracers(struct All_variables *E,
+                                double t0, double dt);
+static void begin_velocity_interpolation(struct All_variables *E);
+static void set_velocity_time(struct All_variables *E, double t);
+static void end_velocity_interpolation(struct All_variables *E);
 static void make_tracer_array(struct All_variables *E);
 static void generate_random_tracers(struct All_variables *E,
                                     int tracers_cap, int j);
@@ -206,6 +247,21 @@ void tracer_input(struct All_variables *E)
         /* Warning level */
         input_boolean("itracer_warnings",&(E->trace.itracer_warnings),"on",m);
 
+        /* re-sort the tracers by element every so many steps, 0: never */
+        input_int("tracer_sort_every",&(E->trace.sort_every),"0,0,nomax",m);
+
+        /* lend velocity interpolation to lighter vertical neighbors */
+        input_boolean("tracer_balance",&(E->trace.balance),"off",m);
+
+        /* 0: predictor-corrector, 1: fourth order Runge-Kutta */
+        input_int("tracer_integrator",&(E->trace.integrator),"0,0,1",m);
+
+        /* substeps per advection step, at least tracer_substeps and,
+           if tracer_courant > 0, enough that a tracer crosses at most
+           tracer_courant elements in one substep */
+        input_int("tracer_substeps",&(E->trace.substeps),"1,1,nomax",m);
+        input_double("tracer_courant",&(E->trace.courant),"0.0,0.0,nomax",m);
+
 
         if(E->parallel.nprocxy == 12)
             full_tracer_input(E);
@@ -224,21 +280,60 @@ void tracer_initial_settings(struct All_variables *E)
    void full_keep_within_bounds();
    void full_tracer_setup();
    void full_get_velocity();
+   void full_get_velocities();
+   void full_get_element_velocities();
    int full_iget_element();
    void regional_keep_within_bounds();
    void regional_tracer_setup();
    void regional_get_velocity();
+   void regional_get_velocities();
+   void regional_get_element_velocities();
    int regional_iget_element();
+   int i;
 
    E->trace.advection_time = 0;
    E->trace.find_tracers_time = 0;
    E->trace.lost_souls_time = 0;
+   E->trace.sort_time = 0;
+
+   E->trace.npool = 0;
+   E->trace.maxpool = 0;
+   E->trace.pool_q = NULL;
+   E->trace.pool_elem = NULL;
+
+   E->trace.nthread_stat = 0;
+   E->trace.thread_stat = NULL;
+   thread_stats_setup(E);
+
+   E->trace.nvel_work = 0;
+   E->trace.elem_start = NULL;
+   E->trace.elem_tracers = NULL;
+   E->trace.tracer_vel = NULL;
+
+   E->trace.ninterp = 0;
+   E->trace.nlent = 0;
+   E->trace.nborrowed = 0;
+
+   for (i=0; i<13; i++)
+       E->trace.vcart[i] = NULL;
+   E->trace.vcart_stamp = -1;
+
+   E->trace.nsubsteps = 1;
+   for (i=0; i<13; i++) {
+       E->trace.vcart_now[i] = NULL;
+       E->trace.vcart_old[i] = NULL;
+   }
+   E->trace.vnow_stamp = -1;
+   E->trace.vold_dt = 0;
+   E->trace.last_dt = 0;
 
    if(E->parallel.nprocxy == 1) {
        E->problem_tracer_setup = regional_tracer_setup;
 
        E->trace.keep_within_bounds = regional_keep_within_bounds;
        E->trace.get_velocity = regional_get_velocity;
+       E->trace.get_velocities = regional_get_velocities;
+       E->trace.get_element_velocities = regional_get_element_velocities;
        E->trace.iget_element = regional_iget_element;
    }
    else {
@@ -246,6 +341,8 @@ void tracer_initial_settings(struct All_variables *E)
 
        E->trace.keep_within_bounds = full_keep_within_bounds;
        E->trace.get_velocity = full_get_velocity;
+       E->trace.get_velocities = full_get_velocities;
+       E->trace.get_element_velocities = full_get_element_velocities;
        E->trace.iget_element = full_iget_element;
    }
 }
@@ -262,10 +359,33 @@ void tracer_advection(struct All_variables *E)
 {
     double CPU_time0();
     double begin_time = CPU_time0();
+    double dt;
+    int i, nsub;
+
+    /* restore the spatial order of the tracers */
+    if (E->trace.sort_every > 0 &&
+        (E->monitor.solution_cycles % E->trace.sort_every) == 0)
+        sort_tracers(E);
 
     /* advect tracers */
-    predict_tracers(E);
-    correct_tracers(E);
+    nsub = count_tracer_substeps(E);
+    dt = E->advection.timestep/nsub;
+
+    if (E->trace.integrator == 1) {
+        begin_velocity_interpolation(E);
+        for (i=0; i<nsub; i++)
+            runge_kutta_tracers(E, i*dt, dt);
+        end_velocity_interpolation(E);
+    }
+    else {
+        for (i=0; i<nsub; i++) {
+            predict_tracers(E, dt);
+            correct_tracers(E, dt);
+        }
+    }
+
+    E->trace.nsubsteps = nsub;
+    E->trace.last_dt = E->advection.timestep;
 
     /* check that the number of tracers is conserved */
     check_sum(E);
@@ -294,22 +414,34 @@ void tracer_post_processing(struct All_variables *E)
 {
     int i;
 
+    merge_thread_stats(E);
+
     /* reset statistical counters */
 
     E->trace.istat_isend=0;
     E->trace.istat_elements_checked=0;
     E->trace.istat1=0;
 
+    /* report the tracer load at every output step */
+    if ((E->monitor.solution_cycles % E->control.record_every) == 0)
+        report_tracer_balance(E);
+
     /* write timing information every 20 steps */
     if ((E->monitor.solution_cycles % 20) == 0) {
         fprintf(E->trace.fpt, "STEP %d\n", E->monitor.solution_cycles);
 
+        fprintf(E->trace.fpt, "Sorting tracers takes %f seconds.\n",
+                E->trace.sort_time);
         fprintf(E->trace.fpt, "Advecting tracers takes %f seconds.\n",
-                E->trace.advection_time - E->trace.find_tracers_time);
+                E->trace.advection_time - E->trace.find_tracers_time
+                - E->trace.sort_time);
         fprintf(E->trace.fpt, "Finding element takes %f seconds.\n",
                 E->trace.find_tracers_time - E->trace.lost_souls_time);
         fprintf(E->trace.fpt, "Exchanging lost tracers takes %f seconds.\n",
                 E->trace.lost_souls_time);
+        if (E->trace.courant > 0.0)
+            fprintf(E->trace.fpt, "Last step took %d substeps.\n",
+                    E->trace.nsubsteps);
     }
 
     if(E->control.verbose){
@@ -351,6 +483,60 @@ void tracer_post_processing(struct All_variables *E)
 }
 
 
+/********* REPORT TRACER BALANCE *****************************************/
+/*                                                                       */
+/* The tracer work of a processor scales with its number of tracers.     */
+/* This function writes the smallest, mean and largest tracer count of   */
+/* the processors and the imbalance (largest over mean) to the log. With */
+/* tracer_balance on, it also gives the largest number of tracers that a */
+/* processor interpolated after lending and borrowing.                   */
+
+static void report_tracer_balance(struct All_variables *E)
+{
+    int j;
+    int imycount, imin, isum, imaxinterp;
+    struct { int n; int rank; } mine, imax;
+    double mean;
+
+    imycount = 0;
+    for (j=1; j<=E->sphere.caps_per_proc; j++)
+        imycount = imycount + E->trace.ntracers[j];
+
+    mine.n = imycount;
+    mine.rank = E->parallel.me;
+
+    MPI_Allreduce(&imycount,&imin,1,MPI_INT,MPI_MIN,E->parallel.world);
+    MPI_Allreduce(&imycount,&isum,1,MPI_INT,MPI_SUM,E->parallel.world);
+    MPI_Allreduce(&mine,&imax,1,MPI_2INT,MPI_MAXLOC,E->parallel.world);
+
+    mean = (double)isum/E->parallel.nproc;
+    if (mean <= 0) mean = 1;
+
+    if (E->trace.balance)
+        MPI_Allreduce(&E->trace.ninterp,&imaxinterp,1,MPI_INT,MPI_MAX,
+                      E->parallel.world);
+
+    fprintf(E->trace.fpt,"Number of tracers: %d",imycount);
+    if (E->trace.balance)
+        fprintf(E->trace.fpt," (lent %d, borrowed %d)",
+                E->trace.nlent,E->trace.nborrowed);
+    fprintf(E->trace.fpt,"\n");
+
+    if (E->parallel.me==0) {
+        fprintf(E->fp,"tracer_balance: %e min %d mean %.1f max %d (proc %d) imbalance %.3f",
+                E->monitor.elapsed_time,imin,mean,imax.n,imax.rank,
+                imax.n/mean);
+        if (E->trace.balance)
+            fprintf(E->fp," interpolated max %d imbalance %.3f",
+                    imaxinterp,imaxinterp/mean);
+        fprintf(E->fp,"\n");
+        fflush(E->fp);
+    }
+
+    return;
+}
+
+
 /*********** PREDICT TRACERS **********************************************/
 /*                                                                        */
 /* This function predicts tracers performing an euler step                */
@@ -363,42 +549,44 @@ void tracer_post_processing(struct All_variables *E)
 /*                                                                        */
 
 
-static void predict_tracers(struct All_variables *E)
+static void predict_tracers(struct All_variables *E, double dt)
 {
 
     int numtracers;
     int j;
     int kk;
-    int nelem;
 
-    double dt;
-    double theta0,phi0,rad0;
     double x0,y0,z0;
     double theta_pred,phi_pred,rad_pred;
     double x_pred,y_pred,z_pred;
     double velocity_vector[4];
+    double *q;
+    double *vel;
 
     void cart_to_sphere();
 
 
-    dt=E->advection.timestep;
-
-
     for (j=1;j<=E->sphere.caps_per_proc;j++) {
 
         numtracers=E->trace.ntracers[j];
 
+        vel=get_tracer_velocities(E,j);
+
+        /* tracers are independent of each other */
+#ifdef _OPENMP
+#pragma omp parallel for private(kk,q,x0,y0,z0,theta_pred,phi_pred,rad_pred,x_pred,y_pred,z_pred,velocity_vector) schedule(static) if(E->control.omp_threads)
+#endif
         for (kk=1;kk<=numtracers;kk++) {
 
-            theta0=E->trace.basicq[j][0][kk];
-            phi0=E->trace.basicq[j][1][kk];
-            rad0=E->trace.basicq[j][2][kk];
-            x0=E->trace.basicq[j][3][kk];
-            y0=E->trace.basicq[j][4][kk];
-            z0=E->trace.basicq[j][5][kk];
+            q=tracer_basicq(E,j,kk);
 
-            nelem=E->trace.ielement[j][kk];
-            (E->trace.get_velocity)(E,j,nelem,theta0,phi0,rad0,velocity_vector);
+            x0=q[3];
+            y0=q[4];
+            z0=q[5];
+
+            velocity_vector[1]=vel[3*kk];
+            velocity_vector[2]=vel[3*kk+1];
+            velocity_vector[3]=vel[3*kk+2];
 
             x_pred=x0+velocity_vector[1]*dt;
             y_pred=y0+velocity_vector[2]*dt;
@@ -412,24 +600,24 @@ static void predict_tracers(struct All_variables *E)
 
             /* Current Coordinates are always kept in positions 0-5. */
 
-            E->trace.basicq[j][0][kk]=theta_pred;
-            E->trace.basicq[j][1][kk]=phi_pred;
-            E->trace.basicq[j][2][kk]=rad_pred;
-            E->trace.basicq[j][3][kk]=x_pred;
-            E->trace.basicq[j][4][kk]=y_pred;
-            E->trace.basicq[j][5][kk]=z_pred;
+            q[0]=theta_pred;
+            q[1]=phi_pred;
+            q[2]=rad_pred;
+            q[3]=x_pred;
+            q[4]=y_pred;
+            q[5]=z_pred;
 
             /* Fill in original coords (positions 6-8) */
 
-            E->trace.basicq[j][6][kk]=x0;
-            E->trace.basicq[j][7][kk]=y0;
-            E->trace.basicq[j][8][kk]=z0;
+            q[6]=x0;
+            q[7]=y0;
+            q[8]=z0;
 
             /* Fill in original velocities (positions 9-11) */
 
-            E->trace.basicq[j][9][kk]=velocity_vector[1];  /* Vx */
-            E->trace.basicq[j][10][kk]=velocity_vector[2];  /* Vy */
-            E->trace.basicq[j][11][kk]=velocity_vector[3];  /* Vz */
+            q[9]=velocity_vector[1];  /* Vx */
+            q[10]=velocity_vector[2];  /* Vy */
+            q[11]=velocity_vector[3];  /* Vz */
 
 
         } /* end kk, predicting tracers */
@@ -457,55 +645,47 @@ static void predict_tracers(struct All_variables *E)
 /*                                                                        */
 
 
-static void correct_tracers(struct All_variables *E)
+static void correct_tracers(struct All_variables *E, double dt)
 {
 
     int j;
     int kk;
-    int nelem;
 
 
-    double dt;
     double x0,y0,z0;
-    double theta_pred,phi_pred,rad_pred;
-    double x_pred,y_pred,z_pred;
     double theta_cor,phi_cor,rad_cor;
     double x_cor,y_cor,z_cor;
-    double velocity_vector[4];
     double Vx0,Vy0,Vz0;
     double Vx_pred,Vy_pred,Vz_pred;
+    double *q;
+    double *vel;
 
     void cart_to_sphere();
 
 
-    dt=E->advection.timestep;
-
-
     for (j=1;j<=E->sphere.caps_per_proc;j++) {
-        for (kk=1;kk<=E->trace.ntracers[j];kk++) {
 
-            theta_pred=E->trace.basicq[j][0][kk];
-            phi_pred=E->trace.basicq[j][1][kk];
-            rad_pred=E->trace.basicq[j][2][kk];
-            x_pred=E->trace.basicq[j][3][kk];
-            y_pred=E->trace.basicq[j][4][kk];
-            z_pred=E->trace.basicq[j][5][kk];
+        vel=get_tracer_velocities(E,j);
 
-            x0=E->trace.basicq[j][6][kk];
-            y0=E->trace.basicq[j][7][kk];
-            z0=E->trace.basicq[j][8][kk];
+#ifdef _OPENMP
+#pragma omp parallel for private(kk,q,x0,y0,z0,Vx0,Vy0,Vz0,Vx_pred,Vy_pred,Vz_pred,theta_cor,phi_cor,rad_cor,x_cor,y_cor,z_cor) schedule(static) if(E->control.omp_threads)
+#endif
+        for (kk=1;kk<=E->trace.ntracers[j];kk++) {
 
-            Vx0=E->trace.basicq[j][9][kk];
-            Vy0=E->trace.basicq[j][10][kk];
-            Vz0=E->trace.basicq[j][11][kk];
+            q=tracer_basicq(E,j,kk);
 
-            nelem=E->trace.ielement[j][kk];
+            x0=q[6];
+            y0=q[7];
+            z0=q[8];
 
-            (E->trace.get_velocity)(E,j,nelem,theta_pred,phi_pred,rad_pred,velocity_vector);
+            Vx0=q[9];
+            Vy0=q[10];
+            Vz0=q[11];
 
-            Vx_pred=velocity_vector[1];
-            Vy_pred=velocity_vector[2];
-            Vz_pred=velocity_vector[3];
+            /* velocity at the predicted position */
+            Vx_pred=vel[3*kk];
+            Vy_pred=vel[3*kk+1];
+            Vz_pred=vel[3*kk+2];
 
             x_cor=x0 + dt * 0.5*(Vx0+Vx_pred);
             y_cor=y0 + dt * 0.5*(Vy0+Vy_pred);
@@ -516,12 +696,12 @@ static void correct_tracers(struct All_variables *E)
 
             /* Fill in Current Positions (other positions are no longer important) */
 
-            E->trace.basicq[j][0][kk]=theta_cor;
-            E->trace.basicq[j][1][kk]=phi_cor;
-            E->trace.basicq[j][2][kk]=rad_cor;
-            E->trace.basicq[j][3][kk]=x_cor;
-            E->trace.basicq[j][4][kk]=y_cor;
-            E->trace.basicq[j][5][kk]=z_cor;
+            q[0]=theta_cor;
+            q[1]=phi_cor;
+            q[2]=rad_cor;
+            q[3]=x_cor;
+            q[4]=y_cor;
+            q[5]=z_cor;
 
         } /* end kk, correcting tracers */
     } /* end caps */
@@ -534,6 +714,729 @@ static void correct_tracers(struct All_variables *E)
 }
 
 
+/*********** COUNT TRACER SUBSTEPS ****************************************/
+/*                                                                        */
+/* This function returns the number of substeps of this advection step.   */
+/* With tracer_courant > 0, the element Courant number of std_timestep()  */
+/* (velocity over element size, summed over the directions) is taken at   */
+/* the element centers; the step is cut so that dt times its global       */
+/* maximum is at most tracer_courant in each substep.                     */
+
+static int count_tracer_substeps(struct All_variables *E)
+{
+    int m, el, i, nsub;
+    float VV[4][9];
+    double uc1, uc2, uc3, uc, ucmax;
+
+    const int sphere_key = 1;
+
+    if (E->trace.courant <= 0.0)
+        return E->trace.substeps;
+
+    ucmax = 0.0;
+    for (m=1;m<=E->sphere.caps_per_proc;m++)
+        for (el=1;el<=E->lmesh.nel;el++) {
+
+            velo_from_element(E,VV,m,el,sphere_key);
+
+            uc1 = uc2 = uc3 = 0.0;
+            for (i=1;i<=ENODES3D;i++) {
+                uc1 += E->N.ppt[GNPINDEX(i,1)]*VV[1][i];
+                uc2 += E->N.ppt[GNPINDEX(i,1)]*VV[2][i];
+                uc3 += E->N.ppt[GNPINDEX(i,1)]*VV[3][i];
+            }
+            uc = fabs(uc1)/E->eco[m][el].size[1]
+                + fabs(uc2)/E->eco[m][el].size[2]
+                + fabs(uc3)/E->eco[m][el].size[3];
+
+            ucmax = max(ucmax, uc);
+        }
+
+    ucmax = global_dmax(E, ucmax);
+
+    nsub = (int) ceil(E->advection.timestep*ucmax/E->trace.courant);
+
+    return max(nsub, E->trace.substeps);
+}
+
+
+/*********** RUNGE KUTTA TRACERS ******************************************/
+/*                                                                        */
+/* This function advances the tracers from time t0 to t0+dt of the        */
+/* current step with the classical fourth order Runge-Kutta scheme.       */
+/* Each stage interpolates the velocity at the stage position and time    */
+/* and locates the tracers at the next stage position, so that tracers    */
+/* may change elements and processors between the stages.                 */
+/*                                                                        */
+/* Note positions used in tracer array                                    */
+/* [positions 0-5 are always fixed with current coordinates               */
+/*  Positions 6-8 contain original Cartesian coordinates.                 */
+/*  Positions 9-11 contain the weighted sum of the stage velocities.      */
+/*                                                                        */
+
+static void runge_kutta_tracers(struct All_variables *E,
+                                double t0, double dt)
+{
+    /* stage times and weights */
+    static const double c[4] = {0.0, 0.5, 0.5, 1.0};
+    static const double b[4] = {1.0, 2.0, 2.0, 1.0};
+
+    int j, kk, s, d;
+    double x[3], theta, phi, rad;
+    double *q;
+    double *vel;
+
+    void cart_to_sphere();
+
+    for (s=0; s<4; s++) {
+
+        set_velocity_time(E, t0 + c[s]*dt);
+
+        for (j=1;j<=E->sphere.caps_per_proc;j++) {
+
+            vel=get_tracer_velocities(E,j);
+
+#ifdef _OPENMP
+#pragma omp parallel for private(kk,d,q,x,theta,phi,rad) schedule(static) if(E->control.omp_threads)
+#endif
+            for (kk=1;kk<=E->trace.ntracers[j];kk++) {
+
+                q=tracer_basicq(E,j,kk);
+
+                if (s == 0)
+                    for (d=0; d<3; d++) {
+                        q[6+d] = q[3+d];
+                        q[9+d] = 0.0;
+                    }
+
+                /* position of the next stage, or the final one */
+                for (d=0; d<3; d++) {
+                    q[9+d] += b[s]*vel[3*kk+d];
+                    if (s < 3)
+                        x[d] = q[6+d] + c[s+1]*dt*vel[3*kk+d];
+                    else
+                        x[d] = q[6+d] + dt/6.0*q[9+d];
+                }
+
+                cart_to_sphere(E,x[0],x[1],x[2],&theta,&phi,&rad);
+                (E->trace.keep_within_bounds)(E,&x[0],&x[1],&x[2],&theta,&phi,&rad);
+
+                q[0]=theta;
+                q[1]=phi;
+                q[2]=rad;
+                q[3]=x[0];
+                q[4]=x[1];
+                q[5]=x[2];
+            }
+        }
+
+        /* find new tracer elements and caps */
+        find_tracers(E);
+    }
+
+    return;
+}
+
+
+/*********** VELOCITY INTERPOLATION IN TIME *******************************/
+/*                                                                        */
+/* The tracers are advected before the Stokes solution of the new step,   */
+/* which depends on them, so the velocity at the end of the step is not   */
+/* known yet. The Runge-Kutta stages take the velocity that is linear in  */
+/* time through the last two Stokes solutions, i.e. the one of the        */
+/* previous step extrapolated over this step. The nodal velocity cache    */
+/* E->trace.vcart is set to this field at the stage time t (counted from  */
+/* the beginning of the step) and restored when the step is done. On the  */
+/* first step, and after a restart, only one solution is known and the    */
+/* velocity is frozen as in the predictor-corrector scheme.               */
+
+static void begin_velocity_interpolation(struct All_variables *E)
+{
+    int j;
+    double *tmp;
+    const int n = 3*(E->lmesh.nno+1);
+
+    update_tracer_velocity_cache(E);
+
+    /* a new solution since the last step? */
+    if (E->trace.vnow_stamp == E->trace.vcart_stamp) {
+        E->trace.vold_dt = 0;
+        return;
+    }
+
+    for (j=1;j<=E->sphere.caps_per_proc;j++) {
+        if (E->trace.vcart_now[j] == NULL) {
+            if ((E->trace.vcart_now[j]=(double *)malloc(n*sizeof(double)))==NULL ||
+                (E->trace.vcart_old[j]=(double *)malloc(n*sizeof(double)))==NULL) {
+                fprintf(E->trace.fpt,"ERROR(begin_velocity_interpolation)-no memory\n");
+                fflush(E->trace.fpt);
+                exit(10);
+            }
+        }
+
+        tmp = E->trace.vcart_old[j];
+        E->trace.vcart_old[j] = E->trace.vcart_now[j];
+        E->trace.vcart_now[j] = tmp;
+        memcpy(E->trace.vcart_now[j], E->trace.vcart[j], n*sizeof(double));
+    }
+
+    E->trace.vold_dt = (E->trace.vnow_stamp >= 0) ? E->trace.last_dt : 0;
+    E->trace.vnow_stamp = E->trace.vcart_stamp;
+
+    return;
+}
+
+
+static void set_velocity_time(struct All_variables *E, double t)
+{
+    int j, i;
+    double w, *vc, *vnow, *vold;
+    const int n = 3*(E->lmesh.nno+1);
+
+    if (E->trace.vold_dt <= 0) return;
+
+    w = t/E->trace.vold_dt;
+
+    for (j=1;j<=E->sphere.caps_per_proc;j++) {
+        vc = E->trace.vcart[j];
+        vnow = E->trace.vcart_now[j];
+        vold = E->trace.vcart_old[j];
+
+#ifdef _OPENMP
+#pragma omp parallel for private(i) schedule(static) if(E->control.omp_threads)
+#endif
+        for (i=3;i<n;i++)
+            vc[i] = vnow[i] + w*(vnow[i] - vold[i]);
+    }
+
+    return;
+}
+
+
+static void end_velocity_interpolation(struct All_variables *E)
+{
+    int j;
+    const int n = 3*(E->lmesh.nno+1);
+
+    if (E->trace.vold_dt <= 0) return;
+
+    for (j=1;j<=E->sphere.caps_per_proc;j++)
+        memcpy(E->trace.vcart[j], E->trace.vcart_now[j], n*sizeof(double));
+
+    return;
+}
+
+
+/*********** BUCKET TRACERS ***********************************/
+/*                                                             */
+/* This function sorts the tracers of cap j by element with a  */
+/* counting sort. Afterwards, the tracers in element e are     */
+/* elem_tracers[elem_start[e]] to elem_tracers[elem_start[e+1]-1], */
+/* in increasing order. The work arrays are kept from call to  */
+/* call, and grown with the tracer store.                      */
+
+static void bucket_tracers(struct All_variables *E, int j)
+{
+    int e, kk;
+    int *start, *list;
+
+    const int nel = E->lmesh.nel;
+    const int numtracers = E->trace.ntracers[j];
+
+    if (E->trace.elem_start == NULL)
+        E->trace.elem_start = (int *)malloc((nel+2)*sizeof(int));
+
+    if (E->trace.nvel_work < numtracers+1) {
+        E->trace.nvel_work = E->trace.max_ntracers[j];
+        if (E->trace.nvel_work < numtracers+1)
+            E->trace.nvel_work = numtracers+1;
+        free(E->trace.elem_tracers);
+        free(E->trace.tracer_vel);
+        E->trace.elem_tracers = (int *)malloc(E->trace.nvel_work*sizeof(int));
+        E->trace.tracer_vel = (double *)malloc(3*E->trace.nvel_work*sizeof(double));
+    }
+
+    if (E->trace.elem_start == NULL || E->trace.elem_tracers == NULL ||
+        E->trace.tracer_vel == NULL) {
+        fprintf(E->trace.fpt,"ERROR(bucket_tracers)-no memory\n");
+        fflush(E->trace.fpt);
+        exit(10);
+    }
+
+    start = E->trace.elem_start;
+    list = E->trace.elem_tracers;
+
+    for (e=0;e<=nel+1;e++) start[e]=0;
+    for (kk=1;kk<=numtracers;kk++) start[tracer_element(E,j,kk)]++;
+    for (e=1;e<=nel+1;e++) start[e]+=start[e-1];
+    for (kk=numtracers;kk>=1;kk--) list[--start[tracer_element(E,j,kk)]]=kk;
+
+    return;
+}
+
+
+/*********** GET TRACER VELOCITIES *****************************/
+/*                                                             */
+/* This function interpolates the velocity of every tracer of  */
+/* cap j at its current position. The tracers are bucketed by  */
+/* element, so that get_velocities() loads the velocity of an  */
+/* element once for all the tracers in it. The velocity of     */
+/* tracer kk is returned in vel[3*kk], vel[3*kk+1] and         */
+/* vel[3*kk+2] (Cartesian).                                    */
+
+static double *get_tracer_velocities(struct All_variables *E, int j)
+{
+    int e, kk, b, bend, nb, t;
+    int nown;
+    int *start, *list;
+    double *q, *vel;
+    double theta[TRACER_BATCH], phi[TRACER_BATCH], rad[TRACER_BATCH];
+    double vx[TRACER_BATCH], vy[TRACER_BATCH], vz[TRACER_BATCH];
+    struct TRACER_LOAN loan;
+
+    const int nel = E->lmesh.nel;
+
+    update_tracer_velocity_cache(E);
+    bucket_tracers(E,j);
+
+    start = E->trace.elem_start;
+    list = E->trace.elem_tracers;
+    vel = E->trace.tracer_vel;
+
+    /* the tracers from position nown of the element order are lent */
+    nown = E->trace.ntracers[j];
+    if (E->trace.balance)
+        nown = lend_tracer_work(E,j,&loan);
+
+#ifdef _OPENMP
+#pragma omp parallel for private(e,b,bend,nb,t,kk,q,theta,phi,rad,vx,vy,vz) schedule(dynamic,64) if(E->control.omp_threads)
+#endif
+    for (e=1;e<=nel;e++) {
+        bend=min(start[e+1],nown);
+        for (b=start[e];b<bend;b+=TRACER_BATCH) {
+
+            nb=min(TRACER_BATCH,bend-b);
+
+            for (t=0;t<nb;t++) {
+                q=tracer_basicq(E,j,list[b+t]);
+                theta[t]=q[0];
+                phi[t]=q[1];
+                rad[t]=q[2];
+            }
+
+            (E->trace.get_velocities)(E,j,e,nb,theta,phi,rad,vx,vy,vz);
+
+            for (t=0;t<nb;t++) {
+                kk=list[b+t];
+                vel[3*kk]=vx[t];
+                vel[3*kk+1]=vy[t];
+                vel[3*kk+2]=vz[t];
+            }
+        }
+    }
+
+    if (E->trace.balance)
+        return_tracer_work(E,j,&loan);
+
+    return vel;
+}
+
+
+/*********** LEND TRACER WORK *********************************/
+/*                                                             */
+/* With tracer_balance on, a processor holding many more       */
+/* tracers than the one above or below it lends part of its    */
+/* velocity interpolation to that processor. The two share the */
+/* lateral element columns, so the borrower only needs the     */
+/* radii and the nodal velocities of the lent elements, which  */
+/* are sent along with the tracer coordinates. The domain      */
+/* decomposition is not changed. The velocities are those the  */
+/* lender would compute, up to round-off: the lateral node     */
+/* coordinates of two shells may differ in the last bit.       */
+/*                                                             */
+/* A processor lends a third of the difference to each lighter */
+/* neighbor, so it never ends up with less work than they do.  */
+/* Both sides compute the loans from the exchanged counts. The */
+/* lent tracers are the last ones of the element order, and    */
+/* are sent as one group per element:                          */
+/*   column, ntracers, 2 radii, 24 nodal velocities,           */
+/*   theta[ntracers], phi[ntracers], rad[ntracers]             */
+/* The borrowed work is done right away, before the own work,  */
+/* so the lenders can collect the results as soon as possible. */
+/* Returns the number of tracers to interpolate here.          */
+
+#define LOAN_HEADER 28
+
+static int lend_tracer_work(struct All_variables *E, int j,
+                            struct TRACER_LOAN *loan)
+{
+    int p, k, d, a, e, kk, pos, end, nt, ng, count, nown;
+    int ncount[3];
+    int *start, *list;
+    double **group;
+    double *h, *q;
+    double VV[4][9];
+    MPI_Status status;
+
+    const int elz = E->lmesh.elz;
+    const int numtracers = E->trace.ntracers[j];
+    const int threshold = 3*TRACER_BATCH;
+
+    start = E->trace.elem_start;
+    list = E->trace.elem_tracers;
+
+    /* the processors are numbered z first (see also */
+    /* icheck_that_processor_shell())                */
+    loan->npartner = 0;
+    if (E->parallel.me_loc[3] > 0)
+        loan->proc[++loan->npartner] = E->parallel.me - 1;
+    if (E->parallel.me_loc[3] < E->parallel.nprocz-1)
+        loan->proc[++loan->npartner] = E->parallel.me + 1;
+
+    loan->nrequest = 0;
+
+    /* exchange the tracer counts with the vertical neighbors */
+
+    for (p=1;p<=loan->npartner;p++) {
+        MPI_Isend(&E->trace.ntracers[j],1,MPI_INT,loan->proc[p],
+                  61,E->parallel.world,&loan->request[loan->nrequest++]);
+        MPI_Irecv(&ncount[p],1,MPI_INT,loan->proc[p],
+                  61,E->parallel.world,&loan->request[loan->nrequest++]);
+    }
+    MPI_Waitall(loan->nrequest,loan->request,MPI_STATUSES_IGNORE);
+    loan->nrequest = 0;
+
+    nown = numtracers;
+    for (p=1;p<=loan->npartner;p++) {
+        loan->nlend[p] = 0;
+        loan->nborrow[p] = 0;
+        if (numtracers-ncount[p] >= threshold)
+            loan->nlend[p] = (numtracers-ncount[p])/3;
+        if (ncount[p]-numtracers >= threshold)
+            loan->nborrow[p] = (ncount[p]-numtracers)/3;
+        nown -= loan->nlend[p];
+    }
+
+    /* pack and send the lent tracers, one group per element */
+
+    pos = nown;
+    for (p=1;p<=loan->npartner;p++) {
+        loan->lend_start[p] = pos;
+        loan->lent[p] = NULL;
+        loan->returned[p] = NULL;
+        if (loan->nlend[p] == 0) continue;
+
+        end = pos + loan->nlend[p];
+        loan->lent[p] = (double *)malloc((LOAN_HEADER+3)*loan->nlend[p]*sizeof(double));
+        loan->returned[p] = (double *)malloc(3*loan->nlend[p]*sizeof(double));
+        if (loan->lent[p] == NULL || loan->returned[p] == NULL) {
+            fprintf(E->trace.fpt,"ERROR(lend_tracer_work)-no memory\n");
+            fflush(E->trace.fpt);
+            exit(10);
+        }
+
+        h = loan->lent[p];
+        while (pos < end) {
+            e = tracer_element(E,j,list[pos]);
+            nt = min(start[e+1],end) - pos;
+
+            tracer_velo_from_element(E,VV,j,e);
+            h[0] = (e-1)/elz;
+            h[1] = nt;
+            tracer_element_radii(E,j,e,&h[2]);
+            for (d=1;d<=3;d++)
+                for (a=1;a<=8;a++)
+                    h[4+8*(d-1)+a-1] = VV[d][a];
+
+            for (k=0;k<nt;k++) {
+                q = tracer_basicq(E,j,list[pos+k]);
+                h[LOAN_HEADER+k] = q[0];
+                h[LOAN_HEADER+nt+k] = q[1];
+                h[LOAN_HEADER+2*nt+k] = q[2];
+            }
+
+            h += LOAN_HEADER + 3*nt;
+            pos += nt;
+        }
+
+        MPI_Isend(loan->lent[p],h-loan->lent[p],MPI_DOUBLE,loan->proc[p],
+                  62,E->parallel.world,&loan->request[loan->nrequest++]);
+        MPI_Irecv(loan->returned[p],3*loan->nlend[p],MPI_DOUBLE,loan->proc[p],
+                  63,E->parallel.world,&loan->request[loan->nrequest++]);
+    }
+
+    /* receive the borrowed tracers, interpolate and send back */
+
+    for (p=1;p<=loan->npartner;p++) {
+        loan->borrowed[p] = NULL;
+        loan->result[p] = NULL;
+        if (loan->nborrow[p] == 0) continue;
+
+        MPI_Probe(loan->proc[p],62,E->parallel.world,&status);
+        MPI_Get_count(&status,MPI_DOUBLE,&count);
+
+        loan->borrowed[p] = (double *)malloc(count*sizeof(double));
+        loan->result[p] = (double *)malloc(3*loan->nborrow[p]*sizeof(double));
+        group = (double **)malloc(loan->nborrow[p]*sizeof(double *));
+        if (loan->borrowed[p] == NULL || loan->result[p] == NULL ||
+            group == NULL) {
+            fprintf(E->trace.fpt,"ERROR(lend_tracer_work)-no memory\n");
+            fflush(E->trace.fpt);
+            exit(10);
+        }
+
+        MPI_Recv(loan->borrowed[p],count,MPI_DOUBLE,loan->proc[p],
+                 62,E->parallel.world,&status);
+
+        /* index the groups, the results follow the same layout */
+        ng = 0;
+        for (h=loan->borrowed[p]; h<loan->borrowed[p]+count;
+             h+=LOAN_HEADER+3*(int)h[1])
+            group[ng++] = h;
+
+#ifdef _OPENMP
+#pragma omp parallel for private(k,kk,nt,h,d,a,VV) schedule(dynamic,16) if(E->control.omp_threads)
+#endif
+        for (k=0;k<ng;k++) {
+            double *res;
+
+            h = group[k];
+            nt = h[1];
+            for (d=1;d<=3;d++)
+                for (a=1;a<=8;a++)
+                    VV[d][a] = h[4+8*(d-1)+a-1];
+
+            /* position of the group in the results */
+            kk = (h - loan->borrowed[p] - LOAN_HEADER*k) / 3;
+            res = loan->result[p] + 3*kk;
+
+            (E->trace.get_element_velocities)(E,j,(int)h[0]*elz+1,&h[2],VV,nt,
+                                              &h[LOAN_HEADER],
+                                              &h[LOAN_HEADER+nt],
+                                              &h[LOAN_HEADER+2*nt],
+                                              res,res+nt,res+2*nt);
+        }
+        free(group);
+
+        MPI_Isend(loan->result[p],3*loan->nborrow[p],MPI_DOUBLE,loan->proc[p],
+                  63,E->parallel.world,&loan->request[loan->nrequest++]);
+    }
+
+    E->trace.nlent = numtracers - nown;
+    E->trace.nborrowed = 0;
+    for (p=1;p<=loan->npartner;p++)
+        E->trace.nborrowed += loan->nborrow[p];
+    E->trace.ninterp = nown + E->trace.nborrowed;
+
+    return nown;
+}
+
+
+/* Waits for the results of the lent work and stores them in   */
+/* tracer_vel, and frees the buffers of lend_tracer_work().    */
+
+static void return_tracer_work(struct All_variables *E, int j,
+                               struct TRACER_LOAN *loan)
+{
+    int p, k, e, pos, end, nt;
+    int *start, *list;
+    double *r, *vel;
+
+    start = E->trace.elem_start;
+    list = E->trace.elem_tracers;
+    vel = E->trace.tracer_vel;
+
+    MPI_Waitall(loan->nrequest,loan->request,MPI_STATUSES_IGNORE);
+
+    for (p=1;p<=loan->npartner;p++) {
+        if (loan->nlend[p] > 0) {
+            pos = loan->lend_start[p];
+            end = pos + loan->nlend[p];
+            r = loan->returned[p];
+            while (pos < end) {
+                e = tracer_element(E,j,list[pos]);
+                nt = min(start[e+1],end) - pos;
+                for (k=0;k<nt;k++) {
+                    vel[3*list[pos+k]] = r[k];
+                    vel[3*list[pos+k]+1] = r[nt+k];
+                    vel[3*list[pos+k]+2] = r[2*nt+k];
+                }
+                r += 3*nt;
+                pos += nt;
+            }
+        }
+
+        free(loan->lent[p]);
+        free(loan->returned[p]);
+        free(loan->borrowed[p]);
+        free(loan->result[p]);
+    }
+
+    return;
+}
+
+
+/* Radii of the bottom and top nodes of element el. */
+
+void tracer_element_radii(struct All_variables *E, int m, int el,
+                          double radbounds[2])
+{
+    radbounds[0] = E->sx[m][3][E->ien[m][el].node[1]];
+    radbounds[1] = E->sx[m][3][E->ien[m][el].node[5]];
+    return;
+}
+
+
+/*********** VELOCITY CACHE ***********************************/
+/*                                                            */
+/* The tracers are advected with Cartesian velocities. The    */
+/* nodal velocities are converted once after every change of  */
+/* E->sphere.cap[].V, instead of once per tracer and stage.   */
+/* The conversion is the one of velo_from_element_d().        */
+
+void update_tracer_velocity_cache(struct All_variables *E)
+{
+    int j, node;
+    double sint, cost, sinf, cosf;
+    double *vc;
+    float *V1, *V2, *V3;
+
+    const int nno = E->lmesh.nno;
+    const int lev = E->mesh.levmax;
+
+    if (E->trace.vcart_stamp == E->sphere.V_stamp) return;
+
+    for (j=1;j<=E->sphere.caps_per_proc;j++) {
+
+        if (E->trace.vcart[j] == NULL &&
+            (E->trace.vcart[j]=(double *)malloc(3*(nno+1)*sizeof(double)))==NULL) {
+            fprintf(E->trace.fpt,"ERROR(update_tracer_velocity_cache)-no memory\n");
+            fflush(E->trace.fpt);
+            exit(10);
+        }
+
+        vc = E->trace.vcart[j];
+        V1 = E->sphere.cap[j].V[1];
+        V2 = E->sphere.cap[j].V[2];
+        V3 = E->sphere.cap[j].V[3];
+
+#ifdef _OPENMP
+#pragma omp parallel for private(node,sint,sinf,cost,cosf) schedule(static) if(E->control.omp_threads)
+#endif
+        for (node=1;node<=nno;node++) {
+            sint = E->SinCos[lev][j][0][node];
+            sinf = E->SinCos[lev][j][1][node];
+            cost = E->SinCos[lev][j][2][node];
+            cosf = E->SinCos[lev][j][3][node];
+
+            vc[3*node]   = V1[node]*cost*cosf - V2[node]*sinf + V3[node]*sint*cosf;
+            vc[3*node+1] = V1[node]*cost*sinf + V2[node]*cosf + V3[node]*sint*sinf;
+            vc[3*node+2] = -V1[node]*sint + V3[node]*cost;
+        }
+    }
+
+    E->trace.vcart_stamp = E->sphere.V_stamp;
+
+    return;
+}
+
+
+/* Cartesian velocities of the nodes of element el, from the cache. */
+/* Same as velo_from_element_d(E,VV,m,el,0).                        */
+
+void tracer_velo_from_element(struct All_variables *E, double VV[4][9],
+                              int m, int el)
+{
+    int a, node;
+    const double *vc = E->trace.vcart[m];
+
+    for (a=1;a<=8;a++) {
+        node = E->ien[m][el].node[a];
+        VV[1][a] = vc[3*node];
+        VV[2][a] = vc[3*node+1];
+        VV[3][a] = vc[3*node+2];
+    }
+
+    return;
+}
+
+
+/*********** SORT TRACERS *************************************/
+/*                                                             */
+/* Tracers that leave a cap are replaced by the last tracer,   */
+/* and arriving tracers are appended, so the tracer order      */
+/* loses its spatial coherence over time. Every                */
+/* tracer_sort_every steps, this function rewrites the store   */
+/* of each cap in element order (tracers in the same element   */
+/* keep their relative order). The sorted records go to new    */
+/* blocks, and the old blocks are returned to the pool.        */
+
+static void sort_tracers(struct All_variables *E)
+{
+    int j, b, kk, it, nblocks;
+    int *list;
+    double **q0;
+    int **elem0;
+    struct TRACER_BLOCKS *store;
+
+    const int nq = E->trace.number_of_tracer_quantities;
+
+    double CPU_time0();
+    double begin_time = CPU_time0();
+
+    for (j=1;j<=E->sphere.caps_per_proc;j++) {
+
+        if (E->trace.ntracers[j]<2) continue;
+
+        bucket_tracers(E,j);
+        list = E->trace.elem_tracers;
+
+        /* detach the old blocks, and fill the store with new ones */
+
+        store = &E->trace.store[j];
+        nblocks = store->nblocks;
+        q0 = (double **)malloc(nblocks*sizeof(double *));
+        elem0 = (int **)malloc(nblocks*sizeof(int *));
+        if (q0==NULL || elem0==NULL) {
+            fprintf(E->trace.fpt,"ERROR(sort_tracers)-no memory\n");
+            fflush(E->trace.fpt);
+            exit(10);
+        }
+        for (b=0;b<nblocks;b++) {
+            q0[b] = store->q[b];
+            elem0[b] = store->elem[b];
+        }
+
+        store->nblocks = 0;
+        while (store->nblocks<nblocks)
+            expand_tracer_arrays(E,j);
+
+#ifdef _OPENMP
+#pragma omp parallel for private(kk,it) schedule(static) if(E->control.omp_threads)
+#endif
+        for (kk=1;kk<=E->trace.ntracers[j];kk++) {
+            it = list[kk-1];
+            memcpy(tracer_basicq(E,j,kk),
+                   q0[it>>TRACER_BLOCK_BITS] + (it&(TRACER_BLOCK-1))*nq,
+                   nq*sizeof(double));
+            tracer_element(E,j,kk) = elem0[it>>TRACER_BLOCK_BITS][it&(TRACER_BLOCK-1)];
+        }
+
+        for (b=0;b<nblocks;b++)
+            return_block_to_pool(E,q0[b],elem0[b]);
+
+        free(q0);
+        free(elem0);
+    }
+
+    trim_tracer_pool(E);
+
+    E->trace.sort_time += CPU_time0() - begin_time;
+
+    return;
+}
+
+
 /************ FIND TRACERS *************************************/
 /*                                                             */
 /* This function finds tracer elements and moves tracers to    */
@@ -554,6 +1457,7 @@ static void find_tracers(struct All_variables *E)
     double x,y,z;
     double time_stat1;
     double time_stat2;
+    double *q;
 
     void put_away_later();
     void eject_tracer();
@@ -566,6 +1470,8 @@ static void find_tracers(struct All_variables *E)
     double begin_time = CPU_time0();
 
 
+    thread_stats_setup(E);
+
     for (j=1;j<=E->sphere.caps_per_proc;j++) {
 
 
@@ -573,29 +1479,32 @@ static void find_tracers(struct All_variables *E)
 
         E->trace.ilater[j]=E->trace.ilatersize[j]=0;
 
+        merge_thread_stats(E);
         E->trace.istat1=0;
         for (kk=0;kk<=4;kk++) {
             E->trace.istat_ichoice[j][kk]=0;
         }
 
-        //TODO: use while-loop instead of for-loop
-        /* important to index by it, not kk */
-
-        it=0;
         num_tracers=E->trace.ntracers[j];
 
+        /* First find the new element of every tracer. The search only
+           depends on the tracer itself, so it runs threaded. */
+
+#ifdef _OPENMP
+#pragma omp parallel for private(kk,q,iel,iprevious_element,theta,phi,rad,x,y,z) schedule(dynamic,256) if(E->control.omp_threads)
+#endif
         for (kk=1;kk<=num_tracers;kk++) {
 
-            it++;
+            q=tracer_basicq(E,j,kk);
 
-            theta=E->trace.basicq[j][0][it];
-            phi=E->trace.basicq[j][1][it];
-            rad=E->trace.basicq[j][2][it];
-            x=E->trace.basicq[j][3][it];
-            y=E->trace.basicq[j][4][it];
-            z=E->trace.basicq[j][5][it];
+            theta=q[0];
+            phi=q[1];
+            rad=q[2];
+            x=q[3];
+            y=q[4];
+            z=q[5];
 
-            iprevious_element=E->trace.ielement[j][it];
+            iprevious_element=tracer_element(E,j,kk);
 
             iel=(E->trace.iget_element)(E,j,iprevious_element,x,y,z,theta,phi,rad);
             /* debug *
@@ -603,7 +1512,26 @@ static void find_tracers(struct All_variables *E)
             fflush(E->trace.fpt);
             */
 
-            E->trace.ielement[j][it]=iel;
+            tracer_element(E,j,kk)=iel;
+
+        } /* end tracers */
+
+        merge_thread_stats(E);
+
+        /* Then remove the tracers that left this cap, in tracer
+           order, so that the surviving tracers and the lost ones
+           keep the same order for any number of threads. */
+
+        //TODO: use while-loop instead of for-loop
+        /* important to index by it, not kk */
+
+        it=0;
+
+        for (kk=1;kk<=num_tracers;kk++) {
+
+            it++;
+
+            iel=tracer_element(E,j,it);
 
             if (iel == -99) {
                 /* tracer is inside other processors */
@@ -660,6 +1588,62 @@ static void find_tracers(struct All_variables *E)
 }
 
 
+/********** THREAD STATISTICS **********************************/
+/*                                                             */
+/* Element search counters are kept per thread (see            */
+/* tracer_defs.h). thread_stats_setup() makes sure there is a  */
+/* slot for every thread, merge_thread_stats() sums the slots  */
+/* into istat1 and istat_elements_checked.                     */
+
+static void thread_stats_setup(struct All_variables *E)
+{
+    int i, n;
+
+    n = 1;
+#ifdef _OPENMP
+    n = omp_get_max_threads();
+#endif
+
+    if (n <= E->trace.nthread_stat) return;
+
+    if ((E->trace.thread_stat=(struct TRACER_THREAD_STAT *)realloc(E->trace.thread_stat,n*sizeof(struct TRACER_THREAD_STAT)))==NULL) {
+        fprintf(E->trace.fpt,"ERROR(thread_stats_setup)-no memory\n");
+        fflush(E->trace.fpt);
+        exit(10);
+    }
+
+    for (i=E->trace.nthread_stat; i<n; i++) {
+        E->trace.thread_stat[i].istat1 = 0;
+        E->trace.thread_stat[i].istat_elements_checked = 0;
+    }
+    E->trace.nthread_stat = n;
+
+    return;
+}
+
+
+static void merge_thread_stats(struct All_variables *E)
+{
+    int i, n;
+    int istat1_before = E->trace.istat1;
+
+    for (i=0; i<E->trace.nthread_stat; i++) {
+        E->trace.istat1 += E->trace.thread_stat[i].istat1;
+        E->trace.istat_elements_checked += E->trace.thread_stat[i].istat_elements_checked;
+        E->trace.thread_stat[i].istat1 = 0;
+        E->trace.thread_stat[i].istat_elements_checked = 0;
+    }
+
+    /* full searches are expensive, report every 100th of them */
+    for (n=(istat1_before/100+1)*100; n<=E->trace.istat1; n+=100) {
+        fprintf(E->trace.fpt,"Checked all elements %d times already this turn\n",n);
+        fflush(E->trace.fpt);
+    }
+
+    return;
+}
+
+
 /***********************************************************************/
 /* This function computes the number of tracers in each element.       */
 /* Each tracer can be of different "flavors", which is the 0th index   */
@@ -682,8 +1666,8 @@ void count_tracers_of_flavors(struct All_variables *E)
 
         /* Fill arrays */
         for (kk=1; kk<=numtracers; kk++) {
-            e = E->trace.ielement[j][kk];
-            flavor = E->trace.extraq[j][0][kk];
+            e = tracer_element(E,j,kk);
+            flavor = tracer_extraq(E,j,kk)[0];
             E->trace.ntracer_flavor[j][flavor][e]++;
         }
     }
@@ -872,12 +1856,12 @@ static void generate_random_tracers(struct All_variables *E,
         E->trace.ntracers[j]++;
         kk=E->trace.ntracers[j];
 
-        E->trace.basicq[j][0][kk]=theta;
-        E->trace.basicq[j][1][kk]=phi;
-        E->trace.basicq[j][2][kk]=rad;
-        E->trace.basicq[j][3][kk]=x;
-        E->trace.basicq[j][4][kk]=y;
-        E->trace.basicq[j][5][kk]=z;
+        tracer_basicq(E,j,kk)[0]=theta;
+        tracer_basicq(E,j,kk)[1]=phi;
+        tracer_basicq(E,j,kk)[2]=rad;
+        tracer_basicq(E,j,kk)[3]=x;
+        tracer_basicq(E,j,kk)[4]=y;
+        tracer_basicq(E,j,kk)[5]=z;
 
     } /* end while */
 
@@ -988,15 +1972,15 @@ static void read_tracer_file(struct All_variables *E)
 
             if (E->trace.ntracers[j]>=(E->trace.max_ntracers[j]-5)) expand_tracer_arrays(E,j);
 
-            E->trace.basicq[j][0][E->trace.ntracers[j]]=theta;
-            E->trace.basicq[j][1][E->trace.ntracers[j]]=phi;
-            E->trace.basicq[j][2][E->trace.ntracers[j]]=rad;
-            E->trace.basicq[j][3][E->trace.ntracers[j]]=x;
-            E->trace.basicq[j][4][E->trace.ntracers[j]]=y;
-            E->trace.basicq[j][5][E->trace.ntracers[j]]=z;
+            tracer_basicq(E,j,E->trace.ntracers[j])[0]=theta;
+            tracer_basicq(E,j,E->trace.ntracers[j])[1]=phi;
+            tracer_basicq(E,j,E->trace.ntracers[j])[2]=rad;
+            tracer_basicq(E,j,E->trace.ntracers[j])[3]=x;
+            tracer_basicq(E,j,E->trace.ntracers[j])[4]=y;
+            tracer_basicq(E,j,E->trace.ntracers[j])[5]=z;
 
             for (i=0; i<E->trace.number_of_extra_quantities; i++)
-                E->trace.extraq[j][i][E->trace.ntracers[j]]=buffer[i+3];
+                tracer_extraq(E,j,E->trace.ntracers[j])[i]=buffer[i+3];
 
         } /* end kk, number of tracers */
 
@@ -1006,12 +1990,12 @@ static void read_tracer_file(struct All_variables *E)
         /* * debug **
         for (kk=1; kk<=E->trace.ntracers[j]; kk++) {
             fprintf(E->trace.fpt, "tracer#=%d sph_coord=(%g,%g,%g)", kk,
-                    E->trace.basicq[j][0][kk],
-                    E->trace.basicq[j][1][kk],
-                    E->trace.basicq[j][2][kk]);
+                    tracer_basicq(E,j,kk)[0],
+                    tracer_basicq(E,j,kk)[1],
+                    tracer_basicq(E,j,kk)[2]);
             fprintf(E->trace.fpt, "   extraq=");
             for (i=0; i<E->trace.number_of_extra_quantities; i++)
-                fprintf(E->trace.fpt, " %g", E->trace.extraq[j][i][kk]);
+                fprintf(E->trace.fpt, " %g", tracer_extraq(E,j,kk)[i]);
             fprintf(E->trace.fpt, "\n");
         }
         fflush(E->trace.fpt);
@@ -1135,27 +2119,27 @@ static void read_old_tracer_file(struct All_variables *E)
 
             (E->trace.keep_within_bounds)(E,&x,&y,&z,&theta,&phi,&rad);
 
-            E->trace.basicq[j][0][kk]=theta;
-            E->trace.basicq[j][1][kk]=phi;
-            E->trace.basicq[j][2][kk]=rad;
-            E->trace.basicq[j][3][kk]=x;
-            E->trace.basicq[j][4][kk]=y;
-            E->trace.basicq[j][5][kk]=z;
+            tracer_basicq(E,j,kk)[0]=theta;
+            tracer_basicq(E,j,kk)[1]=phi;
+            tracer_basicq(E,j,kk)[2]=rad;
+            tracer_basicq(E,j,kk)[3]=x;
+            tracer_basicq(E,j,kk)[4]=y;
+            tracer_basicq(E,j,kk)[5]=z;
 
             for (i=0; i<E->trace.number_of_extra_quantities; i++)
-                E->trace.extraq[j][i][kk]=buffer[i+3];
+                tracer_extraq(E,j,kk)[i]=buffer[i+3];
 
         }
 
         /* debug **
         for (kk=1; kk<=E->trace.ntracers[j]; kk++) {
             fprintf(E->trace.fpt, "tracer#=%d sph_coord=(%g,%g,%g)", kk,
-                    E->trace.basicq[j][0][kk],
-                    E->trace.basicq[j][1][kk],
-                    E->trace.basicq[j][2][kk]);
+                    tracer_basicq(E,j,kk)[0],
+                    tracer_basicq(E,j,kk)[1],
+                    tracer_basicq(E,j,kk)[2]);
             fprintf(E->trace.fpt, "   extraq=");
             for (i=0; i<E->trace.number_of_extra_quantities; i++)
-                fprintf(E->trace.fpt, " %g", E->trace.extraq[j][i][kk]);
+                fprintf(E->trace.fpt, " %g", tracer_extraq(E,j,kk)[i]);
             fprintf(E->trace.fpt, "\n");
         }
         fflush(E->trace.fpt);
@@ -1289,7 +2273,7 @@ static void init_tracer_flavors(struct All_variables *E)
 
 	number_of_tracers = E->trace.ntracers[j];
 	for (kk=1;kk<=number_of_tracers;kk++) {
-	  rad = E->trace.basicq[j][2][kk];
+	  rad = tracer_basicq(E,j,kk)[2];
 
           flavor = E->trace.nflavors - 1;
           for (i=0; i<E->trace.nflavors-1; i++) {
@@ -1298,7 +2282,7 @@ static void init_tracer_flavors(struct All_variables *E)
                   break;
               }
           }
-          E->trace.extraq[j][0][kk] = flavor;
+          tracer_extraq(E,j,kk)[0] = flavor;
 	}
       }
       break;
@@ -1453,39 +2437,27 @@ void allocate_tracer_arrays(struct All_variables *E,
 {
 
     int kk;
+    struct TRACER_BLOCKS *store = &E->trace.store[j];
 
-    /* max_ntracers is physical size of tracer array */
-    /* (initially make it 25% larger than required */
-
-    E->trace.max_ntracers[j]=number_of_tracers+number_of_tracers/4;
-    E->trace.ntracers[j]=0;
-
-    /* make tracer arrays */
+    /* room for the block pointers of 4 times the initial tracers */
 
-    if ((E->trace.ielement[j]=(int *) malloc(E->trace.max_ntracers[j]*sizeof(int)))==NULL) {
+    store->nblocks=0;
+    store->maxblocks=4*((number_of_tracers+1)/TRACER_BLOCK+1);
+    if ((store->q=(double **)malloc(store->maxblocks*sizeof(double *)))==NULL ||
+        (store->elem=(int **)malloc(store->maxblocks*sizeof(int *)))==NULL) {
         fprintf(E->trace.fpt,"ERROR(make tracer array)-no memory 1a\n");
         fflush(E->trace.fpt);
         exit(10);
     }
-    for (kk=1;kk<E->trace.max_ntracers[j];kk++)
-        E->trace.ielement[j][kk]=-99;
 
+    E->trace.max_ntracers[j]=0;
+    E->trace.ntracers[j]=0;
 
-    for (kk=0;kk<E->trace.number_of_basic_quantities;kk++) {
-        if ((E->trace.basicq[j][kk]=(double *)malloc(E->trace.max_ntracers[j]*sizeof(double)))==NULL) {
-            fprintf(E->trace.fpt,"ERROR(initialize tracer arrays)-no memory 1b.%d\n",kk);
-            fflush(E->trace.fpt);
-            exit(10);
-        }
-    }
+    /* max_ntracers is physical size of tracer array */
+    /* (initially make it hold all tracers, plus 5 for the checks of callers) */
 
-    for (kk=0;kk<E->trace.number_of_extra_quantities;kk++) {
-        if ((E->trace.extraq[j][kk]=(double *)malloc(E->trace.max_ntracers[j]*sizeof(double)))==NULL) {
-            fprintf(E->trace.fpt,"ERROR(initialize tracer arrays)-no memory 1c.%d\n",kk);
-            fflush(E->trace.fpt);
-            exit(10);
-        }
-    }
+    while (E->trace.max_ntracers[j]<number_of_tracers+6)
+        expand_tracer_arrays(E,j);
 
     if (E->trace.nflavors > 0) {
         E->trace.ntracer_flavor[j]=(int **)malloc(E->trace.nflavors*sizeof(int*));
@@ -1509,47 +2481,47 @@ void allocate_tracer_arrays(struct All_variables *E,
 
 
 /****** EXPAND TRACER ARRAYS *****************************************/
+/*                                                                   */
+/* Add one block to the tracer store of cap j, from the pool if it   */
+/* has one. The tracers already stored are not moved.                */
 
 void expand_tracer_arrays(struct All_variables *E, int j)
 {
 
-    int inewsize;
     int kk;
-    int icushion;
-
-    /* expand basicq and ielement by 20% */
-
-    icushion=100;
-
-    inewsize=E->trace.max_ntracers[j]+E->trace.max_ntracers[j]/5+icushion;
-
-    if ((E->trace.ielement[j]=(int *)realloc(E->trace.ielement[j],inewsize*sizeof(int)))==NULL) {
-        fprintf(E->trace.fpt,"ERROR(expand tracer arrays )-no memory (ielement)\n");
-        fflush(E->trace.fpt);
-        exit(10);
-    }
-
-    for (kk=0;kk<=((E->trace.number_of_basic_quantities)-1);kk++) {
-        if ((E->trace.basicq[j][kk]=(double *)realloc(E->trace.basicq[j][kk],inewsize*sizeof(double)))==NULL) {
-            fprintf(E->trace.fpt,"ERROR(expand tracer arrays )-no memory (%d)\n",kk);
+    struct TRACER_BLOCKS *store = &E->trace.store[j];
+    const size_t size = (size_t)TRACER_BLOCK*E->trace.number_of_tracer_quantities;
+
+    if (store->nblocks==store->maxblocks) {
+        store->maxblocks+=store->maxblocks/2+1;
+        if ((store->q=(double **)realloc(store->q,store->maxblocks*sizeof(double *)))==NULL ||
+            (store->elem=(int **)realloc(store->elem,store->maxblocks*sizeof(int *)))==NULL) {
+            fprintf(E->trace.fpt,"ERROR(expand tracer arrays )-no memory (blocks)\n");
             fflush(E->trace.fpt);
             exit(10);
         }
     }
 
-    for (kk=0;kk<=((E->trace.number_of_extra_quantities)-1);kk++) {
-        if ((E->trace.extraq[j][kk]=(double *)realloc(E->trace.extraq[j][kk],inewsize*sizeof(double)))==NULL) {
-            fprintf(E->trace.fpt,"ERROR(expand tracer arrays )-no memory 78 (%d)\n",kk);
+    if (E->trace.npool>0) {
+        E->trace.npool--;
+        store->q[store->nblocks]=E->trace.pool_q[E->trace.npool];
+        store->elem[store->nblocks]=E->trace.pool_elem[E->trace.npool];
+    }
+    else {
+        /* records start on a cache line */
+        if (posix_memalign((void **)&store->q[store->nblocks],64,size*sizeof(double)) ||
+            (store->elem[store->nblocks]=(int *)malloc(TRACER_BLOCK*sizeof(int)))==NULL) {
+            fprintf(E->trace.fpt,"ERROR(expand tracer arrays )-no memory (ielement)\n");
             fflush(E->trace.fpt);
             exit(10);
         }
     }
 
+    for (kk=0;kk<TRACER_BLOCK;kk++)
+        store->elem[store->nblocks][kk]=-99;
 
-    fprintf(E->trace.fpt,"Expanding physical memory of ielement, basicq, and extraq to %d from %d\n",
-            inewsize,E->trace.max_ntracers[j]);
-
-    E->trace.max_ntracers[j]=inewsize;
+    store->nblocks++;
+    E->trace.max_ntracers[j]=store->nblocks*TRACER_BLOCK;
 
     return;
 }
@@ -1558,68 +2530,72 @@ void expand_tracer_arrays(struct All_variables *E, int j)
 
 
 /****** REDUCE  TRACER ARRAYS *****************************************/
+/*                                                                    */
+/* Give the blocks that hold no tracers back to the pool, keeping one */
+/* spare block per cap. The pool itself keeps at most one block per   */
+/* cap for the next expansion; the rest is freed.                     */
 
 static void reduce_tracer_arrays(struct All_variables *E)
 {
 
-    int inewsize;
-    int kk;
-    int iempty_space;
     int j;
-
-    int icushion=100;
+    int nneeded;
+    struct TRACER_BLOCKS *store;
 
     for (j=1;j<=E->sphere.caps_per_proc;j++) {
 
+        store = &E->trace.store[j];
 
-        /* if physical size is double tracer size, reduce it */
-
-        iempty_space=(E->trace.max_ntracers[j]-E->trace.ntracers[j]);
+        nneeded=(E->trace.ntracers[j]+6)/TRACER_BLOCK+2;
 
-        if (iempty_space>(E->trace.ntracers[j]+icushion)) {
+        if (store->nblocks>nneeded) {
 
+            fprintf(E->trace.fpt,"Reducing physical memory of tracer arrays to %d from %d\n",
+                    nneeded*TRACER_BLOCK,E->trace.max_ntracers[j]);
 
-            inewsize=E->trace.ntracers[j]+E->trace.ntracers[j]/4+icushion;
-
-            if (inewsize<1) {
-                fprintf(E->trace.fpt,"Error(reduce tracer arrays)-something up (hdf3)\n");
-                fflush(E->trace.fpt);
-                exit(10);
+            while (store->nblocks>nneeded) {
+                store->nblocks--;
+                return_block_to_pool(E,store->q[store->nblocks],
+                                     store->elem[store->nblocks]);
             }
 
+            E->trace.max_ntracers[j]=store->nblocks*TRACER_BLOCK;
 
-            if ((E->trace.ielement[j]=(int *)realloc(E->trace.ielement[j],inewsize*sizeof(int)))==NULL) {
-                fprintf(E->trace.fpt,"ERROR(reduce tracer arrays )-no memory (ielement)\n");
-                fflush(E->trace.fpt);
-                exit(10);
-            }
+        } /* end if */
 
+    } /* end j */
 
-            for (kk=0;kk<=((E->trace.number_of_basic_quantities)-1);kk++) {
-                if ((E->trace.basicq[j][kk]=(double *)realloc(E->trace.basicq[j][kk],inewsize*sizeof(double)))==NULL) {
-                    fprintf(E->trace.fpt,"AKM(reduce tracer arrays )-no memory (%d)\n",kk);
-                    fflush(E->trace.fpt);
-                    exit(10);
-                }
-            }
+    trim_tracer_pool(E);
+
+    return;
+}
 
-            for (kk=0;kk<=((E->trace.number_of_extra_quantities)-1);kk++) {
-                if ((E->trace.extraq[j][kk]=(double *)realloc(E->trace.extraq[j][kk],inewsize*sizeof(double)))==NULL) {
-                    fprintf(E->trace.fpt,"AKM(reduce tracer arrays )-no memory 783 (%d)\n",kk);
-                    fflush(E->trace.fpt);
-                    exit(10);
-                }
-            }
 
+static void return_block_to_pool(struct All_variables *E,
+                                 double *q, int *elem)
+{
+    if (E->trace.npool==E->trace.maxpool) {
+        E->trace.maxpool+=E->trace.maxpool/2+E->sphere.caps_per_proc;
+        E->trace.pool_q=(double **)realloc(E->trace.pool_q,E->trace.maxpool*sizeof(double *));
+        E->trace.pool_elem=(int **)realloc(E->trace.pool_elem,E->trace.maxpool*sizeof(int *));
+    }
+    E->trace.pool_q[E->trace.npool]=q;
+    E->trace.pool_elem[E->trace.npool]=elem;
+    E->trace.npool++;
 
-            fprintf(E->trace.fpt,"Reducing physical memory of ielement, basicq, and extraq to %d from %d\n",
-                    E->trace.max_ntracers[j],inewsize);
+    return;
+}
 
-            E->trace.max_ntracers[j]=inewsize;
 
-        } /* end if */
+/* the pool keeps at most one block per cap */
 
-    } /* end j */
+static void trim_tracer_pool(struct All_variables *E)
+{
+    while (E->trace.npool>E->sphere.caps_per_proc) {
+        E->trace.npool--;
+        free(E->trace.pool_q[E->trace.npool]);
+        free(E->trace.pool_elem[E->trace.npool]);
+    }
 
     return;
 }
@@ -1634,6 +2610,7 @@ static void reduce_tracer_arrays(struct All_variables *E)
 static void put_away_later(struct All_variables *E, int j, int it)
 {
     int kk;
+    double *q;
     void expand_later_array();
 
 
@@ -1660,13 +2637,11 @@ static void put_away_later(struct All_variables *E, int j, int it)
 
     if (E->trace.ilater[j] >= (E->trace.ilatersize[j]-5)) expand_later_array(E,j);
 
-    /* stack basic and extra quantities together (basic first) */
-
-    for (kk=0;kk<=((E->trace.number_of_basic_quantities)-1);kk++)
-        E->trace.rlater[j][kk][E->trace.ilater[j]]=E->trace.basicq[j][kk][it];
+    /* the record already stacks basic and extra quantities (basic first) */
 
-    for (kk=0;kk<=((E->trace.number_of_extra_quantities)-1);kk++)
-        E->trace.rlater[j][E->trace.number_of_basic_quantities+kk][E->trace.ilater[j]]=E->trace.extraq[j][kk][it];
+    q=tracer_basicq(E,j,it);
+    for (kk=0;kk<=((E->trace.number_of_tracer_quantities)-1);kk++)
+        E->trace.rlater[j][kk][E->trace.ilater[j]]=q[kk];
 
 
     return;
@@ -1712,21 +2687,16 @@ static void eject_tracer(struct All_variables *E, int j, int it)
 {
 
     int ilast_tracer;
-    int kk;
 
 
     ilast_tracer=E->trace.ntracers[j];
 
     /* put last tracer in ejected tracer position */
 
-    E->trace.ielement[j][it]=E->trace.ielement[j][ilast_tracer];
-
-    for (kk=0;kk<=((E->trace.number_of_basic_quantities)-1);kk++)
-        E->trace.basicq[j][kk][it]=E->trace.basicq[j][kk][ilast_tracer];
-
-    for (kk=0;kk<=((E->trace.number_of_extra_quantities)-1);kk++)
-        E->trace.extraq[j][kk][it]=E->trace.extraq[j][kk][ilast_tracer];
+    tracer_element(E,j,it)=tracer_element(E,j,ilast_tracer);
 
+    memcpy(tracer_basicq(E,j,it),tracer_basicq(E,j,ilast_tracer),
+           E->trace.number_of_tracer_quantities*sizeof(double));
 
 
     E->trace.ntracers[j]--;
@@ -34,6 +34,12 @@ extern "C" {
 
 void general_stokes_solver(struct All_variables*);
 void general_stokes_solver_setup(struct All_variables*);
+size_t solver_workspace_mark(struct All_variables*);
+double *solver_workspace_alloc(struct All_variables*, int);
+float *solver_workspace_alloc_float(struct All_variables*, int);
+void solver_workspace_release(struct All_variables*, size_t);
+void solver_workspace_report(struct All_variables*);
+void stiffness_operator_report(struct All_variables*);
 
 #ifdef __cplusplus
 }
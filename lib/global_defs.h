@@ -108,6 +108,9 @@ extern "C" {
 #define MAX_LEVELS 12   /* max. number of multigrid levels */
 #define NCS      14   /* max. number of sphere caps */
 
+/* with matrix_free, levmax keeps no nodal stiffness matrix */
+#define MATRIX_FREE_LEVEL(E,lev) ((E)->control.matrix_free && (lev) == (E)->mesh.levmax)
+
 /* type of elt_del and elt_c arrays */
 /* double precision doesn't help,
  * probably due to the coordinate transformation c33matrix */
@@ -206,6 +209,32 @@ struct BOUND  {
 struct PASS  {
     int pass[27];	};
 
+/* one message of an exchange plan; proc is -1 or me when the
+   data stays on this processor and is added in place */
+struct EXCHANGE_MSG {
+    int proc;
+    int n;
+    int offset;
+    int *cap;
+    int *id;
+    };
+
+#define MAX_EXCHANGE_PHASES 3
+
+/* persistent halo exchange, built once per level by the
+   *_parallel_communication_routs_v() functions. Messages of one
+   phase are in flight together; the phases run one after the other */
+struct EXCHANGE_PLAN {
+    MPI_Datatype type;
+    int nphase;
+    int phase[MAX_EXCHANGE_PHASES+1];
+    int req[MAX_EXCHANGE_PHASES+1];
+    int nmsg;
+    struct EXCHANGE_MSG *msg;
+    MPI_Request *request;
+    void *sbuf,*rbuf;
+    };
+
 struct Parallel {
     MPI_Comm world;
     MPI_Comm horizontal_comm;
@@ -251,6 +280,15 @@ struct Parallel {
     struct PASS NUM_sNODE[MAX_LEVELS][NCS];
     struct PASS sPROCESSOR[MAX_LEVELS][NCS];
     struct PASS *EXCHANGE_sNODE[MAX_LEVELS][NCS];
+
+    struct EXCHANGE_PLAN *plan_id_d[MAX_LEVELS];
+    struct EXCHANGE_PLAN *plan_id_f[MAX_LEVELS];  /* levels < levmax, if mg_single_precision */
+    struct EXCHANGE_PLAN *plan_node_d[MAX_LEVELS];
+    struct EXCHANGE_PLAN *plan_node_f[MAX_LEVELS];
+    int exchange_calls[MAX_LEVELS];
+    double exchange_time[MAX_LEVELS];
+    int allreduce_calls;
+    double allreduce_time;
     };
 
 struct CAP    {
@@ -281,6 +319,15 @@ struct SPHERE   {
   double **tablesplm[NCS];
   double **tablescosf[NCS];
   double **tablessinf[NCS];
+  double *tablesw[NCS];     /* surface quadrature weight of each node */
+
+  /* compact tables, see compute_sphereh_table() */
+  int compact_tables;
+  int float_tables;
+  int nlat[NCS], nlon[NCS];
+  int *clat[NCS], *clon[NCS];   /* colatitude, longitude of each node */
+  double *ctable[NCS];
+  float *ctablef[NCS];
 
   double area[NCS];
   double angle[NCS][5];
@@ -291,6 +338,7 @@ struct SPHERE   {
   double *gr;
   double ro,ri;
   struct CAP cap[NCS];
+  int V_stamp;   /* changed whenever cap[].V is rewritten */
 
 };
 
@@ -400,6 +448,15 @@ struct MONITOR {
     double cpu_time_at_last_cycle;
     float  elapsed_time;
 
+    double matvec_time[MAX_LEVELS]; /* in n_assemble_del2_u(), without the exchange */
+    int matvec_calls[MAX_LEVELS];
+    double assembly_time;  /* in construct_stiffness_B_matrix() */
+    int assembly_calls;
+    int elt_k_updated[MAX_LEVELS]; /* stiffness_update_tol: elements reassembled */
+    int elt_k_total[MAX_LEVELS];   /* by the last construct_node_ks(), of all */
+    double elt_k_updated_sum, elt_k_total_sum; /* same, all calls and levels */
+    int elt_k_cycle;               /* solution_cycles of the last full assembly */
+
     float T_interior;
     float T_maxvaried;
     float T_interior_max_for_exit;
@@ -450,6 +507,9 @@ struct CONTROL {
     int augmented_Lagr;
     double augmented;
     int NASSEMBLE;
+    int overlap_exchange;
+    int block_csr;    /* store the nodal matrix in block-CSR rows */
+    int omp_threads;  /* OpenMP threads per rank for nodal kernels and tracer passes, 0: off */
 
     float sob_tolerance;
 
@@ -522,6 +582,16 @@ struct CONTROL {
     int max_mg_cycles;
     int down_heavy;
     int up_heavy;
+    int mg_smoother;    /* 0: natural node order, 1: multicolor */
+    int mg_krylov;      /* multigrid as preconditioner of flexible CG */
+    int mg_coarse_direct; /* direct solve on levmin */
+    int pipelined_cg;   /* overlap the CG reductions with the matvec */
+    int mg_single_precision; /* smooth levels < levmax in float */
+    int matrix_free;    /* recompute the levmax stiffness in every product */
+    int stiffness_cache; /* keep the viscosity-free element stiffness */
+    double stiffness_update_tol; /* reassemble only where EVI moved by more */
+    double mg_sor;
+    double mg_jacobi_omega; /* damping of the levmax smoother if matrix_free */
     int verbose;
 
     int remove_rigid_rotation,inner_remove_rigid_rotation;
@@ -627,6 +697,8 @@ struct gzd_struc{
 
 };
 
+struct OUTPUT_ASYNC;
+
 struct Output {
     char format[20];  /* ascii or hdf5 */
     char optional[1000]; /* comma-delimited list of objects to output */
@@ -650,6 +722,11 @@ struct Output {
     int cache_rdcc_nelmts;
     int cache_rdcc_nbytes;
 
+    int tracer_stride;     /* write every n-th tracer (HDF5) */
+
+    int async;        /* whether to write the ascii output in the background */
+    struct OUTPUT_ASYNC *async_writer;
+
     int connectivity; /* whether to output connectivity */
     int stress;       /* whether to output stress */
     int pressure;     /* whether to output pressure */
@@ -697,6 +774,42 @@ struct COMPOSITION {
 };
 
 
+/* scratch vectors for the iterative solvers, taken and given back in
+   stack order (see Drive_solvers.c) */
+struct WORKSPACE {
+    double *base;
+    size_t size;                /* in doubles */
+    size_t used;
+    size_t peak;
+};
+
+
+/* largest levmin system of mg_coarse_direct, whose dense factor
+   (MAX_COARSE_DIRECT^2 doubles) is computed on processor 0 */
+#define MAX_COARSE_DIRECT 2000
+/* the three rigid rotations of a full sphere with free slip */
+#define MAX_COARSE_PIN 3
+
+/* the levmin system of the multigrid solver, gathered onto processor 0
+   and solved there with a dense Cholesky factorization */
+struct COARSE_SOLVER {
+    int n;                      /* global number of equations */
+    int count;                  /* local equations, all caps */
+    int *gid[NCS];              /* global number of each local equation */
+    double *buf;
+
+    /* on processor 0 only */
+    int total;
+    int *counts,*displs;        /* local equations of each processor */
+    int *rgid;                  /* their global numbers */
+    double *rbuf;
+    double *L;                  /* Cholesky factor, n x n */
+    double *y;
+    int npin;                   /* equations of the null space, x = 0 */
+    int pin[MAX_COARSE_PIN];
+};
+
+
 struct CITCOM_GNOMONIC {
     /* gnomonic projected coordinate */
     double u;
@@ -740,6 +853,8 @@ struct All_variables {
 
     /* for chemical convection & composition rheology */
     struct COMPOSITION composition;
+    struct WORKSPACE workspace;
+    struct COARSE_SOLVER coarse;
 
     struct CITCOM_GNOMONIC *gnomonic;
     double gnomonic_reference_phi;
@@ -756,6 +871,9 @@ struct All_variables {
     struct EG *elt_del[MAX_LEVELS][NCS];
     struct EC *elt_c[MAX_LEVELS][NCS];
     struct EK *elt_k[MAX_LEVELS][NCS];
+    double *elt_k_cache[MAX_LEVELS][NCS]; /* stiffness_cache: get_elt_k() at unit viscosity, per integration point */
+    float *EVI_K[MAX_LEVELS][NCS];  /* stiffness_update_tol: EVI of the assembled Eqn_k */
+    double *K_diag[MAX_LEVELS][NCS]; /* and its diagonal, before inversion into BI */
     struct CC *cc[NCS];
     struct CCX *ccx[NCS];
     struct CC *CC[MAX_LEVELS][NCS];
@@ -769,8 +887,12 @@ struct All_variables {
 
     higher_precision *Eqn_k1[MAX_LEVELS][NCS],*Eqn_k2[MAX_LEVELS][NCS],*Eqn_k3[MAX_LEVELS][NCS];
     int *Node_map [MAX_LEVELS][NCS];
+    unsigned char *Node_halo[MAX_LEVELS][NCS];
+    int *Bsr_ptr[MAX_LEVELS][NCS],*Bsr_col[MAX_LEVELS][NCS],*Bsr_pos[MAX_LEVELS][NCS];
+    higher_precision *Bsr_k[MAX_LEVELS][NCS];
 
     double *BI[MAX_LEVELS][NCS],*BPI[MAX_LEVELS][NCS];
+    float *BIf[MAX_LEVELS][NCS];  /* BI of levels < levmax, if mg_single_precision */
 
     double *rho;
     double *heating_adi[NCS];
@@ -37,6 +37,21 @@ void parallel_process_finalize();
 void parallel_process_termination();
 void parallel_process_sync(struct All_variables *E);
 double CPU_time0();
+struct EXCHANGE_PLAN *exchange_plan_create(MPI_Datatype type);
+void exchange_plan_message(struct EXCHANGE_PLAN *plan, int phase, int proc);
+void exchange_plan_append(struct EXCHANGE_PLAN *plan, int m,
+                          struct PASS *list, int k, int n);
+void exchange_plan_commit(struct All_variables *E, struct EXCHANGE_PLAN *plan);
+void exchange_plans_free(struct All_variables *E);
+void exchange_plan_start(struct All_variables *E, struct EXCHANGE_PLAN *plan,
+                         void **U, int lev);
+void exchange_plan_finish(struct All_variables *E, struct EXCHANGE_PLAN *plan,
+                          void **U, int lev);
+void exchange_plan_execute(struct All_variables *E, struct EXCHANGE_PLAN *plan,
+                           void **U, int lev);
+void exchange_plan_min(struct All_variables *E, struct EXCHANGE_PLAN *plan,
+                       double **U);
+void parallel_exchange_time_report(struct All_variables *E);
 
 #ifdef __cplusplus
 }
@@ -46,6 +46,7 @@ void myerror_s(char *, struct All_variables *);
 /* BC_util.c */
 void internal_horizontal_bc(struct All_variables *, float *[], int, int, float, unsigned int, char, int, int);
 void strip_bcs_from_residual(struct All_variables *, double **, int);
+void strip_bcs_from_residual_float(struct All_variables *, float **, int);
 void temperatures_conform_bcs(struct All_variables *);
 void temperatures_conform_bcs2(struct All_variables *);
 void velocities_conform_bcs(struct All_variables *, double **);
@@ -73,9 +74,12 @@ void construct_lm(struct All_variables *);
 void construct_node_maps(struct All_variables *);
 void construct_node_ks(struct All_variables *);
 void rebuild_BI_on_boundary(struct All_variables *);
+void construct_BI_float(struct All_variables *);
 void construct_masks(struct All_variables *);
 void construct_sub_element(struct All_variables *);
 void construct_elt_ks(struct All_variables *);
+void construct_elt_k_cache(struct All_variables *);
+void construct_stiffness_update(struct All_variables *);
 void construct_elt_gs(struct All_variables *);
 void construct_elt_cs(struct All_variables *);
 void construct_stiffness_B_matrix(struct All_variables *);
@@ -98,6 +102,12 @@ void lubksb_3x3(double [3][3], int, int *, double *);
 /* Drive_solvers.c */
 void general_stokes_solver_setup(struct All_variables *);
 void general_stokes_solver(struct All_variables *);
+size_t solver_workspace_mark(struct All_variables *);
+double *solver_workspace_alloc(struct All_variables *, int);
+float *solver_workspace_alloc_float(struct All_variables *, int);
+void solver_workspace_release(struct All_variables *, size_t);
+void solver_workspace_report(struct All_variables *);
+void stiffness_operator_report(struct All_variables *);
 int need_visc_update(struct All_variables *);
 int need_to_iterate(struct All_variables *);
 void general_stokes_solver_pseudo_surf(struct All_variables *);
@@ -105,10 +115,13 @@ void general_stokes_solver_pseudo_surf(struct All_variables *);
 void assemble_forces(struct All_variables *, int);
 void get_ba(struct Shape_function *, struct Shape_function_dx *, struct CC *, struct CCX *, double [4][9], int, double [9][9][4][7]);
 void get_ba_p(struct Shape_function *, struct Shape_function_dx *, struct CC *, struct CCX *, double [4][9], int, double [9][9][4][7]);
+void get_elt_k_cache(struct All_variables *, int, double *, int, int);
 void get_elt_k(struct All_variables *, int, double [24*24], int, int, int);
 void assemble_del2_u(struct All_variables *, double **, double **, int, int);
 void e_assemble_del2_u(struct All_variables *, double **, double **, int, int);
 void n_assemble_del2_u(struct All_variables *, double **, double **, int, int);
+void n_assemble_del2_u_float(struct All_variables *, float **, float **, int, int);
+double stiffness_product_flops(struct All_variables *, int, int);
 void build_diagonal_of_K(struct All_variables *, int, double [24*24], int, int);
 void build_diagonal_of_Ahat(struct All_variables *);
 void assemble_c_u(struct All_variables *, double **, double **, int);
@@ -139,6 +152,7 @@ void full_parallel_domain_boundary_nodes(struct All_variables *);
 void full_parallel_communication_routs_v(struct All_variables *);
 void full_parallel_communication_routs_s(struct All_variables *);
 void full_exchange_id_d(struct All_variables *, double **, int);
+void full_exchange_id_f(struct All_variables *, float **, int);
 void full_exchange_snode_f(struct All_variables *, float **, float **, int);
 /* Full_read_input_from_files.c */
 void full_read_input_files_for_timesteps(struct All_variables *, int, int);
@@ -155,6 +169,8 @@ void full_lost_souls(struct All_variables *);
 void full_get_shape_functions(struct All_variables *, double [9], int, double, double, double);
 double full_interpolate_data(struct All_variables *, double [9], double [9]);
 void full_get_velocity(struct All_variables *, int, int, double, double, double, double *);
+void full_get_velocities(struct All_variables *, int, int, int, double *, double *, double *, double *, double *, double *);
+void full_get_element_velocities(struct All_variables *, int, int, double [2], double [4][9], int, double *, double *, double *, double *, double *, double *);
 int full_icheck_cap(struct All_variables *, int, double, double, double, double);
 int full_iget_element(struct All_variables *, int, int, double, double, double, double, double, double);
 void full_keep_within_bounds(struct All_variables *, double *, double *, double *, double *, double *, double *);
@@ -169,6 +185,8 @@ void full_construct_boundary(struct All_variables *);
 int solve_del2_u(struct All_variables *, double **, double **, double, int);
 double multi_grid(struct All_variables *, double **, double **, double, int);
 double conj_grad(struct All_variables *, double **, double **, double, int *, int);
+double conj_grad_pipelined(struct All_variables *, double **, double **, double, int *, int);
+double mg_conj_grad(struct All_variables *, double **, double **, double, int *, int);
 void element_gauss_seidel(struct All_variables *, double **, double **, double **, double, int *, int, int);
 void gauss_seidel(struct All_variables *, double **, double **, double **, double, int *, int, int);
 double determinant(double [4][4], int);
@@ -200,9 +218,18 @@ double return_bulk_value_d(struct All_variables *, double **, int);
 float find_max_horizontal(struct All_variables *, double);
 void sum_across_surface(struct All_variables *, float *, int);
 void sum_across_surf_sph1(struct All_variables *, float *, float *);
+void sum_across_surf_sph(struct All_variables *, double *, int);
+void sum_across_all_sph(struct All_variables *, double *, int);
 float global_fvdot(struct All_variables *, float **, float **, int);
 double kineticE_radial(struct All_variables *, double **, int);
+void global_dsum(struct All_variables *, double *, double *, int);
+double local_vdot(struct All_variables *, double **, double **, int);
+double local_pdot(struct All_variables *, double **, double **, int);
+double local_v_norm2(struct All_variables *, double **);
+double local_p_norm2(struct All_variables *, double **);
+double local_div_norm2(struct All_variables *, double **);
 double global_vdot(struct All_variables *, double **, double **, int);
+double global_vdot_float(struct All_variables *, float **, float **, int);
 double global_pdot(struct All_variables *, double **, double **, int);
 double global_v_norm2(struct All_variables *, double **);
 double global_p_norm2(struct All_variables *, double **);
@@ -296,6 +323,7 @@ void output_comp_nd(struct All_variables *, int);
 void output_comp_el(struct All_variables *, int);
 void output_heating(struct All_variables *, int);
 void output_time(struct All_variables *, int);
+void output_flush(struct All_variables *);
 #ifdef USE_GZDIR
 /* Output_gzdir.c */
 void gzdir_output(struct All_variables *, int);
@@ -364,6 +392,16 @@ void parallel_process_finalize(void);
 void parallel_process_termination(void);
 void parallel_process_sync(struct All_variables *);
 double CPU_time0(void);
+struct EXCHANGE_PLAN *exchange_plan_create(MPI_Datatype);
+void exchange_plan_message(struct EXCHANGE_PLAN *, int, int);
+void exchange_plan_append(struct EXCHANGE_PLAN *, int, struct PASS *, int, int);
+void exchange_plan_commit(struct All_variables *, struct EXCHANGE_PLAN *);
+void exchange_plans_free(struct All_variables *);
+void exchange_plan_start(struct All_variables *, struct EXCHANGE_PLAN *, void **, int);
+void exchange_plan_finish(struct All_variables *, struct EXCHANGE_PLAN *, void **, int);
+void exchange_plan_execute(struct All_variables *, struct EXCHANGE_PLAN *, void **, int);
+void exchange_plan_min(struct All_variables *, struct EXCHANGE_PLAN *, double **);
+void parallel_exchange_time_report(struct All_variables *);
 /* Parsing.c */
 void setup_parser(struct All_variables *, char *);
 void shutdown_parser(struct All_variables *);
@@ -415,6 +453,7 @@ void regional_parallel_domain_boundary_nodes(struct All_variables *);
 void regional_parallel_communication_routs_v(struct All_variables *);
 void regional_parallel_communication_routs_s(struct All_variables *);
 void regional_exchange_id_d(struct All_variables *, double **, int);
+void regional_exchange_id_f(struct All_variables *, float **, int);
 void regional_exchange_snode_f(struct All_variables *, float **, float **, int);
 /* Regional_read_input_from_files.c */
 void regional_read_input_files_for_timesteps(struct All_variables *, int, int);
@@ -431,6 +470,8 @@ int regional_icheck_cap(struct All_variables *, int, double, double, double, dou
 void regional_get_shape_functions(struct All_variables *, double [9], int, double, double, double);
 double regional_interpolate_data(struct All_variables *, double [9], double [9]);
 void regional_get_velocity(struct All_variables *, int, int, double, double, double, double *);
+void regional_get_velocities(struct All_variables *, int, int, int, double *, double *, double *, double *, double *, double *);
+void regional_get_element_velocities(struct All_variables *, int, int, double [2], double [4][9], int, double *, double *, double *, double *, double *, double *);
 void regional_keep_within_bounds(struct All_variables *, double *, double *, double *, double *, double *, double *);
 void regional_lost_souls(struct All_variables *);
 /* Regional_version_dependent.c */
@@ -474,10 +515,14 @@ void project_vector(struct All_variables *, int, double **, double **, int);
 void from_xyz_to_rtf(struct All_variables *, int, double **, double **);
 void from_rtf_to_xyz(struct All_variables *, int, double **, double **);
 void fill_in_gaps(struct All_variables *, double **, int);
+void coarse_solver_setup(struct All_variables *);
+void coarse_solver_factor(struct All_variables *);
+void coarse_solve(struct All_variables *, double **, double **);
 /* Sphere_harmonics.c */
 void set_sphere_harmonics(struct All_variables *);
 double modified_plgndr_a(int, int, double);
 void sphere_expansion(struct All_variables *, float **, float *, float *);
+void sphere_expansion_layers(struct All_variables *, int, float ***, double *);
 void debug_sphere_expansion(struct All_variables *);
 /* Sphere_util.c */
 void even_divide_arc12(int, double, double, double, double, double, double, double *, double *);
@@ -503,6 +548,9 @@ void tracer_input(struct All_variables *);
 void tracer_initial_settings(struct All_variables *);
 void tracer_advection(struct All_variables *);
 void tracer_post_processing(struct All_variables *);
+void update_tracer_velocity_cache(struct All_variables *);
+void tracer_velo_from_element(struct All_variables *, double [4][9], int, int);
+void tracer_element_radii(struct All_variables *, int, int, double [2]);
 void count_tracers_of_flavors(struct All_variables *);
 void initialize_tracers(struct All_variables *);
 void cart_to_sphere(struct All_variables *, double, double, double, double *, double *, double *);
@@ -54,6 +54,9 @@ struct Solver {
     void (*parallel_communication_routs_v)(struct All_variables *);
     void (*parallel_communication_routs_s)(struct All_variables *);
     void (*exchange_id_d)(struct All_variables *, double **, int);
+    void (*exchange_id_f)(struct All_variables *, float **, int);
+    void (*exchange_id_d_start)(struct All_variables *, double **, int);
+    void (*exchange_id_d_finish)(struct All_variables *, double **, int);
 
     /* Read_input_from_files.c */
     void (*read_input_files_for_timesteps)(struct All_variables *, int, int);
@@ -32,6 +32,61 @@
 struct All_variables;
 
 
+/* Tracer store. All quantities of a tracer are kept together in one
+   record of number_of_tracer_quantities doubles, the basic quantities
+   first and then the extra ones. The records of a cap are held in
+   blocks of TRACER_BLOCK tracers. Blocks are taken from a pool shared
+   by the caps and never move: the store grows by adding blocks,
+   without copying the tracers already in it, and returns the blocks
+   it no longer needs to the pool. As before, tracers are numbered
+   from 1 to ntracers[j]; the record of tracer kk is found with the
+   macros below. */
+
+#define TRACER_BLOCK_BITS 10
+#define TRACER_BLOCK (1<<TRACER_BLOCK_BITS)
+
+struct TRACER_BLOCKS {
+    int nblocks;        /* blocks in use */
+    int maxblocks;      /* size of q[] and elem[] */
+    double **q;         /* q[b] holds the records of TRACER_BLOCK tracers */
+    int **elem;         /* elem[b] holds their elements */
+};
+
+/* quantities of tracer kk of cap j */
+#define tracer_basicq(E,j,kk) \
+    ((E)->trace.store[j].q[(kk)>>TRACER_BLOCK_BITS] + \
+     ((kk)&(TRACER_BLOCK-1))*(E)->trace.number_of_tracer_quantities)
+#define tracer_extraq(E,j,kk) \
+    (tracer_basicq(E,j,kk) + (E)->trace.number_of_basic_quantities)
+
+/* element of tracer kk of cap j */
+#define tracer_element(E,j,kk) \
+    ((E)->trace.store[j].elem[(kk)>>TRACER_BLOCK_BITS][(kk)&(TRACER_BLOCK-1)])
+
+
+/* at most this many tracers of one element are passed to a single
+   call of get_velocities() */
+#define TRACER_BATCH 64
+
+
+/* Element search counters of one thread. The tracer passes run
+   threaded, so each thread counts in its own slot (padded to a cache
+   line); the slots are summed into istat1 and istat_elements_checked
+   when a pass ends. */
+
+struct TRACER_THREAD_STAT {
+    int istat1;
+    int istat_elements_checked;
+    int pad[14];
+};
+
+#ifdef _OPENMP
+#define tracer_thread_stat(E) ((E)->trace.thread_stat + omp_get_thread_num())
+#else
+#define tracer_thread_stat(E) ((E)->trace.thread_stat)
+#endif
+
+
 struct TRACE{
 
     FILE *fpt;
@@ -39,6 +94,7 @@ struct TRACE{
     char tracer_file[200];
 
     int itracer_warnings;
+    int sort_every;
     int ianalytical_tracer_test;
     int ic_method;
     int itperel;
@@ -51,12 +107,16 @@ struct TRACE{
     int number_of_extra_quantities;
     int number_of_tracer_quantities;
 
-    double *basicq[13][100];
-    double *extraq[13][100];
+    struct TRACER_BLOCKS store[13];
 
     int ntracers[13];
     int max_ntracers[13];
-    int *ielement[13];
+
+    /* free blocks of the tracer store */
+    int npool;
+    int maxpool;
+    double **pool_q;
+    int **pool_elem;
 
     int number_of_tracers;
 
@@ -84,11 +144,54 @@ struct TRACE{
     int istat_elements_checked;
     int ilast_tracer_count;
 
+    int nthread_stat;
+    struct TRACER_THREAD_STAT *thread_stat;
+
+
+    /* nodal velocities in Cartesian components, vcart[j][3*node+d-1],
+       converted from E->sphere.cap[j].V when V_stamp changes */
+    double *vcart[13];
+    int vcart_stamp;
+
+    /* work arrays of the batched velocity interpolation */
+    int nvel_work;
+    int *elem_start;
+    int *elem_tracers;
+    double *tracer_vel;
+
+    /* tracer_balance: lend interpolation work to the processors
+       above and below; the number of tracers interpolated here,
+       lent and borrowed in the last interpolation */
+    int balance;
+    int ninterp;
+    int nlent;
+    int nborrowed;
+
+    /* time integration: tracer_integrator 0 is the predictor-corrector,
+       1 the classical Runge-Kutta scheme; a step is cut into at least
+       tracer_substeps substeps, and with tracer_courant > 0 into
+       enough that no tracer crosses more than tracer_courant elements
+       per substep. nsubsteps is the count of the last step. */
+    int integrator;
+    int substeps;
+    double courant;
+    int nsubsteps;
+
+    /* for the Runge-Kutta integrator: Cartesian nodal velocities of the
+       last two Stokes solutions, the time between them (0 if there is
+       only one) and the length of the last tracer step */
+    double *vcart_now[13];
+    double *vcart_old[13];
+    int vnow_stamp;
+    double vold_dt;
+    double last_dt;
+
 
     /* timing information */
     double advection_time;
     double find_tracers_time;
     double lost_souls_time;
+    double sort_time;
 
 
     /* Mesh information */
@@ -104,6 +207,13 @@ struct TRACE{
     double cos_phi[13][5];
     double sin_phi[13][5];
 
+    /* migration partners of lost_souls(): the processor holding cap kk
+       of the list above (0 is my own cap) one shell below, in or above
+       mine is mig_proc[mig_index[kk][0..2]], or -1 if there is none */
+    int nmig;
+    int mig_proc[39];
+    int mig_index[13][3];
+
 
 
     /*********************/
@@ -151,6 +261,15 @@ struct TRACE{
     void (* get_velocity)(struct All_variables*, int, int,
                           double, double, double, double*);
 
+    void (* get_velocities)(struct All_variables*, int, int, int,
+                            double*, double*, double*,
+                            double*, double*, double*);
+
+    void (* get_element_velocities)(struct All_variables*, int, int,
+                                    double[2], double[4][9], int,
+                                    double*, double*, double*,
+                                    double*, double*, double*);
+
     void (* keep_within_bounds)(struct All_variables*,
                                 double*, double*, double*,
                                 double*, double*, double*);
@@ -0,0 +1,134 @@
+/*
+ * h5totracer.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hdf5.h"
+#include "h5util.h"
+
+
+static const char usage[] =
+    "Convert the tracers of a h5 file to tracer files, for restart purpose\n"
+    "(tracer_ic_method=2)\n"
+    "\n"
+    "Usage: h5totracer modelname step\n"
+    "\n"
+    "modelname: prefix of the CitcomS HDF5 datafile\n"
+    "step: time step\n";
+
+
+
+int main(int argc, char *argv[])
+{
+    char filename[100];
+    char prefix[100];
+
+    hid_t h5file;
+    hid_t root;
+    herr_t status;
+
+    int proc;
+    int step;
+    float time;
+
+    tracer_t *tracer;
+
+
+    if (argc != 3)
+    {
+	fputs(usage, stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
+    {
+	fputs(usage, stderr);
+        return EXIT_FAILURE;
+    }
+
+    sscanf(argv[1], "%s", prefix);
+    sscanf(argv[2], "%d", &step);
+    snprintf(filename, 99, "%s.%d.h5", prefix, step);
+
+    /*
+     * Open HDF5 file (read-only). Complain if invalid.
+     */
+
+    h5file = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (h5file < 0)
+    {
+        fprintf(stderr, "Could not open HDF5 file \"%s\"\n", filename);
+        return EXIT_FAILURE;
+    }
+
+    root = H5Gopen(h5file, "/");
+    status = get_attribute_float(root, "time", &time);
+    status = H5Gclose(root);
+
+    tracer = open_tracer(h5file);
+    if (tracer == NULL)
+    {
+        status = H5Fclose(h5file);
+        return EXIT_FAILURE;
+    }
+
+    if (tracer->stride > 1)
+        fprintf(stderr, "Warning: only one in %d tracers was written, "
+                "the files cannot be used for restart\n", tracer->stride);
+
+    /* one file per processor, as written by output_tracer() */
+    for(proc = 0; proc < tracer->nproc; proc++)
+    {
+	char outfile[100];
+	FILE *file;
+	int n, i;
+
+	if (read_tracer(h5file, tracer, proc) < 0)
+	{
+	    fprintf(stderr, "Could not read the tracers of processor %d\n",
+		    proc);
+	    break;
+	}
+
+	snprintf(outfile, 99, "%s.tracer.%d.%d", prefix, proc, step);
+	fprintf(stderr, "Writing %s\n", outfile);
+
+	file = fopen(outfile, "w");
+	fprintf(file, "%d %d %d %.5e\n", step, tracer->n,
+		tracer->ncolumns, time);
+
+	for(n = 0; n < tracer->n; n++)
+	{
+	    for(i = 0; i < tracer->ncolumns; i++)
+		fprintf(file, (i == 0) ? "%.12e" : " %.12e",
+			tracer->data[n*tracer->ncolumns + i]);
+	    fprintf(file, "\n");
+	}
+
+	fclose(file);
+    }
+
+    status = close_tracer(tracer);
+    status = H5Fclose(h5file);
+
+    return EXIT_SUCCESS;
+}
+
+/* vim:noet:ts=8 sw=8
+ */
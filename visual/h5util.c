@@ -177,6 +177,187 @@ herr_t close_field(field_t *field)
     return 0;
 }
 
+tracer_t *open_tracer(hid_t file)
+{
+    hid_t group;
+    hid_t dataset;
+    hid_t dataspace;
+    herr_t status;
+
+    hsize_t dims[2];
+    int p, nextra;
+
+    tracer_t *tracer;
+
+    group = H5Gopen(file, "tracer");
+    if (group < 0)
+    {
+        fprintf(stderr, "Could not open HDF5 group \"tracer\"\n");
+        return NULL;
+    }
+
+    tracer = (tracer_t *)malloc(sizeof(tracer_t));
+
+    tracer->stride = 1;
+    status = get_attribute_int(group, "stride", &(tracer->stride));
+
+
+    /* Read the number of tracers of each processor. */
+
+    dataset = H5Dopen(group, "count");
+    if (dataset < 0)
+    {
+        free(tracer);
+        H5Gclose(group);
+        fprintf(stderr, "Could not open HDF5 dataset \"tracer/count\"\n");
+        return NULL;
+    }
+
+    dataspace = H5Dget_space(dataset);
+    status = H5Sget_simple_extent_dims(dataspace, dims, NULL);
+    status = H5Sclose(dataspace);
+
+    tracer->nproc = dims[0];
+    tracer->count = (int *)malloc(tracer->nproc * sizeof(int));
+    tracer->offset = (hsize_t *)malloc(tracer->nproc * sizeof(hsize_t));
+
+    status = H5Dread(dataset, H5T_NATIVE_INT, H5S_ALL, H5S_ALL,
+                     H5P_DEFAULT, tracer->count);
+    status = H5Dclose(dataset);
+
+    for(p = 0; p < tracer->nproc; p++)
+        tracer->offset[p] = (p == 0) ? 0
+            : tracer->offset[p-1] + tracer->count[p-1];
+
+
+    /* The extra quantities are optional. Without any tracer there is
+     * no extra dataset, and only the attribute gives their number. */
+
+    nextra = 0;
+    status = get_attribute_int(group, "nextra", &nextra);
+    tracer->ncolumns = 3 + nextra;
+
+    tracer->n = 0;
+    tracer->data = NULL;
+
+    status = H5Gclose(group);
+
+    return tracer;
+}
+
+
+/* Read rows [offset, offset+n) of the 2D double dataset "name" into
+ * columns col... of data, which has ncolumns columns.
+ */
+static herr_t read_tracer_columns(hid_t group, const char *name,
+                                  hsize_t offset, int n,
+                                  double *data, int ncolumns, int col)
+{
+    hid_t dataset;
+    hid_t filespace;
+    hid_t memspace;
+    herr_t status;
+
+    hsize_t dims[2];
+    hsize_t start[2];
+    hsize_t count[2];
+    hsize_t memstart[2];
+    hsize_t memdims[2];
+
+    dataset = H5Dopen(group, name);
+    if (dataset < 0)
+        return -1;
+
+    filespace = H5Dget_space(dataset);
+    status = H5Sget_simple_extent_dims(filespace, dims, NULL);
+
+    start[0] = offset;
+    start[1] = 0;
+    count[0] = n;
+    count[1] = dims[1];
+    status = H5Sselect_hyperslab(filespace, H5S_SELECT_SET,
+                                 start, NULL, count, NULL);
+
+    /* place the values in their columns of data */
+    memdims[0] = n;
+    memdims[1] = ncolumns;
+    memstart[0] = 0;
+    memstart[1] = col;
+    memspace = H5Screate_simple(2, memdims, NULL);
+    status = H5Sselect_hyperslab(memspace, H5S_SELECT_SET,
+                                 memstart, NULL, count, NULL);
+
+    status = H5Dread(dataset, H5T_NATIVE_DOUBLE, memspace,
+                     filespace, H5P_DEFAULT, data);
+
+    H5Sclose(filespace);
+    H5Sclose(memspace);
+    H5Dclose(dataset);
+
+    return status;
+}
+
+
+/* Read the tracers of processor proc, or of all processors if proc < 0.
+ */
+herr_t read_tracer(hid_t file, tracer_t *tracer, int proc)
+{
+    hid_t group;
+    herr_t status;
+
+    hsize_t offset;
+    int n;
+
+    if (file < 0 || tracer == NULL || proc >= tracer->nproc)
+        return -1;
+
+    if (proc < 0)
+    {
+        offset = 0;
+        n = tracer->offset[tracer->nproc-1] + tracer->count[tracer->nproc-1];
+    }
+    else
+    {
+        offset = tracer->offset[proc];
+        n = tracer->count[proc];
+    }
+
+    free(tracer->data);
+    tracer->n = n;
+    tracer->data = (double *)malloc((n*tracer->ncolumns + 1) * sizeof(double));
+
+    if (n == 0)
+        return 0;
+
+    group = H5Gopen(file, "tracer");
+    if (group < 0)
+        return -1;
+
+    status = read_tracer_columns(group, "coord", offset, n,
+                                 tracer->data, tracer->ncolumns, 0);
+    if (status >= 0 && tracer->ncolumns > 3)
+        status = read_tracer_columns(group, "extra", offset, n,
+                                     tracer->data, tracer->ncolumns, 3);
+
+    H5Gclose(group);
+
+    return (status < 0) ? -1 : 0;
+}
+
+
+herr_t close_tracer(tracer_t *tracer)
+{
+    if (tracer != NULL)
+    {
+        free(tracer->count);
+        free(tracer->offset);
+        free(tracer->data);
+        free(tracer);
+    }
+    return 0;
+}
+
+
 herr_t get_attribute_str(hid_t obj_id,
                                 const char *attr_name,
                                 char **data)
@@ -38,10 +38,30 @@ typedef struct field_t
 } field_t;
 
 
+/* tracers of a time-dependent file, see h5output_tracer() */
+typedef struct tracer_t
+{
+    int nproc;
+    int *count;         /* number of tracers written by each processor */
+    hsize_t *offset;    /* first row of each processor */
+
+    int stride;         /* every stride-th tracer was written */
+    int ncolumns;       /* theta, phi, r and the extra quantities */
+
+    int n;              /* number of tracers in data */
+    double *data;       /* n rows of ncolumns values */
+
+} tracer_t;
+
+
 field_t *open_field(hid_t group, const char *name);
 herr_t read_field(hid_t group, field_t *field, int cap);
 herr_t close_field(field_t *field);
 
+tracer_t *open_tracer(hid_t file);
+herr_t read_tracer(hid_t file, tracer_t *tracer, int proc);
+herr_t close_tracer(tracer_t *tracer);
+
 herr_t get_attribute_str(hid_t obj_id, const char *attr_name, char **data);
 herr_t get_attribute_int(hid_t input, const char *name, int *val);
 herr_t get_attribute_float(hid_t input, const char *name, float *val);